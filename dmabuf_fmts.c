@@ -0,0 +1,160 @@
+#include "dmabuf_fmts.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Open addressed hash, linear probe. fourcc 0 marks an empty slot as no
+// real format has that code.
+typedef struct fmt_ent_s
+{
+	uint64_t modifier;
+	uint32_t fourcc;
+	uint32_t flags;
+} fmt_ent_t;
+
+struct dmabuf_fmts
+{
+	unsigned int size;  // Power of 2 (or 0)
+	unsigned int n;
+	fmt_ent_t * ents;
+};
+
+#define FMTS_MIN_SIZE 64
+
+static unsigned int
+fmt_hash(const uint32_t fourcc, const uint64_t modifier)
+{
+	uint64_t x = modifier ^ ((uint64_t)fourcc << 32 | fourcc);
+
+	// splitmix64 finaliser
+	x ^= x >> 30;
+	x *= UINT64_C(0xbf58476d1ce4e5b9);
+	x ^= x >> 27;
+	x *= UINT64_C(0x94d049bb133111eb);
+	x ^= x >> 31;
+	return (unsigned int)x;
+}
+
+static fmt_ent_t *
+fmt_slot(fmt_ent_t * const ents, const unsigned int size, const uint32_t fourcc, const uint64_t modifier)
+{
+	unsigned int i = fmt_hash(fourcc, modifier) & (size - 1);
+
+	while (ents[i].fourcc != 0 && (ents[i].fourcc != fourcc || ents[i].modifier != modifier))
+		i = (i + 1) & (size - 1);
+	return ents + i;
+}
+
+static int
+fmts_grow(dmabuf_fmts_t * const fs)
+{
+	const unsigned int size = fs->size == 0 ? FMTS_MIN_SIZE : fs->size * 2;
+	fmt_ent_t * const ents = calloc(size, sizeof(*ents));
+	unsigned int i;
+
+	if (ents == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i != fs->size; ++i)
+	{
+		if (fs->ents[i].fourcc != 0)
+			*fmt_slot(ents, size, fs->ents[i].fourcc, fs->ents[i].modifier) = fs->ents[i];
+	}
+
+	free(fs->ents);
+	fs->ents = ents;
+	fs->size = size;
+	return 0;
+}
+
+int
+dmabuf_fmts_add(dmabuf_fmts_t * const fs, const uint32_t fourcc, const uint64_t modifier, const unsigned int flags)
+{
+	fmt_ent_t * e;
+
+	// Keep load <= 1/2 so probes stay short
+	if ((fs->n + 1) * 2 > fs->size)
+	{
+		const int rv = fmts_grow(fs);
+		if (rv != 0)
+			return rv;
+	}
+
+	e = fmt_slot(fs->ents, fs->size, fourcc, modifier);
+	if (e->fourcc == 0)
+	{
+		e->fourcc = fourcc;
+		e->modifier = modifier;
+		++fs->n;
+	}
+	e->flags |= flags;
+	return 0;
+}
+
+bool
+dmabuf_fmts_find(const dmabuf_fmts_t * const fs, const uint32_t fourcc, const uint64_t modifier, unsigned int * const pflags)
+{
+	const fmt_ent_t * e;
+
+	if (fs == NULL || fs->n == 0 || fourcc == 0)
+		return false;
+
+	e = fmt_slot(fs->ents, fs->size, fourcc, modifier);
+	if (e->fourcc == 0)
+		return false;
+	if (pflags != NULL)
+		*pflags = e->flags;
+	return true;
+}
+
+unsigned int
+dmabuf_fmts_count(const dmabuf_fmts_t * const fs)
+{
+	return fs == NULL ? 0 : fs->n;
+}
+
+void
+dmabuf_fmts_clear(dmabuf_fmts_t * const fs)
+{
+	if (fs->ents != NULL)
+		memset(fs->ents, 0, fs->size * sizeof(*fs->ents));
+	fs->n = 0;
+}
+
+dmabuf_fmts_t *
+dmabuf_fmts_new(void)
+{
+	return calloc(1, sizeof(dmabuf_fmts_t));
+}
+
+void
+dmabuf_fmts_delete(dmabuf_fmts_t ** const ppfs)
+{
+	dmabuf_fmts_t * const fs = *ppfs;
+
+	if (fs == NULL)
+		return;
+	*ppfs = NULL;
+	free(fs->ents);
+	free(fs);
+}
+
+dmabuf_fmts_t *
+dmabuf_fmts_copy(const dmabuf_fmts_t * const fs)
+{
+	dmabuf_fmts_t * const copy = dmabuf_fmts_new();
+
+	if (copy == NULL || fs == NULL || fs->size == 0)
+		return copy;
+
+	if ((copy->ents = malloc(fs->size * sizeof(*fs->ents))) == NULL)
+	{
+		free(copy);
+		return NULL;
+	}
+	memcpy(copy->ents, fs->ents, fs->size * sizeof(*fs->ents));
+	copy->size = fs->size;
+	copy->n = fs->n;
+	return copy;
+}
@@ -0,0 +1,28 @@
+#ifndef DMABUF_FMTS_H
+#define DMABUF_FMTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Set of DRM fourcc + modifier pairs with per-pair flags
+// Lookup is O(1); not thread safe
+
+#define DMABUF_FMT_FLAG_SCANOUT       1  // Compositor can put it on a plane
+#define DMABUF_FMT_FLAG_EXTERNAL_ONLY 2  // EGL can only sample it as TEXTURE_EXTERNAL
+
+struct dmabuf_fmts;
+typedef struct dmabuf_fmts dmabuf_fmts_t;
+
+dmabuf_fmts_t * dmabuf_fmts_new(void);
+void dmabuf_fmts_delete(dmabuf_fmts_t ** const ppfs);
+// New set with the same contents; fs may be NULL. Returns NULL on ENOMEM
+dmabuf_fmts_t * dmabuf_fmts_copy(const dmabuf_fmts_t * const fs);
+void dmabuf_fmts_clear(dmabuf_fmts_t * const fs);
+// Adds the pair or ORs flags into an existing entry
+// Returns 0 or -ENOMEM
+int dmabuf_fmts_add(dmabuf_fmts_t * const fs, const uint32_t fourcc, const uint64_t modifier, const unsigned int flags);
+// Returns false if the pair isn't in the set
+bool dmabuf_fmts_find(const dmabuf_fmts_t * const fs, const uint32_t fourcc, const uint64_t modifier, unsigned int * const pflags);
+unsigned int dmabuf_fmts_count(const dmabuf_fmts_t * const fs);
+
+#endif
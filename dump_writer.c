@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+#include "dump_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#if HAS_IO_URING
+#include <liburing.h>
+#endif
+
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "libavutil/frame.h"
+#include "libavutil/hwcontext.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
+#include "libavutil/pixdesc.h"
+
+#define DW_SLOTS_MAX    32
+#define DW_THREADS_MAX  4
+#define DW_RING_SIZE    64
+// Each SQE or pwritev takes at most this many iovecs
+#define DW_IOV_CHUNK    IOV_MAX
+
+typedef struct dw_slot_s {
+	struct dw_slot_s *next;    // Free or job list
+	unsigned int idx;
+	AVFrame *frame;            // Ref to a software source frame
+	AVFrame *sw_frame;         // Transfer target for hardware ones, kept
+	off_t offset;
+	size_t size;
+	struct iovec *iov;
+	unsigned int iov_alloc;    // Bytes
+	unsigned int n_iov;
+	unsigned int pending;      // SQEs not yet completed
+	int err;
+} dw_slot_t;
+
+struct dump_writer_s {
+	int fd;
+	off_t end;                 // Where the next frame goes
+	off_t alloc_end;           // fallocated up to
+	size_t prealloc;           // Step, 0 if not preallocating
+	int err;                   // First failure
+
+	pthread_mutex_t lock;      // Everything below (threads only)
+	pthread_cond_t slot_cond;  // A slot has come free
+	pthread_cond_t job_cond;   // A job has been queued
+	dw_slot_t *free;
+	dw_slot_t *jobs;
+	dw_slot_t **jobs_tail;
+	unsigned int n_busy;
+	bool terminate;
+	unsigned int n_threads;
+	pthread_t threads[DW_THREADS_MAX];
+
+#if HAS_IO_URING
+	bool use_uring;
+	struct io_uring ring;
+#endif
+
+	unsigned int n_slots;
+	dw_slot_t slots[DW_SLOTS_MAX];
+};
+
+// Builds iovecs for f in av_image_copy_to_buffer order
+static int
+slot_iov(dw_slot_t *const s, const AVFrame *const f)
+{
+	const AVPixFmtDescriptor *const desc = av_pix_fmt_desc_get(f->format);
+	const int planes = av_pix_fmt_count_planes(f->format);
+	int lines[4];
+	int heights[4];
+	unsigned int rows = 0;
+	unsigned int n = 0;
+	struct iovec *iov;
+	int p, y;
+
+	if (desc == NULL || planes <= 0 || av_image_fill_linesizes(lines, f->format, f->width) < 0)
+		return AVERROR(EINVAL);
+
+	for (p = 0; p != planes; ++p)
+	{
+		heights[p] = p == 1 || p == 2 ? AV_CEIL_RSHIFT(f->height, desc->log2_chroma_h) : f->height;
+		rows += heights[p];
+	}
+	// Worst case is a row each
+	if ((iov = av_fast_realloc(s->iov, &s->iov_alloc, rows * sizeof(*iov))) == NULL)
+		return AVERROR(ENOMEM);
+	s->iov = iov;
+
+	s->size = 0;
+	for (p = 0; p != planes; ++p)
+	{
+		uint8_t *const data = f->data[p];
+		const size_t row = lines[p];
+
+		if (f->linesize[p] == lines[p])
+			iov[n++] = (struct iovec){data, row * heights[p]};
+		else
+			for (y = 0; y != heights[p]; ++y)
+				iov[n++] = (struct iovec){data + (ptrdiff_t)y * f->linesize[p], row};
+		s->size += row * heights[p];
+	}
+	s->n_iov = n;
+	return 0;
+}
+
+static int
+slot_fill(dw_slot_t *const s, const AVFrame *const src)
+{
+	const AVPixFmtDescriptor *const desc = av_pix_fmt_desc_get(src->format);
+	int rv;
+
+	if (desc != NULL && (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) != 0)
+	{
+		// Keep the last transfer's buffer if it will do
+		if (s->sw_frame->buf[0] != NULL &&
+		    (s->sw_frame->width != src->width || s->sw_frame->height != src->height))
+			av_frame_unref(s->sw_frame);
+		if ((rv = av_hwframe_transfer_data(s->sw_frame, src, 0)) < 0)
+			return rv;
+		return slot_iov(s, s->sw_frame);
+	}
+
+	if ((rv = av_frame_ref(s->frame, src)) < 0)
+		return rv;
+	return slot_iov(s, s->frame);
+}
+
+// Step over done bytes of a partly written iov
+static void
+iov_advance(struct iovec **const piov, unsigned int *const pn, size_t done)
+{
+	struct iovec *iov = *piov;
+	unsigned int n = *pn;
+
+	for (; n != 0 && done >= iov->iov_len; ++iov, --n)
+		done -= iov->iov_len;
+	if (done != 0)
+	{
+		iov->iov_base = (uint8_t *)iov->iov_base + done;
+		iov->iov_len -= done;
+	}
+	*piov = iov;
+	*pn = n;
+}
+
+// Writes all of iov, which is used up on the way
+static int
+write_iov(const int fd, struct iovec *iov, unsigned int n, off_t offset)
+{
+	while (n != 0)
+	{
+		const ssize_t done = pwritev(fd, iov, n > DW_IOV_CHUNK ? DW_IOV_CHUNK : n, offset);
+
+		if (done < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return AVERROR(errno);
+		}
+		if (done == 0)
+			return AVERROR(EIO);
+		offset += done;
+		iov_advance(&iov, &n, done);
+	}
+	return 0;
+}
+
+// Called with the lock held if threaded
+static void
+slot_done(dump_writer_t *const dw, dw_slot_t *const s)
+{
+	if (s->err != 0 && dw->err == 0)
+		dw->err = s->err;
+	// The sw_frame buffer is kept for next time
+	av_frame_unref(s->frame);
+	s->next = dw->free;
+	dw->free = s;
+	--dw->n_busy;
+}
+
+static void *
+write_thread(void *v)
+{
+	dump_writer_t *const dw = v;
+
+	pthread_mutex_lock(&dw->lock);
+	for (;;)
+	{
+		dw_slot_t *s;
+
+		while ((s = dw->jobs) == NULL && !dw->terminate)
+			pthread_cond_wait(&dw->job_cond, &dw->lock);
+		if (s == NULL)
+			break;
+		if ((dw->jobs = s->next) == NULL)
+			dw->jobs_tail = &dw->jobs;
+		pthread_mutex_unlock(&dw->lock);
+
+		s->err = write_iov(dw->fd, s->iov, s->n_iov, s->offset);
+
+		pthread_mutex_lock(&dw->lock);
+		slot_done(dw, s);
+		pthread_cond_signal(&dw->slot_cond);
+	}
+	pthread_mutex_unlock(&dw->lock);
+	return NULL;
+}
+
+#if HAS_IO_URING
+// SQE user data is slot index << 32 | first iovec
+static void
+uring_complete(dump_writer_t *const dw, struct io_uring_cqe *const cqe)
+{
+	const uint64_t data = io_uring_cqe_get_data64(cqe);
+	dw_slot_t *const s = dw->slots + (data >> 32);
+	const unsigned int first = (uint32_t)data;
+	unsigned int n = s->n_iov - first > DW_IOV_CHUNK ? DW_IOV_CHUNK : s->n_iov - first;
+	const int res = cqe->res;
+
+	io_uring_cqe_seen(&dw->ring, cqe);
+
+	if (res < 0)
+	{
+		if (s->err == 0)
+			s->err = res;
+	}
+	else if (s->err == 0)
+	{
+		struct iovec *iov = s->iov + first;
+		off_t offset = s->offset + res;
+		unsigned int i;
+
+		for (i = 0; i != first; ++i)
+			offset += s->iov[i].iov_len;
+		// Short write - finish it here
+		iov_advance(&iov, &n, res);
+		if (n != 0)
+			s->err = write_iov(dw->fd, iov, n, offset);
+	}
+
+	if (--s->pending == 0)
+		slot_done(dw, s);
+}
+
+// Wait for at least one completion, then take any others ready
+// Fails, having completed nothing, if the ring can't be waited on
+static int
+uring_reap(dump_writer_t *const dw)
+{
+	struct io_uring_cqe *cqe;
+	int rv;
+
+	while ((rv = io_uring_wait_cqe(&dw->ring, &cqe)) == -EINTR)
+		;
+	if (rv < 0)
+	{
+		dw->err = dw->err != 0 ? dw->err : rv;
+		return rv;
+	}
+	uring_complete(dw, cqe);
+	while (io_uring_peek_cqe(&dw->ring, &cqe) == 0)
+		uring_complete(dw, cqe);
+	return 0;
+}
+
+static void
+uring_submit(dump_writer_t *const dw, dw_slot_t *const s)
+{
+	unsigned int first;
+
+	// Held until all are queued so an early completion can't free the slot
+	s->pending = 1;
+	for (first = 0; first < s->n_iov; first += DW_IOV_CHUNK)
+	{
+		const unsigned int n = s->n_iov - first > DW_IOV_CHUNK ? DW_IOV_CHUNK : s->n_iov - first;
+		struct io_uring_sqe *sqe;
+		off_t offset = s->offset;
+		unsigned int i;
+
+		for (i = 0; i != first; ++i)
+			offset += s->iov[i].iov_len;
+
+		while ((sqe = io_uring_get_sqe(&dw->ring)) == NULL)
+		{
+			int rv;
+
+			io_uring_submit(&dw->ring);
+			if ((rv = uring_reap(dw)) != 0)
+			{
+				s->err = s->err != 0 ? s->err : rv;
+				break;
+			}
+		}
+		// Whatever was queued still completes; the rest is never written
+		if (sqe == NULL)
+			break;
+		io_uring_prep_writev(sqe, dw->fd, s->iov + first, n, offset);
+		io_uring_sqe_set_data64(sqe, (uint64_t)s->idx << 32 | first);
+		++s->pending;
+	}
+	io_uring_submit(&dw->ring);
+	if (--s->pending == 0)
+		slot_done(dw, s);
+}
+#endif
+
+static void
+file_prealloc(dump_writer_t *const dw, const off_t end)
+{
+	off_t len;
+
+	if (dw->prealloc == 0 || end <= dw->alloc_end)
+		return;
+	len = (end - dw->alloc_end + dw->prealloc - 1) / dw->prealloc * dw->prealloc;
+	// Not all filesystems can - just carry on without
+	if (fallocate(dw->fd, FALLOC_FL_KEEP_SIZE, dw->alloc_end, len) != 0)
+		dw->prealloc = 0;
+	else
+		dw->alloc_end += len;
+}
+
+static dw_slot_t *
+slot_get(dump_writer_t *const dw)
+{
+	dw_slot_t *s;
+
+#if HAS_IO_URING
+	if (dw->use_uring)
+	{
+		while (dw->free == NULL)
+			if (uring_reap(dw) != 0)
+				return NULL;
+		s = dw->free;
+		dw->free = s->next;
+		++dw->n_busy;
+		return s;
+	}
+#endif
+	pthread_mutex_lock(&dw->lock);
+	while ((s = dw->free) == NULL)
+		pthread_cond_wait(&dw->slot_cond, &dw->lock);
+	dw->free = s->next;
+	++dw->n_busy;
+	pthread_mutex_unlock(&dw->lock);
+	return s;
+}
+
+static int
+writer_err(dump_writer_t *const dw)
+{
+	int err;
+
+#if HAS_IO_URING
+	if (dw->use_uring)
+		return dw->err;
+#endif
+	pthread_mutex_lock(&dw->lock);
+	err = dw->err;
+	pthread_mutex_unlock(&dw->lock);
+	return err;
+}
+
+int
+dump_writer_write(dump_writer_t *const dw, const AVFrame *const frame)
+{
+	dw_slot_t *const s = slot_get(dw);
+	int rv;
+
+	if (s == NULL)
+		return writer_err(dw);
+	s->err = 0;
+	s->pending = 0;
+	if ((rv = slot_fill(s, frame)) != 0)
+	{
+		s->err = rv;
+		goto fail;
+	}
+
+	s->offset = dw->end;
+	dw->end += s->size;
+	file_prealloc(dw, dw->end);
+
+#if HAS_IO_URING
+	if (dw->use_uring)
+	{
+		uring_submit(dw, s);
+		return writer_err(dw);
+	}
+#endif
+	pthread_mutex_lock(&dw->lock);
+	s->next = NULL;
+	*dw->jobs_tail = s;
+	dw->jobs_tail = &s->next;
+	pthread_cond_signal(&dw->job_cond);
+	pthread_mutex_unlock(&dw->lock);
+	return writer_err(dw);
+
+fail:
+#if HAS_IO_URING
+	if (dw->use_uring)
+	{
+		slot_done(dw, s);
+		return rv;
+	}
+#endif
+	pthread_mutex_lock(&dw->lock);
+	slot_done(dw, s);
+	pthread_mutex_unlock(&dw->lock);
+	return rv;
+}
+
+const char *
+dump_writer_backend(const dump_writer_t *const dw)
+{
+#if HAS_IO_URING
+	if (dw->use_uring)
+		return "io_uring";
+#endif
+	(void)dw;
+	return "pwritev";
+}
+
+int
+dump_writer_delete(dump_writer_t **const pdw)
+{
+	dump_writer_t *const dw = *pdw;
+	unsigned int i;
+	int err;
+
+	if (dw == NULL)
+		return 0;
+	*pdw = NULL;
+
+#if HAS_IO_URING
+	if (dw->use_uring)
+	{
+		// If the ring has gone bad, forget what is outstanding - exit
+		// cancels it before the frames are freed below
+		while (dw->n_busy != 0)
+			if (uring_reap(dw) != 0)
+				break;
+		io_uring_queue_exit(&dw->ring);
+	}
+#endif
+	pthread_mutex_lock(&dw->lock);
+	dw->terminate = true;
+	pthread_cond_broadcast(&dw->job_cond);
+	pthread_mutex_unlock(&dw->lock);
+	// Threads finish the job list before they look at terminate
+	for (i = 0; i != dw->n_threads; ++i)
+		pthread_join(dw->threads[i], NULL);
+
+	err = dw->err;
+	// Let go of any preallocation past the end
+	if (dw->alloc_end > dw->end && ftruncate(dw->fd, dw->end) != 0 && err == 0)
+		err = AVERROR(errno);
+	if (dw->fd != -1 && close(dw->fd) != 0 && err == 0)
+		err = AVERROR(errno);
+
+	for (i = 0; i != dw->n_slots; ++i)
+	{
+		av_frame_free(&dw->slots[i].frame);
+		av_frame_free(&dw->slots[i].sw_frame);
+		av_freep(&dw->slots[i].iov);
+	}
+	pthread_cond_destroy(&dw->job_cond);
+	pthread_cond_destroy(&dw->slot_cond);
+	pthread_mutex_destroy(&dw->lock);
+	free(dw);
+	return err;
+}
+
+dump_writer_t *
+dump_writer_new(const char *const fname, const unsigned int depth, const size_t prealloc)
+{
+	dump_writer_t *dw = calloc(1, sizeof(*dw));
+	unsigned int i;
+
+	if (dw == NULL)
+		return NULL;
+
+	dw->fd = -1;
+	pthread_mutex_init(&dw->lock, NULL);
+	pthread_cond_init(&dw->slot_cond, NULL);
+	pthread_cond_init(&dw->job_cond, NULL);
+	dw->jobs_tail = &dw->jobs;
+	dw->prealloc = prealloc;
+	dw->n_slots = depth == 0 ? 1 : depth > DW_SLOTS_MAX ? DW_SLOTS_MAX : depth;
+
+	for (i = dw->n_slots; i-- != 0;)
+	{
+		dw_slot_t *const s = dw->slots + i;
+
+		s->idx = i;
+		if ((s->frame = av_frame_alloc()) == NULL || (s->sw_frame = av_frame_alloc()) == NULL)
+			goto fail;
+		s->next = dw->free;
+		dw->free = s;
+	}
+
+	if ((dw->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1)
+		goto fail;
+
+#if HAS_IO_URING
+	if (io_uring_queue_init(DW_RING_SIZE, &dw->ring, 0) == 0)
+	{
+		dw->use_uring = true;
+		return dw;
+	}
+#endif
+
+	dw->n_threads = dw->n_slots < DW_THREADS_MAX ? dw->n_slots : DW_THREADS_MAX;
+	for (i = 0; i != dw->n_threads; ++i)
+	{
+		if (pthread_create(dw->threads + i, NULL, write_thread, dw) != 0)
+		{
+			dw->n_threads = i;
+			if (i == 0)
+				goto fail;
+			break;
+		}
+	}
+	return dw;
+
+fail:
+	dump_writer_delete(&dw);
+	return NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef DUMP_WRITER_H
+#define DUMP_WRITER_H
+
+#include <stddef.h>
+
+struct AVFrame;
+
+// Raw frame dump that writes behind the decoder
+//
+// Planes are written straight from the frame (or, for hardware frames,
+// from a transfer target kept per slot) with one iovec per plane, or per
+// row where rows are padded, so nothing is copied to a staging buffer.
+// Up to depth frames are in flight; each holds a ref to its frame until
+// written. Uses io_uring where built with it and the kernel allows, else
+// a few threads doing pwritev. The file can be grown in prealloc byte
+// steps with fallocate ahead of the writes to keep it unfragmented.
+// The output is the same as av_image_copy_to_buffer with align 1.
+// One caller thread.
+
+struct dump_writer_s;
+typedef struct dump_writer_s dump_writer_t;
+
+dump_writer_t *dump_writer_new(const char *fname, unsigned int depth, size_t prealloc);
+// Waits for all writes. Returns 0 or the first error
+int dump_writer_delete(dump_writer_t **const pdw);
+
+// Queues frame, waiting for a slot if depth are in flight
+// Returns 0 or an AVERROR, which may be from an earlier frame's write
+int dump_writer_write(dump_writer_t *const dw, const struct AVFrame *const frame);
+
+// "io_uring" or "pwritev"
+const char *dump_writer_backend(const dump_writer_t *const dw);
+
+#endif
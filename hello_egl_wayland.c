@@ -32,6 +32,7 @@
  * frames from the HW video surfaces.
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -41,16 +42,24 @@
 #include <libavutil/pixdesc.h>
 #include <libavutil/hwcontext.h>
 #include <libavutil/opt.h>
+#include <libavutil/parseutils.h>
 #include <libavutil/avassert.h>
 #include <libavutil/imgutils.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 
+#include "dump_writer.h"
 #include "init_window.h"
+#include "log.h"
+#include "pace.h"
+#include "pkt_queue.h"
+#include "trace.h"
 
 static enum AVPixelFormat hw_pix_fmt;
-static FILE *output_file = NULL;
+static dump_writer_t *dump = NULL;
 static long frames = 0;
+static unsigned int mosaic_tiles = 0;
+static unsigned int headless_w = 0, headless_h = 0;
 
 static AVFilterContext *buffersink_ctx = NULL;
 static AVFilterContext *buffersrc_ctx = NULL;
@@ -89,13 +98,36 @@ static enum AVPixelFormat get_hw_format(AVCodecContext *ctx,
     return AV_PIX_FMT_NONE;
 }
 
+// Kept for the whole of a stream so that decoding allocates nothing of
+// ours per frame
+// (the dump writer keeps its own frames)
+typedef struct decode_env_s {
+    AVFrame *frame;
+} decode_env_t;
+
+static void decode_env_uninit(decode_env_t * const dec)
+{
+    av_frame_free(&dec->frame);
+}
+
+static int decode_env_init(decode_env_t * const dec)
+{
+    *dec = (decode_env_t){
+        .frame = av_frame_alloc(),
+    };
+    if (dec->frame == NULL) {
+        decode_env_uninit(dec);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
 static int decode_write(AVCodecContext * const avctx,
                         egl_wayland_out_env_t * const dpo,
+                        decode_env_t * const dec,
                         AVPacket *packet)
 {
-    AVFrame *frame = NULL, *sw_frame = NULL;
-    uint8_t *buffer = NULL;
-    int size;
+    AVFrame * const frame = dec->frame;
     int ret = 0;
 
     ret = avcodec_send_packet(avctx, packet);
@@ -105,21 +137,14 @@ static int decode_write(AVCodecContext * const avctx,
     }
 
     for (;;) {
-        if (!(frame = av_frame_alloc()) || !(sw_frame = av_frame_alloc())) {
-            fprintf(stderr, "Can not alloc frame\n");
-            ret = AVERROR(ENOMEM);
-            goto fail;
-        }
-
         ret = avcodec_receive_frame(avctx, frame);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            av_frame_free(&frame);
-            av_frame_free(&sw_frame);
             return 0;
         } else if (ret < 0) {
             fprintf(stderr, "Error while decoding\n");
             goto fail;
         }
+        trace_frame_new(frame, TRACE_DECODED);
 
         // push the decoded frame into the filtergraph if it exists
         if (filter_graph != NULL &&
@@ -141,48 +166,29 @@ static int decode_write(AVCodecContext * const avctx,
                         fprintf(stderr, "Failed to get frame: %s", av_err2str(ret));
                     goto fail;
                 }
-                egl_wayland_out_modeset(dpo, av_buffersink_get_w(buffersink_ctx), av_buffersink_get_h(buffersink_ctx), av_buffersink_get_time_base(buffersink_ctx));
+                egl_wayland_out_modeset(dpo, av_buffersink_get_w(buffersink_ctx), av_buffersink_get_h(buffersink_ctx),
+                                        av_buffersink_get_sample_aspect_ratio(buffersink_ctx),
+                                        av_buffersink_get_frame_rate(buffersink_ctx));
             }
             else {
-                egl_wayland_out_modeset(dpo, avctx->coded_width, avctx->coded_height, avctx->framerate);
+                // Coded size includes alignment padding - use the frame's cropped size
+                egl_wayland_out_modeset(dpo, (int)(frame->width - frame->crop_left - frame->crop_right),
+                                        (int)(frame->height - frame->crop_top - frame->crop_bottom),
+                                        frame->sample_aspect_ratio, avctx->framerate);
             }
 
-            egl_wayland_out_display(dpo, frame);
-
-            if (output_file != NULL) {
-                AVFrame *tmp_frame;
-
-                if (frame->format == hw_pix_fmt) {
-                    /* retrieve data from GPU to CPU */
-                    if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0) {
-                        fprintf(stderr, "Error transferring the data to system memory\n");
-                        goto fail;
-                    }
-                    tmp_frame = sw_frame;
-                } else
-                    tmp_frame = frame;
-
-                size = av_image_get_buffer_size(tmp_frame->format, tmp_frame->width,
-                                                tmp_frame->height, 1);
-                buffer = av_malloc(size);
-                if (!buffer) {
-                    fprintf(stderr, "Can not alloc buffer\n");
-                    ret = AVERROR(ENOMEM);
-                    goto fail;
-                }
-                ret = av_image_copy_to_buffer(buffer, size,
-                                              (const uint8_t * const *)tmp_frame->data,
-                                              (const int *)tmp_frame->linesize, tmp_frame->format,
-                                              tmp_frame->width, tmp_frame->height, 1);
-                if (ret < 0) {
-                    fprintf(stderr, "Can not copy image to buffer\n");
-                    goto fail;
-                }
+            if (mosaic_tiles != 0) {
+                // One decoder standing in for many streams
+                for (unsigned int i = 0; i != mosaic_tiles; ++i)
+                    egl_wayland_out_mosaic_display(dpo, i, frame);
+            }
+            else
+                egl_wayland_out_display(dpo, frame);
 
-                if ((ret = fwrite(buffer, 1, size, output_file)) < 0) {
-                    fprintf(stderr, "Failed to dump raw data.\n");
-                    goto fail;
-                }
+            // Written behind us - hardware frames are transferred first
+            if (dump != NULL && (ret = dump_writer_write(dump, frame)) < 0) {
+                fprintf(stderr, "Failed to dump raw data: %s\n", av_err2str(ret));
+                goto fail;
             }
         } while (buffersink_ctx != NULL);  // Loop if we have a filter to drain
 
@@ -190,9 +196,7 @@ static int decode_write(AVCodecContext * const avctx,
             ret = -1;
 
     fail:
-        av_frame_free(&frame);
-        av_frame_free(&sw_frame);
-        av_freep(&buffer);
+        av_frame_unref(frame);
         if (ret < 0)
             return ret;
     }
@@ -289,22 +293,89 @@ end:
     return ret;
 }
 
-static uint64_t
-us_time()
+// Reads the video stream into the packet queue so demux stalls and decoder
+// backpressure don't hold each other up
+typedef struct demux_env_s {
+    AVFormatContext *input_ctx;
+    int video_stream;
+    pace_t *pace;
+    pkt_queue_t *q;
+    pthread_t thread;
+} demux_env_t;
+
+static void *demux_thread(void *v)
 {
-    struct timespec ts = {0};
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    demux_env_t * const dm = v;
+    AVPacket *packet = av_packet_alloc();
+    int ret = 0;
+
+    if (packet == NULL) {
+        pkt_queue_finish(dm->q, AVERROR(ENOMEM));
+        return NULL;
+    }
+
+    while ((ret = av_read_frame(dm->input_ctx, packet)) >= 0) {
+        if (dm->video_stream != packet->stream_index ||
+            (dm->pace != NULL && !pace_packet(dm->pace, packet))) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        // Aborted - decode has finished early
+        if (pkt_queue_put(dm->q, packet) != 0)
+            break;
+    }
+
+    pkt_queue_finish(dm->q, ret);
+    av_packet_free(&packet);
+    return NULL;
 }
 
 void usage()
 {
     fprintf(stderr,
-            "Usage: hello_egl_wayland [-d]\n"
+            "Usage: hello_egl_wayland [-d|-s]\n"
             "                      [-l loop_count] [-f <frames>] [-o yuv_output_file]\n"
-            "                      [--deinterlace] [--pace-input <hz>] [--fullscreen]\n"
+            "                      [--deinterlace] [--pace-input <rate>|pts] [--fullscreen]\n"
+            "                      [--pace-late catchup|resync|skip[:<ms>]]\n"
+            "                      [--pts-sched] [--queue-depth <n>] [--explicit-sync]\n"
+            "                      [--queue-policy block|drop-new|drop-oldest]\n"
+            "                      [--present fifo|mailbox|immediate] [--subsurface]\n"
+            "                      [--mosaic <n>] [--headless <w>x<h>]\n"
+            "                      [--trace <json>|--trace-stats] [--log <spec>]\n"
+            "                      [--read-ahead <MB>[:<ms>]]\n"
+            "                      [--dump-depth <n>] [--dump-prealloc <MB>]\n"
             "                      <input file> [<input_file> ...]\n"
-            " -d   Use dmabuf (otherwise egl)\n");
+            " -d             Use dmabuf (otherwise egl)\n"
+            " -s             Software decode to wl_shm (no GPU needed)\n"
+            " --pts-sched    Present frames at their PTS using wp_presentation\n"
+            "                (defaults the queue to 4 deep, blocking)\n"
+            " --queue-depth  Frames queued for display (1-16, default 1)\n"
+            " --queue-policy What to do when the display queue is full\n"
+            "                (default drop-oldest)\n"
+            " --present      Frame pacing: fifo shows every frame a refresh apart,\n"
+            "                mailbox the newest frame at each refresh (use for\n"
+            "                live sources), immediate as soon as it arrives\n"
+            "                (default fifo)\n"
+            " --explicit-sync Release frames on explicit GPU/compositor fences\n"
+            " --subsurface   Put the video on its own desync subsurface (-d or -s)\n"
+            " --mosaic       Show every frame in each of n tiles of one EGL window\n"
+            " --headless     Draw with EGL into a w x h offscreen buffer, no compositor\n"
+            " --pace-input   Feed packets to the decoder at <rate> (e.g. 25, 59.94,\n"
+            "                60000/1001, ntsc) or at their timestamps (pts), as if live\n"
+            " --pace-late    Paced packets over <ms> (default 50) late are sent at once\n"
+            "                (catchup, the default), move the timeline (resync) or\n"
+            "                are dropped up to the next keyframe (skip)\n"
+            " --dump-depth   Frames being written to the -o file at once (1-32, default 4)\n"
+            " --dump-prealloc Grow the -o file in <MB> steps with fallocate\n"
+            " --read-ahead   Packets the demux thread may queue ahead of the decoder\n"
+            "                (default 16MB or 2000ms, whichever is reached first)\n"
+            " --trace        Time every frame through each stage; print latency\n"
+            "                percentiles and write a Chrome trace to <json> at exit\n"
+            " --trace-stats  Just the percentiles\n"
+            " --log          Log levels by category, e.g. all:warn,frame:trace\n"
+            "                (cats gen wl egl dmabuf shm pres frame; levels off\n"
+            "                error warn info debug trace). Also $EGL_WAYLAND_LOG\n");
     exit(1);
 }
 
@@ -319,7 +390,11 @@ int main(int argc, char *argv[])
 #else
     AVCodec *decoder = NULL;
 #endif
-    AVPacket packet;
+    AVPacket packet = {0};
+    demux_env_t demux;
+    decode_env_t dec;
+    unsigned int read_ahead_mb = 16;
+    unsigned int read_ahead_ms = 2000;
     enum AVHWDeviceType type;
     const char * in_file;
     char * const * in_filelist;
@@ -331,10 +406,22 @@ int main(int argc, char *argv[])
     long loop_count = 1;
     long frame_count = -1;
     const char * out_name = NULL;
+    unsigned int dump_depth = 4;
+    unsigned int dump_prealloc_mb = 0;
     bool wants_deinterlace = false;
-    long pace_input_hz = 0;
+    AVRational pace_rate = {0, 1};
+    bool pace_pts = false;
+    enum pace_late pace_late = PACE_LATE_CATCHUP;
+    long pace_late_ms = 50;
     bool use_dmabuf = false;
+    bool use_shm = false;
     bool fullscreen = false;
+    bool pts_sched = false;
+    bool explicit_sync = false;
+    bool video_subsurface = false;
+    long queue_depth = -1;
+    int queue_policy = -1;
+    enum egl_wayland_out_present_mode present_mode = EGL_WAYLAND_OUT_PRESENT_FIFO;
 
     {
         char * const * a = argv + 1;
@@ -382,18 +469,170 @@ int main(int argc, char *argv[])
             }
             else if (strcmp(arg, "-d") == 0) {
                 use_dmabuf = true;
+            }
+            else if (strcmp(arg, "-s") == 0) {
+                use_shm = true;
             } else if (strcmp(arg, "--pace-input") == 0) {
                 if (n == 0)
                     usage();
-                pace_input_hz = strtol(*a, &e, 0);
-                if (*e != 0)
+                if (strcmp(*a, "pts") == 0)
+                    pace_pts = true;
+                else if (av_parse_video_rate(&pace_rate, *a) < 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--pace-late") == 0) {
+                static const char * const policies[] = {"catchup", "resync", "skip"};
+                const char *ms;
+                size_t len;
+                if (n == 0)
                     usage();
+                len = strcspn(*a, ":");
+                for (i = 0; i != 3; ++i) {
+                    if (strlen(policies[i]) == len && strncmp(*a, policies[i], len) == 0)
+                        break;
+                }
+                if (i == 3)
+                    usage();
+                pace_late = (enum pace_late)i;
+                if ((*a)[len] == ':') {
+                    ms = *a + len + 1;
+                    pace_late_ms = strtol(ms, &e, 0);
+                    if (*e != 0 || e == ms || pace_late_ms < 0)
+                        usage();
+                }
                 --n;
                 ++a;
             }
             else if (strcmp(arg, "--deinterlace") == 0) {
                 wants_deinterlace = true;
             }
+            else if (strcmp(arg, "--pts-sched") == 0) {
+                pts_sched = true;
+            }
+            else if (strcmp(arg, "--explicit-sync") == 0) {
+                explicit_sync = true;
+            }
+            else if (strcmp(arg, "--subsurface") == 0) {
+                video_subsurface = true;
+            }
+            else if (strcmp(arg, "--mosaic") == 0) {
+                long n_tiles;
+                if (n == 0)
+                    usage();
+                n_tiles = strtol(*a, &e, 0);
+                if (*e != 0 || n_tiles < 1 || n_tiles > 64)
+                    usage();
+                mosaic_tiles = (unsigned int)n_tiles;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--trace") == 0) {
+                if (n == 0)
+                    usage();
+                if (trace_init(*a) != 0)
+                    fprintf(stderr, "Failed to start tracing\n");
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--dump-depth") == 0) {
+                if (n == 0)
+                    usage();
+                dump_depth = strtoul(*a, &e, 0);
+                if (*e != 0 || dump_depth == 0 || dump_depth > 32)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--dump-prealloc") == 0) {
+                if (n == 0)
+                    usage();
+                dump_prealloc_mb = strtoul(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--read-ahead") == 0) {
+                unsigned int mb, ms;
+                if (n == 0)
+                    usage();
+                switch (sscanf(*a, "%u:%u", &mb, &ms)) {
+                case 2:
+                    read_ahead_ms = ms;
+                    /* fallthrough */
+                case 1:
+                    read_ahead_mb = mb;
+                    break;
+                default:
+                    usage();
+                }
+                if (read_ahead_mb == 0 || read_ahead_ms == 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--log") == 0) {
+                if (n == 0)
+                    usage();
+                if (log_config(*a) != 0) {
+                    fprintf(stderr, "Bad log spec '%s'\n", *a);
+                    usage();
+                }
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--trace-stats") == 0) {
+                if (trace_init(NULL) != 0)
+                    fprintf(stderr, "Failed to start tracing\n");
+            }
+            else if (strcmp(arg, "--headless") == 0) {
+                if (n == 0)
+                    usage();
+                if (sscanf(*a, "%ux%u", &headless_w, &headless_h) != 2 ||
+                    headless_w == 0 || headless_h == 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--queue-depth") == 0) {
+                if (n == 0)
+                    usage();
+                queue_depth = strtol(*a, &e, 0);
+                if (*e != 0 || queue_depth < 1)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--queue-policy") == 0) {
+                if (n == 0)
+                    usage();
+                if (strcmp(*a, "block") == 0)
+                    queue_policy = EGL_WAYLAND_OUT_Q_BLOCK;
+                else if (strcmp(*a, "drop-new") == 0)
+                    queue_policy = EGL_WAYLAND_OUT_Q_DROP_NEW;
+                else if (strcmp(*a, "drop-oldest") == 0)
+                    queue_policy = EGL_WAYLAND_OUT_Q_DROP_OLDEST;
+                else
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--present") == 0) {
+                if (n == 0)
+                    usage();
+                if (strcmp(*a, "fifo") == 0)
+                    present_mode = EGL_WAYLAND_OUT_PRESENT_FIFO;
+                else if (strcmp(*a, "mailbox") == 0)
+                    present_mode = EGL_WAYLAND_OUT_PRESENT_MAILBOX;
+                else if (strcmp(*a, "immediate") == 0)
+                    present_mode = EGL_WAYLAND_OUT_PRESENT_IMMEDIATE;
+                else
+                    usage();
+                --n;
+                ++a;
+            }
             else if (strcmp(arg, "--") == 0) {
                 --n;  // If we are going to break out then need to dec count like in the while
                 break;
@@ -411,8 +650,8 @@ int main(int argc, char *argv[])
         loop_count *= in_count;
     }
 
-    type = av_hwdevice_find_type_by_name(hwdev);
-    if (type == AV_HWDEVICE_TYPE_NONE) {
+    type = use_shm ? AV_HWDEVICE_TYPE_NONE : av_hwdevice_find_type_by_name(hwdev);
+    if (type == AV_HWDEVICE_TYPE_NONE && !use_shm) {
         fprintf(stderr, "Device type %s is not supported.\n", hwdev);
         fprintf(stderr, "Available device types:");
         while((type = av_hwdevice_iterate_types(type)) != AV_HWDEVICE_TYPE_NONE)
@@ -421,18 +660,42 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    dpo = use_dmabuf ? dmabuf_wayland_out_new(fullscreen) : egl_wayland_out_new(fullscreen);
+    if (mosaic_tiles != 0 && (use_shm || use_dmabuf)) {
+        fprintf(stderr, "--mosaic needs the EGL output\n");
+        usage();
+    }
+    if (headless_w != 0 && (use_shm || use_dmabuf || mosaic_tiles != 0)) {
+        fprintf(stderr, "--headless needs the plain EGL output\n");
+        usage();
+    }
+    dpo = headless_w != 0 ? egl_headless_out_new(headless_w, headless_h) :
+        use_shm ? shm_wayland_out_new(fullscreen) :
+        use_dmabuf ? dmabuf_wayland_out_new(fullscreen) :
+        mosaic_tiles != 0 ? egl_wayland_out_mosaic_new(fullscreen, mosaic_tiles) : egl_wayland_out_new(fullscreen);
     if (dpo == NULL) {
         fprintf(stderr, "Failed to open egl_wayland output\n");
         return 1;
     }
 
+    // PTS scheduling wants every frame so default to holding the decoder back
+    if (queue_depth < 0)
+        queue_depth = pts_sched ? 4 : 1;
+    if (queue_policy < 0)
+        queue_policy = pts_sched ? EGL_WAYLAND_OUT_Q_BLOCK : EGL_WAYLAND_OUT_Q_DROP_OLDEST;
+    egl_wayland_out_set_queue(dpo, queue_depth, queue_policy);
+    egl_wayland_out_explicit_sync(dpo, explicit_sync);
+    egl_wayland_out_present_mode(dpo, present_mode);
+    if (video_subsurface && egl_wayland_out_video_subsurface(dpo, true) != 0)
+        fprintf(stderr, "Video subsurface needs -d or -s; ignored\n");
+
     /* open the file to dump raw data */
     if (out_name != NULL) {
-        if ((output_file = fopen(out_name, "w+")) == NULL) {
+        if ((dump = dump_writer_new(out_name, dump_depth, (size_t)dump_prealloc_mb << 20)) == NULL) {
             fprintf(stderr, "Failed to open output file %s: %s\n", out_name, strerror(errno));
             return -1;
         }
+        LOG_I(LOG_CAT_GEN, "Dumping to %s with %s, %u frames in flight\n", out_name,
+              dump_writer_backend(dump), dump_depth);
     }
 
 loopy:
@@ -459,7 +722,11 @@ loopy:
     }
     video_stream = ret;
 
-    if (decoder->id == AV_CODEC_ID_H264) {
+    if (use_shm) {
+        // Plain software decoder
+        hw_pix_fmt = AV_PIX_FMT_NONE;
+    }
+    else if (decoder->id == AV_CODEC_ID_H264) {
         if ((decoder = avcodec_find_decoder_by_name("h264_v4l2m2m")) == NULL) {
             fprintf(stderr, "Cannot find the h264 v4l2m2m decoder\n");
             return -1;
@@ -498,10 +765,17 @@ loopy:
     if (avcodec_parameters_to_context(decoder_ctx, video->codecpar) < 0)
         return -1;
 
-    decoder_ctx->get_format  = get_hw_format;
+    if (use_shm) {
+        // Decode straight into the buffers we give the compositor
+        decoder_ctx->opaque = dpo;
+        decoder_ctx->get_buffer2 = egl_wayland_out_get_buffer2;
+    }
+    else {
+        decoder_ctx->get_format  = get_hw_format;
 
-    if (hw_decoder_init(decoder_ctx, type) < 0)
-        return -1;
+        if (hw_decoder_init(decoder_ctx, type) < 0)
+            return -1;
+    }
 
     decoder_ctx->thread_count = 3;
     decoder_ctx->flags = AV_CODEC_FLAG_LOW_DELAY;
@@ -511,59 +785,68 @@ loopy:
         return -1;
     }
 
-    if (wants_deinterlace) {
+    if (wants_deinterlace && !use_shm) {
         if (init_filters(video, decoder_ctx, "deinterlace_v4l2m2m") < 0) {
             fprintf(stderr, "Failed to init deinterlace\n");
             return -1;
         }
     }
 
-    /* actual decoding and dump the raw data */
-    {
-        uint64_t t0 = us_time() + 3000; // Allow a few ms so we aren't behind at startup
-        int pts_seen = 0;
-        uint64_t fake_ts = 0;
-
-        frames = frame_count;
-        while (ret >= 0) {
-            if ((ret = av_read_frame(input_ctx, &packet)) < 0)
-                break;
-
-            if (video_stream == packet.stream_index) {
-                if (pace_input_hz > 0) {
-                    const uint64_t now = us_time();
-                    if (now < t0)
-                        usleep(t0 - now);
-                    else
-                        fprintf(stderr, "input pace failure by %"PRId64"us\n", now - t0);
-
-                    t0 += 1000000 / pace_input_hz;
-
-                    if (packet.pts != AV_NOPTS_VALUE) {
-                        pts_seen = 1;
-                    }
-                    else if (!pts_seen) {
-                        packet.dts = fake_ts;
-                        packet.pts = fake_ts;
-                        fake_ts += 90000 / pace_input_hz;
-                    }
-                }
+    if (pts_sched)
+        egl_wayland_out_pts_sched(dpo, filter_graph != NULL ?
+                                  av_buffersink_get_time_base(buffersink_ctx) : video->time_base);
 
-                ret = decode_write(decoder_ctx, dpo, &packet);
-            }
+    /* actual decoding and dump the raw data */
+    demux = (demux_env_t){
+        .input_ctx = input_ctx,
+        .video_stream = video_stream,
+        .pace = pace_pts || pace_rate.num != 0 ?
+            pace_new(pace_rate, video->time_base, pace_late, (int64_t)pace_late_ms * 1000000) : NULL,
+        .q = pkt_queue_new((size_t)read_ahead_mb << 20, (int64_t)read_ahead_ms * 1000, video->time_base),
+    };
+    if (decode_env_init(&dec) != 0 || demux.q == NULL ||
+        pthread_create(&demux.thread, NULL, demux_thread, &demux) != 0) {
+        fprintf(stderr, "Failed to start demux thread\n");
+        return -1;
+    }
 
-            av_packet_unref(&packet);
+    frames = frame_count;
+    while (ret >= 0) {
+        if ((ret = pkt_queue_get(demux.q, &packet)) < 0) {
+            if (ret != AVERROR_EOF)
+                fprintf(stderr, "Demux failed: %s\n", av_err2str(ret));
+            break;
         }
+        ret = decode_write(decoder_ctx, dpo, &dec, &packet);
+        av_packet_unref(&packet);
+    }
+
+    // Unblock the demuxer if we stopped first
+    pkt_queue_abort(demux.q);
+    pthread_join(demux.thread, NULL);
+    {
+        pkt_queue_stats_t qs;
+        pkt_queue_stats(demux.q, &qs);
+        LOG_I(LOG_CAT_GEN, "Read ahead: %u packets, peak %u/%zukB/%"PRId64"ms, demux blocked %u, decoder starved %u\n",
+              qs.packets, qs.max_packets, qs.max_bytes >> 10, qs.max_dur_us / 1000, qs.put_waits, qs.get_waits);
+    }
+    pkt_queue_delete(&demux.q);
+    if (demux.pace != NULL) {
+        pace_stats_t ps;
+        pace_stats(demux.pace, &ps);
+        LOG_I(LOG_CAT_GEN, "Pacing: %u packets, late %u (avg %"PRId64"us, max %"PRId64"us), resyncs %u, skipped %u, discontinuities %u\n",
+              ps.packets, ps.late, ps.late == 0 ? 0 : ps.late_total_ns / ps.late / 1000, ps.late_max_ns / 1000,
+              ps.resyncs, ps.skipped, ps.disconts);
+        pace_delete(&demux.pace);
     }
 
     /* flush the decoder */
     packet.data = NULL;
     packet.size = 0;
-    ret = decode_write(decoder_ctx, dpo, &packet);
+    ret = decode_write(decoder_ctx, dpo, &dec, &packet);
     av_packet_unref(&packet);
+    decode_env_uninit(&dec);
 
-    if (output_file)
-        fclose(output_file);
     avfilter_graph_free(&filter_graph);
     avcodec_free_context(&decoder_ctx);
     avformat_close_input(&input_ctx);
@@ -571,6 +854,8 @@ loopy:
     if (--loop_count > 0)
         goto loopy;
 
+    if ((ret = dump_writer_delete(&dump)) != 0)
+        fprintf(stderr, "Failed to dump raw data: %s\n", av_err2str(ret));
     egl_wayland_out_delete(dpo);
 
     return 0;
@@ -9,10 +9,17 @@
 #include "xdg-shell-client-protocol.h"
 #include "xdg-decoration-unstable-v1-client-protocol.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
+#if HAS_DRM_SYNCOBJ
+#include "linux-drm-syncobj-v1-client-protocol.h"
+#endif
 
 #include "init_window.h"
-//#include "log.h"
-#define LOG printf
+#include "dmabuf_fmts.h"
+#include "log.h"
+#include "shm_pool.h"
+#include "trace.h"
+#include "yuv_convert.h"
 
 #include <assert.h>
 #include <fcntl.h>
@@ -28,51 +35,116 @@
 #include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/poll.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+
+#if HAS_DRM_SYNCOBJ
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+#include <linux/sync_file.h>
+#include <xf86drm.h>
+#endif
 
 #include <epoxy/gl.h>
 #include <epoxy/egl.h>
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 
 #include "libavutil/frame.h"
 #include "libavcodec/avcodec.h"
 #include "libavutil/hwcontext.h"
 #include "libavutil/hwcontext_drm.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/mathematics.h"
+#include "libavutil/pixdesc.h"
 
-#define TRACE_ALL 1
 #define  DEBUG_SOLID 0
 
 #define ES_SIG 0x12345678
 
-#define W_SUBSURFACE 0
+// The wl_display connection & its globals - one per process, shared by
+// every output. Globals are bound on the default queue; each output wraps
+// them onto its own queue so its display thread only dispatches its own
+// events. The default queue (ping, new globals) is dispatched by whichever
+// display thread gets the lock.
+typedef struct wo_conn_s
+{
+	unsigned int ref_count;  // (protected by conn_lock)
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct wl_compositor *w_compositor;
+	struct wl_subcompositor *w_subcompositor;
+	struct zwp_linux_dmabuf_v1 *linux_dmabuf_v1_bind;
+	struct wl_shm *w_shm;
+	struct xdg_wm_base *x_wm_base;
+	struct zxdg_decoration_manager_v1 *x_decoration;
+	struct wp_viewporter *w_viewporter;
+	struct wp_presentation *w_presentation;
+#if HAS_DRM_SYNCOBJ
+	struct wp_linux_drm_syncobj_manager_v1 *w_syncobj_manager;
+#endif
+	clockid_t pres_clock;
+	dmabuf_fmts_t *dmabuf_fmts;  // Pre-v4 format events
+	dmabuf_fmts_t *shm_fmts;     // wl_shm formats (modifier 0)
+} wo_conn_t;
 
-struct wl_egl_window *egl_window;
-struct wl_region *region;
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static wo_conn_t *conn_shared;
 
-struct xdg_wm_base *XDGWMBase;
-struct xdg_surface *XDGSurface;
-struct xdg_toplevel *XDGToplevel;
+// Default queue events are rare and nothing waits on them so skip if
+// someone else is already on it
+static void
+conn_dispatch(wo_conn_t *const conn)
+{
+	if (pthread_mutex_trylock(&conn_lock) != 0)
+		return;
+	wl_display_dispatch_pending(conn->display);
+	pthread_mutex_unlock(&conn_lock);
+}
 
+// Per output window state. The global pointers (w_compositor, w_shm etc.)
+// are wrappers of conn's that put anything made from them on w_queue.
 struct _escontext
 {
+	wo_conn_t *conn;
 	struct wl_display *native_display;
+	struct wl_event_queue *w_queue;  // Everything this output creates
 	int window_width;
 	int window_height;
 	int req_w;
 	int req_h;
+	unsigned int req_gen;  // Bumped whenever req_w/req_h change
 	struct wl_egl_window *native_window;
 	struct wl_compositor *w_compositor;
 	struct wl_surface *w_surface;
-	struct wl_surface *w_surface2;
+	struct xdg_surface *x_surface;
+	struct xdg_toplevel *x_toplevel;
+	struct wl_surface *w_surface2;          // Video, when on a subsurface
 	struct wl_subsurface *w_subsurface2;
+	struct wp_viewport *w_viewport2;
 	struct zwp_linux_dmabuf_v1 * linux_dmabuf_v1_bind;
 	struct wl_shm *w_shm;
+	shm_pool_t *bg_pool;     // Parent fill under the video subsurface
 	struct wl_subcompositor *w_subcompositor;
+	struct xdg_wm_base *x_wm_base;
 	struct zxdg_decoration_manager_v1 *x_decoration;
 	struct wp_viewporter *w_viewporter;
 	struct wp_viewport *w_viewport;
+	struct wp_presentation *w_presentation;
+	clockid_t pres_clock;
+#if HAS_DRM_SYNCOBJ
+	struct wp_linux_drm_syncobj_manager_v1 *w_syncobj_manager;
+#endif
+	// Formats the compositor will take - from v4 surface feedback if we
+	// have it, else the v3 modifier events. Only used on the display thread
+	dmabuf_fmts_t *dmabuf_fmts;
+	unsigned int fmts_gen;   // Bumped when dmabuf_fmts changes
+	dev_t dmabuf_main_dev;
+	const dmabuf_fmts_t *shm_fmts; // conn's
 	EGLDisplay display;
 	EGLContext context;
 	EGLSurface surface;
@@ -80,45 +152,323 @@ struct _escontext
 	unsigned int sig;
 };
 
-struct _escontext ESContext = {
-	.native_display = NULL,
-	.window_width = 0,
-	.window_height = 0,
-	.native_window  = 0,
-	.display = NULL,
-	.context = NULL,
-	.surface = NULL,
-	.sig = ES_SIG
+#define EGL_AUX_SIZE 32
+#define W_BUF_CACHE_SIZE 32
+#define PRES_FB_SIZE 16
+#define FRAME_Q_SLOTS 16  // Max queue depth; must be a power of 2
+// Spare AVFrames kept for frame_get - enough for the queue, a held frame,
+// the fence list & mosaic tiles in the steady state
+#define FRAME_SHELLS 48
+#define FENCE_Q_SIZE 8    // Frames waiting on an EGL fence
+#define SHM_POOL_SLOTS 24 // Enough for decoder refs + threads + display
+#define MOSAIC_MAX_TILES 64
+
+// How an AVFrame is laid out in a shm buffer
+typedef struct shm_frame_layout_s {
+	enum AVPixelFormat avfmt;
+	int width, height;
+	int linesize[4];
+	size_t plane_offset[4];
+	size_t size;
+} shm_frame_layout_t;
+
+#define DRM_MOD_INVALID ((UINT64_C(1) << 56) - 1)
+
+struct egl_wayland_out_env;
+
+// Outstanding wp_presentation_feedback
+typedef struct pres_fb_s
+{
+	struct egl_wayland_out_env *de;
+	struct wp_presentation_feedback *fb;  // NULL => slot free
+	int64_t target_ns;  // Vblank we were aiming at; 0 if unscheduled
+	int64_t commit_ns;
+	int64_t arrival_ns;  // When egl_wayland_out_display got the frame
+} pres_fb_t;
+
+// Identity of the dmabufs behind a frame. fd numbers get recycled so we use
+// the dmabuf inode, which is unique for the lifetime of the buffer object
+// on kernels that give each dmabuf its own inode (older ones share one
+// anon inode - see dmabuf_key_make)
+typedef struct dmabuf_key_s
+{
+	uint32_t format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int nb_objects;
+	unsigned int nb_planes;
+	ino_t ino[AV_DRM_MAX_PLANES];
+	uint32_t offset[AV_DRM_MAX_PLANES];
+	uint32_t pitch[AV_DRM_MAX_PLANES];
+	uint64_t seq;             // Non-zero (so never matches) until inodes are known good
+} dmabuf_key_t;
+
+struct dmabuf_w_env_s;
+
+// YUV formats we can draw from one EGLImage per plane when the driver
+// can't import the whole frame as an external texture
+enum egl_yuv_fmt_e
+{
+	EGL_YUV_NV12,
+	EGL_YUV_YUV420,
+	EGL_YUV_P010,
+	EGL_YUV_FMTS
 };
 
 typedef struct egl_aux_s
 {
-	int fd;
-	GLuint texture;
+	dmabuf_key_t key;
+	uint64_t last_used;  // LRU stamp; 0 => slot unused
+	GLuint texture;      // Whole frame (external) or first plane
+	GLuint planes[2];    // Other planes if per-plane
+	int yuv_fmt;         // Valid if planes[0] != 0
 } egl_aux_t;
 
+// Imports of one decoder's frames
+typedef struct egl_aux_cache_s
+{
+	egl_aux_t ents[EGL_AUX_SIZE];
+	uint64_t stamp;
+	const void *frames_ctx;  // hw_frames_ctx that the cache was filled from
+} egl_aux_cache_t;
+
+// One stream of a mosaic
+typedef struct mosaic_tile_s
+{
+	AVFrame *frame;          // Newest from the decoder (protected by q_lock)
+	AVFrame *shown;          // Drawn in the tile now
+	AVFrame *prev;           // Replaced by shown - freed after the swap
+	unsigned int shown_n;
+	unsigned int dropped;    // Replaced before they were drawn (protected by q_lock)
+	egl_aux_cache_t aux;
+} mosaic_tile_t;
+
+// Per-plane YUV program with the uniforms it was last set up for
+typedef struct gl_yuv_prog_s
+{
+	GLuint prog;
+	GLint u_cm, u_off, u_coff;
+	enum AVColorSpace colorspace;
+	enum AVColorRange range;
+	enum AVChromaLocation chroma_loc;
+	int w, h;
+} gl_yuv_prog_t;
+
+// Single producer (egl_wayland_out_display), single consumer (display thread)
+// frame ring. The producer may also advance tail to drop the oldest frame so
+// tail is only ever moved by CAS and the slots are atomic.
+typedef struct frame_q_slot_s
+{
+	_Atomic(AVFrame *) frame;
+	_Atomic int64_t arrival_ns;
+} frame_q_slot_t;
+
+typedef struct frame_q_s
+{
+	unsigned int depth;
+	enum egl_wayland_out_q_policy policy;
+	atomic_uint head;  // Only written by the producer
+	atomic_uint tail;
+	sem_t space;       // Free slots - only the producer waits on this
+	frame_q_slot_t slots[FRAME_Q_SLOTS];
+
+	unsigned int drop_new;  // Producer side counters
+	unsigned int drop_oldest;
+	unsigned int blocked;
+} frame_q_t;
+
+typedef struct fence_ent_s
+{
+	AVFrame *frame;
+	int fd;  // sync_file that signals when the GPU is done with frame
+} fence_ent_t;
+
+// linux-dmabuf v4 format table entry
+typedef struct dmabuf_fmt_table_ent_s
+{
+	uint32_t format;
+	uint32_t pad;
+	uint64_t modifier;
+} dmabuf_fmt_table_ent_t;
+
+enum egl_import_e
+{
+	EGL_IMPORT_NONE,      // Can't import
+	EGL_IMPORT_MOD,       // Import with explicit modifier
+	EGL_IMPORT_IMPLICIT,  // Import without modifier - driver's default layout
+};
+
+typedef struct out_mode_s
+{
+	int w, h;
+	AVRational sar;
+	AVRational frame_rate;
+} out_mode_t;
+
 struct egl_wayland_out_env
 {
 	struct _escontext * es;
 
 	enum AVPixelFormat avfmt;
 
-	int show_all;
 	int window_width, window_height;
 	int window_x, window_y;
 	int fullscreen;
 
-	egl_aux_t aux[32];
+	egl_aux_cache_t aux;      // Mosaic tiles have their own
+	unsigned int aux_hits;
+	unsigned int aux_misses;
+
+	// What EGL can import - built once at startup on the display thread
+	dmabuf_fmts_t *egl_fmts;
+	bool egl_fmts_implicit;   // Can't query - try implicit import
+	dmabuf_fmts_t *egl_failed; // Pairs eglCreateImageKHR has refused
+	uint32_t egl_bad_fourcc;  // Last unsupported pair (to limit logging)
+	uint64_t egl_bad_mod;
+	unsigned int egl_unsupported;
+	unsigned int egl_planar;  // Frames imported plane by plane
+
+	GLuint gl_prog_ext;
+	gl_yuv_prog_t gl_yuv[EGL_YUV_FMTS];
+	GLuint gl_prog_cur;
+
+	// Mosaic - mosaic_n streams drawn as a grid of tiles with one swap per
+	// frame callback
+	unsigned int mosaic_n;    // 0 => one stream through the frame queue
+	unsigned int mosaic_cols, mosaic_rows;
+	mosaic_tile_t *tiles;
+	bool mosaic_new;          // Some tile has a new frame (protected by q_lock)
+	unsigned int mosaic_swaps;
+
+	// Headless - no compositor, draws into an offscreen framebuffer
+	bool is_headless;
+	GLuint hl_fbo;            // 0 if drawing into a pbuffer
+	GLuint hl_tex;
+	bool hl_readback;         // Keep a copy of each frame - set before the first display
+	pthread_mutex_t hl_lock;  // Protects hl_pixels & hl_have_frame
+	uint8_t *hl_pixels;       // RGBA, bottom row first
+	bool hl_have_frame;
+	unsigned int hl_frames;
+
+	struct dmabuf_w_env_s *wbufs[W_BUF_CACHE_SIZE];
+	struct dmabuf_w_env_s *wbuf_dead;  // Evicted but still held by the compositor
+	uint64_t wbuf_stamp;
+	const void *wbuf_frames_ctx;
+	uint32_t wbuf_format;
+	unsigned int wbuf_width, wbuf_height;
+	unsigned int wbuf_hits;
+	unsigned int wbuf_misses;
+	// dmabuf keys are only trusted once two objects have been seen with
+	// different inodes
+	bool key_ino_unique;
+	ino_t key_ino0;
+	uint64_t key_seq;
+
+	// Output geometry - mode is set by modeset, the video rectangle is
+	// derived from it and the window size on the display thread
+	out_mode_t mode_last;     // Producer side copy for the fast path
+	out_mode_t mode;          // (protected by q_lock)
+	atomic_uint mode_gen;
+	unsigned int geo_mode_gen;
+	unsigned int geo_req_gen;
+	AVRational frame_rate;    // Display thread copy of mode.frame_rate
+	int vid_x, vid_y, vid_w, vid_h;
+
+	// Video surface - es->w_surface or, with want_subsurface, a desync
+	// subsurface of it so video commits never wait on the parent
+	bool want_subsurface;     // Set before the first display
+	bool sub_tried;
+	struct wl_surface *v_surface;
+	struct wp_viewport *v_viewport;
+
+	// linux-dmabuf v4 surface feedback - built up in fb_fmts then swapped
+	// into es->dmabuf_fmts on done
+	struct zwp_linux_dmabuf_feedback_v1 *dmabuf_fb;
+	const dmabuf_fmt_table_ent_t *fb_table;  // mmaped
+	size_t fb_table_size;
+	dmabuf_fmts_t *fb_fmts;
+	dev_t fb_tranche_dev;
+	uint32_t fb_tranche_flags;
+	struct wl_array fb_tranche_idx;  // uint16_t indices into fb_table
+	// Classification of the last frame format we showed
+	unsigned int fb_last_gen;
+	uint32_t fb_last_fourcc;
+	uint64_t fb_last_mod;
+	bool fb_last_scanout;
+	unsigned int frames_scanout;     // Frames the compositor could put on a plane
+	unsigned int frames_composite;
+
+	// wl_shm output
+	bool is_shm;
+	pthread_mutex_t shm_lock;       // Pool layout changes + acquire
+	shm_pool_t *shm_pool;
+	shm_frame_layout_t shm_lay;     // How frames sit in the pool's current layout
+	size_t shm_src_x, shm_src_y;    // Viewport source last set
+	int shm_src_w, shm_src_h;
+	enum AVPixelFormat shm_bad_fmt; // Last unsupported format (to limit logging)
+	unsigned int shm_zero_copy;
+	unsigned int shm_copied;
+	unsigned int shm_converted;
+	yuv_cvt_t *shm_cvt;             // YUV -> XRGB for compositors without YUV shm
+	unsigned int shm_dropped;
+	unsigned int shm_pool_empty;    // Decoder wanted a slot but there wasn't one
+
+	// Frame callback throttling
+	enum egl_wayland_out_present_mode present_mode;  // Set before the first display
+	struct wl_callback *frame_cb;  // Outstanding frame callback, NULL if none
+	unsigned int frame_cb_waits;   // Frames that had to wait for a callback
+	unsigned int mailbox_drops;
+
+	// Explicit sync
+	bool explicit_sync;       // Requested - set before the first display
+	bool egl_fence_ext;       // EGL_ANDROID_native_fence_sync available
+	fence_ent_t fences[FENCE_Q_SIZE];  // Oldest first
+	unsigned int fence_n;
+	unsigned int fence_waits; // Times we had to block on a full fence list
+#if HAS_DRM_SYNCOBJ
+	bool sync_tried;          // Syncobj setup attempted (successfully or not)
+	int drm_fd;               // Render node for our syncobjs
+	int sync_efd;             // Prodded as release points are reached
+	struct wp_linux_drm_syncobj_surface_v1 *sync_surface;  // NULL => implicit
+#endif
+
+	// Presentation timing - all times in pres_clock ns
+	bool pts_sched;           // Aim commits at frame PTS (protected by q_lock)
+	AVRational time_base;     // (protected by q_lock)
+	int timer_fd;
+	AVFrame *q_hold;          // Frame waiting for its commit time
+	int64_t q_hold_arrival_ns;
+	int64_t q_hold_commit_ns;
+	int64_t q_hold_target_ns;
+	int64_t anchor_ns;        // 0 => not anchored
+	int64_t anchor_pts_ns;
+	int64_t last_pts_ns;
+	int64_t refresh_ns;       // 0 => unknown
+	int64_t last_present_ns;
+	int64_t commit_lat_ns;    // Estimated commit -> present time
+	pres_fb_t pres_fb[PRES_FB_SIZE];
+	unsigned int pres_presented;
+	unsigned int pres_discarded;
+	unsigned int pres_late;
+	unsigned int pres_zero_copy;
+	unsigned int pres_targeted;
+	int64_t pres_lat_total_ns;
+	int64_t pres_lat_max_ns;
+	int64_t pres_err_total_ns;
 
 	pthread_t q_thread;
 	pthread_mutex_t q_lock;
-	sem_t display_start_sem;
-	sem_t q_sem;
+	sem_t display_start_sem;  // Posted by each xdg configure
+	sem_t display_ready_sem;  // Posted once by display_thread when set up (or failed)
 	int prod_fd;
 	int q_terminate;
 	bool is_egl;
 	AVFrame *q_this;
-	AVFrame *q_next;
+	frame_q_t q;
+
+	pthread_mutex_t shell_lock;
+	unsigned int shell_n;
+	AVFrame *shells[FRAME_SHELLS];
 };
 
 #define TRUE 1
@@ -127,761 +477,2830 @@ struct egl_wayland_out_env
 #define WINDOW_WIDTH 1280
 #define WINDOW_HEIGHT 720
 
+#define NS_PER_SEC INT64_C(1000000000)
+// Commit -> present guess until we have feedback
+#define PRES_DEFAULT_LAT_NS (NS_PER_SEC / 60)
+// PTS jumps bigger than this (or backwards) re-anchor the timeline
+#define PRES_REANCHOR_NS (NS_PER_SEC * 10)
+
 bool program_alive;
 
 
-/* Shared memory support code */
-static void
-randname(char *buf)
+static const struct {
+	enum AVPixelFormat avfmt;
+	uint32_t shm_fmt;
+} shm_fmt_map[] = {
+	{AV_PIX_FMT_NV12,    WL_SHM_FORMAT_NV12},
+	{AV_PIX_FMT_YUV420P, WL_SHM_FORMAT_YUV420},
+	{AV_PIX_FMT_P010,    WL_SHM_FORMAT_P010},
+	{AV_PIX_FMT_BGR0,    WL_SHM_FORMAT_XRGB8888},
+	{AV_PIX_FMT_BGRA,    WL_SHM_FORMAT_ARGB8888},
+};
+
+// Returns true and the wl_shm format if the compositor can take avfmt
+// directly
+static bool
+shm_fmt_find(const struct _escontext *const es, const enum AVPixelFormat avfmt, uint32_t *const pshm_fmt)
 {
-	struct timespec ts;
-	clock_gettime(CLOCK_REALTIME, &ts);
-	long r = ts.tv_nsec;
-	for (int i = 0; i < 6; ++i) {
-		buf[i] = 'A'+(r&15)+(r&16)*2;
-		r >>= 5;
+	unsigned int i;
+
+	for (i = 0; i != FF_ARRAY_ELEMS(shm_fmt_map); ++i)
+	{
+		if (shm_fmt_map[i].avfmt == avfmt)
+		{
+			*pshm_fmt = shm_fmt_map[i].shm_fmt;
+			return dmabuf_fmts_find(es->shm_fmts, shm_fmt_map[i].shm_fmt, 0, NULL);
+		}
 	}
+	return false;
 }
 
 static int
-create_shm_file(void)
+shm_frame_layout_init(shm_frame_layout_t *const lay, const enum AVPixelFormat avfmt, const int w, const int h)
 {
-	int retries = 100;
-	do {
-		char name[] = "/wl_shm-XXXXXX";
-		randname(name + sizeof(name) - 7);
-		--retries;
-		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
-		if (fd >= 0) {
-			shm_unlink(name);
-			return fd;
-		}
-	} while (retries > 0 && errno == EEXIST);
-	return -1;
+	const AVPixFmtDescriptor *const pfd = av_pix_fmt_desc_get(avfmt);
+	size_t offset = 0;
+	unsigned int i;
+
+	memset(lay, 0, sizeof(*lay));
+	lay->avfmt = avfmt;
+	lay->width = w;
+	lay->height = h;
+
+	// wl_shm only has a stride for the 1st plane - the others are implied
+	// by it and the height in the same way av_image_fill_linesizes does it
+	if (pfd == NULL || av_image_fill_linesizes(lay->linesize, avfmt, FFALIGN(w, 64)) < 0)
+		return -1;
+	for (i = 0; i != 4 && lay->linesize[i] != 0; ++i)
+	{
+		const int ph = i == 0 || i == 3 ? h : -((-h) >> pfd->log2_chroma_h);
+		lay->plane_offset[i] = offset;
+		offset += (size_t)lay->linesize[i] * ph;
+	}
+	// Decoders may overread/write a little beyond the end
+	lay->size = offset + 64;
+	return 0;
 }
 
-static int
-allocate_shm_file(size_t size)
+// Get a free buffer that will hold a w x h frame of avfmt, changing the
+// pool layout if need be. If grow_only then any current layout of the same
+// format that is at least as big will do (the viewport crops it).
+// Returns NULL if all buffers are busy (or no memory)
+static shm_buf_t *
+shm_frame_buf_get(struct egl_wayland_out_env *const de, const enum AVPixelFormat avfmt, const uint32_t shm_fmt,
+		  const int w, const int h, const bool grow_only, shm_frame_layout_t *const lay)
 {
-	int fd = create_shm_file();
-	if (fd < 0)
-		return -1;
-	int ret;
-	do {
-		ret = ftruncate(fd, size);
-	} while (ret < 0 && errno == EINTR);
-	if (ret < 0) {
-		close(fd);
-		return -1;
+	shm_frame_layout_t *const cur = &de->shm_lay;
+	shm_buf_t *buf = NULL;
+
+	pthread_mutex_lock(&de->shm_lock);
+
+	if (de->shm_pool == NULL && (de->shm_pool = shm_pool_new(de->es->w_shm, SHM_POOL_SLOTS)) == NULL)
+		goto fail;
+
+	if (cur->avfmt != avfmt ||
+	    (grow_only ? cur->width < w || cur->height < h : cur->width != w || cur->height != h))
+	{
+		shm_frame_layout_t nl;
+		shm_layout_t sl;
+
+		if (shm_frame_layout_init(&nl, avfmt, w, h) != 0)
+			goto fail;
+		sl.format = shm_fmt;
+		sl.width = w;
+		sl.height = h;
+		sl.stride = nl.linesize[0];
+		sl.size = nl.size;
+		if (shm_pool_set_layout(de->shm_pool, &sl) != 0)
+			goto fail;
+		*cur = nl;
 	}
-	return fd;
+
+	if ((buf = shm_pool_acquire(de->shm_pool)) != NULL)
+		*lay = *cur;
+
+fail:
+	pthread_mutex_unlock(&de->shm_lock);
+	return buf;
 }
 
 static void
-shm_buffer_release(void *data, struct wl_buffer *wl_buffer)
+shm_frame_buf_free(void *opaque, uint8_t *data)
 {
+	shm_buf_t *buf = opaque;
 	(void)data;
-	/* Sent by the compositor when it's no longer using this buffer */
-	wl_buffer_destroy(wl_buffer);
+	shm_buf_unref(&buf);
 }
 
-static const struct wl_buffer_listener shm_buffer_listener = {
-	.release = shm_buffer_release,
-};
+// Decoder get_buffer2 - lets software decoders render straight into the
+// shm buffers that we will give to the compositor
+int egl_wayland_out_get_buffer2(struct AVCodecContext *avctx, AVFrame *frame, int flags)
+{
+	struct egl_wayland_out_env *const de = avctx->opaque;
+	int align[AV_NUM_DATA_POINTERS];
+	int w = frame->width;
+	int h = frame->height;
+	shm_frame_layout_t lay;
+	uint32_t shm_fmt;
+	shm_buf_t *buf;
+	unsigned int i;
+
+	if (de == NULL || !de->is_shm || !(avctx->codec->capabilities & AV_CODEC_CAP_DR1) ||
+	    !shm_fmt_find(de->es, frame->format, &shm_fmt))
+		return avcodec_default_get_buffer2(avctx, frame, flags);
+
+	avcodec_align_dimensions2(avctx, &w, &h, align);
+
+	if ((buf = shm_frame_buf_get(de, frame->format, shm_fmt, w, h, false, &lay)) == NULL ||
+	    (frame->buf[0] = av_buffer_create(shm_buf_data(buf), lay.size, shm_frame_buf_free, buf, 0)) == NULL)
+	{
+		shm_buf_unref(&buf);
+		// Pool exhausted (decoder holding lots of refs) - display will copy
+		++de->shm_pool_empty;
+		return avcodec_default_get_buffer2(avctx, frame, flags);
+	}
 
-static struct wl_buffer *
-draw_frame(struct _escontext * const es)
+	for (i = 0; i != 4 && lay.linesize[i] != 0; ++i)
+	{
+		frame->data[i] = frame->buf[0]->data + lay.plane_offset[i];
+		frame->linesize[i] = lay.linesize[i];
+	}
+	frame->extended_data = frame->data;
+	return 0;
+}
+
+// Fill in a converter source if we can turn frame into XRGB
+static bool
+shm_cvt_src(yuv_cvt_src_t *const src, const AVFrame *const frame)
 {
-	const int width = 640, height = 480;
-	int stride = width * 4;
-	int size = stride * height;
+	unsigned int i;
 
-	int fd = allocate_shm_file(size);
-	if (fd == -1) {
-		return NULL;
+	switch (frame->format)
+	{
+	case AV_PIX_FMT_NV12:
+		src->fmt = YUV_CVT_NV12;
+		break;
+	case AV_PIX_FMT_YUV420P:
+		src->fmt = YUV_CVT_YUV420P;
+		break;
+	case AV_PIX_FMT_P010:
+		src->fmt = YUV_CVT_P010;
+		break;
+	default:
+		return false;
 	}
 
-	uint32_t *data = mmap(NULL, size,
-			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED) {
-		close(fd);
-		return NULL;
+	// Unspecified is 709 for HD, 601 otherwise
+	src->matrix = frame->colorspace == AVCOL_SPC_BT709 ? YUV_CVT_BT709 :
+		frame->colorspace == AVCOL_SPC_UNSPECIFIED && frame->height > 576 ? YUV_CVT_BT709 :
+		YUV_CVT_BT601;
+	src->full_range = frame->color_range == AVCOL_RANGE_JPEG;
+	src->width = frame->width;
+	src->height = frame->height;
+	for (i = 0; i != 3; ++i)
+	{
+		src->data[i] = frame->data[i];
+		src->linesize[i] = frame->linesize[i];
 	}
+	return true;
+}
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(es->w_shm, fd, size);
-	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0,
-			width, height, stride, WL_SHM_FORMAT_XRGB8888);
-	wl_shm_pool_destroy(pool);
-	close(fd);
+static int
+do_display_shm(egl_wayland_out_env_t *const de, struct _escontext *const es, AVFrame *const frame)
+{
+	const int crop_w = av_frame_cropped_width(frame);
+	const int crop_h = av_frame_cropped_height(frame);
+	size_t src_x = frame->crop_left;
+	size_t src_y = frame->crop_top;
+	shm_buf_t *buf = NULL;
+
+	// The frame's ref keeps a decoded-into buffer alive until commit has
+	// taken the compositor's
+	if (de->shm_pool != NULL && frame->buf[0] != NULL &&
+	    (buf = shm_pool_find(de->shm_pool, frame->buf[0]->data)) != NULL)
+	{
+		// libavcodec crops by moving data[] on (and zeroing crop_left/top)
+		// but the wl_buffer still starts at the top left of the whole thing
+		const size_t off = frame->data[0] - shm_buf_data(buf);
+		const size_t pitch = frame->linesize[0];
+
+		src_x += off % pitch / av_pix_fmt_desc_get(frame->format)->comp[0].step;
+		src_y += off / pitch;
+		++de->shm_zero_copy;
+		buf = shm_buf_ref(buf);
+	}
+	else
+	{
+		const int w = FFALIGN(frame->width, 2);
+		const int h = FFALIGN(frame->height, 2);
+		shm_frame_layout_t lay;
+		uint32_t shm_fmt;
+		yuv_cvt_src_t src;
 
-	/* Draw checkerboxed background */
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			if ((x + y / 8 * 8) % 16 < 8)
-				data[y * width + x] = 0xFF666666;
-			else
-				data[y * width + x] = 0xFFEEEEEE;
+		if (shm_fmt_find(es, frame->format, &shm_fmt))
+		{
+			uint8_t *dst[4] = {NULL};
+			int i;
+
+			if ((buf = shm_frame_buf_get(de, frame->format, shm_fmt, w, h, true, &lay)) == NULL)
+			{
+				++de->shm_dropped;
+				return AVERROR(EAGAIN);
+			}
+			for (i = 0; i != 4 && lay.linesize[i] != 0; ++i)
+				dst[i] = shm_buf_data(buf) + lay.plane_offset[i];
+			av_image_copy(dst, lay.linesize, (const uint8_t * const *)frame->data, frame->linesize,
+				      frame->format, frame->width, frame->height);
+			++de->shm_copied;
+		}
+		else if (shm_cvt_src(&src, frame) && shm_fmt_find(es, AV_PIX_FMT_BGR0, &shm_fmt))
+		{
+			// No YUV in shm - convert to XRGB, which every compositor has
+			if (de->shm_cvt == NULL && (de->shm_cvt = yuv_cvt_new(0)) != NULL)
+				LOG_I(LOG_CAT_SHM, "%s: Converting %s to XRGB with %s x %u\n", __func__,
+				    av_get_pix_fmt_name(frame->format),
+				    yuv_cvt_isa_name(yuv_cvt_isa(de->shm_cvt)), yuv_cvt_threads(de->shm_cvt));
+			if (de->shm_cvt == NULL ||
+			    (buf = shm_frame_buf_get(de, AV_PIX_FMT_BGR0, shm_fmt, w, h, true, &lay)) == NULL)
+			{
+				++de->shm_dropped;
+				return AVERROR(EAGAIN);
+			}
+			yuv_cvt_frame(de->shm_cvt, &src, shm_buf_data(buf), lay.linesize[0]);
+			++de->shm_converted;
+		}
+		else
+		{
+			++de->shm_dropped;
+			if (frame->format != de->shm_bad_fmt)
+				LOG_W(LOG_CAT_SHM, "%s: Compositor can't take %s\n", __func__, av_get_pix_fmt_name(frame->format));
+			de->shm_bad_fmt = frame->format;
+			return AVERROR(EINVAL);
 		}
 	}
 
-	munmap(data, size);
-	wl_buffer_add_listener(buffer, &shm_buffer_listener, NULL);
-	return buffer;
+	if (src_x != de->shm_src_x || src_y != de->shm_src_y ||
+	    crop_w != de->shm_src_w || crop_h != de->shm_src_h)
+	{
+		de->shm_src_x = src_x;
+		de->shm_src_y = src_y;
+		de->shm_src_w = crop_w;
+		de->shm_src_h = crop_h;
+		wp_viewport_set_source(de->v_viewport,
+				       wl_fixed_from_int(de->shm_src_x), wl_fixed_from_int(de->shm_src_y),
+				       wl_fixed_from_int(crop_w), wl_fixed_from_int(crop_h));
+	}
+
+	trace_stamp(frame, TRACE_IMPORTED);
+	shm_buf_commit(buf, de->v_surface);
+	shm_buf_unref(&buf);
+	return 0;
 }
 
 
 
 
 static int
-check_support(const struct _escontext *const es, const uint32_t fmt, const uint64_t mod)
+dmabuf_key_make(struct egl_wayland_out_env *const de, dmabuf_key_t *const key, const AVFrame *const frame)
 {
-	EGLuint64KHR mods[16];
-	GLint mod_count = 0;
-	GLint i;
+	const AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
+	unsigned int n = 0;
+	int i, j;
 
-	if (!eglQueryDmaBufModifiersEXT(es->display, fmt, 16, mods, NULL, &mod_count))
+	// Zero the lot so we can memcmp without worrying about padding
+	memset(key, 0, sizeof(*key));
+	key->format = desc->layers[0].format;
+	key->width = av_frame_cropped_width(frame);
+	key->height = av_frame_cropped_height(frame);
+	key->nb_objects = desc->nb_objects;
+
+	for (i = 0; i != desc->nb_objects && i != AV_DRM_MAX_PLANES; ++i)
 	{
-		LOG("queryDmaBufModifiersEXT Failed for %s\n", av_fourcc2str(fmt));
-		return 0;
+		struct stat st;
+		if (fstat(desc->objects[i].fd, &st) != 0)
+		{
+			LOG_E(LOG_CAT_DMABUF, "%s: fstat(%d) failed: %s\n", __func__, desc->objects[i].fd, strerror(errno));
+			return -1;
+		}
+		key->ino[i] = st.st_ino;
 	}
 
-	for (i = 0; i < mod_count; ++i)
+	// The same buffer can be laid out differently from one frame to the next
+	for (i = 0; i < desc->nb_layers; ++i)
 	{
-		if (mods[i] == mod)
-			return 1;
+		for (j = 0; j < desc->layers[i].nb_planes && n != AV_DRM_MAX_PLANES; ++j, ++n)
+		{
+			key->offset[n] = (uint32_t)desc->layers[i].planes[j].offset;
+			key->pitch[n] = (uint32_t)desc->layers[i].planes[j].pitch;
+		}
 	}
+	key->nb_planes = n;
 
-	LOG("Failed to find modifier %"PRIx64"\n", mod);
+	// Where every dmabuf shares the one anon inode every key of a given
+	// size & format would match, and we would show the first frame
+	// forever. Decoders cycle through a pool, so trust inodes once two
+	// differ; until then give each key a sequence number so nothing hits.
+	if (!de->key_ino_unique)
+	{
+		if (de->key_ino0 == 0)
+			de->key_ino0 = key->ino[0];
+		for (i = 0; i != (int)key->nb_objects && i != AV_DRM_MAX_PLANES; ++i)
+		{
+			if (key->ino[i] != de->key_ino0)
+			{
+				LOG_D(LOG_CAT_DMABUF, "%s: dmabuf inodes are unique - caching imports\n", __func__);
+				de->key_ino_unique = true;
+				break;
+			}
+		}
+		if (!de->key_ino_unique)
+			key->seq = ++de->key_seq;
+	}
 	return 0;
 }
 
+static int
+dmabuf_key_eq(const dmabuf_key_t *const a, const dmabuf_key_t *const b)
+{
+	return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+// One of these per decoder buffer that we have made a wl_buffer for
 struct dmabuf_w_env_s {
-	AVBufferRef * buf;
-	struct _escontext * es;
+	dmabuf_key_t key;
+	unsigned int flags;
+	uint64_t last_used;
+	struct wl_buffer * wbuf;  // NULL until the compositor has created it
+	AVBufferRef * buf;        // Held from attach until the compositor releases it
+	AVBufferRef * trace_ref;  // Frame isn't released for tracing until buf is
+	struct egl_wayland_out_env * de;
+	bool dead;                // Dropped from the cache whilst still busy
+	struct dmabuf_w_env_s * next;  // Dead list
+	const AVDRMFrameDescriptor * desc;  // Valid whilst buf is held
+#if HAS_DRM_SYNCOBJ
+	uint32_t sync_handle;     // Timeline syncobj, 0 if implicit sync
+	struct wp_linux_drm_syncobj_timeline_v1 * sync_tl;
+	uint64_t sync_point;      // Last point used on the timeline
+	uint64_t release_point;   // Point that will release buf, 0 if none
+#endif
 };
 
 static struct dmabuf_w_env_s *
-dmabuf_w_env_new(struct _escontext *const es, AVBufferRef * const buf)
+dmabuf_w_env_new(struct egl_wayland_out_env *const de, const dmabuf_key_t * const key, const unsigned int flags)
 {
-	struct dmabuf_w_env_s * const dbe = malloc(sizeof(*dbe));
+	struct dmabuf_w_env_s * const dbe = calloc(1, sizeof(*dbe));
 	if (!dbe)
 		return NULL;
-	dbe->buf = av_buffer_ref(buf);
-	dbe->es = es;
+	dbe->key = *key;
+	dbe->flags = flags;
+	dbe->de = de;
 	return dbe;
 }
 
 static void
 dmabuf_w_env_delete(struct dmabuf_w_env_s * const dbe)
 {
+#if HAS_DRM_SYNCOBJ
+	if (dbe->sync_tl != NULL)
+		wp_linux_drm_syncobj_timeline_v1_destroy(dbe->sync_tl);
+	if (dbe->sync_handle != 0)
+		drmSyncobjDestroy(dbe->de->drm_fd, dbe->sync_handle);
+#endif
+	if (dbe->wbuf != NULL)
+		wl_buffer_destroy(dbe->wbuf);
 	av_buffer_unref(&dbe->buf);
+	av_buffer_unref(&dbe->trace_ref);
 	free(dbe);
 }
 
+// Drop a buffer from the cache. If the compositor still has it then the
+// destroy is deferred until it is released
 static void
-w_buffer_release(void *data, struct wl_buffer *wl_buffer)
+dmabuf_w_env_kill(struct dmabuf_w_env_s * const dbe)
 {
-	struct dmabuf_w_env_s * const dbe = data;
+	struct egl_wayland_out_env * const de = dbe->de;
 
-	/* Sent by the compositor when it's no longer using this buffer */
-	wl_buffer_destroy(wl_buffer);
-	dmabuf_w_env_delete(dbe);
-}
+	if (dbe->buf == NULL)
+	{
+		dmabuf_w_env_delete(dbe);
+		return;
+	}
 
-static const struct wl_buffer_listener w_buffer_listener = {
-	.release = w_buffer_release,
-};
+	dbe->dead = true;
+	dbe->next = de->wbuf_dead;
+	de->wbuf_dead = dbe;
+}
 
 static void
-create_wl_dmabuf_succeeded(void *data, struct zwp_linux_buffer_params_v1 *params,
-		 struct wl_buffer *new_buffer)
+dmabuf_w_env_unlink_dead(struct dmabuf_w_env_s * const dbe)
 {
-	struct dmabuf_w_env_s * const dbe = data;
-	struct _escontext * const es = dbe->es;
-	AVBufferRef * buf = dbe->buf;
-#if 0
-	ConstructBufferData *d = data;
+	struct dmabuf_w_env_s ** pp = &dbe->de->wbuf_dead;
 
-	g_mutex_lock(&d->lock);
-	d->wbuf = new_buffer;
-	g_cond_signal(&d->cond);
-	g_mutex_unlock(&d->lock);
-#endif
-	printf("%s: ok data=%p, buf=%p, es=%p, %dx%d\n", __func__, data, (void*)buf, (void*)es, es->req_w, es->req_h);
-	fflush(stdout);
-	zwp_linux_buffer_params_v1_destroy(params);
+	while (*pp != dbe)
+		pp = &(*pp)->next;
+	*pp = dbe->next;
+}
 
-	wl_buffer_add_listener(new_buffer, &w_buffer_listener, dbe);
+static void
+w_buf_cache_remove(struct egl_wayland_out_env *const de, const struct dmabuf_w_env_s * const dbe)
+{
+	unsigned int i;
 
-	// *************
-	assert(es->sig == ES_SIG);
-	if (0)
+	for (i = 0; i != W_BUF_CACHE_SIZE; ++i)
 	{
-	wl_buffer_destroy(new_buffer);
-	dmabuf_w_env_delete(dbe);
-	new_buffer = draw_frame(es);
+		if (de->wbufs[i] == dbe)
+			de->wbufs[i] = NULL;
 	}
-	// *************
-
-//	wl_surface_attach(es->w_surface2, draw_frame(es), 0, 0);
-//	wl_surface_damage(es->w_surface2, 0, 0, INT32_MAX, INT32_MAX);
-//    wl_surface_commit(es->w_surface2);
-
-	wl_surface_attach(es->w_surface, new_buffer, 0, 0);
-	wp_viewport_set_destination(es->w_viewport, es->req_w, es->req_h);
-	wl_surface_damage(es->w_surface, 0, 0, INT32_MAX, INT32_MAX);
-	wl_surface_commit(es->w_surface);
 }
 
 static void
-create_wl_dmabuf_failed(void *data, struct zwp_linux_buffer_params_v1 *params)
+w_buf_cache_flush(struct egl_wayland_out_env *const de)
 {
-	struct dmabuf_w_env_s * const dbe = data;
-#if 0
-	ConstructBufferData *d = data;
+	unsigned int i;
 
-	g_mutex_lock(&d->lock);
-	d->wbuf = NULL;
-	g_cond_signal(&d->cond);
-	g_mutex_unlock(&d->lock);
-#endif
-	(void)data;
-	printf("%s: FAILED\n", __func__);
-	zwp_linux_buffer_params_v1_destroy(params);
-	dmabuf_w_env_delete(dbe);
+	for (i = 0; i != W_BUF_CACHE_SIZE; ++i)
+	{
+		if (de->wbufs[i] != NULL)
+			dmabuf_w_env_kill(de->wbufs[i]);
+		de->wbufs[i] = NULL;
+	}
+	de->wbuf_frames_ctx = NULL;
 }
 
-static const struct zwp_linux_buffer_params_v1_listener params_wl_dmabuf_listener = {
-	create_wl_dmabuf_succeeded,
-	create_wl_dmabuf_failed
-};
-
-static struct wl_buffer*
-do_display_dmabuf(struct _escontext *const es, AVFrame * const frame)
+// Only called once the display thread has gone so no more releases will come
+static void
+w_buf_cache_uninit(struct egl_wayland_out_env *const de)
 {
-	struct zwp_linux_buffer_params_v1 *params;
-	const AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
-	const uint32_t format = desc->layers[0].format;
-	const unsigned int width = av_frame_cropped_width(frame);
-	const unsigned int height = av_frame_cropped_height(frame);
-	unsigned int n = 0;
-	unsigned int flags = 0;
-	int i;
+	struct dmabuf_w_env_s * dbe;
+	unsigned int i;
 
-	LOG("<<< %s\n", __func__);
+	for (i = 0; i != W_BUF_CACHE_SIZE; ++i)
+	{
+		if (de->wbufs[i] != NULL)
+			dmabuf_w_env_delete(de->wbufs[i]);
+		de->wbufs[i] = NULL;
+	}
 
-	/* Creation and configuration of planes  */
-	params = zwp_linux_dmabuf_v1_create_params(es->linux_dmabuf_v1_bind);
-	if (!params)
+	while ((dbe = de->wbuf_dead) != NULL)
 	{
-		LOG("zwp_linux_dmabuf_v1_create_params FAILED\n");
-		return NULL;
+		de->wbuf_dead = dbe->next;
+		dmabuf_w_env_delete(dbe);
 	}
+}
 
-	for (i = 0; i < desc->nb_layers; ++i)
+static struct dmabuf_w_env_s *
+w_buf_cache_lookup(struct egl_wayland_out_env *const de, const dmabuf_key_t * const key, const unsigned int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i != W_BUF_CACHE_SIZE; ++i)
 	{
-		int j;
-		for (j = 0; j < desc->layers[i].nb_planes; ++j)
-		{
-			const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
-			const AVDRMObjectDescriptor *const obj = desc->objects + p->object_index;
+		struct dmabuf_w_env_s * const dbe = de->wbufs[i];
 
-			zwp_linux_buffer_params_v1_add(params, obj->fd, n++, p->offset, p->pitch,
-							   (unsigned int)(obj->format_modifier >> 32),
-							   (unsigned int)(obj->format_modifier & 0xFFFFFFFF));
+		if (dbe != NULL && dbe->flags == flags && dmabuf_key_eq(&dbe->key, key))
+		{
+			dbe->last_used = ++de->wbuf_stamp;
+			++de->wbuf_hits;
+			return dbe;
 		}
 	}
+	++de->wbuf_misses;
+	return NULL;
+}
 
-	if (frame->interlaced_frame)
+static void
+w_buf_cache_add(struct egl_wayland_out_env *const de, struct dmabuf_w_env_s * const dbe)
+{
+	unsigned int lru = 0;
+	unsigned int i;
+
+	for (i = 0; i != W_BUF_CACHE_SIZE; ++i)
 	{
-		flags |= ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_INTERLACED;
-		if (!frame->top_field_first)
-			flags |= ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_BOTTOM_FIRST;
+		if (de->wbufs[i] == NULL)
+		{
+			lru = i;
+			break;
+		}
+		if (de->wbufs[i]->last_used < de->wbufs[lru]->last_used)
+			lru = i;
 	}
 
-	assert(es->sig == ES_SIG);
+	if (de->wbufs[lru] != NULL)
+		dmabuf_w_env_kill(de->wbufs[lru]);
+	dbe->last_used = ++de->wbuf_stamp;
+	de->wbufs[lru] = dbe;
+}
 
-	/* Request buffer creation */
-	zwp_linux_buffer_params_v1_add_listener(params, &params_wl_dmabuf_listener,
-		dmabuf_w_env_new(es, frame->buf[0]));
+static void
+w_buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct dmabuf_w_env_s * const dbe = data;
+	(void)wl_buffer;
 
-	zwp_linux_buffer_params_v1_create(params, width, height, format, flags);
+#if HAS_DRM_SYNCOBJ
+	// With explicit sync the release point is what counts - this may refer
+	// to an earlier attach of a buffer that has since been reused
+	if (dbe->sync_tl != NULL)
+		return;
+#endif
 
-#if 0
-	/* Wait for the request answer */
-	wl_display_flush(gst_wl_display_get_display(display));
-	data.wbuf = (gpointer)0x1;
-	timeout = g_get_monotonic_time() + G_TIME_SPAN_SECOND;
-	while (data.wbuf == (gpointer)0x1) {
-		if (!g_cond_wait_until(&data.cond, &data.lock, timeout)) {
-			GST_ERROR_OBJECT(mem->allocator, "zwp_linux_buffer_params_v1 time out");
-			zwp_linux_buffer_params_v1_destroy(params);
-			data.wbuf = NULL;
-		}
-	}
+	/* Sent by the compositor when it's no longer using this buffer */
+	av_buffer_unref(&dbe->buf);
+	av_buffer_unref(&dbe->trace_ref);
 
-out:
-	if (!data.wbuf) {
-		GST_ERROR_OBJECT(mem->allocator, "can't create linux-dmabuf buffer");
-	} else {
-		GST_DEBUG_OBJECT(mem->allocator, "created linux_dmabuf wl_buffer (%p):"
-				 "%dx%d, fmt=%.4s, %d planes",
-				 data.wbuf, width, height, (char *)&format, nplanes);
+	if (dbe->dead)
+	{
+		dmabuf_w_env_unlink_dead(dbe);
+		dmabuf_w_env_delete(dbe);
 	}
-
-	g_mutex_unlock(&data.lock);
-	g_mutex_clear(&data.lock);
-	g_cond_clear(&data.cond);
-
-	return data.wbuf;
-#endif
-	return NULL;
 }
 
-static int do_display(egl_wayland_out_env_t *const de, struct _escontext *const es, AVFrame *const frame)
+static const struct wl_buffer_listener w_buffer_listener = {
+	.release = w_buffer_release,
+};
+
+#if HAS_DRM_SYNCOBJ
+// Find a render node to make syncobjs on
+static int
+drm_render_open(void)
 {
-#if DEBUG_SOLID
-	(void)de;
-	(void)frame;
-	static double a = 0.3;
+	drmDevicePtr devs[16];
+	const int n = drmGetDevices2(0, devs, 16);
+	int fd = -1;
+	int i;
 
-	glClearColor(0.5, a, 0.0, 1.0);
+	for (i = 0; i < n && fd == -1; ++i)
+	{
+		uint64_t cap = 0;
 
-	a += 0.05;
-	if (a >= 1.0)
-		a = 0.0;
+		if (!(devs[i]->available_nodes & (1 << DRM_NODE_RENDER)))
+			continue;
+		if ((fd = open(devs[i]->nodes[DRM_NODE_RENDER], O_RDWR | O_CLOEXEC)) == -1)
+			continue;
+		if (drmGetCap(fd, DRM_CAP_SYNCOBJ_TIMELINE, &cap) != 0 || cap == 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (n > 0)
+		drmFreeDevices(devs, n);
+	return fd;
+}
 
-	glClear(GL_COLOR_BUFFER_BIT);
+// Called on the first dmabuf frame if explicit sync is wanted
+// On failure we carry on with implicit sync
+static void
+w_sync_setup(struct egl_wayland_out_env *const de, struct _escontext *const es)
+{
+	de->sync_tried = true;
 
-	eglSwapBuffers(es->display, es->surface);
-#else
-	const AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
-	egl_aux_t *da = NULL;
-	unsigned int i;
+	if (es->w_syncobj_manager == NULL)
+	{
+		LOG_I(LOG_CAT_GEN, "%s: No wp_linux_drm_syncobj_manager_v1 - using implicit sync\n", __func__);
+		return;
+	}
+	if ((de->drm_fd = drm_render_open()) == -1)
+	{
+		LOG_I(LOG_CAT_GEN, "%s: No render node with timeline syncobjs - using implicit sync\n", __func__);
+		return;
+	}
+	if ((de->sync_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+	{
+		LOG_E(LOG_CAT_GEN, "%s: Failed to make eventfd: %s\n", __func__, strerror(errno));
+		return;
+	}
+	de->sync_surface = wp_linux_drm_syncobj_manager_v1_get_surface(es->w_syncobj_manager, de->v_surface);
+	LOG_I(LOG_CAT_GEN, "%s: Using explicit sync\n", __func__);
+}
 
-#if TRACE_ALL
-	LOG("<<< %s\n", __func__);
-#endif
+static void
+w_sync_uninit(struct egl_wayland_out_env *const de)
+{
+	if (de->sync_surface != NULL)
+		wp_linux_drm_syncobj_surface_v1_destroy(de->sync_surface);
+	de->sync_surface = NULL;
+	if (de->sync_efd != -1)
+		close(de->sync_efd);
+	de->sync_efd = -1;
+	if (de->drm_fd != -1)
+		close(de->drm_fd);
+	de->drm_fd = -1;
+}
+
+// Give the buffer its own timeline so release points on different buffers
+// can signal in any order
+static int
+w_sync_buf_new(struct egl_wayland_out_env *const de, struct _escontext *const es, struct dmabuf_w_env_s * const dbe)
+{
+	int fd;
+
+	if (drmSyncobjCreate(de->drm_fd, 0, &dbe->sync_handle) != 0)
+	{
+		dbe->sync_handle = 0;
+		return AVERROR(errno);
+	}
+	if (drmSyncobjHandleToFD(de->drm_fd, dbe->sync_handle, &fd) != 0)
+		return AVERROR(errno);
+	dbe->sync_tl = wp_linux_drm_syncobj_manager_v1_import_timeline(es->w_syncobj_manager, fd);
+	close(fd);
+	return 0;
+}
+
+// Merge the write fences of all the objects in the frame into one sync_file
+static int
+w_sync_export(const AVDRMFrameDescriptor * const desc)
+{
+	int fd = -1;
+	int i;
 
+	for (i = 0; i != desc->nb_objects; ++i)
 	{
-		static int z = 0;
-		if (!z)
+		struct dma_buf_export_sync_file ex = {.flags = DMA_BUF_SYNC_READ, .fd = -1};
+
+		if (ioctl(desc->objects[i].fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &ex) != 0)
 		{
-			z = 1;
-			if (!check_support(es, desc->layers[0].format, desc->objects[0].format_modifier))
-			{
-				LOG("No support for format\n");
+			if (fd != -1)
+				close(fd);
+			return -1;
+		}
+		if (fd == -1)
+		{
+			fd = ex.fd;
+		}
+		else
+		{
+			struct sync_merge_data merge = {.name = "egl_wayland", .fd2 = ex.fd};
+			const int rv = ioctl(fd, SYNC_IOC_MERGE, &merge);
+
+			close(ex.fd);
+			close(fd);
+			if (rv != 0)
 				return -1;
-			}
+			fd = merge.fence;
 		}
 	}
+	return fd;
+}
 
-	if (es->req_w != es->window_width || es->req_h != es->window_height) {
-		LOG("%s: Resize %dx%d -> %dx%d\n", __func__, es->window_width, es->window_height, es->req_w, es->req_h);
-		wl_egl_window_resize(es->native_window, es->req_w, es->req_h, 0, 0);
-		es->window_width = es->req_w;
-		es->window_height = es->req_h;
-	}
+// Set the acquire point to the decoder's write fences (or just signal it if
+// the kernel can't export them - the decoder has finished by the time it
+// gives us the frame) and the release point to the next one after it
+static void
+w_sync_points(struct egl_wayland_out_env *const de, struct dmabuf_w_env_s * const dbe)
+{
+	const uint64_t acquire = ++dbe->sync_point;
+	const uint64_t release = ++dbe->sync_point;
+	const int sync_fd = w_sync_export(dbe->desc);
+	bool signalled = false;
 
-	for (i = 0; i != 32; ++i)
+	if (sync_fd != -1)
 	{
-		if (de->aux[i].fd == -1 || de->aux[i].fd == desc->objects[0].fd)
+		uint32_t tmp;
+
+		if (drmSyncobjCreate(de->drm_fd, 0, &tmp) == 0)
 		{
-			da = de->aux + i;
-			break;
+			signalled = drmSyncobjImportSyncFile(de->drm_fd, tmp, sync_fd) == 0 &&
+				drmSyncobjTransfer(de->drm_fd, dbe->sync_handle, acquire, tmp, 0, 0) == 0;
+			drmSyncobjDestroy(de->drm_fd, tmp);
 		}
+		close(sync_fd);
 	}
-
-	if (da == NULL)
+	if (!signalled)
 	{
-		LOG("%s: Out of handles\n", __func__);
-		return AVERROR(EINVAL);
+		uint64_t pt = acquire;
+		drmSyncobjTimelineSignal(de->drm_fd, &dbe->sync_handle, &pt, 1);
 	}
 
-	if (da->texture == 0)
-	{
-		EGLint attribs[50];
-		EGLint *a = attribs;
-		int i, j;
-		static const EGLint anames[] = {
-			EGL_DMA_BUF_PLANE0_FD_EXT,
-			EGL_DMA_BUF_PLANE0_OFFSET_EXT,
-			EGL_DMA_BUF_PLANE0_PITCH_EXT,
-			EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
-			EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
-			EGL_DMA_BUF_PLANE1_FD_EXT,
-			EGL_DMA_BUF_PLANE1_OFFSET_EXT,
-			EGL_DMA_BUF_PLANE1_PITCH_EXT,
-			EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
-			EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT,
-			EGL_DMA_BUF_PLANE2_FD_EXT,
-			EGL_DMA_BUF_PLANE2_OFFSET_EXT,
-			EGL_DMA_BUF_PLANE2_PITCH_EXT,
-			EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
-			EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT,
-		};
-		const EGLint *b = anames;
+	wp_linux_drm_syncobj_surface_v1_set_acquire_point(de->sync_surface, dbe->sync_tl,
+							  (uint32_t)(acquire >> 32), (uint32_t)acquire);
+	wp_linux_drm_syncobj_surface_v1_set_release_point(de->sync_surface, dbe->sync_tl,
+							  (uint32_t)(release >> 32), (uint32_t)release);
+	dbe->release_point = release;
+}
 
-		*a++ = EGL_WIDTH;
-		*a++ = av_frame_cropped_width(frame);
-		*a++ = EGL_HEIGHT;
-		*a++ = av_frame_cropped_height(frame);
-		*a++ = EGL_LINUX_DRM_FOURCC_EXT;
-		*a++ = desc->layers[0].format;
+static bool
+w_sync_buf_released(struct dmabuf_w_env_s * const dbe)
+{
+	uint64_t pt = 0;
 
-		for (i = 0; i < desc->nb_layers; ++i)
-		{
-			for (j = 0; j < desc->layers[i].nb_planes; ++j)
-			{
-				const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
-				const AVDRMObjectDescriptor *const obj = desc->objects + p->object_index;
-				*a++ = *b++;
-				*a++ = obj->fd;
-				*a++ = *b++;
-				*a++ = p->offset;
-				*a++ = *b++;
-				*a++ = p->pitch;
-				if (obj->format_modifier == 0)
-				{
-					b += 2;
-				}
-				else
-				{
-					*a++ = *b++;
-					*a++ = (EGLint)(obj->format_modifier & 0xFFFFFFFF);
-					*a++ = *b++;
-					*a++ = (EGLint)(obj->format_modifier >> 32);
-				}
-			}
-		}
+	if (dbe->release_point == 0 ||
+	    drmSyncobjQuery(dbe->de->drm_fd, &dbe->sync_handle, &pt, 1) != 0 ||
+	    pt < dbe->release_point)
+		return false;
 
-		*a = EGL_NONE;
+	dbe->release_point = 0;
+	av_buffer_unref(&dbe->buf);
+	av_buffer_unref(&dbe->trace_ref);
+	return true;
+}
 
-#if TRACE_ALL
-		for (a = attribs, i = 0; *a != EGL_NONE; a += 2, ++i)
+// Called when sync_efd fires - give back every buffer whose release point
+// has been reached
+static void
+w_sync_service(struct egl_wayland_out_env *const de)
+{
+	struct dmabuf_w_env_s ** pp = &de->wbuf_dead;
+	uint64_t count;
+	unsigned int i;
+
+	if (read(de->sync_efd, &count, sizeof(count)) != sizeof(count))
+		return;
+
+	for (i = 0; i != W_BUF_CACHE_SIZE; ++i)
+	{
+		if (de->wbufs[i] != NULL)
+			w_sync_buf_released(de->wbufs[i]);
+	}
+
+	while (*pp != NULL)
+	{
+		struct dmabuf_w_env_s * const dbe = *pp;
+
+		if (w_sync_buf_released(dbe))
 		{
-			LOG("[%2d] %4x: %d\n", i, a[0], a[1]);
+			*pp = dbe->next;
+			dmabuf_w_env_delete(dbe);
 		}
-#endif
+		else
 		{
-			const EGLImage image = eglCreateImageKHR(es->display,
-													 EGL_NO_CONTEXT,
-													 EGL_LINUX_DMA_BUF_EXT,
-													 NULL, attribs);
-			if (!image)
-			{
-				LOG("Failed to import fd %d\n", desc->objects[0].fd);
-				return -1;
-			}
+			pp = &dbe->next;
+		}
+	}
+}
+#endif
 
-			glGenTextures(1, &da->texture);
-			glBindTexture(GL_TEXTURE_EXTERNAL_OES, da->texture);
-			glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+static void
+w_buf_attach(egl_wayland_out_env_t *const de, struct dmabuf_w_env_s * const dbe)
+{
+	wl_surface_attach(de->v_surface, dbe->wbuf, 0, 0);
+#if HAS_DRM_SYNCOBJ
+	if (dbe->sync_tl != NULL)
+		w_sync_points(de, dbe);
+#endif
+	wl_surface_damage(de->v_surface, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_commit(de->v_surface);
+#if HAS_DRM_SYNCOBJ
+	// Nothing waits here: sync_efd is polled by the display loop and fires
+	// once the release point is signalled (flags 0, so not merely once the
+	// compositor has attached a fence), then w_sync_service lets the buffer
+	// go. If registration fails the buffer is only freed when a later
+	// release wakes the loop and finds this point passed too, or at teardown
+	if (dbe->sync_tl != NULL &&
+	    drmSyncobjEventfd(de->drm_fd, dbe->sync_handle, dbe->release_point, de->sync_efd, 0) != 0)
+		LOG_E(LOG_CAT_DMABUF, "%s: drmSyncobjEventfd failed: %s\n", __func__, strerror(errno));
+#endif
+}
 
-			eglDestroyImageKHR(es->display, image);
-		}
+static void frame_cb_cancel(egl_wayland_out_env_t *const de);
+static void dmabuf_fb_attach(egl_wayland_out_env_t *const de, struct wl_surface *const surface);
+static void display_service(egl_wayland_out_env_t *const de, struct _escontext *const es);
+
+// The frame we asked for a frame callback for was never committed
+static void
+w_buf_abandoned(struct egl_wayland_out_env *const de)
+{
+	frame_cb_cancel(de);
+	display_service(de, de->es);
+}
 
-		da->fd = desc->objects[0].fd;
+static void
+create_wl_dmabuf_succeeded(void *data, struct zwp_linux_buffer_params_v1 *params,
+		 struct wl_buffer *new_buffer)
+{
+	struct dmabuf_w_env_s * const dbe = data;
+	struct _escontext * const es = dbe->de->es;
 
-#if 0
-		LOG( "%dx%d, fmt: %x, boh=%d,%d,%d,%d, pitch=%d,%d,%d,%d,"
-			" offset=%d,%d,%d,%d, mod=%llx,%llx,%llx,%llx\n",
-			av_frame_cropped_width(frame),
-			av_frame_cropped_height(frame),
-			desc->layers[0].format,
-			bo_plane_handles[0],
-			bo_plane_handles[1],
-			bo_plane_handles[2],
-			bo_plane_handles[3],
-			pitches[0],
-			pitches[1],
-			pitches[2],
-			pitches[3],
-			offsets[0],
-			offsets[1],
-			offsets[2],
-			offsets[3],
-			(long long)modifiers[0],
-			(long long)modifiers[1],
-			(long long)modifiers[2],
-			(long long)modifiers[3]
-		   );
+	LOG_D(LOG_CAT_DMABUF, "%s: ok data=%p, es=%p, %dx%d\n", __func__, data, (void*)es, es->req_w, es->req_h);
+	zwp_linux_buffer_params_v1_destroy(params);
+
+	dbe->wbuf = new_buffer;
+	wl_buffer_add_listener(new_buffer, &w_buffer_listener, dbe);
+
+	assert(es->sig == ES_SIG);
+
+	// Flushed while we were waiting - format has changed so don't show it
+	if (dbe->dead)
+	{
+		struct egl_wayland_out_env * const de = dbe->de;
+
+		dmabuf_w_env_unlink_dead(dbe);
+		dmabuf_w_env_delete(dbe);
+		w_buf_abandoned(de);
+		return;
+	}
+
+	w_buf_attach(dbe->de, dbe);
+}
+
+static void
+create_wl_dmabuf_failed(void *data, struct zwp_linux_buffer_params_v1 *params)
+{
+	struct dmabuf_w_env_s * const dbe = data;
+	struct egl_wayland_out_env * const de = dbe->de;
+
+	LOG_E(LOG_CAT_DMABUF, "%s: FAILED\n", __func__);
+	zwp_linux_buffer_params_v1_destroy(params);
+
+	if (dbe->dead)
+		dmabuf_w_env_unlink_dead(dbe);
+	else
+		w_buf_cache_remove(de, dbe);
+	dmabuf_w_env_delete(dbe);
+	w_buf_abandoned(de);
+}
+
+static const struct zwp_linux_buffer_params_v1_listener params_wl_dmabuf_listener = {
+	create_wl_dmabuf_succeeded,
+	create_wl_dmabuf_failed
+};
+
+// Note whether the compositor can scan out what we are about to give it
+// Only looks the format up when it (or the feedback) changes
+static void
+dmabuf_fb_classify(egl_wayland_out_env_t *const de, const uint32_t fourcc, const uint64_t modifier)
+{
+	struct _escontext *const es = de->es;
+
+	if (fourcc != de->fb_last_fourcc || modifier != de->fb_last_mod || es->fmts_gen != de->fb_last_gen)
+	{
+		unsigned int flags = 0;
+
+		de->fb_last_fourcc = fourcc;
+		de->fb_last_mod = modifier;
+		de->fb_last_gen = es->fmts_gen;
+
+		if (!dmabuf_fmts_find(es->dmabuf_fmts, fourcc, modifier, &flags))
+			LOG_W(LOG_CAT_DMABUF, "%s: %s mod %#"PRIx64" not advertised by compositor\n", __func__, av_fourcc2str(fourcc), modifier);
+		else if (!(flags & DMABUF_FMT_FLAG_SCANOUT) && de->dmabuf_fb != NULL)
+			LOG_W(LOG_CAT_DMABUF, "%s: %s mod %#"PRIx64" can't be scanned out - compositor will composite\n", __func__,
+			    av_fourcc2str(fourcc), modifier);
+		de->fb_last_scanout = (flags & DMABUF_FMT_FLAG_SCANOUT) != 0;
+	}
+
+	if (de->fb_last_scanout)
+		++de->frames_scanout;
+	else
+		++de->frames_composite;
+}
+
+static int
+do_display_dmabuf(egl_wayland_out_env_t *const de, struct _escontext *const es, AVFrame * const frame)
+{
+	struct zwp_linux_buffer_params_v1 *params;
+	const AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
+	const void *const frames_ctx = frame->hw_frames_ctx == NULL ? NULL : frame->hw_frames_ctx->data;
+	const uint32_t format = desc->layers[0].format;
+	const unsigned int width = av_frame_cropped_width(frame);
+	const unsigned int height = av_frame_cropped_height(frame);
+	struct dmabuf_w_env_s * dbe;
+	dmabuf_key_t key;
+	unsigned int n = 0;
+	unsigned int flags = 0;
+	int i;
+
+	LOG_T(LOG_CAT_FRAME, "<<< %s\n", __func__);
+
+#if HAS_DRM_SYNCOBJ
+	if (de->explicit_sync && !de->sync_tried)
+		w_sync_setup(de, es);
 #endif
+
+	// New decoder pool or new format => none of our wl_buffers will be seen again
+	if (frames_ctx != de->wbuf_frames_ctx ||
+	    format != de->wbuf_format || width != de->wbuf_width || height != de->wbuf_height)
+	{
+		w_buf_cache_flush(de);
+		de->wbuf_frames_ctx = frames_ctx;
+		de->wbuf_format = format;
+		de->wbuf_width = width;
+		de->wbuf_height = height;
 	}
 
-	glClearColor(0.5, 0.5, 0.5, 0.5);
-	glClear(GL_COLOR_BUFFER_BIT);
+	if (frame->interlaced_frame)
+	{
+		flags |= ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_INTERLACED;
+		if (!frame->top_field_first)
+			flags |= ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_BOTTOM_FIRST;
+	}
 
-	glBindTexture(GL_TEXTURE_EXTERNAL_OES, da->texture);
-	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-	eglSwapBuffers(es->display, es->surface);
+	if (dmabuf_key_make(de, &key, frame) != 0)
+		return AVERROR(EINVAL);
 
-	glDeleteTextures(1, &da->texture);
-	da->texture = 0;
-	da->fd = -1;
+	dmabuf_fb_classify(de, format, desc->objects[0].format_modifier);
+
+	if ((dbe = w_buf_cache_lookup(de, &key, flags)) != NULL)
+	{
+		// Still waiting for the async create - it will be shown when it arrives
+		if (dbe->wbuf == NULL)
+			return 0;
+
+		av_buffer_unref(&dbe->buf);
+		av_buffer_unref(&dbe->trace_ref);
+		dbe->buf = av_buffer_ref(frame->buf[0]);
+		dbe->trace_ref = trace_ref(frame);
+		dbe->desc = desc;
+		trace_stamp(frame, TRACE_IMPORTED);
+		w_buf_attach(de, dbe);
+		return 0;
+	}
+
+	/* Creation and configuration of planes  */
+	params = zwp_linux_dmabuf_v1_create_params(es->linux_dmabuf_v1_bind);
+	if (!params)
+	{
+		LOG_E(LOG_CAT_DMABUF, "zwp_linux_dmabuf_v1_create_params FAILED\n");
+		return AVERROR(ENOMEM);
+	}
+
+	if ((dbe = dmabuf_w_env_new(de, &key, flags)) == NULL)
+	{
+		zwp_linux_buffer_params_v1_destroy(params);
+		return AVERROR(ENOMEM);
+	}
+	dbe->buf = av_buffer_ref(frame->buf[0]);
+	dbe->trace_ref = trace_ref(frame);
+	dbe->desc = desc;
+
+#if HAS_DRM_SYNCOBJ
+	if (de->sync_surface != NULL && (i = w_sync_buf_new(de, es, dbe)) != 0)
+	{
+		// Can't commit without sync points once we have a sync surface
+		LOG_E(LOG_CAT_DMABUF, "%s: Failed to make syncobj: %s\n", __func__, av_err2str(i));
+		zwp_linux_buffer_params_v1_destroy(params);
+		dmabuf_w_env_delete(dbe);
+		return i;
+	}
 #endif
+
+	for (i = 0; i < desc->nb_layers; ++i)
+	{
+		int j;
+		for (j = 0; j < desc->layers[i].nb_planes; ++j)
+		{
+			const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
+			const AVDRMObjectDescriptor *const obj = desc->objects + p->object_index;
+
+			zwp_linux_buffer_params_v1_add(params, obj->fd, n++, p->offset, p->pitch,
+							   (unsigned int)(obj->format_modifier >> 32),
+							   (unsigned int)(obj->format_modifier & 0xFFFFFFFF));
+		}
+	}
+
+	assert(es->sig == ES_SIG);
+
+	w_buf_cache_add(de, dbe);
+
+	if (zwp_linux_dmabuf_v1_get_version(es->linux_dmabuf_v1_bind) >= ZWP_LINUX_BUFFER_PARAMS_V1_CREATE_IMMED_SINCE_VERSION)
+	{
+		// Failure here is a protocol error so no need to listen on params
+		dbe->wbuf = zwp_linux_buffer_params_v1_create_immed(params, width, height, format, flags);
+		zwp_linux_buffer_params_v1_destroy(params);
+		wl_buffer_add_listener(dbe->wbuf, &w_buffer_listener, dbe);
+		trace_stamp(frame, TRACE_IMPORTED);
+		w_buf_attach(de, dbe);
+	}
+	else
+	{
+		/* Request buffer creation */
+		zwp_linux_buffer_params_v1_add_listener(params, &params_wl_dmabuf_listener, dbe);
+		zwp_linux_buffer_params_v1_create(params, width, height, format, flags);
+	}
+
 	return 0;
 }
 
+static void
+egl_aux_evict(egl_aux_t *const da)
+{
+	if (da->texture != 0)
+		glDeleteTextures(1, &da->texture);
+	if (da->planes[0] != 0)
+		glDeleteTextures(2, da->planes);
+	da->texture = 0;
+	da->planes[0] = 0;
+	da->planes[1] = 0;
+	da->last_used = 0;
+}
 
-static GLint
-compile_shader(GLenum target, const char *source)
+static void
+egl_aux_flush(egl_aux_cache_t *const ac)
 {
-	GLuint s = glCreateShader(target);
+	unsigned int i;
 
-	if (s == 0)
+	for (i = 0; i != EGL_AUX_SIZE; ++i)
+		egl_aux_evict(ac->ents + i);
+	ac->frames_ctx = NULL;
+}
+
+// Find the cache entry for key. If there isn't one then return an empty slot
+// (evicting the least recently used entry if need be) with da->texture == 0
+static egl_aux_t *
+egl_aux_find(egl_wayland_out_env_t *const de, egl_aux_cache_t *const ac, const dmabuf_key_t *const key)
+{
+	egl_aux_t *lru = ac->ents;
+	unsigned int i;
+
+	for (i = 0; i != EGL_AUX_SIZE; ++i)
+	{
+		egl_aux_t *const da = ac->ents + i;
+
+		if (da->last_used != 0 && dmabuf_key_eq(&da->key, key))
+		{
+			++de->aux_hits;
+			da->last_used = ++ac->stamp;
+			return da;
+		}
+		if (da->last_used < lru->last_used)
+			lru = da;
+	}
+
+	++de->aux_misses;
+	egl_aux_evict(lru);
+	lru->key = *key;
+	lru->last_used = ++ac->stamp;
+	return lru;
+}
+
+// Build the table of what EGL can import once at startup so that there
+// are no per-frame queries
+static int
+egl_fmts_build(egl_wayland_out_env_t *const de, struct _escontext *const es)
+{
+	EGLint fmt_count = 0;
+	EGLint *fmts = NULL;
+	EGLuint64KHR *mods = NULL;
+	EGLBoolean *ext_only = NULL;
+	EGLint mods_size = 0;
+	EGLint i;
+	int rv = -1;
+
+	if ((de->egl_fmts = dmabuf_fmts_new()) == NULL ||
+	    (de->egl_failed = dmabuf_fmts_new()) == NULL)
+		return -1;
+
+	// Without this we can't ask - try whatever we are given and remember
+	// what fails
+	if (!epoxy_has_egl_extension(es->display, "EGL_EXT_image_dma_buf_import_modifiers"))
+	{
+		LOG_I(LOG_CAT_EGL, "%s: No EGL_EXT_image_dma_buf_import_modifiers - implicit import only\n", __func__);
+		de->egl_fmts_implicit = true;
+		return 0;
+	}
+
+	if (!eglQueryDmaBufFormatsEXT(es->display, 0, NULL, &fmt_count) ||
+	    (fmts = malloc(sizeof(*fmts) * (fmt_count + 1))) == NULL ||
+	    !eglQueryDmaBufFormatsEXT(es->display, fmt_count, fmts, &fmt_count))
+	{
+		LOG_I(LOG_CAT_EGL, "%s: Failed to get dmabuf formats\n", __func__);
+		goto fail;
+	}
+
+	for (i = 0; i != fmt_count; ++i)
+	{
+		EGLint mod_count = 0;
+		EGLint j;
+
+		if (!eglQueryDmaBufModifiersEXT(es->display, fmts[i], 0, NULL, NULL, &mod_count))
+			continue;
+
+		// No modifiers => only the driver's implicit layout
+		if (mod_count == 0)
+		{
+			LOG_D(LOG_CAT_EGL, "[%d] %s: implicit only\n", i, av_fourcc2str(fmts[i]));
+			if (dmabuf_fmts_add(de->egl_fmts, fmts[i], DRM_MOD_INVALID, 0) != 0)
+				goto fail;
+			continue;
+		}
+
+		if (mod_count > mods_size)
+		{
+			free(mods);
+			free(ext_only);
+			mods_size = mod_count;
+			mods = malloc(sizeof(*mods) * mods_size);
+			ext_only = malloc(sizeof(*ext_only) * mods_size);
+			if (mods == NULL || ext_only == NULL)
+				goto fail;
+		}
+
+		if (!eglQueryDmaBufModifiersEXT(es->display, fmts[i], mods_size, mods, ext_only, &mod_count))
+			continue;
+
+		for (j = 0; j != mod_count; ++j)
+		{
+			if (dmabuf_fmts_add(de->egl_fmts, fmts[i], mods[j], ext_only[j] ? DMABUF_FMT_FLAG_EXTERNAL_ONLY : 0) != 0)
+				goto fail;
+		}
+		LOG_D(LOG_CAT_EGL, "[%d] %s: %d modifiers\n", i, av_fourcc2str(fmts[i]), mod_count);
+	}
+	LOG_I(LOG_CAT_EGL, "%s: %u format/modifier pairs\n", __func__, dmabuf_fmts_count(de->egl_fmts));
+	rv = 0;
+
+fail:
+	free(fmts);
+	free(mods);
+	free(ext_only);
+	return rv;
+}
+
+// How (if at all) we can import a buffer. Called on import cache misses
+// so nothing is looked up for buffers we have seen before
+static enum egl_import_e
+egl_import_type(egl_wayland_out_env_t *const de, const uint32_t fourcc, const uint64_t modifier)
+{
+	enum egl_import_e rv = EGL_IMPORT_NONE;
+
+	if (dmabuf_fmts_find(de->egl_failed, fourcc, modifier, NULL))
+		return EGL_IMPORT_NONE;
+	if (dmabuf_fmts_find(de->egl_fmts, fourcc, modifier, NULL))
+		rv = EGL_IMPORT_MOD;
+	// With nothing to go on the driver's implicit layout (e.g. from the BO's
+	// tiling) may still be right, so try it until it fails
+	else if (de->egl_fmts_implicit)
+		rv = EGL_IMPORT_IMPLICIT;
+	// Otherwise implicit import is only safe for buffers that are really linear
+	else if ((modifier == 0 || modifier == DRM_MOD_INVALID) &&
+		 dmabuf_fmts_find(de->egl_fmts, fourcc, DRM_MOD_INVALID, NULL))
+		rv = EGL_IMPORT_IMPLICIT;
+	return rv;
+}
+
+// eglCreateImageKHR refused a pair - don't ask again
+static void
+egl_import_failed(egl_wayland_out_env_t *const de, const uint32_t fourcc, const uint64_t modifier)
+{
+	LOG_I(LOG_CAT_EGL, "%s: %s mod %#"PRIx64" won't import\n", __func__, av_fourcc2str(fourcc), modifier);
+	dmabuf_fmts_add(de->egl_failed, fourcc, modifier, 0);
+}
+
+#define DRM_FOURCC(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+static const struct egl_yuv_fmt_s {
+	uint32_t fourcc;            // Whole frame
+	unsigned int n_planes;
+	uint32_t plane_fourcc[3];   // What each plane is imported as
+	unsigned int depth;
+	const char *defines;        // Shader specialisation
+} egl_yuv_fmts[EGL_YUV_FMTS] = {
+	[EGL_YUV_NV12] = {
+		DRM_FOURCC('N', 'V', '1', '2'), 2,
+		{DRM_FOURCC('R', '8', ' ', ' '), DRM_FOURCC('G', 'R', '8', '8')}, 8,
+		"#define PLANES 2\n#define SCALE 1.0\n"
+	},
+	[EGL_YUV_YUV420] = {
+		DRM_FOURCC('Y', 'U', '1', '2'), 3,
+		{DRM_FOURCC('R', '8', ' ', ' '), DRM_FOURCC('R', '8', ' ', ' '), DRM_FOURCC('R', '8', ' ', ' ')}, 8,
+		"#define PLANES 3\n#define SCALE 1.0\n"
+	},
+	// 10 bits in the top of 16 - rescale so 1023 << 6 reads as 1.0
+	[EGL_YUV_P010] = {
+		DRM_FOURCC('P', '0', '1', '0'), 2,
+		{DRM_FOURCC('R', '1', '6', ' '), DRM_FOURCC('G', 'R', '3', '2')}, 10,
+		"#define PLANES 2\n#define SCALE (65535.0 / 65472.0)\n"
+	},
+};
+
+// Which per-plane format (if any) desc is. Frames come either as one
+// multi-plane layer or as a layer per plane.
+static int
+egl_yuv_fmt_find(const AVDRMFrameDescriptor *const desc)
+{
+	unsigned int i, j;
+
+	for (i = 0; i != EGL_YUV_FMTS; ++i)
+	{
+		const struct egl_yuv_fmt_s *const yf = egl_yuv_fmts + i;
+
+		if (desc->nb_layers == 1)
+		{
+			if (desc->layers[0].format == yf->fourcc && (unsigned int)desc->layers[0].nb_planes == yf->n_planes)
+				return i;
+			continue;
+		}
+		if ((unsigned int)desc->nb_layers != yf->n_planes)
+			continue;
+		for (j = 0; j != yf->n_planes; ++j)
+		{
+			if (desc->layers[j].format != yf->plane_fourcc[j] || desc->layers[j].nb_planes != 1)
+				break;
+		}
+		if (j == yf->n_planes)
+			return i;
+	}
+	return -1;
+}
+
+// Import a single plane as a GL_TEXTURE_2D. Returns 0 on failure
+static GLuint
+egl_import_plane(egl_wayland_out_env_t *const de, struct _escontext *const es,
+		 const uint32_t fourcc, const int w, const int h,
+		 const AVDRMObjectDescriptor *const obj, const AVDRMPlaneDescriptor *const p)
+{
+	const enum egl_import_e import = egl_import_type(de, fourcc, obj->format_modifier);
+	unsigned int flags = 0;
+	EGLint attribs[20];
+	EGLint *a = attribs;
+	EGLImage image;
+	GLuint tex;
+
+	// External only modifiers can't be bound to TEXTURE_2D
+	if (import == EGL_IMPORT_NONE ||
+	    (dmabuf_fmts_find(de->egl_fmts, fourcc, obj->format_modifier, &flags) &&
+	     (flags & DMABUF_FMT_FLAG_EXTERNAL_ONLY) != 0))
+		return 0;
+
+	*a++ = EGL_WIDTH;
+	*a++ = w;
+	*a++ = EGL_HEIGHT;
+	*a++ = h;
+	*a++ = EGL_LINUX_DRM_FOURCC_EXT;
+	*a++ = fourcc;
+	*a++ = EGL_DMA_BUF_PLANE0_FD_EXT;
+	*a++ = obj->fd;
+	*a++ = EGL_DMA_BUF_PLANE0_OFFSET_EXT;
+	*a++ = p->offset;
+	*a++ = EGL_DMA_BUF_PLANE0_PITCH_EXT;
+	*a++ = p->pitch;
+	if (import == EGL_IMPORT_MOD && obj->format_modifier != DRM_MOD_INVALID)
+	{
+		*a++ = EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT;
+		*a++ = (EGLint)(obj->format_modifier & 0xFFFFFFFF);
+		*a++ = EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT;
+		*a++ = (EGLint)(obj->format_modifier >> 32);
+	}
+	*a = EGL_NONE;
+
+	image = eglCreateImageKHR(es->display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+	if (!image)
+	{
+		if (de->egl_fmts_implicit)
+			egl_import_failed(de, fourcc, obj->format_modifier);
+		return 0;
+	}
+
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+	eglDestroyImageKHR(es->display, image);
+	return tex;
+}
+
+// Import each plane of a YUV frame as its own R8/GR88 (or 16 bit) image
+// Returns 0 or -1 if any plane can't be imported
+static int
+egl_import_planes(egl_wayland_out_env_t *const de, struct _escontext *const es, egl_aux_t *const da,
+		  const AVFrame *const frame, const AVDRMFrameDescriptor *const desc)
+{
+	const int yuv_fmt = egl_yuv_fmt_find(desc);
+	const int w = av_frame_cropped_width(frame);
+	const int h = av_frame_cropped_height(frame);
+	GLuint tex[3] = {0};
+	unsigned int n = 0;
+	int i, j;
+
+	if (yuv_fmt < 0 || de->gl_yuv[yuv_fmt].prog == 0)
+		return -1;
+
+	for (i = 0; i < desc->nb_layers; ++i)
+	{
+		for (j = 0; j < desc->layers[i].nb_planes && n != egl_yuv_fmts[yuv_fmt].n_planes; ++j, ++n)
+		{
+			const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
+
+			// All our formats are 4:2:0
+			if ((tex[n] = egl_import_plane(de, es, egl_yuv_fmts[yuv_fmt].plane_fourcc[n],
+						       n == 0 ? w : (w + 1) >> 1, n == 0 ? h : (h + 1) >> 1,
+						       desc->objects + p->object_index, p)) == 0)
+			{
+				glDeleteTextures(3, tex);
+				return -1;
+			}
+		}
+	}
+
+	da->texture = tex[0];
+	da->planes[0] = tex[1];
+	da->planes[1] = tex[2];
+	da->yuv_fmt = yuv_fmt;
+	return 0;
+}
+
+// Set the colour matrix, range offsets & chroma siting uniforms if the
+// frame's differ from what the program was last set up for
+static void
+gl_yuv_uniforms(gl_yuv_prog_t *const yp, const unsigned int depth, const AVFrame *const frame)
+{
+	const int w = av_frame_cropped_width(frame);
+	const int h = av_frame_cropped_height(frame);
+	const double max = (double)((1 << depth) - 1);
+	const bool full = frame->color_range == AVCOL_RANGE_JPEG;
+	double kr, kb, kg, sy, sc;
+	float cm[9], off[3];
+	float cx = 0.0f, cy = 0.0f;
+
+	if (yp->colorspace == frame->colorspace && yp->range == frame->color_range &&
+	    yp->chroma_loc == frame->chroma_location && yp->w == w && yp->h == h)
+		return;
+	yp->colorspace = frame->colorspace;
+	yp->range = frame->color_range;
+	yp->chroma_loc = frame->chroma_location;
+	yp->w = w;
+	yp->h = h;
+
+	switch (frame->colorspace)
+	{
+	case AVCOL_SPC_BT709:
+		kr = 0.2126, kb = 0.0722;
+		break;
+	case AVCOL_SPC_BT2020_NCL:
+	case AVCOL_SPC_BT2020_CL:
+		kr = 0.2627, kb = 0.0593;
+		break;
+	case AVCOL_SPC_UNSPECIFIED:
+		// Guess from the size like everyone else
+		if (h > 576)
+			kr = 0.2126, kb = 0.0722;
+		else
+			kr = 0.299, kb = 0.114;
+		break;
+	default:
+		kr = 0.299, kb = 0.114;
+		break;
+	}
+	kg = 1.0 - kr - kb;
+
+	sy = full ? 1.0 : max / (219 << (depth - 8));
+	sc = full ? 1.0 : max / (224 << (depth - 8));
+	off[0] = full ? 0.0f : (float)((16 << (depth - 8)) / max);
+	off[1] = off[2] = (float)((1 << (depth - 1)) / max);
+
+	// Column major: Y, U, V columns of R, G, B
+	cm[0] = cm[1] = cm[2] = (float)sy;
+	cm[3] = 0.0f;
+	cm[4] = (float)(-2.0 * (1.0 - kb) * kb / kg * sc);
+	cm[5] = (float)(2.0 * (1.0 - kb) * sc);
+	cm[6] = (float)(2.0 * (1.0 - kr) * sc);
+	cm[7] = (float)(-2.0 * (1.0 - kr) * kr / kg * sc);
+	cm[8] = 0.0f;
+
+	// Chroma textures put samples at 2x+1 luma; left/top sited are at 2x+0.5
+	// so shift half a luma pixel to line them up
+	if (frame->chroma_location == AVCHROMA_LOC_LEFT || frame->chroma_location == AVCHROMA_LOC_TOPLEFT ||
+	    frame->chroma_location == AVCHROMA_LOC_BOTTOMLEFT || frame->chroma_location == AVCHROMA_LOC_UNSPECIFIED)
+		cx = 0.5f / w;
+	if (frame->chroma_location == AVCHROMA_LOC_TOPLEFT || frame->chroma_location == AVCHROMA_LOC_TOP)
+		cy = 0.5f / h;
+	else if (frame->chroma_location == AVCHROMA_LOC_BOTTOMLEFT || frame->chroma_location == AVCHROMA_LOC_BOTTOM)
+		cy = -0.5f / h;
+
+	glUniformMatrix3fv(yp->u_cm, 1, GL_FALSE, cm);
+	glUniform3fv(yp->u_off, 1, off);
+	glUniform2f(yp->u_coff, cx, cy);
+}
+
+static void
+gl_use_program(egl_wayland_out_env_t *const de, const GLuint prog)
+{
+	if (prog == de->gl_prog_cur)
+		return;
+	glUseProgram(prog);
+	de->gl_prog_cur = prog;
+}
+
+// Finish a frame. Headless has nothing to throttle it so wait for the GPU
+// to be done - otherwise throughput numbers would just measure queuing.
+static void
+egl_present(egl_wayland_out_env_t *const de, struct _escontext *const es)
+{
+	if (!de->is_headless)
+	{
+		eglSwapBuffers(es->display, es->surface);
+		return;
+	}
+
+	if (de->hl_readback)
+	{
+		pthread_mutex_lock(&de->hl_lock);
+		glReadPixels(0, 0, es->window_width, es->window_height, GL_RGBA, GL_UNSIGNED_BYTE, de->hl_pixels);
+		de->hl_have_frame = true;
+		pthread_mutex_unlock(&de->hl_lock);
+	}
+	else
+		glFinish();
+	++de->hl_frames;
+}
+
+// Import the whole frame as one external image
+// Returns 0 or -1 if EGL won't take it
+static int
+egl_import_whole(egl_wayland_out_env_t *const de, struct _escontext *const es, egl_aux_t *const da,
+		 const AVFrame *const frame, const AVDRMFrameDescriptor *const desc)
+{
+	const enum egl_import_e import = egl_import_type(de, desc->layers[0].format, desc->objects[0].format_modifier);
+	EGLint attribs[50];
+	EGLint *a = attribs;
+	EGLImage image;
+	int i, j;
+	static const EGLint anames[] = {
+		EGL_DMA_BUF_PLANE0_FD_EXT,
+		EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+		EGL_DMA_BUF_PLANE0_PITCH_EXT,
+		EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+		EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
+		EGL_DMA_BUF_PLANE1_FD_EXT,
+		EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+		EGL_DMA_BUF_PLANE1_PITCH_EXT,
+		EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+		EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT,
+		EGL_DMA_BUF_PLANE2_FD_EXT,
+		EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+		EGL_DMA_BUF_PLANE2_PITCH_EXT,
+		EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+		EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT,
+	};
+	const EGLint *b = anames;
+
+	*a++ = EGL_WIDTH;
+	*a++ = av_frame_cropped_width(frame);
+	*a++ = EGL_HEIGHT;
+	*a++ = av_frame_cropped_height(frame);
+	*a++ = EGL_LINUX_DRM_FOURCC_EXT;
+	*a++ = desc->layers[0].format;
+
+	for (i = 0; i < desc->nb_layers; ++i)
+	{
+		for (j = 0; j < desc->layers[i].nb_planes; ++j)
+		{
+			const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
+			const AVDRMObjectDescriptor *const obj = desc->objects + p->object_index;
+			*a++ = *b++;
+			*a++ = obj->fd;
+			*a++ = *b++;
+			*a++ = p->offset;
+			*a++ = *b++;
+			*a++ = p->pitch;
+			if (import == EGL_IMPORT_IMPLICIT || obj->format_modifier == DRM_MOD_INVALID)
+			{
+				b += 2;
+			}
+			else
+			{
+				*a++ = *b++;
+				*a++ = (EGLint)(obj->format_modifier & 0xFFFFFFFF);
+				*a++ = *b++;
+				*a++ = (EGLint)(obj->format_modifier >> 32);
+			}
+		}
+	}
+
+	*a = EGL_NONE;
+
+	if (log_on(LOG_CAT_EGL, LOG_LVL_TRACE))
+	{
+		for (a = attribs, i = 0; *a != EGL_NONE; a += 2, ++i)
+			LOG_T(LOG_CAT_EGL, "[%2d] %4x: %d\n", i, a[0], a[1]);
+	}
+
+	image = eglCreateImageKHR(es->display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+	// Remembered so later frames go straight to per-plane import
+	if (!image)
+	{
+		egl_import_failed(de, desc->layers[0].format, desc->objects[0].format_modifier);
+		return -1;
+	}
+
+	glGenTextures(1, &da->texture);
+	glBindTexture(GL_TEXTURE_EXTERNAL_OES, da->texture);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+
+	eglDestroyImageKHR(es->display, image);
+
+#if 0
+	LOG_T(LOG_CAT_EGL, "%dx%d, fmt: %x, boh=%d,%d,%d,%d, pitch=%d,%d,%d,%d,"
+		" offset=%d,%d,%d,%d, mod=%llx,%llx,%llx,%llx\n",
+		av_frame_cropped_width(frame),
+		av_frame_cropped_height(frame),
+		desc->layers[0].format,
+		bo_plane_handles[0],
+		bo_plane_handles[1],
+		bo_plane_handles[2],
+		bo_plane_handles[3],
+		pitches[0],
+		pitches[1],
+		pitches[2],
+		pitches[3],
+		offsets[0],
+		offsets[1],
+		offsets[2],
+		offsets[3],
+		(long long)modifiers[0],
+		(long long)modifiers[1],
+		(long long)modifiers[2],
+		(long long)modifiers[3]
+	   );
+#endif
+	return 0;
+}
+
+// Find frame's textures in ac, importing it if it isn't there
+// Returns NULL if EGL can't take it
+static egl_aux_t *
+egl_frame_import(egl_wayland_out_env_t *const de, struct _escontext *const es,
+		 egl_aux_cache_t *const ac, AVFrame *const frame)
+{
+	const AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
+	const void *const frames_ctx = frame->hw_frames_ctx == NULL ? NULL : frame->hw_frames_ctx->data;
+	egl_aux_t *da = NULL;
+	dmabuf_key_t key;
+
+	// A new frames context means the decoder has reallocated its pool so
+	// nothing we hold is going to be seen again
+	if (frames_ctx != ac->frames_ctx)
+	{
+		egl_aux_flush(ac);
+		ac->frames_ctx = frames_ctx;
+	}
+
+	if (dmabuf_key_make(de, &key, frame) != 0)
+		return NULL;
+
+	da = egl_aux_find(de, ac, &key);
+
+	if (da->texture != 0)
+		return da;
+
+	// If the driver can't (or won't, when it comes to it) take the whole
+	// frame try it a plane at a time
+	if ((egl_import_type(de, desc->layers[0].format, desc->objects[0].format_modifier) == EGL_IMPORT_NONE ||
+	     egl_import_whole(de, es, da, frame, desc) != 0) &&
+	    egl_import_planes(de, es, da, frame, desc) != 0)
+	{
+		if (desc->layers[0].format != de->egl_bad_fourcc || desc->objects[0].format_modifier != de->egl_bad_mod)
+		{
+			LOG_W(LOG_CAT_EGL, "%s: EGL can't import %s mod %#"PRIx64" - frames dropped\n", __func__,
+			    av_fourcc2str(desc->layers[0].format), desc->objects[0].format_modifier);
+			de->egl_bad_fourcc = desc->layers[0].format;
+			de->egl_bad_mod = desc->objects[0].format_modifier;
+		}
+		++de->egl_unsupported;
+		egl_aux_evict(da);
+		return NULL;
+	}
+	return da;
+}
+
+// Draw an imported frame into the current viewport
+static void
+egl_frame_draw(egl_wayland_out_env_t *const de, const egl_aux_t *const da, const AVFrame *const frame)
+{
+	if (da->planes[0] != 0)
+	{
+		gl_yuv_prog_t *const yp = de->gl_yuv + da->yuv_fmt;
+
+		gl_use_program(de, yp->prog);
+		gl_yuv_uniforms(yp, egl_yuv_fmts[da->yuv_fmt].depth, frame);
+		if (da->planes[1] != 0)
+		{
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, da->planes[1]);
+		}
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, da->planes[0]);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, da->texture);
+		++de->egl_planar;
+	}
+	else
+	{
+		gl_use_program(de, de->gl_prog_ext);
+		glBindTexture(GL_TEXTURE_EXTERNAL_OES, da->texture);
+	}
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+}
+
+static int do_display(egl_wayland_out_env_t *const de, struct _escontext *const es, AVFrame *const frame)
+{
+#if DEBUG_SOLID
+	(void)de;
+	(void)frame;
+	static double a = 0.3;
+
+	glClearColor(0.5, a, 0.0, 1.0);
+
+	a += 0.05;
+	if (a >= 1.0)
+		a = 0.0;
+
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	eglSwapBuffers(es->display, es->surface);
+#else
+	const egl_aux_t *da;
+
+	LOG_T(LOG_CAT_FRAME, "<<< %s\n", __func__);
+
+	if ((da = egl_frame_import(de, es, &de->aux, frame)) == NULL)
+		return AVERROR(EINVAL);
+	trace_stamp(frame, TRACE_IMPORTED);
+
+	// Bars (if any) are outside the viewport set by geometry_update
+	glClearColor(0.0, 0.0, 0.0, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	egl_frame_draw(de, da, frame);
+	egl_present(de, es);
+#endif
+	return 0;
+}
+
+static GLint
+compile_shader(GLenum target, const char *source)
+{
+	GLuint s = glCreateShader(target);
+
+	if (s == 0)
+	{
+		LOG_E(LOG_CAT_EGL, "Failed to create shader\n");
+		return 0;
+	}
+
+	glShaderSource(s, 1, (const GLchar **)&source, NULL);
+	glCompileShader(s);
+
+	{
+		GLint ok;
+		glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
+
+		if (!ok)
+		{
+			GLchar *info;
+			GLint size;
+
+			glGetShaderiv(s, GL_INFO_LOG_LENGTH, &size);
+			info = malloc(size);
+
+			glGetShaderInfoLog(s, size, NULL, info);
+			LOG_E(LOG_CAT_EGL, "Failed to compile shader: %ssource:\n%s\n", info, source);
+
+			return 0;
+		}
+	}
+
+	return s;
+}
+
+static GLuint link_program(GLint vs, GLint fs)
+{
+	GLuint prog = glCreateProgram();
+
+	if (prog == 0)
+	{
+		LOG_E(LOG_CAT_EGL, "Failed to create program\n");
+		return 0;
+	}
+
+	glAttachShader(prog, vs);
+	glAttachShader(prog, fs);
+	glBindAttribLocation(prog, 0, "pos");
+	glLinkProgram(prog);
+
+	{
+		GLint ok;
+		glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+		if (!ok)
+		{
+			/* Some drivers return a size of 1 for an empty log.  This is the size
+			 * of a log that contains only a terminating NUL character.
+			 */
+			GLint size;
+			GLchar *info = NULL;
+			glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &size);
+			if (size > 1)
+			{
+				info = malloc(size);
+				glGetProgramInfoLog(prog, size, NULL, info);
+			}
+
+			LOG_E(LOG_CAT_EGL, "Failed to link: %s\n",
+				(info != NULL) ? info : "<empty log>");
+			return 0;
+		}
+	}
+
+	return prog;
+}
+
+static const char gl_vs[] =
+	"attribute vec4 pos;\n"
+	"varying vec2 texcoord;\n"
+	"\n"
+	"void main() {\n"
+	"  gl_Position = pos;\n"
+	"  texcoord.x = (pos.x + 1.0) / 2.0;\n"
+	"  texcoord.y = (-pos.y + 1.0) / 2.0;\n"
+	"}\n";
+
+// Per-plane YUV -> RGB. egl_yuv_fmts[].defines are prepended so each
+// format gets its own program with no per-pixel branches.
+static const char gl_yuv_fs[] =
+	"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+	"precision highp float;\n"
+	"#else\n"
+	"precision mediump float;\n"
+	"#endif\n"
+	"uniform sampler2D s0;\n"
+	"uniform sampler2D s1;\n"
+	"#if PLANES == 3\n"
+	"uniform sampler2D s2;\n"
+	"#endif\n"
+	"uniform mat3 cm;\n"
+	"uniform vec3 off;\n"
+	"uniform vec2 coff;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"  vec2 ctc = texcoord + coff;\n"
+	"  vec3 yuv;\n"
+	"  yuv.x = texture2D(s0, texcoord).r;\n"
+	"#if PLANES == 3\n"
+	"  yuv.y = texture2D(s1, ctc).r;\n"
+	"  yuv.z = texture2D(s2, ctc).r;\n"
+	"#else\n"
+	"  yuv.yz = texture2D(s1, ctc).rg;\n"
+	"#endif\n"
+	"  gl_FragColor = vec4(cm * (yuv * SCALE - off), 1.0);\n"
+	"}\n";
+
+// Build the per-plane programs. A format whose program fails just won't
+// have the per-plane fallback
+static void
+gl_yuv_build(egl_wayland_out_env_t *const de, const GLuint vs_s)
+{
+	unsigned int i;
+
+	for (i = 0; i != EGL_YUV_FMTS; ++i)
+	{
+		gl_yuv_prog_t *const yp = de->gl_yuv + i;
+		const size_t dlen = strlen(egl_yuv_fmts[i].defines);
+		char fs[sizeof(gl_yuv_fs) + 128];
+		GLuint fs_s;
+
+		if (dlen + sizeof(gl_yuv_fs) > sizeof(fs))
+			continue;
+		memcpy(fs, egl_yuv_fmts[i].defines, dlen);
+		memcpy(fs + dlen, gl_yuv_fs, sizeof(gl_yuv_fs));
+
+		if (!(fs_s = compile_shader(GL_FRAGMENT_SHADER, fs)) ||
+		    !(yp->prog = link_program(vs_s, fs_s)))
+		{
+			LOG_W(LOG_CAT_EGL, "%s: No per-plane program for %s\n", __func__, av_fourcc2str(egl_yuv_fmts[i].fourcc));
+			continue;
+		}
+
+		glUseProgram(yp->prog);
+		glUniform1i(glGetUniformLocation(yp->prog, "s0"), 0);
+		glUniform1i(glGetUniformLocation(yp->prog, "s1"), 1);
+		if (egl_yuv_fmts[i].n_planes == 3)
+			glUniform1i(glGetUniformLocation(yp->prog, "s2"), 2);
+		yp->u_cm = glGetUniformLocation(yp->prog, "cm");
+		yp->u_off = glGetUniformLocation(yp->prog, "off");
+		yp->u_coff = glGetUniformLocation(yp->prog, "coff");
+	}
+}
+
+static int
+gl_setup(egl_wayland_out_env_t *const de)
+{
+	const char *fs =
+		"#extension GL_OES_EGL_image_external : enable\n"
+		"precision mediump float;\n"
+		"uniform samplerExternalOES s;\n"
+		"varying vec2 texcoord;\n"
+		"void main() {\n"
+		"  gl_FragColor = texture2D(s, texcoord);\n"
+		"}\n";
+
+	GLuint vs_s;
+	GLuint fs_s;
+	GLuint prog;
+
+	if (!(vs_s = compile_shader(GL_VERTEX_SHADER, gl_vs)) ||
+		!(fs_s = compile_shader(GL_FRAGMENT_SHADER, fs)) ||
+		!(prog = link_program(vs_s, fs_s)))
+		return -1;
+
+	de->gl_prog_ext = prog;
+	gl_yuv_build(de, vs_s);
+
+	glUseProgram(prog);
+	de->gl_prog_cur = prog;
+
+	{
+		static const float verts[] = {
+			-1, -1,
+			1, -1,
+			1, 1,
+			-1, 1,
+		};
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	}
+
+	glEnableVertexAttribArray(0);
+	return 0;
+}
+
+static void
+frame_q_init(frame_q_t *const q, const unsigned int depth, const enum egl_wayland_out_q_policy policy)
+{
+	q->depth = depth;
+	q->policy = policy;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	sem_init(&q->space, 0, depth);
+}
+
+// Producer only
+// Returns true if the frame was queued, false if it was dropped. Any frame
+// dropped, new or oldest, is passed back in *pdropped
+static bool
+frame_q_push(frame_q_t *const q, AVFrame **const pframe, const int64_t arrival_ns, AVFrame **const pdropped)
+{
+	const unsigned int h = atomic_load_explicit(&q->head, memory_order_relaxed);
+	frame_q_slot_t *slot;
+
+	while (sem_trywait(&q->space) != 0)
+	{
+		unsigned int t;
+		AVFrame *old;
+
+		switch (q->policy)
+		{
+			case EGL_WAYLAND_OUT_Q_DROP_NEW:
+				++q->drop_new;
+				*pdropped = *pframe;
+				*pframe = NULL;
+				return false;
+
+			case EGL_WAYLAND_OUT_Q_DROP_OLDEST:
+				t = atomic_load_explicit(&q->tail, memory_order_acquire);
+				// Empty but the consumer hasn't posted the space yet
+				if (t == h)
+					break;
+				old = atomic_load_explicit(&q->slots[t & (FRAME_Q_SLOTS - 1)].frame, memory_order_relaxed);
+				if (!atomic_compare_exchange_strong_explicit(&q->tail, &t, t + 1,
+									     memory_order_acq_rel, memory_order_acquire))
+					continue;  // Consumer took it - there will be space now
+				++q->drop_oldest;
+				*pdropped = old;
+				goto have_space;  // We own the slot we freed
+
+			case EGL_WAYLAND_OUT_Q_BLOCK:
+			default:
+				break;
+		}
+
+		++q->blocked;
+		while (sem_wait(&q->space) != 0 && errno == EINTR)
+			/* Loop */;
+		break;
+	}
+
+have_space:
+	slot = q->slots + (h & (FRAME_Q_SLOTS - 1));
+	atomic_store_explicit(&slot->frame, *pframe, memory_order_relaxed);
+	atomic_store_explicit(&slot->arrival_ns, arrival_ns, memory_order_relaxed);
+	atomic_store_explicit(&q->head, h + 1, memory_order_release);
+	*pframe = NULL;
+	return true;
+}
+
+// Consumer only (or anyone once the display thread has gone)
+static AVFrame *
+frame_q_pop(frame_q_t *const q, int64_t *const parrival_ns)
+{
+	unsigned int t = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	for (;;)
+	{
+		const frame_q_slot_t *slot;
+		AVFrame *frame;
+		int64_t arrival_ns;
+
+		if (t == atomic_load_explicit(&q->head, memory_order_acquire))
+			return NULL;
+
+		slot = q->slots + (t & (FRAME_Q_SLOTS - 1));
+		frame = atomic_load_explicit(&slot->frame, memory_order_relaxed);
+		arrival_ns = atomic_load_explicit(&slot->arrival_ns, memory_order_relaxed);
+
+		// On failure t is reloaded - the producer dropped the oldest
+		if (atomic_compare_exchange_weak_explicit(&q->tail, &t, t + 1,
+							  memory_order_acq_rel, memory_order_acquire))
+		{
+			sem_post(&q->space);
+			*parrival_ns = arrival_ns;
+			return frame;
+		}
+	}
+}
+
+// Only a snapshot if the producer is running
+static unsigned int
+frame_q_count(frame_q_t *const q)
+{
+	const unsigned int t = atomic_load_explicit(&q->tail, memory_order_acquire);
+	return atomic_load_explicit(&q->head, memory_order_acquire) - t;
+}
+
+static void
+frame_q_uninit(frame_q_t *const q)
+{
+	AVFrame *frame;
+	int64_t arrival_ns;
+
+	while ((frame = frame_q_pop(q, &arrival_ns)) != NULL)
+		av_frame_free(&frame);
+	sem_destroy(&q->space);
+}
+
+static AVFrame *
+frame_shell_get(struct egl_wayland_out_env *const de)
+{
+	AVFrame *frame = NULL;
+
+	pthread_mutex_lock(&de->shell_lock);
+	if (de->shell_n != 0)
+		frame = de->shells[--de->shell_n];
+	pthread_mutex_unlock(&de->shell_lock);
+	return frame != NULL ? frame : av_frame_alloc();
+}
+
+// Drop a frame from frame_get and keep its AVFrame for the next one
+static void
+frame_shell_put(struct egl_wayland_out_env *const de, AVFrame **const pframe)
+{
+	AVFrame *frame = *pframe;
+
+	if (frame == NULL)
+		return;
+	*pframe = NULL;
+	av_frame_unref(frame);
+
+	pthread_mutex_lock(&de->shell_lock);
+	if (de->shell_n < FRAME_SHELLS)
+	{
+		de->shells[de->shell_n++] = frame;
+		frame = NULL;
+	}
+	pthread_mutex_unlock(&de->shell_lock);
+	av_frame_free(&frame);
+}
+
+static int64_t
+pres_now_ns(const struct _escontext *const es)
+{
+	struct timespec ts;
+	clock_gettime(es->pres_clock, &ts);
+	return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void
+pres_fb_done(pres_fb_t *const pf)
+{
+	wp_presentation_feedback_destroy(pf->fb);
+	pf->fb = NULL;
+}
+
+static void
+pres_fb_sync_output(void *data, struct wp_presentation_feedback *fb, struct wl_output *output)
+{
+	(void)data;
+	(void)fb;
+	(void)output;
+}
+
+static void
+pres_fb_presented(void *data, struct wp_presentation_feedback *fb,
+		  uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		  uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo, uint32_t flags)
+{
+	pres_fb_t *const pf = data;
+	struct egl_wayland_out_env *const de = pf->de;
+	const int64_t present_ns = (int64_t)(((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * NS_PER_SEC + tv_nsec;
+	const int64_t lat_ns = present_ns - pf->arrival_ns;
+	(void)fb;
+	(void)seq_hi;
+	(void)seq_lo;
+
+	if (refresh != 0)
+		de->refresh_ns = refresh;
+	de->last_present_ns = present_ns;
+
+	// Track how long a commit takes to hit the screen so we can commit
+	// that far ahead of the target vblank
+	de->commit_lat_ns += (present_ns - pf->commit_ns - de->commit_lat_ns) / 8;
+
+	if (pf->target_ns != 0)
+	{
+		const int64_t err_ns = present_ns - pf->target_ns;
+		++de->pres_targeted;
+		de->pres_err_total_ns += err_ns < 0 ? -err_ns : err_ns;
+		// Over 4 refreshes out => we've lost track (pause, stall, clock step)
+		// rather than just missed a vblank or two
+		if (de->refresh_ns != 0 && (err_ns > de->refresh_ns * 4 || err_ns < -de->refresh_ns * 4))
+			de->anchor_ns = 0;
+	}
+
+	++de->pres_presented;
+	if ((flags & WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY) != 0)
+		++de->pres_zero_copy;
+	de->pres_lat_total_ns += lat_ns;
+	if (lat_ns > de->pres_lat_max_ns)
+		de->pres_lat_max_ns = lat_ns;
+
+	LOG_D(LOG_CAT_PRES, "%s: latency %"PRId64"us, error %"PRId64"us, refresh %"PRIu32"ns, flags %#x\n", __func__,
+	    lat_ns / 1000, pf->target_ns == 0 ? 0 : (present_ns - pf->target_ns) / 1000, refresh, flags);
+	pres_fb_done(pf);
+}
+
+static void
+pres_fb_discarded(void *data, struct wp_presentation_feedback *fb)
+{
+	pres_fb_t *const pf = data;
+	(void)fb;
+
+	++pf->de->pres_discarded;
+	pres_fb_done(pf);
+}
+
+static const struct wp_presentation_feedback_listener pres_fb_listener = {
+	.sync_output = pres_fb_sync_output,
+	.presented = pres_fb_presented,
+	.discarded = pres_fb_discarded,
+};
+
+// Must be called before the commit (or eglSwapBuffers) that it is for
+static void
+pres_fb_request(egl_wayland_out_env_t *const de, struct _escontext *const es,
+		const int64_t arrival_ns, const int64_t target_ns)
+{
+	unsigned int i;
+
+	if (es->w_presentation == NULL)
+		return;
+
+	for (i = 0; i != PRES_FB_SIZE; ++i)
+	{
+		pres_fb_t *const pf = de->pres_fb + i;
+
+		if (pf->fb != NULL)
+			continue;
+
+		pf->de = de;
+		pf->arrival_ns = arrival_ns;
+		pf->target_ns = target_ns;
+		pf->commit_ns = pres_now_ns(es);
+		pf->fb = wp_presentation_feedback(es->w_presentation, de->v_surface);
+		wp_presentation_feedback_add_listener(pf->fb, &pres_fb_listener, pf);
+		return;
+	}
+}
+
+static void
+pres_fb_uninit(egl_wayland_out_env_t *const de)
+{
+	unsigned int i;
+
+	for (i = 0; i != PRES_FB_SIZE; ++i)
+	{
+		if (de->pres_fb[i].fb != NULL)
+			pres_fb_done(de->pres_fb + i);
+	}
+}
+
+// Work out which vblank this frame should be presented on
+// Returns 0 if the frame isn't being scheduled
+static int64_t
+pres_target_ns(egl_wayland_out_env_t *const de, const AVFrame *const frame, const int64_t now_ns)
+{
+	AVRational time_base;
+	bool pts_sched;
+	int64_t pts_ns;
+	int64_t target_ns;
+
+	pthread_mutex_lock(&de->q_lock);
+	pts_sched = de->pts_sched;
+	time_base = de->time_base;
+	pthread_mutex_unlock(&de->q_lock);
+
+	if (!pts_sched || de->timer_fd == -1)
+		return 0;
+
+	if (frame->pts != AV_NOPTS_VALUE)
+		pts_ns = av_rescale_q(frame->pts, time_base, (AVRational){1, 1000000000});
+	else if (de->frame_rate.num > 0 && de->frame_rate.den > 0)
+		// No PTS - make one up from the frame rate given to modeset
+		pts_ns = de->last_pts_ns + av_rescale(NS_PER_SEC, de->frame_rate.den, de->frame_rate.num);
+	else
+		return 0;
+
+	if (de->anchor_ns == 0 || pts_ns < de->last_pts_ns || pts_ns > de->last_pts_ns + PRES_REANCHOR_NS)
+	{
+		// (Re)start the timeline - show this frame as soon as we can
+		de->anchor_ns = now_ns + de->commit_lat_ns;
+		de->anchor_pts_ns = pts_ns;
+	}
+	de->last_pts_ns = pts_ns;
+
+	target_ns = de->anchor_ns + (pts_ns - de->anchor_pts_ns);
+
+	// Snap to the nearest vblank so we aim at a real refresh
+	if (de->refresh_ns != 0 && de->last_present_ns != 0)
+	{
+		const int64_t d = target_ns - de->last_present_ns + de->refresh_ns / 2;
+		int64_t k = d / de->refresh_ns;
+		if (d < 0 && k * de->refresh_ns != d)
+			--k;
+		target_ns = de->last_present_ns + k * de->refresh_ns;
+	}
+
+	return target_ns;
+}
+
+static void
+set_opaque(struct _escontext *const es, struct wl_surface *const surface, const int w, const int h)
+{
+	struct wl_region *const r = wl_compositor_create_region(es->w_compositor);
+
+	wl_region_add(r, 0, 0, w, h);
+	wl_surface_set_opaque_region(surface, r);
+	wl_region_destroy(r);
+}
+
+// Parent of the video subsurface: a 1x1 black buffer scaled to the window
+// Only touched when the geometry changes
+static void
+parent_fill(struct _escontext *const es, const int w, const int h)
+{
+	static const shm_layout_t layout = {
+		.format = WL_SHM_FORMAT_XRGB8888,
+		.width = 1,
+		.height = 1,
+		.stride = 4,
+		.size = 4,
+	};
+	shm_buf_t *buf = NULL;
+
+	if (es->bg_pool == NULL && es->w_shm != NULL)
+		es->bg_pool = shm_pool_new(es->w_shm, 2);
+	if (es->bg_pool != NULL && shm_pool_set_layout(es->bg_pool, &layout) == 0)
+		buf = shm_pool_acquire(es->bg_pool);
+
+	wp_viewport_set_destination(es->w_viewport, w, h);
+	set_opaque(es, es->w_surface, w, h);
+	if (buf == NULL)
+	{
+		// Rescale whatever is already attached
+		wl_surface_commit(es->w_surface);
+		return;
+	}
+	*(uint32_t *)shm_buf_data(buf) = 0xff000000;
+	shm_buf_commit(buf, es->w_surface);
+	shm_buf_unref(&buf);
+}
+
+// Move the video onto a desync subsurface with its own viewport
+// Done on the display thread before the first frame; on failure the video
+// stays on the parent
+static void
+video_subsurface_setup(egl_wayland_out_env_t *const de, struct _escontext *const es)
+{
+	de->sub_tried = true;
+
+	if (es->w_subcompositor == NULL)
+	{
+		LOG_W(LOG_CAT_WL, "%s: No subcompositor - video stays on the main surface\n", __func__);
+		return;
+	}
+
+	es->w_surface2 = wl_compositor_create_surface(es->w_compositor);
+	es->w_subsurface2 = wl_subcompositor_get_subsurface(es->w_subcompositor, es->w_surface2, es->w_surface);
+	wl_subsurface_place_above(es->w_subsurface2, es->w_surface);
+	wl_subsurface_set_desync(es->w_subsurface2);
+	es->w_viewport2 = wp_viewporter_get_viewport(es->w_viewporter, es->w_surface2);
+
+	de->v_surface = es->w_surface2;
+	de->v_viewport = es->w_viewport2;
+
+	// Plane promotion is decided per surface so we want the video's feedback
+	dmabuf_fb_attach(de, de->v_surface);
+
+	LOG_I(LOG_CAT_WL, "%s: Video on desync subsurface\n", __func__);
+}
+
+// Work out where the video goes in the window and reconfigure the output
+// Called on the display thread once per mode or window size change
+static void
+geometry_update(egl_wayland_out_env_t *const de, struct _escontext *const es)
+{
+	const int win_w = es->req_w;
+	const int win_h = es->req_h;
+	out_mode_t mode;
+	int64_t dw, dh;  // Video display size in square pixels
+
+	// Read the gen first so a racing modeset gets another update
+	de->geo_mode_gen = atomic_load_explicit(&de->mode_gen, memory_order_acquire);
+	de->geo_req_gen = es->req_gen;
+
+	pthread_mutex_lock(&de->q_lock);
+	mode = de->mode;
+	pthread_mutex_unlock(&de->q_lock);
+
+	de->frame_rate = mode.frame_rate;
+
+	if (mode.w <= 0 || mode.h <= 0)
+	{
+		// No modeset yet - fill the window
+		dw = win_w;
+		dh = win_h;
+	}
+	else
+	{
+		dw = mode.w;
+		dh = mode.h;
+		if (mode.sar.num > 0 && mode.sar.den > 0)
+			dw = av_rescale(dw, mode.sar.num, mode.sar.den);
+	}
+
+	// Letterbox or pillarbox into the window
+	if (dw * win_h > dh * win_w)
+	{
+		de->vid_w = win_w;
+		de->vid_h = (int)av_rescale(win_w, dh, dw);
+	}
+	else
+	{
+		de->vid_w = (int)av_rescale(win_h, dw, dh);
+		de->vid_h = win_h;
+	}
+	de->vid_x = (win_w - de->vid_w) / 2;
+	de->vid_y = (win_h - de->vid_h) / 2;
+
+	LOG_I(LOG_CAT_WL, "%s: window %dx%d, video %dx%d @ %d,%d\n", __func__,
+	    win_w, win_h, de->vid_w, de->vid_h, de->vid_x, de->vid_y);
+
+	if (de->is_egl)
+	{
+		if (win_w != es->window_width || win_h != es->window_height)
+		{
+			wl_egl_window_resize(es->native_window, win_w, win_h, 0, 0);
+			set_opaque(es, es->w_surface, win_w, win_h);
+			es->window_width = win_w;
+			es->window_height = win_h;
+		}
+		// GL y is bottom up but the bars are symmetric so it doesn't matter
+		glViewport(de->vid_x, de->vid_y, de->vid_w, de->vid_h);
+	}
+	else if (de->v_surface != es->w_surface)
+	{
+		// Video sits on the subsurface; the parent is the black window
+		// behind it. The position is applied with the parent's commit.
+		wl_subsurface_set_position(es->w_subsurface2, de->vid_x, de->vid_y);
+		wp_viewport_set_destination(de->v_viewport, de->vid_w, de->vid_h);
+		set_opaque(es, de->v_surface, de->vid_w, de->vid_h);
+		parent_fill(es, win_w, win_h);
+		es->window_width = win_w;
+		es->window_height = win_h;
+	}
+	else
+	{
+		// The surface is just the video - the compositor centres it and
+		// fills the rest (in fullscreen) with black
+		wp_viewport_set_destination(es->w_viewport, de->vid_w, de->vid_h);
+		set_opaque(es, es->w_surface, de->vid_w, de->vid_h);
+		es->window_width = de->vid_w;
+		es->window_height = de->vid_h;
+	}
+}
+
+// Returns a sync_file fd that signals once the GPU has finished everything
+// issued so far, or -1
+static int
+egl_fence_fd(struct _escontext *const es)
+{
+	static const EGLint attribs[] = {EGL_NONE};
+	const EGLSyncKHR sync = eglCreateSyncKHR(es->display, EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+	int fd;
+
+	if (sync == EGL_NO_SYNC_KHR)
+		return -1;
+	// The fd doesn't exist until the fence has been flushed
+	glFlush();
+	fd = eglDupNativeFenceFDANDROID(es->display, sync);
+	eglDestroySyncKHR(es->display, sync);
+	return fd == EGL_NO_NATIVE_FENCE_FD_ANDROID ? -1 : fd;
+}
+
+// Free the frames whose fences have signalled. Fences signal in order so
+// stop at the first one that hasn't. If wait then block for the oldest.
+static void
+fence_q_reap(egl_wayland_out_env_t *const de, bool wait)
+{
+	unsigned int n = 0;
+
+	while (n != de->fence_n)
+	{
+		fence_ent_t *const fe = de->fences + n;
+		struct pollfd pfd = {.fd = fe->fd, .events = POLLIN};
+		int rv;
+
+		while ((rv = poll(&pfd, 1, wait ? -1 : 0)) < 0 && errno == EINTR)
+			/* Loop */;
+		if (rv == 0)
+			break;
+
+		close(fe->fd);
+		frame_shell_put(de, &fe->frame);
+		wait = false;
+		++n;
+	}
+
+	if (n != 0)
+	{
+		de->fence_n -= n;
+		memmove(de->fences, de->fences + n, de->fence_n * sizeof(de->fences[0]));
+	}
+}
+
+// Hold frame until the GPU has finished sampling it
+// Returns false if we couldn't make a fence
+static bool
+fence_q_add(egl_wayland_out_env_t *const de, struct _escontext *const es, AVFrame *const frame)
+{
+	const int fd = egl_fence_fd(es);
+
+	if (fd == -1)
+		return false;
+
+	if (de->fence_n == FENCE_Q_SIZE)
+	{
+		++de->fence_waits;
+		fence_q_reap(de, true);
+	}
+	de->fences[de->fence_n++] = (fence_ent_t){.frame = frame, .fd = fd};
+	return true;
+}
+
+static void
+fence_q_uninit(egl_wayland_out_env_t *const de)
+{
+	while (de->fence_n != 0)
+		fence_q_reap(de, true);
+}
+
+static void
+frame_cb_done(void *data, struct wl_callback *cb, uint32_t time)
+{
+	egl_wayland_out_env_t *const de = data;
+	(void)time;
+
+	wl_callback_destroy(cb);
+	de->frame_cb = NULL;
+	// The compositor wants another frame - give it whatever is waiting
+	display_service(de, de->es);
+}
+
+static const struct wl_callback_listener frame_cb_listener = {
+	.done = frame_cb_done,
+};
+
+// Used when a frame wasn't committed after all - otherwise we would wait
+// for a callback that won't come until the next commit
+static void
+frame_cb_cancel(egl_wayland_out_env_t *const de)
+{
+	if (de->frame_cb == NULL)
+		return;
+	wl_callback_destroy(de->frame_cb);
+	de->frame_cb = NULL;
+}
+
+static void
+show_frame(egl_wayland_out_env_t *const de, struct _escontext *const es, AVFrame *const frame,
+	   const int64_t arrival_ns, const int64_t target_ns)
+{
+	int rv;
+
+	trace_stamp(frame, TRACE_DEQUEUED);
+
+	if (de->want_subsurface && !de->sub_tried)
+	{
+		video_subsurface_setup(de, es);
+		// Place it
+		de->geo_req_gen = es->req_gen - 1;
+	}
+
+	if (atomic_load_explicit(&de->mode_gen, memory_order_acquire) != de->geo_mode_gen ||
+	    es->req_gen != de->geo_req_gen)
+		geometry_update(de, es);
+
+	pres_fb_request(de, es, arrival_ns, target_ns);
+
+	// Must be asked for before the commit (or swap) it applies to
+	if (de->present_mode != EGL_WAYLAND_OUT_PRESENT_IMMEDIATE)
+	{
+		de->frame_cb = wl_surface_frame(de->v_surface);
+		wl_callback_add_listener(de->frame_cb, &frame_cb_listener, de);
+	}
+
+	if (de->is_egl)
+		rv = do_display(de, es, frame);
+	else if (de->is_shm)
+		rv = do_display_shm(de, es, frame);
+	else
+		rv = do_display_dmabuf(de, es, frame);
+	if (rv != 0)
+		frame_cb_cancel(de);
+	else
+		trace_stamp(frame, TRACE_PRESENTED);
+	frame_shell_put(de, &de->q_this);
+
+	// With a fence the frame goes back to the decoder as soon as the GPU is
+	// done with it rather than when the next frame turns up
+	if (de->is_egl && de->explicit_sync && de->egl_fence_ext && fence_q_add(de, es, frame))
+		return;
+	de->q_this = frame;
+}
+
+// Letterbox frame into tile n of the grid. GL's y is bottom up.
+static void
+mosaic_tile_viewport(const egl_wayland_out_env_t *const de, const unsigned int n, const AVFrame *const frame)
+{
+	const struct _escontext *const es = de->es;
+	const int col = n % de->mosaic_cols;
+	const int row = n / de->mosaic_cols;
+	const int x0 = es->window_width * col / de->mosaic_cols;
+	const int x1 = es->window_width * (col + 1) / de->mosaic_cols;
+	const int y0 = es->window_height - es->window_height * (row + 1) / de->mosaic_rows;
+	const int y1 = es->window_height - es->window_height * row / de->mosaic_rows;
+	int64_t dw = av_frame_cropped_width(frame);
+	const int64_t dh = av_frame_cropped_height(frame);
+	int w = x1 - x0;
+	int h = y1 - y0;
+
+	if (frame->sample_aspect_ratio.num > 0 && frame->sample_aspect_ratio.den > 0)
+		dw = av_rescale(dw, frame->sample_aspect_ratio.num, frame->sample_aspect_ratio.den);
+	if (dw > 0 && dh > 0)
+	{
+		if (dw * h > dh * w)
+			h = (int)av_rescale(w, dh, dw);
+		else
+			w = (int)av_rescale(h, dw, dh);
+	}
+	glViewport(x0 + (x1 - x0 - w) / 2, y0 + (y1 - y0 - h) / 2, w, h);
+}
+
+// Draw the newest frame of every tile with a single swap. Paced by the
+// frame callback; decoders that run ahead just have their slot replaced.
+static void
+mosaic_service(egl_wayland_out_env_t *const de, struct _escontext *const es)
+{
+	bool fresh[MOSAIC_MAX_TILES] = {false};
+	unsigned int i;
+
+	if (de->frame_cb != NULL)
+		return;
+
+	pthread_mutex_lock(&de->q_lock);
+	if (!de->mosaic_new)
 	{
-		LOG("Failed to create shader\n");
-		return 0;
+		pthread_mutex_unlock(&de->q_lock);
+		return;
 	}
-
-	glShaderSource(s, 1, (const GLchar **)&source, NULL);
-	glCompileShader(s);
-
+	de->mosaic_new = false;
+	for (i = 0; i != de->mosaic_n; ++i)
 	{
-		GLint ok;
-		glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
-
-		if (!ok)
-		{
-			GLchar *info;
-			GLint size;
+		mosaic_tile_t *const t = de->tiles + i;
+
+		if (t->frame == NULL)
+			continue;
+		t->prev = t->shown;
+		t->shown = t->frame;
+		t->frame = NULL;
+		++t->shown_n;
+		fresh[i] = true;
+		trace_stamp(t->shown, TRACE_DEQUEUED);
+	}
+	pthread_mutex_unlock(&de->q_lock);
 
-			glGetShaderiv(s, GL_INFO_LOG_LENGTH, &size);
-			info = malloc(size);
+	if (es->req_gen != de->geo_req_gen)
+		geometry_update(de, es);
 
-			glGetShaderInfoLog(s, size, NULL, info);
-			LOG("Failed to compile shader: %ssource:\n%s\n", info, source);
+	de->frame_cb = wl_surface_frame(de->v_surface);
+	wl_callback_add_listener(de->frame_cb, &frame_cb_listener, de);
 
-			return 0;
-		}
+	glClearColor(0.0, 0.0, 0.0, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	for (i = 0; i != de->mosaic_n; ++i)
+	{
+		mosaic_tile_t *const t = de->tiles + i;
+		const egl_aux_t *da;
+
+		if (t->shown == NULL || (da = egl_frame_import(de, es, &t->aux, t->shown)) == NULL)
+			continue;
+		trace_stamp(t->shown, TRACE_IMPORTED);
+		mosaic_tile_viewport(de, i, t->shown);
+		egl_frame_draw(de, da, t->shown);
+	}
+	egl_present(de, es);
+	++de->mosaic_swaps;
+	for (i = 0; i != de->mosaic_n; ++i)
+	{
+		if (fresh[i])
+			trace_stamp(de->tiles[i].shown, TRACE_PRESENTED);
 	}
 
-	return s;
+	// Only let the old frames go once the GL that read them is queued
+	for (i = 0; i != de->mosaic_n; ++i)
+		frame_shell_put(de, &de->tiles[i].prev);
 }
 
-static GLuint link_program(GLint vs, GLint fs)
+// Show whatever is due. Frames that are early sit in q_hold until the timer
+// says it is time to commit them
+static void
+display_service(egl_wayland_out_env_t *const de, struct _escontext *const es)
 {
-	GLuint prog = glCreateProgram();
-
-	if (prog == 0)
+	if (de->mosaic_n != 0)
 	{
-		LOG("Failed to create program\n");
-		return 0;
+		mosaic_service(de, es);
+		return;
 	}
 
-	glAttachShader(prog, vs);
-	glAttachShader(prog, fs);
-	glLinkProgram(prog);
-
+	for (;;)
 	{
-		GLint ok;
-		glGetProgramiv(prog, GL_LINK_STATUS, &ok);
-		if (!ok)
+		int64_t now_ns;
+
+		// Wait for the compositor to want another frame. frame_cb_done
+		// calls us again.
+		if (de->frame_cb != NULL)
 		{
-			/* Some drivers return a size of 1 for an empty log.  This is the size
-			 * of a log that contains only a terminating NUL character.
-			 */
-			GLint size;
-			GLchar *info = NULL;
-			glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &size);
-			if (size > 1)
+			if (de->q_hold != NULL || frame_q_count(&de->q) != 0)
+				++de->frame_cb_waits;
+			return;
+		}
+
+		if (de->q_hold == NULL)
+		{
+			de->q_hold = frame_q_pop(&de->q, &de->q_hold_arrival_ns);
+			if (de->q_hold == NULL)
+				return;
+
+			// Only the newest frame is worth showing
+			if (de->present_mode == EGL_WAYLAND_OUT_PRESENT_MAILBOX)
 			{
-				info = malloc(size);
-				glGetProgramInfoLog(prog, size, NULL, info);
+				AVFrame *f;
+				int64_t arrival_ns;
+
+				while ((f = frame_q_pop(&de->q, &arrival_ns)) != NULL)
+				{
+					++de->mailbox_drops;
+					frame_shell_put(de, &de->q_hold);
+					de->q_hold = f;
+					de->q_hold_arrival_ns = arrival_ns;
+				}
 			}
 
-			LOG("Failed to link: %s\n",
-				(info != NULL) ? info : "<empty log>");
-			return 0;
+			now_ns = pres_now_ns(es);
+			de->q_hold_target_ns = pres_target_ns(de, de->q_hold, now_ns);
+			de->q_hold_commit_ns = de->q_hold_target_ns - de->commit_lat_ns;
+		}
+		else
+		{
+			now_ns = pres_now_ns(es);
 		}
-	}
 
-	return prog;
+		// Less than half a ms to go isn't worth a trip round poll
+		if (de->q_hold_target_ns != 0 && de->q_hold_commit_ns > now_ns + 500000)
+		{
+			const struct itimerspec its = {
+				.it_value = {
+					.tv_sec = de->q_hold_commit_ns / NS_PER_SEC,
+					.tv_nsec = de->q_hold_commit_ns % NS_PER_SEC
+				}
+			};
+			if (timerfd_settime(de->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+				LOG_E(LOG_CAT_PRES, "%s: timerfd_settime failed: %s\n", __func__, strerror(errno));
+			return;
+		}
+
+		if (de->q_hold_target_ns != 0 && de->refresh_ns != 0 &&
+		    now_ns > de->q_hold_target_ns + de->refresh_ns)
+			++de->pres_late;
+
+		show_frame(de, es, de->q_hold, de->q_hold_arrival_ns, de->q_hold_target_ns);
+		de->q_hold = NULL;
+	}
 }
 
+// Surfaceless has no default framebuffer so make one
 static int
-gl_setup()
+headless_fbo_setup(egl_wayland_out_env_t *const de, struct _escontext *const es)
 {
-	const char *vs =
-		"attribute vec4 pos;\n"
-		"varying vec2 texcoord;\n"
-		"\n"
-		"void main() {\n"
-		"  gl_Position = pos;\n"
-		"  texcoord.x = (pos.x + 1.0) / 2.0;\n"
-		"  texcoord.y = (-pos.y + 1.0) / 2.0;\n"
-		"}\n";
-	const char *fs =
-		"#extension GL_OES_EGL_image_external : enable\n"
-		"precision mediump float;\n"
-		"uniform samplerExternalOES s;\n"
-		"varying vec2 texcoord;\n"
-		"void main() {\n"
-		"  gl_FragColor = texture2D(s, texcoord);\n"
-		"}\n";
-
-	GLuint vs_s;
-	GLuint fs_s;
-	GLuint prog;
+	GLenum status;
 
-	if (!(vs_s = compile_shader(GL_VERTEX_SHADER, vs)) ||
-		!(fs_s = compile_shader(GL_FRAGMENT_SHADER, fs)) ||
-		!(prog = link_program(vs_s, fs_s)))
-		return -1;
+	if (es->surface != EGL_NO_SURFACE)
+		return 0;
 
-	glUseProgram(prog);
+	glGenTextures(1, &de->hl_tex);
+	glBindTexture(GL_TEXTURE_2D, de->hl_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, es->window_width, es->window_height, 0,
+		     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glGenFramebuffers(1, &de->hl_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, de->hl_fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, de->hl_tex, 0);
 
+	if ((status = glCheckFramebufferStatus(GL_FRAMEBUFFER)) != GL_FRAMEBUFFER_COMPLETE)
 	{
-		static const float verts[] = {
-			-1, -1,
-			1, -1,
-			1, 1,
-			-1, 1,
-		};
-		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
+		LOG_E(LOG_CAT_EGL, "%s: Framebuffer incomplete: %#x\n", __func__, status);
+		return -1;
 	}
-
-	glEnableVertexAttribArray(0);
 	return 0;
 }
 
+static void
+headless_fbo_uninit(egl_wayland_out_env_t *const de)
+{
+	if (de->hl_fbo != 0)
+		glDeleteFramebuffers(1, &de->hl_fbo);
+	if (de->hl_tex != 0)
+		glDeleteTextures(1, &de->hl_tex);
+	de->hl_fbo = 0;
+	de->hl_tex = 0;
+}
+
 static void* display_thread(void *v)
 {
 	egl_wayland_out_env_t *const de = v;
-	struct _escontext *const es = &ESContext;
-	struct pollfd pollfds[2];
+	struct _escontext *const es = de->es;
+	struct pollfd pollfds[4];
 	int wl_fd;
 	int wl_poll_out = 0;
 
-#if TRACE_ALL
-	LOG("<<< %s\n", __func__);
-#endif
+	LOG_D(LOG_CAT_GEN, "<<< %s\n", __func__);
 
 	if (de->is_egl)
 	{
 		// Make the context current
 		if (!eglMakeCurrent(es->display, es->surface, es->surface, es->context))
 		{
-			LOG("Could not make the current window current !\n");
+			LOG_E(LOG_CAT_EGL, "Could not make the current window current !\n");
 			goto fail;
 		}
 
-		LOG("GL Vendor: %s\n", glGetString(GL_VENDOR));
-		LOG("GL Version: %s\n", glGetString(GL_VERSION));
-		LOG("GL Renderer: %s\n", glGetString(GL_RENDERER));
-		LOG("GL Extensions: %s\n", glGetString(GL_EXTENSIONS));
-		LOG("EGL Extensions: %s\n", eglQueryString(es->display, EGL_EXTENSIONS));
+		// Pacing is done with frame callbacks - never block in eglSwapBuffers
+		if (!de->is_headless && !eglSwapInterval(es->display, 0))
+			LOG_W(LOG_CAT_EGL, "%s: eglSwapInterval(0) failed\n", __func__);
+
+		LOG_I(LOG_CAT_EGL, "GL Vendor: %s\n", glGetString(GL_VENDOR));
+		LOG_I(LOG_CAT_EGL, "GL Version: %s\n", glGetString(GL_VERSION));
+		LOG_I(LOG_CAT_EGL, "GL Renderer: %s\n", glGetString(GL_RENDERER));
+		LOG_D(LOG_CAT_EGL, "GL Extensions: %s\n", glGetString(GL_EXTENSIONS));
+		LOG_D(LOG_CAT_EGL, "EGL Extensions: %s\n", eglQueryString(es->display, EGL_EXTENSIONS));
 
 		if (!epoxy_has_egl_extension(es->display, "EGL_EXT_image_dma_buf_import"))
 		{
-			LOG("Missing EGL EXT image dma_buf extension\n");
+			LOG_E(LOG_CAT_EGL, "Missing EGL EXT image dma_buf extension\n");
 			goto fail;
 		}
 
-		if (gl_setup())
+		if (gl_setup(de))
 		{
-			LOG("%s: gl_setup failed\n", __func__);
+			LOG_E(LOG_CAT_EGL, "%s: gl_setup failed\n", __func__);
 			goto fail;
 		}
 
-		{
-			EGLint fmts[128];
-			EGLint fcount = 0;
-			EGLint i;
+		if (de->is_headless && headless_fbo_setup(de, es) != 0)
+			goto fail;
 
-			eglQueryDmaBufFormatsEXT(es->display, 128, fmts, &fcount);
-			LOG("DmaBuf formats found=%d\n", fcount);
-			for (i = 0; i != fcount; ++i)
-			{
-				LOG("[%d] %s\n", i, av_fourcc2str(fmts[i]));
-			}
+		de->egl_fence_ext = epoxy_has_egl_extension(es->display, "EGL_ANDROID_native_fence_sync");
+
+		if (egl_fmts_build(de, es) != 0)
+		{
+			LOG_E(LOG_CAT_EGL, "%s: Failed to build EGL format table\n", __func__);
+			goto fail;
 		}
 	}
 
-#if TRACE_ALL
-	LOG("--- %s: Start done\n", __func__);
-#endif
-	wl_fd = wl_display_get_fd(es->native_display);
+	LOG_D(LOG_CAT_GEN, "--- %s: Start done\n", __func__);
+	sem_post(&de->display_ready_sem);
+	// Headless has no display - poll ignores -ve fds
+	wl_fd = es->native_display == NULL ? -1 : wl_display_get_fd(es->native_display);
 
 	while (!de->q_terminate)
 	{
-		AVFrame *frame;
 		int rv;
 
-		for(;;) {
-			wl_display_dispatch_pending(es->native_display);
-			if (wl_display_prepare_read(es->native_display) == 0)
+		for(; wl_fd != -1;) {
+			wl_display_dispatch_queue_pending(es->native_display, es->w_queue);
+			conn_dispatch(es->conn);
+			if (wl_display_prepare_read_queue(es->native_display, es->w_queue) == 0)
 				break;
 			if (errno != EAGAIN)
 			{
-				LOG("prepared_read: %s\n", strerror(errno));
+				LOG_E(LOG_CAT_GEN, "prepared_read: %s\n", strerror(errno));
 				break;
 			}
 		}
 
 		wl_poll_out = 0;
-		if (wl_display_flush(es->native_display) == -1 && errno == EAGAIN)
+		if (wl_fd != -1 && wl_display_flush(es->native_display) == -1 && errno == EAGAIN)
 			wl_poll_out = 1;
 
 		pollfds[0] = (struct pollfd){.fd = de->prod_fd, .events = POLLIN};
 		pollfds[1] = (struct pollfd){.fd = wl_fd, .events = wl_poll_out ? POLLIN | POLLOUT : POLLIN};
+		pollfds[2] = (struct pollfd){.fd = de->timer_fd, .events = POLLIN};
+		// Release fences - poll ignores -ve fds
+		pollfds[3] = (struct pollfd){.fd = -1, .events = POLLIN};
+		if (de->fence_n != 0)
+			pollfds[3].fd = de->fences[0].fd;
+#if HAS_DRM_SYNCOBJ
+		if (de->sync_surface != NULL)
+			pollfds[3].fd = de->sync_efd;
+#endif
 
 		do {
-			rv = poll(pollfds, 2, -1);
+			rv = poll(pollfds, 4, -1);
 		} while (rv < 0 && errno == EINTR);
 
 		if (rv < 0)
 		{
-			LOG("Poll failed: %s\n", strerror(errno));
+			LOG_E(LOG_CAT_GEN, "Poll failed: %s\n", strerror(errno));
 			break;
 		}
 		if (rv == 0)
 		{
-			LOG("Poll unexpected timeout\n");
+			LOG_E(LOG_CAT_GEN, "Poll unexpected timeout\n");
 			break;
 		}
 
-		if (wl_display_read_events(es->native_display) != 0)
-			LOG("Read Event Failed\n");
+		if (wl_fd != -1 && wl_display_read_events(es->native_display) != 0)
+			LOG_E(LOG_CAT_GEN, "Read Event Failed\n");
 
 		if (pollfds[0].revents)
 		{
 			uint64_t rcount = 0;
 			if (read(de->prod_fd, &rcount, sizeof(rcount)) != sizeof(rcount))
-				LOG("Unexpected prod read\n");
+				LOG_E(LOG_CAT_GEN, "Unexpected prod read\n");
+		}
 
-			pthread_mutex_lock(&de->q_lock);
-			frame = de->q_next;
-			de->q_next = NULL;
-			pthread_mutex_unlock(&de->q_lock);
+		if (de->timer_fd != -1 && pollfds[2].revents)
+		{
+			uint64_t expirations = 0;
+			if (read(de->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+				LOG_E(LOG_CAT_GEN, "Unexpected timer read\n");
+		}
 
-			if (frame)
-			{
-				if (de->is_egl)
-					do_display(de, es, frame);
-				else
-					do_display_dmabuf(es, frame);
-				av_frame_free(&de->q_this);
-				de->q_this = frame;
-			}
+		if (pollfds[3].revents)
+		{
+#if HAS_DRM_SYNCOBJ
+			if (de->sync_surface != NULL)
+				w_sync_service(de);
+			else
+#endif
+				fence_q_reap(de, false);
 		}
+
+		if (pollfds[0].revents || (de->timer_fd != -1 && pollfds[2].revents))
+			display_service(de, es);
 	}
 
-#if TRACE_ALL
-	LOG(">>> %s\n", __func__);
-#endif
+	frame_cb_cancel(de);
+	pres_fb_uninit(de);
+	fence_q_uninit(de);
+	if (de->is_egl)
+	{
+		unsigned int i;
+
+		egl_aux_flush(&de->aux);
+		for (i = 0; i != de->mosaic_n; ++i)
+			egl_aux_flush(&de->tiles[i].aux);
+		headless_fbo_uninit(de);
+	}
+
+	LOG_D(LOG_CAT_GEN, ">>> %s\n", __func__);
 
 	return NULL;
 
 fail:
-#if TRACE_ALL
-	LOG(">>> %s: FAIL\n", __func__);
-#endif
+	LOG_E(LOG_CAT_GEN, ">>> %s: FAIL\n", __func__);
 	de->q_terminate = 1;
-	sem_post(&de->display_start_sem);
+	sem_post(&de->display_ready_sem);
 
 	return NULL;
 }
@@ -894,18 +3313,22 @@ static void xdg_toplevel_handle_configure(void *data,
 	(void)xdg_toplevel;
 	uint32_t * p;
 
-	LOG("%s: %dx%d\n", __func__, w, h);
+	LOG_D(LOG_CAT_WL, "%s: %dx%d\n", __func__, w, h);
 
 	wl_array_for_each(p, states) {
-		LOG("  [] %"PRId32"\n", *p);
+		LOG_D(LOG_CAT_WL, "  [] %"PRId32"\n", *p);
 	}
 
 	// no window geometry event, ignore
 	if (w == 0 && h == 0)
 		return;
 
+	if (w == es->req_w && h == es->req_h)
+		return;
+
 	es->req_h = h;
 	es->req_w = w;
+	++es->req_gen;
 }
 
 static void xdg_toplevel_handle_close(void *data,
@@ -925,7 +3348,7 @@ xdg_toplevel_configure_bounds_cb(void *data,
 			 int32_t height)
 {
 	(void)data;
-	LOG("%s[%p]: %dx%d\n", __func__, (void*)xdg_toplevel, width, height);
+	LOG_D(LOG_CAT_WL, "%s[%p]: %dx%d\n", __func__, (void*)xdg_toplevel, width, height);
 }
 
 /**
@@ -960,10 +3383,10 @@ static void xdg_toplevel_wm_capabilities_cb(void *data,
 			struct wl_array *capabilities)
 {
 	(void)data;
-	LOG("%s[%p]:\n", __func__, (void*)xdg_toplevel);
+	LOG_D(LOG_CAT_WL, "%s[%p]:\n", __func__, (void*)xdg_toplevel);
 	for (size_t i = 0; i != capabilities->size / 4; ++i) {
 		uint32_t cap = ((const uint32_t *)capabilities->data)[i];
-		LOG("  [%zd]: %"PRId32"\n", i, cap);
+		LOG_D(LOG_CAT_WL, "  [%zd]: %"PRId32"\n", i, cap);
 	}
 }
 
@@ -980,7 +3403,7 @@ static void xdg_surface_configure(void *data, struct xdg_surface *xdg_surface,
 {
 	struct egl_wayland_out_env * const de = data;
 //	struct _escontext *const es = de->es;
-	LOG("%s\n", __func__);
+	LOG_D(LOG_CAT_WL, "%s\n", __func__);
 	// confirm that you exist to the compositor
 	xdg_surface_ack_configure(xdg_surface, serial);
 
@@ -1010,14 +3433,14 @@ const struct xdg_wm_base_listener xdg_wm_base_listener = {
 
 void CreateNativeWindow(struct _escontext * const es, char *title)
 {
+	struct wl_region *const region = wl_compositor_create_region(es->w_compositor);
 	(void)title;
 
-	region = wl_compositor_create_region(es->w_compositor);
-
 	wl_region_add(region, 0, 0, es->req_w, es->req_h);
 	wl_surface_set_opaque_region(es->w_surface, region);
+	wl_region_destroy(region);
 
-	LOG("%s: %dx%d\n", __func__, es->req_w, es->req_h);
+	LOG_I(LOG_CAT_WL, "%s: %dx%d\n", __func__, es->req_w, es->req_h);
 	es->window_width = es->req_w;
 	es->window_height = es->req_h;
 }
@@ -1043,33 +3466,33 @@ EGLBoolean CreateEGLContext(struct _escontext * const es)
 	EGLDisplay display = eglGetDisplay(es->native_display);
 	if (display == EGL_NO_DISPLAY)
 	{
-		LOG("No EGL Display...\n");
+		LOG_E(LOG_CAT_EGL, "No EGL Display...\n");
 		return EGL_FALSE;
 	}
 
 	// Initialize EGL
 	if (!eglInitialize(display, &majorVersion, &minorVersion))
 	{
-		LOG("No Initialisation...\n");
+		LOG_E(LOG_CAT_EGL, "No Initialisation...\n");
 		return EGL_FALSE;
 	}
 
-	LOG("EGL init: version %d.%d\n", majorVersion, minorVersion);
+	LOG_I(LOG_CAT_EGL, "EGL init: version %d.%d\n", majorVersion, minorVersion);
 
 	eglBindAPI(EGL_OPENGL_ES_API);
 
 	// Get configs
 	if ((eglGetConfigs(display, NULL, 0, &numConfigs) != EGL_TRUE) || (numConfigs == 0))
 	{
-		LOG("No configuration...\n");
+		LOG_E(LOG_CAT_EGL, "No configuration...\n");
 		return EGL_FALSE;
 	}
-	LOG("GL Configs: %d\n", numConfigs);
+	LOG_I(LOG_CAT_EGL, "GL Configs: %d\n", numConfigs);
 
 	// Choose config
 	if ((eglChooseConfig(display, fbAttribs, &config, 1, &numConfigs) != EGL_TRUE) || (numConfigs != 1))
 	{
-		LOG("No configuration...\n");
+		LOG_E(LOG_CAT_EGL, "No configuration...\n");
 		return EGL_FALSE;
 	}
 
@@ -1078,17 +3501,17 @@ EGLBoolean CreateEGLContext(struct _escontext * const es)
 
 	if (es->native_window == EGL_NO_SURFACE)
 	{
-		LOG("No window !?\n");
+		LOG_E(LOG_CAT_EGL, "No window !?\n");
 		return EGL_FALSE;
 	}
 	else
-		LOG("Window created !\n");
+		LOG_I(LOG_CAT_EGL, "Window created !\n");
 
 	// Create a surface
 	surface = eglCreateWindowSurface(display, config, es->native_window, NULL);
 	if (surface == EGL_NO_SURFACE)
 	{
-		LOG("No surface...\n");
+		LOG_E(LOG_CAT_EGL, "No surface...\n");
 		return EGL_FALSE;
 	}
 
@@ -1096,7 +3519,8 @@ EGLBoolean CreateEGLContext(struct _escontext * const es)
 	context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
 	if (context == EGL_NO_CONTEXT)
 	{
-		LOG("No context...\n");
+		LOG_E(LOG_CAT_EGL, "No context...\n");
+		eglDestroySurface(display, surface);
 		return EGL_FALSE;
 	}
 
@@ -1117,40 +3541,286 @@ static void CreateWindowForDmaBuf(struct _escontext * const es, char *title)
 	CreateNativeWindow(es, title);
 }
 
+// No compositor: EGL_MESA_platform_surfaceless if we have it (drawing into
+// an FBO), else a pbuffer on the default display
+static EGLBoolean CreateHeadlessEGLContext(struct _escontext * const es)
+{
+	EGLint numConfigs;
+	EGLint majorVersion;
+	EGLint minorVersion;
+	EGLConfig config;
+	EGLDisplay display = EGL_NO_DISPLAY;
+	bool surfaceless = false;
+	EGLint fbAttribs[] =
+	{
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_RED_SIZE,   	 8,
+		EGL_GREEN_SIZE, 	 8,
+		EGL_BLUE_SIZE,  	 8,
+		EGL_NONE
+	};
+	const EGLint pbAttribs[] = { EGL_WIDTH, es->window_width, EGL_HEIGHT, es->window_height, EGL_NONE };
+	EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE, EGL_NONE };
+
+	if (epoxy_has_egl_extension(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless"))
+		display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (display != EGL_NO_DISPLAY && eglInitialize(display, &majorVersion, &minorVersion))
+		surfaceless = epoxy_has_egl_extension(display, "EGL_KHR_surfaceless_context");
+	else if ((display = eglGetDisplay(EGL_DEFAULT_DISPLAY)) == EGL_NO_DISPLAY ||
+		 !eglInitialize(display, &majorVersion, &minorVersion))
+	{
+		LOG_E(LOG_CAT_EGL, "No EGL Display...\n");
+		return EGL_FALSE;
+	}
+
+	LOG_I(LOG_CAT_EGL, "EGL init: version %d.%d, %s\n", majorVersion, minorVersion, surfaceless ? "surfaceless" : "pbuffer");
+
+	eglBindAPI(EGL_OPENGL_ES_API);
+
+	if (surfaceless)
+		fbAttribs[1] = 0;  // Any
+	if ((eglChooseConfig(display, fbAttribs, &config, 1, &numConfigs) != EGL_TRUE) || (numConfigs != 1))
+	{
+		LOG_E(LOG_CAT_EGL, "No configuration...\n");
+		return EGL_FALSE;
+	}
+
+	es->surface = EGL_NO_SURFACE;
+	if (!surfaceless &&
+	    (es->surface = eglCreatePbufferSurface(display, config, pbAttribs)) == EGL_NO_SURFACE)
+	{
+		LOG_E(LOG_CAT_EGL, "No surface...\n");
+		return EGL_FALSE;
+	}
+
+	if ((es->context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs)) == EGL_NO_CONTEXT)
+	{
+		LOG_E(LOG_CAT_EGL, "No context...\n");
+		if (es->surface != EGL_NO_SURFACE)
+			eglDestroySurface(display, es->surface);
+		return EGL_FALSE;
+	}
+
+	es->display = display;
+	return EGL_TRUE;
+}
+
 unsigned long last_click = 0;
-void RefreshWindow()
+
+// Pre-v4 format events - only arrive during startup. Each output starts
+// with a copy.
+static void
+dmabuf_fmts_note(wo_conn_t * const conn, const uint32_t format, const uint64_t modifier)
 {
-	eglSwapBuffers(ESContext.display, ESContext.surface);
+	if (conn->dmabuf_fmts == NULL && (conn->dmabuf_fmts = dmabuf_fmts_new()) == NULL)
+		return;
+	dmabuf_fmts_add(conn->dmabuf_fmts, format, modifier, 0);
 }
 
 static void linux_dmabuf_v1_listener_format(void *data,
 			   struct zwp_linux_dmabuf_v1 *zwp_linux_dmabuf_v1,
 			   uint32_t format)
 {
-	// Superceeded by _modifier
-	struct _escontext * const es = data;
-	(void)zwp_linux_dmabuf_v1;
-	(void)format;
-	printf("%s[%p], %s\n", __func__, (void*)es, av_fourcc2str(format));
+	// Superceeded by _modifier
+	wo_conn_t * const conn = data;
+	(void)zwp_linux_dmabuf_v1;
+	(void)format;
+	LOG_T(LOG_CAT_DMABUF, "%s[%p], %s\n", __func__, (void*)conn, av_fourcc2str(format));
+	dmabuf_fmts_note(conn, format, DRM_MOD_INVALID);
+}
+
+static void
+linux_dmabuf_v1_listener_modifier(void *data,
+		 struct zwp_linux_dmabuf_v1 *zwp_linux_dmabuf_v1,
+		 uint32_t format,
+		 uint32_t modifier_hi,
+		 uint32_t modifier_lo)
+{
+	wo_conn_t * const conn = data;
+	(void)zwp_linux_dmabuf_v1;
+
+	LOG_T(LOG_CAT_DMABUF, "%s[%p], %s %08x%08x\n", __func__, (void*)conn, av_fourcc2str(format), modifier_hi, modifier_lo);
+	dmabuf_fmts_note(conn, format, ((uint64_t)modifier_hi << 32) | modifier_lo);
+}
+
+static const struct zwp_linux_dmabuf_v1_listener linux_dmabuf_v1_listener = {
+	.format = linux_dmabuf_v1_listener_format,
+	.modifier = linux_dmabuf_v1_listener_modifier,
+};
+
+static void
+presentation_clock_id(void *data, struct wp_presentation *wp_presentation, uint32_t clk_id)
+{
+	wo_conn_t * const conn = data;
+	(void)wp_presentation;
+
+	LOG_I(LOG_CAT_PRES, "%s: clock %"PRIu32"\n", __func__, clk_id);
+	conn->pres_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	.clock_id = presentation_clock_id,
+};
+
+static void
+dmabuf_fb_table_unmap(egl_wayland_out_env_t *const de)
+{
+	if (de->fb_table != NULL)
+		munmap((void *)de->fb_table, de->fb_table_size);
+	de->fb_table = NULL;
+	de->fb_table_size = 0;
+}
+
+static void
+dmabuf_fb_format_table(void *data, struct zwp_linux_dmabuf_feedback_v1 *fb, int32_t fd, uint32_t size)
+{
+	egl_wayland_out_env_t *const de = data;
+	void *table;
+	(void)fb;
+
+	dmabuf_fb_table_unmap(de);
+	// Must be mapped private - it is shared with everyone else
+	table = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED)
+	{
+		LOG_E(LOG_CAT_DMABUF, "%s: Failed to map format table: %s\n", __func__, strerror(errno));
+		return;
+	}
+	de->fb_table = table;
+	de->fb_table_size = size;
+}
+
+static void
+dmabuf_fb_main_device(void *data, struct zwp_linux_dmabuf_feedback_v1 *fb, struct wl_array *device)
+{
+	egl_wayland_out_env_t *const de = data;
+	(void)fb;
+
+	if (device->size == sizeof(dev_t))
+		memcpy(&de->es->dmabuf_main_dev, device->data, sizeof(dev_t));
+}
+
+static void
+dmabuf_fb_tranche_target_device(void *data, struct zwp_linux_dmabuf_feedback_v1 *fb, struct wl_array *device)
+{
+	egl_wayland_out_env_t *const de = data;
+	(void)fb;
+
+	if (device->size == sizeof(dev_t))
+		memcpy(&de->fb_tranche_dev, device->data, sizeof(dev_t));
+}
+
+static void
+dmabuf_fb_tranche_formats(void *data, struct zwp_linux_dmabuf_feedback_v1 *fb, struct wl_array *indices)
+{
+	egl_wayland_out_env_t *const de = data;
+	void *const p = wl_array_add(&de->fb_tranche_idx, indices->size);
+	(void)fb;
+
+	if (p != NULL)
+		memcpy(p, indices->data, indices->size);
+}
+
+static void
+dmabuf_fb_tranche_flags(void *data, struct zwp_linux_dmabuf_feedback_v1 *fb, uint32_t flags)
+{
+	egl_wayland_out_env_t *const de = data;
+	(void)fb;
+
+	de->fb_tranche_flags = flags;
+}
+
+// Tranche events can come in any order so only act on them here
+static void
+dmabuf_fb_tranche_done(void *data, struct zwp_linux_dmabuf_feedback_v1 *fb)
+{
+	egl_wayland_out_env_t *const de = data;
+	const size_t table_n = de->fb_table_size / sizeof(dmabuf_fmt_table_ent_t);
+	const unsigned int flags = (de->fb_tranche_flags & ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT) != 0 ?
+		DMABUF_FMT_FLAG_SCANOUT : 0;
+	const uint16_t *idx;
+	(void)fb;
+
+	if (de->fb_fmts == NULL && (de->fb_fmts = dmabuf_fmts_new()) == NULL)
+		return;
+
+	wl_array_for_each(idx, &de->fb_tranche_idx)
+	{
+		if (*idx < table_n)
+			dmabuf_fmts_add(de->fb_fmts, de->fb_table[*idx].format, de->fb_table[*idx].modifier, flags);
+	}
+
+	LOG_I(LOG_CAT_DMABUF, "%s: dev %u:%u, flags %#x, %zu formats\n", __func__,
+	    major(de->fb_tranche_dev), minor(de->fb_tranche_dev), de->fb_tranche_flags,
+	    de->fb_tranche_idx.size / sizeof(uint16_t));
+
+	de->fb_tranche_idx.size = 0;
+	de->fb_tranche_flags = 0;
+	de->fb_tranche_dev = de->es->dmabuf_main_dev;
+}
+
+// End of a complete set of feedback - replaces everything we had before
+static void
+dmabuf_fb_done(void *data, struct zwp_linux_dmabuf_feedback_v1 *fb)
+{
+	egl_wayland_out_env_t *const de = data;
+	struct _escontext *const es = de->es;
+	dmabuf_fmts_t *const fmts = de->fb_fmts;
+	(void)fb;
+
+	if (fmts == NULL)
+		return;
+
+	de->fb_fmts = es->dmabuf_fmts;
+	es->dmabuf_fmts = fmts;
+	++es->fmts_gen;
+
+	if (de->fb_fmts != NULL)
+		dmabuf_fmts_clear(de->fb_fmts);
+
+	LOG_I(LOG_CAT_DMABUF, "%s: main dev %u:%u, %u format/modifier pairs\n", __func__,
+	    major(es->dmabuf_main_dev), minor(es->dmabuf_main_dev), dmabuf_fmts_count(fmts));
+}
+
+static const struct zwp_linux_dmabuf_feedback_v1_listener dmabuf_fb_listener = {
+	.done = dmabuf_fb_done,
+	.format_table = dmabuf_fb_format_table,
+	.main_device = dmabuf_fb_main_device,
+	.tranche_done = dmabuf_fb_tranche_done,
+	.tranche_target_device = dmabuf_fb_tranche_target_device,
+	.tranche_formats = dmabuf_fb_tranche_formats,
+	.tranche_flags = dmabuf_fb_tranche_flags,
+};
+
+static void
+dmabuf_fb_uninit(egl_wayland_out_env_t *const de)
+{
+	if (de->dmabuf_fb != NULL)
+		zwp_linux_dmabuf_feedback_v1_destroy(de->dmabuf_fb);
+	de->dmabuf_fb = NULL;
+	dmabuf_fb_table_unmap(de);
+	wl_array_release(&de->fb_tranche_idx);
+	dmabuf_fmts_delete(&de->fb_fmts);
 }
 
+// (Re)start surface feedback on the surface the video goes on
 static void
-linux_dmabuf_v1_listener_modifier(void *data,
-		 struct zwp_linux_dmabuf_v1 *zwp_linux_dmabuf_v1,
-		 uint32_t format,
-		 uint32_t modifier_hi,
-		 uint32_t modifier_lo)
+dmabuf_fb_attach(egl_wayland_out_env_t *const de, struct wl_surface *const surface)
 {
-	struct _escontext * const es = data;
-	(void)zwp_linux_dmabuf_v1;
+	struct _escontext *const es = de->es;
 
-	printf("%s[%p], %s %08x%08x\n", __func__, (void*)es, av_fourcc2str(format), modifier_hi, modifier_lo);
+	dmabuf_fb_uninit(de);
+	wl_array_init(&de->fb_tranche_idx);
+
+	if (es->linux_dmabuf_v1_bind == NULL ||
+	    zwp_linux_dmabuf_v1_get_version(es->linux_dmabuf_v1_bind) < ZWP_LINUX_DMABUF_V1_GET_SURFACE_FEEDBACK_SINCE_VERSION)
+		return;
+	de->dmabuf_fb = zwp_linux_dmabuf_v1_get_surface_feedback(es->linux_dmabuf_v1_bind, surface);
+	zwp_linux_dmabuf_feedback_v1_add_listener(de->dmabuf_fb, &dmabuf_fb_listener, de);
 }
 
-static const struct zwp_linux_dmabuf_v1_listener linux_dmabuf_v1_listener = {
-	.format = linux_dmabuf_v1_listener_format,
-	.modifier = linux_dmabuf_v1_listener_modifier,
-};
 
 static void
 decoration_configure(void *data,
@@ -1158,7 +3828,7 @@ decoration_configure(void *data,
 			  uint32_t mode)
 {
 	(void)data;
-	printf("%s[%p]: mode %d\n", __func__, (void*)zxdg_toplevel_decoration_v1, mode);
+	LOG_D(LOG_CAT_WL, "%s[%p]: mode %d\n", __func__, (void*)zxdg_toplevel_decoration_v1, mode);
 	zxdg_toplevel_decoration_v1_destroy(zxdg_toplevel_decoration_v1);
 }
 
@@ -1166,32 +3836,57 @@ static struct zxdg_toplevel_decoration_v1_listener decoration_listener = {
 	.configure = decoration_configure,
 };
 
+static void
+shm_listener_format(void *data, struct wl_shm *wl_shm, uint32_t format)
+{
+	wo_conn_t * const conn = data;
+	(void)wl_shm;
+
+	if (conn->shm_fmts == NULL && (conn->shm_fmts = dmabuf_fmts_new()) == NULL)
+		return;
+	dmabuf_fmts_add(conn->shm_fmts, format, 0, 0);
+}
+
+static const struct wl_shm_listener shm_listener = {
+	.format = shm_listener_format,
+};
+
 static void global_registry_handler(void *data, struct wl_registry *registry, uint32_t id,
 									const char *interface, uint32_t version)
 {
-	struct _escontext * const es = data;
-	(void)version;
+	wo_conn_t * const conn = data;
 
-	LOG("Got a registry event for %s id %d\n", interface, id);
+	LOG_D(LOG_CAT_WL, "Got a registry event for %s id %d\n", interface, id);
 	if (strcmp(interface, wl_compositor_interface.name) == 0)
-		es->w_compositor = wl_registry_bind(registry, id, &wl_compositor_interface, 4);
+		conn->w_compositor = wl_registry_bind(registry, id, &wl_compositor_interface, 4);
 	if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0) {
-		es->linux_dmabuf_v1_bind = wl_registry_bind(registry, id, &zwp_linux_dmabuf_v1_interface, 1);
-		zwp_linux_dmabuf_v1_add_listener(es->linux_dmabuf_v1_bind, &linux_dmabuf_v1_listener, es);
+		// v2 gives us create_immed, v3 modifier events, v4 feedback
+		conn->linux_dmabuf_v1_bind = wl_registry_bind(registry, id, &zwp_linux_dmabuf_v1_interface, version < 4 ? version : 4);
+		zwp_linux_dmabuf_v1_add_listener(conn->linux_dmabuf_v1_bind, &linux_dmabuf_v1_listener, conn);
+	}
+	if (strcmp(interface, wl_shm_interface.name) == 0) {
+		conn->w_shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
+		wl_shm_add_listener(conn->w_shm, &shm_listener, conn);
 	}
-	if (strcmp(interface, wl_shm_interface.name) == 0)
-		es->w_shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
 	if (strcmp(interface, wl_subcompositor_interface.name) == 0)
-		es->w_subcompositor = wl_registry_bind(registry, id, &wl_subcompositor_interface, 1);
+		conn->w_subcompositor = wl_registry_bind(registry, id, &wl_subcompositor_interface, 1);
 	if (strcmp(interface, xdg_wm_base_interface.name) == 0)
 	{
-		XDGWMBase = wl_registry_bind(registry, id, &xdg_wm_base_interface, 1);
-		xdg_wm_base_add_listener(XDGWMBase, &xdg_wm_base_listener, NULL);
+		conn->x_wm_base = wl_registry_bind(registry, id, &xdg_wm_base_interface, 1);
+		xdg_wm_base_add_listener(conn->x_wm_base, &xdg_wm_base_listener, NULL);
 	}
 	if (strcmp(interface, zxdg_decoration_manager_v1_interface.name) == 0)
-		es->x_decoration = wl_registry_bind(registry, id, &zxdg_decoration_manager_v1_interface, 1);
+		conn->x_decoration = wl_registry_bind(registry, id, &zxdg_decoration_manager_v1_interface, 1);
 	if (strcmp(interface, wp_viewporter_interface.name) == 0)
-		es->w_viewporter = wl_registry_bind(registry, id, &wp_viewporter_interface, 1);
+		conn->w_viewporter = wl_registry_bind(registry, id, &wp_viewporter_interface, 1);
+	if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		conn->w_presentation = wl_registry_bind(registry, id, &wp_presentation_interface, 1);
+		wp_presentation_add_listener(conn->w_presentation, &presentation_listener, conn);
+	}
+#if HAS_DRM_SYNCOBJ
+	if (strcmp(interface, wp_linux_drm_syncobj_manager_v1_interface.name) == 0)
+		conn->w_syncobj_manager = wl_registry_bind(registry, id, &wp_linux_drm_syncobj_manager_v1_interface, 1);
+#endif
 }
 
 static void global_registry_remover(void *data, struct wl_registry *registry, uint32_t id)
@@ -1199,7 +3894,7 @@ static void global_registry_remover(void *data, struct wl_registry *registry, ui
 	(void)data;
 	(void)registry;
 
-	LOG("Got a registry losing event for %d\n", id);
+	LOG_D(LOG_CAT_WL, "Got a registry losing event for %d\n", id);
 }
 
 const struct wl_registry_listener listener = {
@@ -1208,20 +3903,78 @@ const struct wl_registry_listener listener = {
 };
 
 static void
-get_server_references(struct _escontext * const es)
+server_references_unref(wo_conn_t **const pconn)
 {
+	wo_conn_t *const conn = *pconn;
+	void *globals[] = {
+		conn->w_compositor, conn->w_subcompositor, conn->linux_dmabuf_v1_bind, conn->w_shm,
+		conn->x_wm_base, conn->x_decoration, conn->w_viewporter, conn->w_presentation,
+#if HAS_DRM_SYNCOBJ
+		conn->w_syncobj_manager,
+#endif
+		conn->registry
+	};
+	unsigned int i;
+
+	*pconn = NULL;
+	pthread_mutex_lock(&conn_lock);
+	if (--conn->ref_count != 0)
+	{
+		pthread_mutex_unlock(&conn_lock);
+		return;
+	}
+	conn_shared = NULL;
+	pthread_mutex_unlock(&conn_lock);
+
+	for (i = 0; i != sizeof(globals) / sizeof(globals[0]); ++i)
+	{
+		if (globals[i] != NULL)
+			wl_proxy_destroy(globals[i]);
+	}
+	dmabuf_fmts_delete(&conn->dmabuf_fmts);
+	dmabuf_fmts_delete(&conn->shm_fmts);
+	wl_display_disconnect(conn->display);
+	LOG_I(LOG_CAT_WL, "Display disconnected !\n");
+	free(conn);
+}
+
+// Returns a ref to the process' connection, making it if need be, or NULL
+// if there is no compositor
+static wo_conn_t *
+get_server_references(void)
+{
+	wo_conn_t *conn;
+
+	pthread_mutex_lock(&conn_lock);
+	if ((conn = conn_shared) != NULL)
+	{
+		++conn->ref_count;
+		pthread_mutex_unlock(&conn_lock);
+		return conn;
+	}
 
 	struct wl_display *display = wl_display_connect(NULL);
 	if (display == NULL)
 	{
-		LOG("Can't connect to wayland display !?\n");
-		exit(1);
+		LOG_E(LOG_CAT_WL, "Can't connect to wayland display !?\n");
+		pthread_mutex_unlock(&conn_lock);
+		return NULL;
+	}
+
+	if ((conn = calloc(1, sizeof(*conn))) == NULL)
+	{
+		LOG_E(LOG_CAT_WL, "%s: Out of memory\n", __func__);
+		wl_display_disconnect(display);
+		pthread_mutex_unlock(&conn_lock);
+		return NULL;
 	}
-	LOG("Got a display !");
+	conn->ref_count = 1;
+	conn->pres_clock = CLOCK_MONOTONIC;
+	LOG_D(LOG_CAT_WL, "Got a display !");
 
-	struct wl_registry *wl_registry =
-		wl_display_get_registry(display);
-	wl_registry_add_listener(wl_registry, &listener, &ESContext);
+	conn->display = display;
+	conn->registry = wl_display_get_registry(display);
+	wl_registry_add_listener(conn->registry, &listener, conn);
 
 	// This call the attached listener global_registry_handler
 	wl_display_dispatch(display);
@@ -1229,26 +3982,80 @@ get_server_references(struct _escontext * const es)
 
 	// If at this point, global_registry_handler didn't set the
 	// compositor, nor the shell, bailout !
-	if (es->w_compositor == NULL || XDGWMBase == NULL)
+	if (conn->w_compositor == NULL || conn->x_wm_base == NULL)
 	{
-		LOG("No compositor !? No XDG !! There's NOTHING in here !\n");
-		exit(1);
+		LOG_E(LOG_CAT_WL, "No compositor !? No XDG !! There's NOTHING in here !\n");
+		pthread_mutex_unlock(&conn_lock);
+		server_references_unref(&conn);
+		return NULL;
 	}
 	else
 	{
-		LOG("Okay, we got a compositor and a shell... That's something !\n");
-		es->native_display = display;
+		LOG_D(LOG_CAT_WL, "Okay, we got a compositor and a shell... That's something !\n");
 	}
+
+	conn_shared = conn;
+	pthread_mutex_unlock(&conn_lock);
+	return conn;
+}
+
+// Wrap a global onto the output's queue
+static void *
+conn_wrap(void *const global, struct wl_event_queue *const queue)
+{
+	void *wrapper;
+
+	if (global == NULL || (wrapper = wl_proxy_create_wrapper(global)) == NULL)
+		return NULL;
+	wl_proxy_set_queue(wrapper, queue);
+	return wrapper;
+}
+
+static void
+conn_unwrap(void *const wrapper)
+{
+	if (wrapper != NULL)
+		wl_proxy_wrapper_destroy(wrapper);
 }
 
 void destroy_window(struct _escontext * const es)
 {
-	eglDestroySurface(es->display, es->surface);
-	eglDestroyContext(es->display, es->context);
-	wl_egl_window_destroy(es->native_window);
-	xdg_toplevel_destroy(XDGToplevel);
-	xdg_surface_destroy(XDGSurface);
-	wl_surface_destroy(es->w_surface);
+	// Also copes with a window that failed part way through being made
+	if (es->display != NULL)
+	{
+		eglDestroySurface(es->display, es->surface);
+		eglDestroyContext(es->display, es->context);
+	}
+	if (es->native_window != NULL)
+		wl_egl_window_destroy(es->native_window);
+	if (es->x_toplevel != NULL)
+		xdg_toplevel_destroy(es->x_toplevel);
+	if (es->x_surface != NULL)
+		xdg_surface_destroy(es->x_surface);
+	if (es->w_subsurface2 != NULL)
+	{
+		wp_viewport_destroy(es->w_viewport2);
+		wl_subsurface_destroy(es->w_subsurface2);
+		wl_surface_destroy(es->w_surface2);
+	}
+	if (es->w_viewport != NULL)
+		wp_viewport_destroy(es->w_viewport);
+	if (es->w_surface != NULL)
+		wl_surface_destroy(es->w_surface);
+
+	conn_unwrap(es->w_compositor);
+	conn_unwrap(es->w_subcompositor);
+	conn_unwrap(es->linux_dmabuf_v1_bind);
+	conn_unwrap(es->w_shm);
+	conn_unwrap(es->x_wm_base);
+	conn_unwrap(es->x_decoration);
+	conn_unwrap(es->w_viewporter);
+	conn_unwrap(es->w_presentation);
+#if HAS_DRM_SYNCOBJ
+	conn_unwrap(es->w_syncobj_manager);
+#endif
+	if (es->w_queue != NULL)
+		wl_event_queue_destroy(es->w_queue);
 }
 
 #if 0
@@ -1259,10 +4066,10 @@ int main()
 	surface = wl_compositor_create_surface(compositor);
 	if (surface == NULL)
 	{
-		LOG("No Compositor surface ! Yay....\n");
+		LOG_E(LOG_CAT_WL, "No Compositor surface ! Yay....\n");
 		exit(1);
 	}
-	else LOG("Got a compositor surface !\n");
+	else LOG_D(LOG_CAT_WL, "Got a compositor surface !\n");
 
 	XDGSurface = xdg_wm_base_get_xdg_surface(XDGWMBase, surface);
 
@@ -1287,19 +4094,109 @@ int main()
 
 	destroy_window();
 	wl_display_disconnect(ESContext.native_display);
-	LOG("Display disconnected !\n");
+	LOG_I(LOG_CAT_WL, "Display disconnected !\n");
 
 	exit(0);
 }
 #endif
 
-void egl_wayland_out_modeset(struct egl_wayland_out_env *dpo, int w, int h, AVRational frame_rate)
+static bool
+out_mode_eq(const out_mode_t *const a, const out_mode_t *const b)
+{
+	return a->w == b->w && a->h == b->h &&
+		av_cmp_q(a->sar, b->sar) == 0 && av_cmp_q(a->frame_rate, b->frame_rate) == 0;
+}
+
+// Called for every frame so the unchanged case must be cheap
+// The real work is done by geometry_update on the display thread
+void egl_wayland_out_modeset(struct egl_wayland_out_env *de, int w, int h, AVRational sar, AVRational frame_rate)
+{
+	const out_mode_t mode = {.w = w, .h = h, .sar = sar, .frame_rate = frame_rate};
+
+	if (out_mode_eq(&mode, &de->mode_last))
+		return;
+	de->mode_last = mode;
+
+	LOG_I(LOG_CAT_GEN, "%s: %dx%d sar %d/%d, rate %d/%d\n", __func__, w, h, sar.num, sar.den, frame_rate.num, frame_rate.den);
+
+	pthread_mutex_lock(&de->q_lock);
+	de->mode = mode;
+	pthread_mutex_unlock(&de->q_lock);
+	atomic_fetch_add_explicit(&de->mode_gen, 1, memory_order_release);
+}
+
+void egl_wayland_out_present_mode(struct egl_wayland_out_env *de, enum egl_wayland_out_present_mode mode)
+{
+	// Headless has no frame callbacks to pace with
+	if (!de->is_headless)
+		de->present_mode = mode;
+}
+
+void egl_headless_out_readback(struct egl_wayland_out_env *de, bool enable)
+{
+	const struct _escontext *const es = de->es;
+
+	if (!de->is_headless)
+		return;
+	if (enable && de->hl_pixels == NULL)
+		de->hl_pixels = malloc((size_t)es->window_width * es->window_height * 4);
+	de->hl_readback = enable && de->hl_pixels != NULL;
+}
+
+int egl_headless_out_read(struct egl_wayland_out_env *de, uint8_t *dst, size_t stride)
+{
+	const struct _escontext *const es = de->es;
+	const size_t row = (size_t)es->window_width * 4;
+	int i;
+
+	if (!de->hl_readback)
+		return -EINVAL;
+
+	pthread_mutex_lock(&de->hl_lock);
+	if (!de->hl_have_frame)
+	{
+		pthread_mutex_unlock(&de->hl_lock);
+		return -EAGAIN;
+	}
+	for (i = 0; i != es->window_height; ++i)
+		memcpy(dst + stride * i, de->hl_pixels + row * i, row);
+	pthread_mutex_unlock(&de->hl_lock);
+	return 0;
+}
+
+void egl_wayland_out_explicit_sync(struct egl_wayland_out_env *de, bool enable)
+{
+	de->explicit_sync = enable;
+}
+
+int egl_wayland_out_video_subsurface(struct egl_wayland_out_env *de, bool enable)
+{
+	// GL renders into the window surface itself
+	if (de->is_egl)
+		return -EINVAL;
+	de->want_subsurface = enable;
+	return 0;
+}
+
+void egl_wayland_out_set_queue(struct egl_wayland_out_env *de, unsigned int depth, enum egl_wayland_out_q_policy policy)
 {
-	(void)dpo;
-	(void)w;
-	(void)h;
-	(void)frame_rate;
-	/* NIF */
+	if (depth < 1)
+		depth = 1;
+	if (depth > FRAME_Q_SLOTS)
+		depth = FRAME_Q_SLOTS;
+
+	// Only valid before the first frame so nothing can be in the queue or
+	// waiting on space
+	sem_destroy(&de->q.space);
+	frame_q_init(&de->q, depth, policy);
+}
+
+void egl_wayland_out_pts_sched(struct egl_wayland_out_env *de, AVRational time_base)
+{
+	pthread_mutex_lock(&de->q_lock);
+	de->pts_sched = time_base.num != 0 && time_base.den != 0;
+	de->time_base = time_base;
+	pthread_mutex_unlock(&de->q_lock);
 }
 
 void
@@ -1313,133 +4210,327 @@ display_prod(struct egl_wayland_out_env *de)
 	} while (rv == -1 && errno == EINTR);
 
 	if (rv != sizeof(one))
-		LOG("Event prod failed!\n");
+		LOG_E(LOG_CAT_GEN, "Event prod failed!\n");
 }
 
-int egl_wayland_out_display(struct egl_wayland_out_env *de, AVFrame *src_frame)
+// A new ref to src_frame in a form we can show, NULL if there isn't one
+static AVFrame *
+frame_get(struct egl_wayland_out_env *const de, AVFrame *const src_frame)
 {
 	AVFrame *frame = NULL;
 
-#if TRACE_ALL
-	LOG("<<< %s\n", __func__);
-#endif
-
-	if (src_frame->format == AV_PIX_FMT_DRM_PRIME)
+	if (de->is_shm)
+	{
+		frame = frame_shell_get(de);
+		// Hardware frames have to come down to memory
+		if (frame == NULL ||
+		    ((av_pix_fmt_desc_get(src_frame->format)->flags & AV_PIX_FMT_FLAG_HWACCEL) != 0 ?
+		    av_hwframe_transfer_data(frame, src_frame, 0) != 0 || av_frame_copy_props(frame, src_frame) != 0 :
+		    av_frame_ref(frame, src_frame) != 0))
+		{
+			LOG_E(LOG_CAT_FRAME, "Failed to get frame (format=%d) for shm\n", src_frame->format);
+			frame_shell_put(de, &frame);
+			return NULL;
+		}
+	}
+	else if (src_frame->format == AV_PIX_FMT_DRM_PRIME)
 	{
-		frame = av_frame_alloc();
-		av_frame_ref(frame, src_frame);
+		frame = frame_shell_get(de);
+		if (frame == NULL || av_frame_ref(frame, src_frame) != 0)
+		{
+			LOG_E(LOG_CAT_FRAME, "Failed to ref frame (format=%d)\n", src_frame->format);
+			frame_shell_put(de, &frame);
+			return NULL;
+		}
 	}
 	else if (src_frame->format == AV_PIX_FMT_VAAPI)
 	{
-		frame = av_frame_alloc();
+		frame = frame_shell_get(de);
+		if (frame == NULL)
+			return NULL;
 		frame->format = AV_PIX_FMT_DRM_PRIME;
 		if (av_hwframe_map(frame, src_frame, 0) != 0)
 		{
-			LOG("Failed to map frame (format=%d) to DRM_PRiME\n", src_frame->format);
-			av_frame_free(&frame);
-			return AVERROR(EINVAL);
+			LOG_E(LOG_CAT_FRAME, "Failed to map frame (format=%d) to DRM_PRiME\n", src_frame->format);
+			frame_shell_put(de, &frame);
+			return NULL;
 		}
 	}
 	else
 	{
-		LOG("Frame (format=%d) not DRM_PRiME\n", src_frame->format);
-		return AVERROR(EINVAL);
+		LOG_E(LOG_CAT_FRAME, "Frame (format=%d) not DRM_PRiME\n", src_frame->format);
+		return NULL;
 	}
 
-	// Really hacky sync
-	while (de->show_all && de->q_next)
-	{
-		usleep(3000);
-	}
+	return frame;
+}
+
+int egl_wayland_out_mosaic_display(struct egl_wayland_out_env *de, unsigned int tile, AVFrame *src_frame)
+{
+	AVFrame *frame;
+	AVFrame *old;
+
+	if (tile >= de->mosaic_n || (frame = frame_get(de, src_frame)) == NULL)
+		return AVERROR(EINVAL);
+	trace_frame_queued(frame);
 
 	pthread_mutex_lock(&de->q_lock);
-	{
-		AVFrame *const t = de->q_next;
-		de->q_next = frame;
-		frame = t;
-	}
+	old = de->tiles[tile].frame;
+	de->tiles[tile].frame = frame;
+	if (old != NULL)
+		++de->tiles[tile].dropped;
+	de->mosaic_new = true;
 	pthread_mutex_unlock(&de->q_lock);
 
-	if (frame == NULL)
+	frame_shell_put(de, &old);
+	display_prod(de);
+	return 0;
+}
+
+int egl_wayland_out_display(struct egl_wayland_out_env *de, AVFrame *src_frame)
+{
+	AVFrame *frame;
+	AVFrame *dropped = NULL;
+
+	LOG_T(LOG_CAT_FRAME, "<<< %s\n", __func__);
+
+	if (de->mosaic_n != 0)
+		return egl_wayland_out_mosaic_display(de, 0, src_frame);
+
+	if ((frame = frame_get(de, src_frame)) == NULL)
+		return AVERROR(EINVAL);
+	trace_frame_queued(frame);
+
+	if (frame_q_push(&de->q, &frame, pres_now_ns(de->es), &dropped))
 		display_prod(de);
-	else
-		av_frame_free(&frame);
+	frame_shell_put(de, &dropped);
 
 	return 0;
 }
 
 
+// Everything that doesn't need a display
 static struct egl_wayland_out_env*
-wayland_out_new(const bool is_egl, const bool fullscreen)
+out_env_new(const bool is_egl, const bool is_shm, const unsigned int mosaic_n)
 {
 	struct egl_wayland_out_env *de = calloc(1, sizeof(*de));
-	unsigned int i;
-	struct _escontext * const es = &ESContext;
+	struct _escontext * const es = calloc(1, sizeof(*es));
+	mosaic_tile_t *const tiles = mosaic_n == 0 ? NULL : calloc(mosaic_n, sizeof(*tiles));
+	const int prod_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
-	LOG("<<< %s\n", __func__);
+	if (de == NULL || es == NULL || (mosaic_n != 0 && tiles == NULL) || prod_fd == -1)
+	{
+		LOG_E(LOG_CAT_GEN, "%s: Allocation failed\n", __func__);
+		if (prod_fd != -1)
+			close(prod_fd);
+		free(tiles);
+		free(es);
+		free(de);
+		return NULL;
+	}
 
+	es->sig = ES_SIG;
+	es->pres_clock = CLOCK_MONOTONIC;
 	de->es = es;
-	de->prod_fd = -1;
+	de->prod_fd = prod_fd;
+	de->timer_fd = -1;
+#if HAS_DRM_SYNCOBJ
+	de->drm_fd = -1;
+	de->sync_efd = -1;
+#endif
+	de->commit_lat_ns = PRES_DEFAULT_LAT_NS;
 	de->q_terminate = 0;
 	de->is_egl = is_egl;
+	de->is_shm = is_shm;
+	de->shm_bad_fmt = AV_PIX_FMT_NONE;
+	de->shm_lay.avfmt = AV_PIX_FMT_NONE;
+	pthread_mutex_init(&de->shm_lock, NULL);
+	pthread_mutex_init(&de->hl_lock, NULL);
+	wl_array_init(&de->fb_tranche_idx);
+
+	if (mosaic_n != 0)
+	{
+		de->tiles = tiles;
+		de->mosaic_n = mosaic_n;
+		de->mosaic_cols = 1;
+		while (de->mosaic_cols * de->mosaic_cols < mosaic_n)
+			++de->mosaic_cols;
+		de->mosaic_rows = (mosaic_n + de->mosaic_cols - 1) / de->mosaic_cols;
+	}
 
 	es->req_w = WINDOW_WIDTH;
 	es->req_h = WINDOW_HEIGHT;
+	// Force a geometry update on the first frame
+	de->geo_req_gen = es->req_gen - 1;
 
 	pthread_mutex_init(&de->q_lock, NULL);
+	pthread_mutex_init(&de->shell_lock, NULL);
+	// Default is the old single slot that always holds the newest frame
+	frame_q_init(&de->q, 1, EGL_WAYLAND_OUT_Q_DROP_OLDEST);
 	sem_init(&de->display_start_sem, 0, 0);
+	sem_init(&de->display_ready_sem, 0, 0);
+
+	return de;
+}
+
+// Only for failures before the display thread is running
+static void
+out_env_free(struct egl_wayland_out_env *const de)
+{
+	struct _escontext *const es = de->es;
+
+	if (de->is_headless)
+	{
+		if (es->surface != EGL_NO_SURFACE)
+			eglDestroySurface(es->display, es->surface);
+		if (es->context != EGL_NO_CONTEXT)
+			eglDestroyContext(es->display, es->context);
+	}
+	else if (es->conn != NULL)
+	{
+		dmabuf_fb_uninit(de);
+		destroy_window(es);
+		server_references_unref(&es->conn);
+	}
+	close(de->prod_fd);
+	frame_q_uninit(&de->q);
+	sem_destroy(&de->display_ready_sem);
+	sem_destroy(&de->display_start_sem);
+	pthread_mutex_destroy(&de->shell_lock);
+	dmabuf_fmts_delete(&de->es->dmabuf_fmts);
+	free(de->tiles);
+	free(de->es);
+	free(de);
+}
+
+// Start the display thread and wait for it to be ready
+static struct egl_wayland_out_env*
+out_env_start(struct egl_wayland_out_env *const de)
+{
+	struct _escontext * const es = de->es;
+
+	// We can only time commits if our timer runs on the presentation clock
+	if (es->w_presentation == NULL)
+		LOG_W(LOG_CAT_PRES, "%s: No wp_presentation - frames will not be scheduled\n", __func__);
+	else if ((de->timer_fd = timerfd_create(es->pres_clock, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+		LOG_W(LOG_CAT_PRES, "%s: Can't make timer on clock %d - frames will not be scheduled\n", __func__, (int)es->pres_clock);
+
+	if (pthread_create(&de->q_thread, NULL, display_thread, de) != 0)
+	{
+		LOG_E(LOG_CAT_GEN, "%s: Can't start display thread\n", __func__);
+		if (de->timer_fd != -1)
+			close(de->timer_fd);
+		out_env_free(de);
+		return NULL;
+	}
+
+	// The thread says whether its setup worked; q_terminate is only looked
+	// at once it has
+	sem_wait(&de->display_ready_sem);
+
+	if (de->q_terminate)
+	{
+		LOG_E(LOG_CAT_GEN, "%s: Display startup failure\n", __func__);
+		// The thread has given up - delete joins it and undoes the rest
+		egl_wayland_out_delete(de);
+		return NULL;
+	}
+
+	// And the first configure - usually had by wayland_out_new's roundtrip
+	// already, else the display thread will dispatch it
+	if (!de->is_headless)
+		sem_wait(&de->display_start_sem);
+
+	LOG_D(LOG_CAT_GEN, ">>> %s\n", __func__);
+
+	program_alive = true;
+
+	return de;
+}
+
+static struct egl_wayland_out_env*
+wayland_out_new(const bool is_egl, const bool is_shm, const bool fullscreen, const unsigned int mosaic_n)
+{
+	struct egl_wayland_out_env *const de = out_env_new(is_egl, is_shm, mosaic_n);
+	struct _escontext * es;
+	wo_conn_t *conn;
+
+	LOG_D(LOG_CAT_GEN, "<<< %s\n", __func__);
 
-	get_server_references(es);
+	if (de == NULL)
+		return NULL;
+	es = de->es;
+	if ((conn = get_server_references()) == NULL)
+	{
+		out_env_free(de);
+		return NULL;
+	}
+	es->conn = conn;
+	es->native_display = conn->display;
+	es->w_queue = wl_display_create_queue(conn->display);
+	es->w_compositor = conn_wrap(conn->w_compositor, es->w_queue);
+	es->w_subcompositor = conn_wrap(conn->w_subcompositor, es->w_queue);
+	es->linux_dmabuf_v1_bind = conn_wrap(conn->linux_dmabuf_v1_bind, es->w_queue);
+	es->w_shm = conn_wrap(conn->w_shm, es->w_queue);
+	es->x_wm_base = conn_wrap(conn->x_wm_base, es->w_queue);
+	es->x_decoration = conn_wrap(conn->x_decoration, es->w_queue);
+	es->w_viewporter = conn_wrap(conn->w_viewporter, es->w_queue);
+	es->w_presentation = conn_wrap(conn->w_presentation, es->w_queue);
+#if HAS_DRM_SYNCOBJ
+	es->w_syncobj_manager = conn_wrap(conn->w_syncobj_manager, es->w_queue);
+#endif
+	// Startup events have all been had by now
+	pthread_mutex_lock(&conn_lock);
+	es->pres_clock = conn->pres_clock;
+	es->shm_fmts = conn->shm_fmts;
+	es->dmabuf_fmts = dmabuf_fmts_copy(conn->dmabuf_fmts);
+	pthread_mutex_unlock(&conn_lock);
 
 	es->w_surface = wl_compositor_create_surface(es->w_compositor);
 	if (es->w_surface == NULL)
 	{
-		LOG("No Compositor surface ! Yay....\n");
-		exit(1);
+		LOG_E(LOG_CAT_WL, "No Compositor surface ! Yay....\n");
+		out_env_free(de);
+		return NULL;
 	}
 	else
-		LOG("Got a compositor surface !\n");
+		LOG_D(LOG_CAT_WL, "Got a compositor surface !\n");
 
 	es->w_viewport = wp_viewporter_get_viewport(es->w_viewporter, es->w_surface);
-	XDGSurface = xdg_wm_base_get_xdg_surface(XDGWMBase, es->w_surface);
+	de->v_surface = es->w_surface;
+	de->v_viewport = es->w_viewport;
 
-	xdg_surface_add_listener(XDGSurface, &xdg_surface_listener, de);
+	// The per-surface feedback tells us which formats can skip the GPU
+	// composite when we are the only thing on screen
+	dmabuf_fb_attach(de, de->v_surface);
+	es->x_surface = xdg_wm_base_get_xdg_surface(es->x_wm_base, es->w_surface);
 
-	XDGToplevel = xdg_surface_get_toplevel(XDGSurface);
-	xdg_toplevel_add_listener(XDGToplevel, &xdg_toplevel_listener, es);
+	xdg_surface_add_listener(es->x_surface, &xdg_surface_listener, de);
 
-	xdg_toplevel_set_title(XDGToplevel, "Wayland EGL example");
+	es->x_toplevel = xdg_surface_get_toplevel(es->x_surface);
+	xdg_toplevel_add_listener(es->x_toplevel, &xdg_toplevel_listener, es);
+
+	xdg_toplevel_set_title(es->x_toplevel, "Wayland EGL example");
 	if (fullscreen)
-		xdg_toplevel_set_fullscreen(XDGToplevel, NULL);
+		xdg_toplevel_set_fullscreen(es->x_toplevel, NULL);
 
 	if (!es->x_decoration) {
-		LOG("No decoration manager\n");
+		LOG_W(LOG_CAT_WL, "No decoration manager\n");
 	}
 	else {
 		struct zxdg_toplevel_decoration_v1 * const decobj =
-			zxdg_decoration_manager_v1_get_toplevel_decoration(es->x_decoration, XDGToplevel);
+			zxdg_decoration_manager_v1_get_toplevel_decoration(es->x_decoration, es->x_toplevel);
 		zxdg_toplevel_decoration_v1_set_mode(decobj, ZXDG_TOPLEVEL_DECORATION_V1_MODE_SERVER_SIDE);
 		zxdg_toplevel_decoration_v1_add_listener(decobj, &decoration_listener, es);
 	}
 
-#if W_SUBSURFACE
-	es->w_surface2 = wl_compositor_create_surface(es->w_compositor);
-	es->w_subsurface2 = wl_subcompositor_get_subsurface(es->w_subcompositor, es->w_surface2, es->w_surface);
-	wl_subsurface_set_position(es->w_subsurface2, -20, -20);
-	wl_subsurface_place_above(es->w_subsurface2, es->w_surface);
-	wl_subsurface_set_sync(es->w_subsurface2);
-
-	wl_surface_attach(es->w_surface2, draw_frame(es), 0, 0);
-	wl_surface_commit(es->w_surface2);
-#endif
-
 	wl_surface_commit(es->w_surface);
 
-	// This call the attached listener global_registry_handler
-	wl_display_dispatch(es->native_display);
-	wl_display_roundtrip(es->native_display);
+	// Get the first configure. Other outputs' threads may be reading the
+	// connection too so only ever dispatch our own queue.
+	wl_display_roundtrip_queue(es->native_display, es->w_queue);
 
-	LOG("--- post round 2--\n");
+	LOG_D(LOG_CAT_WL, "--- post round 2--\n");
 
 // *****
 
@@ -1450,72 +4541,167 @@ wayland_out_new(const bool is_egl, const bool fullscreen)
 
 // *****
 
-	if (is_egl)
-		CreateWindowWithEGLContext(es, "Nya");
-	else
+	if (!is_egl)
 		CreateWindowForDmaBuf(es, "Dma");
-
-	LOG("<<< %s\n", __func__);
-
-	for (i = 0; i != 32; ++i)
+	else if (!CreateWindowWithEGLContext(es, "Nya"))
 	{
-		de->aux[i].fd = -1;
+		out_env_free(de);
+		return NULL;
 	}
 
-	de->prod_fd = eventfd(0, EFD_NONBLOCK);
+	return out_env_start(de);
+}
 
-	assert(pthread_create(&de->q_thread, NULL, display_thread, de) == 0);
+struct egl_wayland_out_env* egl_wayland_out_new(bool fullscreen)
+{
+	return wayland_out_new(true, false, fullscreen, 0);
+}
 
-	sem_wait(&de->display_start_sem);
+struct egl_wayland_out_env* egl_wayland_out_mosaic_new(bool fullscreen, unsigned int n_tiles)
+{
+	if (n_tiles == 0 || n_tiles > MOSAIC_MAX_TILES)
+		return NULL;
+	return wayland_out_new(true, false, fullscreen, n_tiles);
+}
 
-	if (de->q_terminate)
-	{
-		LOG("%s: Display startup failure\n", __func__);
+struct egl_wayland_out_env* egl_headless_out_new(unsigned int width, unsigned int height)
+{
+	struct egl_wayland_out_env *de;
+	struct _escontext *es;
+
+	if (width == 0 || height == 0 || width > 16384 || height > 16384)
 		return NULL;
-	}
 
-	LOG(">>> %s\n", __func__);
+	if ((de = out_env_new(true, false, 0)) == NULL)
+		return NULL;
+	es = de->es;
+	de->is_headless = true;
+	de->present_mode = EGL_WAYLAND_OUT_PRESENT_IMMEDIATE;
+	es->req_w = es->window_width = width;
+	es->req_h = es->window_height = height;
 
-	program_alive = true;
+	if (!CreateHeadlessEGLContext(es))
+	{
+		out_env_free(de);
+		return NULL;
+	}
 
-	return de;
+	return out_env_start(de);
 }
 
-struct egl_wayland_out_env* egl_wayland_out_new(bool fullscreen)
+struct egl_wayland_out_env* dmabuf_wayland_out_new(bool fullscreen)
 {
-	return wayland_out_new(true, fullscreen);
+	return wayland_out_new(false, false, fullscreen, 0);
 }
 
-struct egl_wayland_out_env* dmabuf_wayland_out_new(bool fullscreen)
+struct egl_wayland_out_env* shm_wayland_out_new(bool fullscreen)
 {
-	return wayland_out_new(false, fullscreen);
+	return wayland_out_new(false, true, fullscreen, 0);
 }
 
 void egl_wayland_out_delete(struct egl_wayland_out_env *de)
 {
-	struct _escontext * const es = &ESContext;
+	struct _escontext * es;
 
 	if (de == NULL)
 		return;
+	es = de->es;
 
-	LOG("<<< %s\n", __func__);
+	LOG_D(LOG_CAT_GEN, "<<< %s\n", __func__);
 
 	de->q_terminate = 1;
 	display_prod(de);
 	pthread_join(de->q_thread, NULL);
+	sem_destroy(&de->display_ready_sem);
+	sem_destroy(&de->display_start_sem);
 	if (de->prod_fd != -1)
 		close(de->prod_fd);
+	if (de->timer_fd != -1)
+		close(de->timer_fd);
 	pthread_mutex_destroy(&de->q_lock);
 
-	av_frame_free(&de->q_next);
+	LOG_I(LOG_CAT_GEN, "%s: Queue depth=%u: dropped new=%u, dropped oldest=%u, producer blocked=%u\n", __func__,
+	    de->q.depth, de->q.drop_new, de->q.drop_oldest, de->q.blocked);
+	frame_q_uninit(&de->q);
+	av_frame_free(&de->q_hold);
 	av_frame_free(&de->q_this);
 
-	LOG(">>> %s\n", __func__);
+	if (de->mosaic_n != 0)
+	{
+		unsigned int i, shown = 0, dropped = 0;
+
+		for (i = 0; i != de->mosaic_n; ++i)
+		{
+			mosaic_tile_t *const t = de->tiles + i;
+
+			shown += t->shown_n;
+			dropped += t->dropped;
+			av_frame_free(&t->frame);
+			av_frame_free(&t->shown);
+			av_frame_free(&t->prev);
+		}
+		LOG_I(LOG_CAT_GEN, "%s: Mosaic %ux%u: swaps=%u, tile frames shown=%u, replaced unseen=%u\n", __func__,
+		    de->mosaic_cols, de->mosaic_rows, de->mosaic_swaps, shown, dropped);
+		free(de->tiles);
+	}
+
+	if (de->pres_presented != 0)
+		LOG_I(LOG_CAT_GEN, "%s: Presented=%u, discarded=%u, late=%u, zero-copy=%u, latency avg=%"PRId64"us max=%"PRId64"us\n",
+		    __func__, de->pres_presented, de->pres_discarded, de->pres_late, de->pres_zero_copy,
+		    de->pres_lat_total_ns / de->pres_presented / 1000, de->pres_lat_max_ns / 1000);
+	if (de->pres_targeted != 0)
+		LOG_I(LOG_CAT_GEN, "%s: Scheduled=%u, target error avg=%"PRId64"us\n", __func__,
+		    de->pres_targeted, de->pres_err_total_ns / de->pres_targeted / 1000);
+
+	if (de->is_egl)
+		LOG_I(LOG_CAT_GEN, "%s: Import cache hits=%u, misses=%u, unsupported=%u, per-plane frames=%u\n", __func__,
+		    de->aux_hits, de->aux_misses, de->egl_unsupported, de->egl_planar);
+	else if (de->is_shm)
+		LOG_I(LOG_CAT_GEN, "%s: shm zero-copy=%u, copied=%u, converted=%u, dropped=%u, pool empty=%u\n", __func__,
+		    de->shm_zero_copy, de->shm_copied, de->shm_converted, de->shm_dropped, de->shm_pool_empty);
+	else
+		LOG_I(LOG_CAT_GEN, "%s: wl_buffer cache hits=%u, misses=%u\n", __func__, de->wbuf_hits, de->wbuf_misses);
+	dmabuf_fmts_delete(&de->egl_fmts);
+	dmabuf_fmts_delete(&de->egl_failed);
+	LOG_I(LOG_CAT_GEN, "%s: Present mode %d: waited for frame callback=%u, mailbox dropped=%u\n", __func__,
+	    de->present_mode, de->frame_cb_waits, de->mailbox_drops);
+	if (de->fence_waits != 0)
+		LOG_I(LOG_CAT_GEN, "%s: Blocked on a full fence list %u times\n", __func__, de->fence_waits);
+	if (!de->is_egl && !de->is_shm)
+		LOG_I(LOG_CAT_GEN, "%s: Frames scanout capable=%u, composited=%u\n", __func__, de->frames_scanout, de->frames_composite);
+	dmabuf_fb_uninit(de);
+	dmabuf_fmts_delete(&es->dmabuf_fmts);
+	w_buf_cache_uninit(de);
+	shm_pool_delete(&de->shm_pool);
+	shm_pool_delete(&es->bg_pool);
+	pthread_mutex_destroy(&de->shm_lock);
+	yuv_cvt_delete(&de->shm_cvt);
+#if HAS_DRM_SYNCOBJ
+	w_sync_uninit(de);
+#endif
+
+	LOG_D(LOG_CAT_GEN, ">>> %s\n", __func__);
+
+	if (de->is_headless)
+	{
+		LOG_I(LOG_CAT_GEN, "%s: Headless frames drawn=%u\n", __func__, de->hl_frames);
+		if (es->surface != EGL_NO_SURFACE)
+			eglDestroySurface(es->display, es->surface);
+		eglDestroyContext(es->display, es->context);
+	}
+	else
+	{
+		destroy_window(es);
+		server_references_unref(&es->conn);
+	}
+	pthread_mutex_destroy(&de->hl_lock);
+	free(de->hl_pixels);
 
-	destroy_window(es);
-	wl_display_disconnect(es->native_display);
-	LOG("Display disconnected !\n");
+	while (de->shell_n != 0)
+		av_frame_free(de->shells + --de->shell_n);
+	pthread_mutex_destroy(&de->shell_lock);
 
+	free(es);
 	free(de);
 }
 
@@ -1,13 +1,73 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include "libavutil/frame.h"
 
 struct egl_wayland_out_env;
 typedef struct egl_wayland_out_env egl_wayland_out_env_t;
 
-void egl_wayland_out_modeset(struct egl_wayland_out_env * dpo, int w, int h, AVRational frame_rate);
+// What egl_wayland_out_display does when the display queue is full
+enum egl_wayland_out_q_policy {
+    EGL_WAYLAND_OUT_Q_BLOCK,        // Wait for the display to take a frame
+    EGL_WAYLAND_OUT_Q_DROP_NEW,     // Drop the frame being added
+    EGL_WAYLAND_OUT_Q_DROP_OLDEST,  // Drop the oldest frame in the queue
+};
+
+// How frames are paced to the compositor. All modes render with swap
+// interval 0 so the display thread never blocks in EGL
+enum egl_wayland_out_present_mode {
+    EGL_WAYLAND_OUT_PRESENT_FIFO,       // One frame per frame callback, in order
+    EGL_WAYLAND_OUT_PRESENT_MAILBOX,    // Newest frame at each frame callback, drop the rest
+    EGL_WAYLAND_OUT_PRESENT_IMMEDIATE,  // Commit as soon as a frame arrives
+};
+
+// Cheap if nothing has changed so may be called for every frame
+// sar may be 0/1 if unknown; frame_rate is used to pace frames with no PTS
+void egl_wayland_out_modeset(struct egl_wayland_out_env * dpo, int w, int h, AVRational sar, AVRational frame_rate);
+// Set queue depth (1..16) & policy. Default is depth 1, drop oldest
+// Must be called before the first egl_wayland_out_display
+void egl_wayland_out_set_queue(struct egl_wayland_out_env * dpo, unsigned int depth, enum egl_wayland_out_q_policy policy);
+// Default is FIFO. Must be called before the first egl_wayland_out_display
+void egl_wayland_out_present_mode(struct egl_wayland_out_env * dpo, enum egl_wayland_out_present_mode mode);
+// Present frames at their PTS (in time_base units) rather than on arrival
+// Needs wp_presentation; a zero time_base turns it off again
+void egl_wayland_out_pts_sched(struct egl_wayland_out_env * dpo, AVRational time_base);
+// Release frames on explicit fences (EGL native fence / drm syncobj) rather
+// than relying on implicit dmabuf sync. Falls back to implicit if the
+// platform can't do it. Must be called before the first egl_wayland_out_display
+void egl_wayland_out_explicit_sync(struct egl_wayland_out_env * dpo, bool enable);
+// Put the video on a desynchronised subsurface over a black parent so the
+// compositor can scan it out directly and video commits never wait on the
+// parent. dmabuf & shm outputs only - returns -EINVAL for the EGL output.
+// Must be called before the first egl_wayland_out_display
+int egl_wayland_out_video_subsurface(struct egl_wayland_out_env * dpo, bool enable);
 int egl_wayland_out_display(struct egl_wayland_out_env * dpo, AVFrame * frame);
 struct egl_wayland_out_env * egl_wayland_out_new(bool fullscreen);
 struct egl_wayland_out_env * dmabuf_wayland_out_new(bool fullscreen);
+// One EGL window showing n_tiles (1..64) streams as a grid of tiles, all
+// drawn with a single swap per frame callback. Each stream feeds its tile
+// with egl_wayland_out_mosaic_display, from any thread; only the newest
+// frame per tile is kept. egl_wayland_out_display feeds tile 0
+struct egl_wayland_out_env * egl_wayland_out_mosaic_new(bool fullscreen, unsigned int n_tiles);
+int egl_wayland_out_mosaic_display(struct egl_wayland_out_env * dpo, unsigned int tile, AVFrame * frame);
+// No compositor: draws into a width x height offscreen framebuffer
+// (EGL_MESA_platform_surfaceless, else a pbuffer) through the same display
+// thread, import & draw as the EGL output. Each frame is finished with
+// glFinish (or a readback) instead of a swap, so display calls run as fast
+// as the GPU does.
+struct egl_wayland_out_env * egl_headless_out_new(unsigned int width, unsigned int height);
+// Keep a copy of each frame drawn for egl_headless_out_read
+// Must be called before the first egl_wayland_out_display
+void egl_headless_out_readback(struct egl_wayland_out_env * dpo, bool enable);
+// Copy the last frame drawn into dst as RGBA, bottom row first
+// Returns 0, -EAGAIN if nothing drawn yet, -EINVAL if readback isn't on
+int egl_headless_out_read(struct egl_wayland_out_env * dpo, uint8_t * dst, size_t stride);
+// Software frames via wl_shm. Hardware frames are copied down to memory
+struct egl_wayland_out_env * shm_wayland_out_new(bool fullscreen);
+// Set as AVCodecContext.get_buffer2 (with opaque = the shm output) to have
+// a software decoder write straight into the buffers we give the compositor
+// The decoder must be freed before the output is deleted
+struct AVCodecContext;
+int egl_wayland_out_get_buffer2(struct AVCodecContext * avctx, AVFrame * frame, int flags);
 void egl_wayland_out_delete(struct egl_wayland_out_env * dpo);
 
 
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+// Per thread - a power of 2
+#define LOG_SLOTS      256
+#define LOG_MSG_MAX    240
+// How long a message below warn may sit in a ring
+#define LOG_PERIOD_MS  50
+
+typedef struct log_slot_s {
+	uint64_t ns;
+	uint8_t cat;
+	uint8_t lvl;
+	char msg[LOG_MSG_MAX];
+} log_slot_t;
+
+// Single producer (the owning thread), single consumer (the writer)
+typedef struct log_ring_s {
+	struct log_ring_s *next;
+	_Atomic uint32_t head;
+	_Atomic uint32_t tail;
+	_Atomic uint32_t dropped;
+	_Atomic bool dead;        // Owner has exited
+	uint32_t dropped_shown;
+	long tid;
+	log_slot_t slots[LOG_SLOTS];
+} log_ring_t;
+
+typedef struct log_env_s {
+	pthread_mutex_t lock;     // Ring list & flush counts
+	pthread_cond_t flush_cond;
+	log_ring_t *rings;
+	sem_t wake;
+	pthread_t thread;
+	bool running;
+	_Atomic bool stop;
+	uint64_t flush_req;
+	uint64_t flush_done;
+	uint64_t t0;
+	pthread_key_t key;
+} log_env_t;
+
+static const char *const cat_names[LOG_CATS] = {
+	"gen", "wl", "egl", "dmabuf", "shm", "pres", "frame"
+};
+static const char *const lvl_names[] = {
+	"off", "error", "warn", "info", "debug", "trace"
+};
+static const char lvl_chars[] = "-EWIDT";
+
+uint8_t log_levels[LOG_CATS] = {
+	LOG_LVL_INFO, LOG_LVL_INFO, LOG_LVL_INFO, LOG_LVL_INFO,
+	LOG_LVL_INFO, LOG_LVL_INFO, LOG_LVL_INFO,
+};
+
+static log_env_t log_env = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.flush_cond = PTHREAD_COND_INITIALIZER,
+};
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static _Thread_local log_ring_t *log_ring;
+
+static uint64_t
+ns_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+slot_write(const log_env_t *const le, const log_ring_t *const lr, const log_slot_t *const s)
+{
+	const uint64_t ns = s->ns - le->t0;
+	const size_t len = strlen(s->msg);
+
+	printf("[%4u.%06u] %-6s %c %5ld: %s%s", (unsigned int)(ns / 1000000000), (unsigned int)(ns / 1000 % 1000000),
+	       cat_names[s->cat], lvl_chars[s->lvl], lr->tid, s->msg,
+	       len == 0 || s->msg[len - 1] != '\n' ? "\n" : "");
+}
+
+// Write out everything queued so far, oldest first across all threads.
+// Called with the lock held
+static void
+log_drain(log_env_t *const le)
+{
+	log_ring_t *lr;
+	log_ring_t **plr;
+
+	for (;;)
+	{
+		log_ring_t *best = NULL;
+		uint64_t best_ns = 0;
+
+		for (lr = le->rings; lr != NULL; lr = lr->next)
+		{
+			const uint32_t tail = atomic_load_explicit(&lr->tail, memory_order_relaxed);
+			const log_slot_t *s;
+
+			if (atomic_load_explicit(&lr->head, memory_order_acquire) == tail)
+				continue;
+			s = lr->slots + (tail & (LOG_SLOTS - 1));
+			if (best == NULL || s->ns < best_ns)
+			{
+				best = lr;
+				best_ns = s->ns;
+			}
+		}
+		if (best == NULL)
+			break;
+
+		{
+			const uint32_t tail = atomic_load_explicit(&best->tail, memory_order_relaxed);
+			slot_write(le, best, best->slots + (tail & (LOG_SLOTS - 1)));
+			atomic_store_explicit(&best->tail, tail + 1, memory_order_release);
+		}
+	}
+
+	for (plr = &le->rings; (lr = *plr) != NULL;)
+	{
+		const uint32_t dropped = atomic_load_explicit(&lr->dropped, memory_order_relaxed);
+
+		if (dropped != lr->dropped_shown)
+		{
+			printf("log: %u messages dropped by thread %ld\n", dropped - lr->dropped_shown, lr->tid);
+			lr->dropped_shown = dropped;
+		}
+		// Anything it wrote before exit was drained above
+		if (atomic_load_explicit(&lr->dead, memory_order_acquire) &&
+		    atomic_load_explicit(&lr->head, memory_order_acquire) == atomic_load_explicit(&lr->tail, memory_order_relaxed))
+		{
+			*plr = lr->next;
+			free(lr);
+		}
+		else
+			plr = &lr->next;
+	}
+	fflush(stdout);
+}
+
+static void *
+log_thread(void *v)
+{
+	log_env_t *const le = v;
+
+	while (!atomic_load_explicit(&le->stop, memory_order_acquire))
+	{
+		struct timespec ts;
+		uint64_t req;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_PERIOD_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000)
+		{
+			ts.tv_nsec -= 1000000000;
+			++ts.tv_sec;
+		}
+		while (sem_timedwait(&le->wake, &ts) != 0 && errno == EINTR)
+			;
+
+		pthread_mutex_lock(&le->lock);
+		req = le->flush_req;
+		log_drain(le);
+		le->flush_done = req;
+		pthread_cond_broadcast(&le->flush_cond);
+		pthread_mutex_unlock(&le->lock);
+	}
+	return NULL;
+}
+
+static void
+log_finish(void)
+{
+	log_env_t *const le = &log_env;
+
+	if (!le->running)
+		return;
+	atomic_store(&le->stop, true);
+	sem_post(&le->wake);
+	pthread_join(le->thread, NULL);
+
+	pthread_mutex_lock(&le->lock);
+	le->running = false;
+	log_drain(le);
+	pthread_cond_broadcast(&le->flush_cond);
+	pthread_mutex_unlock(&le->lock);
+}
+
+// Thread exit - the writer frees the ring once it is empty
+static void
+ring_dead(void *v)
+{
+	log_ring_t *const lr = v;
+	atomic_store_explicit(&lr->dead, true, memory_order_release);
+}
+
+static void
+log_start(void)
+{
+	log_env_t *const le = &log_env;
+
+	le->t0 = ns_now();
+	if (pthread_key_create(&le->key, ring_dead) != 0 ||
+	    sem_init(&le->wake, 0, 0) != 0)
+		return;
+	if (pthread_create(&le->thread, NULL, log_thread, le) != 0)
+	{
+		sem_destroy(&le->wake);
+		return;
+	}
+	pthread_setname_np(le->thread, "log");
+	le->running = true;
+	atexit(log_finish);
+}
+
+static log_ring_t *
+ring_get(log_env_t *const le)
+{
+	log_ring_t *lr = log_ring;
+
+	if (lr != NULL)
+		return lr;
+
+	pthread_once(&log_once, log_start);
+	if (!le->running || (lr = calloc(1, sizeof(*lr))) == NULL)
+		return NULL;
+	lr->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&le->lock);
+	lr->next = le->rings;
+	le->rings = lr;
+	pthread_mutex_unlock(&le->lock);
+
+	pthread_setspecific(le->key, lr);
+	log_ring = lr;
+	return lr;
+}
+
+void
+log_msg_(const enum log_cat cat, const enum log_level lvl, const char *const fmt, ...)
+{
+	log_env_t *const le = &log_env;
+	log_ring_t *const lr = ring_get(le);
+	va_list ap;
+	uint32_t head, used;
+	log_slot_t *s;
+
+	va_start(ap, fmt);
+	// No writer (never started or gone at exit) - write it here
+	if (lr == NULL || atomic_load_explicit(&le->stop, memory_order_relaxed))
+	{
+		vprintf(fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	head = atomic_load_explicit(&lr->head, memory_order_relaxed);
+	used = head - atomic_load_explicit(&lr->tail, memory_order_acquire);
+	if (used >= LOG_SLOTS)
+	{
+		va_end(ap);
+		atomic_fetch_add_explicit(&lr->dropped, 1, memory_order_relaxed);
+		sem_post(&le->wake);
+		return;
+	}
+
+	s = lr->slots + (head & (LOG_SLOTS - 1));
+	s->ns = ns_now();
+	s->cat = (uint8_t)cat;
+	s->lvl = (uint8_t)lvl;
+	vsnprintf(s->msg, sizeof(s->msg), fmt, ap);
+	va_end(ap);
+	atomic_store_explicit(&lr->head, head + 1, memory_order_release);
+
+	// Otherwise leave it for the writer's next period - a post to a
+	// waiting writer is a syscall
+	if (lvl <= LOG_LVL_WARN || used + 1 == LOG_SLOTS / 2)
+		sem_post(&le->wake);
+}
+
+void
+log_flush(void)
+{
+	log_env_t *const le = &log_env;
+	uint64_t req;
+
+	if (!le->running)
+	{
+		fflush(stdout);
+		return;
+	}
+	pthread_mutex_lock(&le->lock);
+	req = ++le->flush_req;
+	sem_post(&le->wake);
+	while (le->flush_done < req && le->running)
+		pthread_cond_wait(&le->flush_cond, &le->lock);
+	pthread_mutex_unlock(&le->lock);
+}
+
+static int
+lvl_parse(const char *const s, const size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i != sizeof(lvl_names) / sizeof(lvl_names[0]); ++i)
+		if (strlen(lvl_names[i]) == len && strncmp(s, lvl_names[i], len) == 0)
+			return (int)i;
+	return -1;
+}
+
+int
+log_config(const char *spec)
+{
+	uint8_t levels[LOG_CATS];
+
+	memcpy(levels, log_levels, sizeof(levels));
+	while (*spec != '\0')
+	{
+		const size_t len = strcspn(spec, ",");
+		const size_t cat_len = strcspn(spec, ":,");
+		int lvl = LOG_LVL_DEBUG;
+		unsigned int i;
+
+		if (cat_len < len && (lvl = lvl_parse(spec + cat_len + 1, len - cat_len - 1)) < 0)
+			return -EINVAL;
+
+		if (cat_len == 3 && strncmp(spec, "all", 3) == 0)
+			memset(levels, lvl, sizeof(levels));
+		else
+		{
+			for (i = 0; i != LOG_CATS; ++i)
+				if (strlen(cat_names[i]) == cat_len && strncmp(spec, cat_names[i], cat_len) == 0)
+					break;
+			if (i == LOG_CATS)
+				return -EINVAL;
+			levels[i] = (uint8_t)lvl;
+		}
+
+		spec += len;
+		if (*spec == ',')
+			++spec;
+	}
+	memcpy(log_levels, levels, sizeof(levels));
+	return 0;
+}
+
+// Levels are wanted before the first message could be checked against them
+__attribute__((constructor)) static void
+log_env_config(void)
+{
+	const char *const spec = getenv("EGL_WAYLAND_LOG");
+
+	if (spec != NULL && log_config(spec) != 0)
+		fprintf(stderr, "Bad EGL_WAYLAND_LOG '%s'\n", spec);
+}
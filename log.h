@@ -0,0 +1,61 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// Leveled logging by category
+//
+// Each thread formats into its own lock-free ring and a background thread
+// writes the rings out to stdout, so logging never waits on terminal or
+// journal I/O. A full ring drops (and counts) rather than blocks.
+// A message below its category's level costs one compare and branch.
+//
+// Levels are set from $EGL_WAYLAND_LOG at startup or by log_config with a
+// spec of comma separated <cat>[:<level>], e.g. "all:warn,frame:trace".
+// <cat> is one of the names below or "all"; <level> is off, error, warn,
+// info, debug or trace, and defaults to debug. Everything starts at info.
+
+enum log_level {
+	LOG_LVL_OFF,
+	LOG_LVL_ERROR,
+	LOG_LVL_WARN,
+	LOG_LVL_INFO,
+	LOG_LVL_DEBUG,
+	LOG_LVL_TRACE,
+};
+
+enum log_cat {
+	LOG_CAT_GEN,      // "gen"    Setup, teardown & stats
+	LOG_CAT_WL,       // "wl"     Wayland protocol events
+	LOG_CAT_EGL,      // "egl"    EGL/GL setup and frame import
+	LOG_CAT_DMABUF,   // "dmabuf" wl_buffers from dmabufs
+	LOG_CAT_SHM,      // "shm"    wl_shm pool and copies
+	LOG_CAT_PRES,     // "pres"   Presentation feedback and scheduling
+	LOG_CAT_FRAME,    // "frame"  Per-frame path through the output
+	LOG_CATS
+};
+
+// Highest level shown for each category
+extern uint8_t log_levels[LOG_CATS];
+
+// Returns 0 or -EINVAL (levels are unchanged if the spec is bad)
+int log_config(const char *spec);
+// Wait for everything logged so far to be written
+void log_flush(void);
+
+void log_msg_(enum log_cat cat, enum log_level lvl, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define log_on(cat, lvl) __builtin_expect(log_levels[cat] >= (lvl), 0)
+
+#define LOG_MSG(cat, lvl, ...) do {\
+	if (log_on(cat, lvl))\
+		log_msg_(cat, lvl, __VA_ARGS__);\
+} while (0)
+
+#define LOG_E(cat, ...) LOG_MSG(cat, LOG_LVL_ERROR, __VA_ARGS__)
+#define LOG_W(cat, ...) LOG_MSG(cat, LOG_LVL_WARN, __VA_ARGS__)
+#define LOG_I(cat, ...) LOG_MSG(cat, LOG_LVL_INFO, __VA_ARGS__)
+#define LOG_D(cat, ...) LOG_MSG(cat, LOG_LVL_DEBUG, __VA_ARGS__)
+#define LOG_T(cat, ...) LOG_MSG(cat, LOG_LVL_TRACE, __VA_ARGS__)
+
+#endif
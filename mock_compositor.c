@@ -0,0 +1,1859 @@
+// Stand-in compositor for repeatable output benchmarks
+//
+// Implements just enough of the globals the outputs bind (wl_compositor,
+// wl_subcompositor, wl_shm, xdg_wm_base, zxdg_decoration_manager_v1,
+// zwp_linux_dmabuf_v1 v4, wp_viewporter & wp_presentation) to run them in
+// CI with no GPU or desktop. Nothing is drawn - buffers are only held and
+// released. A virtual vblank at a fixed rate latches the newest commit on
+// every surface (subsurfaces are all treated as desync): frame callbacks
+// are done, presentation feedback sent, and the buffer it replaced is
+// released after the release delay. A buffer replaced before it was
+// latched is released at once and its feedback discarded.
+//
+// A script (-s) changes things as the run goes on, one command per line:
+//   at <ms>                 Following commands happen <ms> after start
+//   refresh <hz>            Vblank rate, may be fractional
+//   release-delay <us>      How long a replaced buffer is held
+//   configure <w> <h>       Resize every toplevel (0 0 lets the client pick)
+//   resize-storm <n> <ms> <w0> <h0> <w1> <h1>
+//                           n configures <ms> apart alternating two sizes
+//   close                   Ask every toplevel to close
+//   quit                    Stop, killing the client if need be
+// '#' starts a comment.
+//
+// Given a client command line it runs it against the compositor and exits
+// with the client's status, printing what happened to stderr.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#include <wayland-server.h>
+
+#include "linux-dmabuf-unstable-v1-server-protocol.h"
+#include "presentation-time-server-protocol.h"
+#include "viewporter-server-protocol.h"
+#include "xdg-decoration-unstable-v1-server-protocol.h"
+#include "xdg-shell-server-protocol.h"
+
+#define DRM_FOURCC(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+#define DRM_MOD_LINEAR  0ULL
+#define DRM_MOD_INVALID 0xffffffffffffffULL
+
+#define VLOG(...) do { if (verbose) fprintf(stderr, __VA_ARGS__); } while (0)
+
+static bool verbose = false;
+
+// dmabuf formats we claim. The first MC_SCANOUT_FMTS are also offered in a
+// scanout tranche
+static const struct mc_dmabuf_fmt_s {
+	uint32_t fourcc;
+	uint64_t modifier;
+} mc_dmabuf_fmts[] = {
+	{DRM_FOURCC('N', 'V', '1', '2'), DRM_MOD_LINEAR},
+	{DRM_FOURCC('P', '0', '1', '0'), DRM_MOD_LINEAR},
+	{DRM_FOURCC('N', 'V', '1', '2'), DRM_MOD_INVALID},
+	{DRM_FOURCC('P', '0', '1', '0'), DRM_MOD_INVALID},
+	{DRM_FOURCC('Y', 'U', '1', '2'), DRM_MOD_LINEAR},
+	{DRM_FOURCC('Y', 'U', '1', '2'), DRM_MOD_INVALID},
+	{DRM_FOURCC('X', 'R', '2', '4'), DRM_MOD_LINEAR},
+	{DRM_FOURCC('X', 'R', '2', '4'), DRM_MOD_INVALID},
+	{DRM_FOURCC('A', 'R', '2', '4'), DRM_MOD_LINEAR},
+	{DRM_FOURCC('A', 'R', '2', '4'), DRM_MOD_INVALID},
+};
+#define MC_DMABUF_FMTS (sizeof(mc_dmabuf_fmts) / sizeof(mc_dmabuf_fmts[0]))
+#define MC_SCANOUT_FMTS 2
+
+enum mc_op {
+	MC_OP_REFRESH,
+	MC_OP_RELEASE_DELAY,
+	MC_OP_CONFIGURE,
+	MC_OP_CLOSE,
+	MC_OP_QUIT,
+};
+
+typedef struct mc_event_s {
+	uint64_t t_ns;            // From start
+	unsigned int seq;         // Keeps script order for equal times
+	enum mc_op op;
+	double val;
+	int32_t w, h;
+} mc_event_t;
+
+typedef struct mc_stats_s {
+	unsigned int vblanks;
+	unsigned int vblanks_missed;  // We were late ourselves
+	unsigned int commits;
+	unsigned int latched;         // Buffers that reached the "screen"
+	unsigned int replaced;        // Buffers replaced before they were latched
+	unsigned int released;
+	unsigned int frame_done;
+	unsigned int fb_presented;
+	unsigned int fb_discarded;
+	unsigned int configures;
+	unsigned int acks;
+	unsigned int dmabuf_buffers;
+} mc_stats_t;
+
+typedef struct mc_s {
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	uint64_t t0;
+
+	int vbl_fd;
+	uint64_t period_ns;
+	uint64_t vbl_next;
+	uint64_t vbl_seq;
+
+	int rel_fd;
+	uint64_t release_delay_ns;
+	struct wl_list releases;      // mc_release_t, soonest first
+
+	struct wl_list surfaces;      // mc_surface_t
+	struct wl_list xdgs;          // mc_xdg_t with a toplevel
+	int32_t cfg_w, cfg_h;         // What toplevels are configured to
+	int32_t out_w, out_h;         // Fullscreen size
+
+	int script_fd;
+	mc_event_t *events;
+	unsigned int n_events;
+	unsigned int next_event;
+
+	int fmt_table_fd;
+	size_t fmt_table_size;
+	dev_t main_dev;
+
+	pid_t child;
+	int child_status;
+
+	mc_stats_t stats;
+} mc_t;
+
+// A buffer that a surface holds in some role; cleared if the client
+// destroys the buffer under us
+typedef struct mc_buf_ref_s {
+	struct wl_resource *buffer;
+	struct wl_listener destroy;
+} mc_buf_ref_t;
+
+typedef struct mc_release_s {
+	struct wl_list link;
+	mc_t *mc;
+	uint64_t due;
+	mc_buf_ref_t ref;
+} mc_release_t;
+
+struct mc_xdg_s;
+
+typedef struct mc_surface_s {
+	struct wl_list link;
+	mc_t *mc;
+	struct wl_resource *resource;
+	struct mc_xdg_s *xdg;
+
+	bool pending_attach;
+	mc_buf_ref_t pending;
+	struct wl_list pending_frames;
+	struct wl_list pending_feedback;
+
+	bool has_commit;              // Something to latch at the next vblank
+	bool next_attach;
+	mc_buf_ref_t next;
+	struct wl_list frames;
+	struct wl_list feedback;
+
+	mc_buf_ref_t cur;             // On "screen"
+} mc_surface_t;
+
+typedef struct mc_xdg_s {
+	struct wl_list link;
+	mc_t *mc;
+	mc_surface_t *surface;
+	struct wl_resource *resource;
+	struct wl_resource *toplevel;
+	struct wl_resource *decoration;
+	bool configured;              // Initial configure sent
+	bool fullscreen;
+	uint32_t serial;
+} mc_xdg_t;
+
+typedef struct mc_params_s {
+	mc_t *mc;
+	int fds[4];
+	bool used;
+} mc_params_t;
+
+static uint64_t
+ns_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 0 disarms
+static void
+timer_set(const int fd, const uint64_t abs_ns)
+{
+	struct itimerspec its = {
+		.it_value = {.tv_sec = abs_ns / 1000000000, .tv_nsec = abs_ns % 1000000000}
+	};
+	timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static bool
+timer_read(const int fd)
+{
+	uint64_t n;
+	return read(fd, &n, sizeof(n)) == sizeof(n);
+}
+
+static void
+unlink_resource(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+destroy_resource(struct wl_client *client, struct wl_resource *resource)
+{
+	(void)client;
+	wl_resource_destroy(resource);
+}
+
+// ---------------------------------------------------------------------------
+// Buffer holds & releases
+
+static void
+buf_ref_destroyed(struct wl_listener *listener, void *data)
+{
+	mc_buf_ref_t *const ref = wl_container_of(listener, ref, destroy);
+	(void)data;
+	ref->buffer = NULL;
+	wl_list_remove(&ref->destroy.link);
+	wl_list_init(&ref->destroy.link);
+}
+
+static void
+buf_ref_init(mc_buf_ref_t *const ref)
+{
+	ref->buffer = NULL;
+	ref->destroy.notify = buf_ref_destroyed;
+	wl_list_init(&ref->destroy.link);
+}
+
+static void
+buf_ref_set(mc_buf_ref_t *const ref, struct wl_resource *const buffer)
+{
+	wl_list_remove(&ref->destroy.link);
+	wl_list_init(&ref->destroy.link);
+	ref->buffer = buffer;
+	if (buffer != NULL)
+		wl_resource_add_destroy_listener(buffer, &ref->destroy);
+}
+
+static void
+release_free(mc_release_t *const rel)
+{
+	wl_list_remove(&rel->link);
+	buf_ref_set(&rel->ref, NULL);
+	free(rel);
+}
+
+static void
+release_arm(mc_t *const mc)
+{
+	const mc_release_t *rel;
+
+	if (wl_list_empty(&mc->releases))
+	{
+		timer_set(mc->rel_fd, 0);
+		return;
+	}
+	rel = wl_container_of(mc->releases.next, rel, link);
+	timer_set(mc->rel_fd, rel->due);
+}
+
+static void
+release_send(mc_t *const mc, struct wl_resource *const buffer)
+{
+	wl_buffer_send_release(buffer);
+	++mc->stats.released;
+}
+
+static void
+release_queue(mc_t *const mc, struct wl_resource *const buffer, const uint64_t now)
+{
+	mc_release_t *rel;
+	mc_release_t *pos;
+
+	if (buffer == NULL)
+		return;
+	if (mc->release_delay_ns == 0 || (rel = calloc(1, sizeof(*rel))) == NULL)
+	{
+		release_send(mc, buffer);
+		return;
+	}
+
+	rel->mc = mc;
+	rel->due = now + mc->release_delay_ns;
+	buf_ref_init(&rel->ref);
+	buf_ref_set(&rel->ref, buffer);
+
+	// Delay can change so keep in order rather than just appending
+	wl_list_for_each_reverse(pos, &mc->releases, link)
+	{
+		if (pos->due <= rel->due)
+			break;
+	}
+	wl_list_insert(&pos->link, &rel->link);
+	release_arm(mc);
+}
+
+// Buffer is being used again - it must not be released for its last use
+static void
+release_cancel(mc_t *const mc, struct wl_resource *const buffer)
+{
+	mc_release_t *rel, *tmp;
+
+	wl_list_for_each_safe(rel, tmp, &mc->releases, link)
+	{
+		if (rel->ref.buffer == buffer)
+			release_free(rel);
+	}
+}
+
+static int
+release_timer_cb(int fd, uint32_t mask, void *data)
+{
+	mc_t *const mc = data;
+	const uint64_t now = ns_now();
+	mc_release_t *rel, *tmp;
+
+	(void)mask;
+	timer_read(fd);
+	wl_list_for_each_safe(rel, tmp, &mc->releases, link)
+	{
+		if (rel->due > now)
+			break;
+		if (rel->ref.buffer != NULL)
+			release_send(mc, rel->ref.buffer);
+		release_free(rel);
+	}
+	release_arm(mc);
+	return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Vblank
+
+static void
+feedback_discard(mc_t *const mc, struct wl_list *const list)
+{
+	struct wl_resource *r, *tmp;
+
+	wl_resource_for_each_safe(r, tmp, list)
+	{
+		wp_presentation_feedback_send_discarded(r);
+		wl_resource_destroy(r);
+		++mc->stats.fb_discarded;
+	}
+}
+
+static void
+surface_latch(mc_surface_t *const s, const uint64_t t)
+{
+	mc_t *const mc = s->mc;
+	struct wl_resource *r, *tmp;
+	const uint64_t sec = t / 1000000000;
+
+	if (s->next_attach)
+	{
+		if (s->cur.buffer != s->next.buffer)
+			release_queue(mc, s->cur.buffer, t);
+		buf_ref_set(&s->cur, s->next.buffer);
+		buf_ref_set(&s->next, NULL);
+		s->next_attach = false;
+		if (s->cur.buffer != NULL)
+			++mc->stats.latched;
+	}
+
+	wl_resource_for_each_safe(r, tmp, &s->feedback)
+	{
+		wp_presentation_feedback_send_presented(r, (uint32_t)(sec >> 32), (uint32_t)sec,
+			(uint32_t)(t % 1000000000), (uint32_t)mc->period_ns,
+			(uint32_t)(mc->vbl_seq >> 32), (uint32_t)mc->vbl_seq,
+			WP_PRESENTATION_FEEDBACK_KIND_VSYNC | WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK |
+			WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION);
+		wl_resource_destroy(r);
+		++mc->stats.fb_presented;
+	}
+	wl_resource_for_each_safe(r, tmp, &s->frames)
+	{
+		wl_callback_send_done(r, (uint32_t)(t / 1000000));
+		wl_resource_destroy(r);
+		++mc->stats.frame_done;
+	}
+	s->has_commit = false;
+}
+
+static int
+vblank_timer_cb(int fd, uint32_t mask, void *data)
+{
+	mc_t *const mc = data;
+	const uint64_t t = mc->vbl_next;
+	const uint64_t now = ns_now();
+	mc_surface_t *s;
+
+	(void)mask;
+	timer_read(fd);
+	++mc->vbl_seq;
+	++mc->stats.vblanks;
+
+	wl_list_for_each(s, &mc->surfaces, link)
+	{
+		if (s->has_commit)
+			surface_latch(s, t);
+	}
+
+	mc->vbl_next += mc->period_ns;
+	while (mc->vbl_next <= now)
+	{
+		mc->vbl_next += mc->period_ns;
+		++mc->vbl_seq;
+		++mc->stats.vblanks_missed;
+	}
+	timer_set(mc->vbl_fd, mc->vbl_next);
+	return 0;
+}
+
+static void
+refresh_set(mc_t *const mc, const double hz)
+{
+	const uint64_t last = mc->vbl_next - mc->period_ns;
+
+	mc->period_ns = (uint64_t)(1e9 / hz + 0.5);
+	mc->vbl_next = last + mc->period_ns;
+	if (mc->vbl_next <= ns_now())
+		mc->vbl_next = ns_now() + mc->period_ns;
+	timer_set(mc->vbl_fd, mc->vbl_next);
+}
+
+// ---------------------------------------------------------------------------
+// xdg_shell & decoration
+
+static void
+xdg_configure_send(mc_xdg_t *const x)
+{
+	mc_t *const mc = x->mc;
+	struct wl_array states;
+	uint32_t *p;
+
+	if (x->toplevel == NULL)
+		return;
+
+	wl_array_init(&states);
+	if ((p = wl_array_add(&states, sizeof(*p))) != NULL)
+		*p = XDG_TOPLEVEL_STATE_ACTIVATED;
+	if (x->fullscreen && (p = wl_array_add(&states, sizeof(*p))) != NULL)
+		*p = XDG_TOPLEVEL_STATE_FULLSCREEN;
+
+	if (x->decoration != NULL)
+		zxdg_toplevel_decoration_v1_send_configure(x->decoration, ZXDG_TOPLEVEL_DECORATION_V1_MODE_SERVER_SIDE);
+	xdg_toplevel_send_configure(x->toplevel,
+				    x->fullscreen ? mc->out_w : mc->cfg_w,
+				    x->fullscreen ? mc->out_h : mc->cfg_h, &states);
+	x->serial = wl_display_next_serial(mc->display);
+	xdg_surface_send_configure(x->resource, x->serial);
+	wl_array_release(&states);
+
+	x->configured = true;
+	++mc->stats.configures;
+	VLOG("configure %ux%u%s serial %u\n",
+	     x->fullscreen ? mc->out_w : mc->cfg_w, x->fullscreen ? mc->out_h : mc->cfg_h,
+	     x->fullscreen ? " fullscreen" : "", x->serial);
+}
+
+static void
+decoration_set_mode(struct wl_client *client, struct wl_resource *resource, uint32_t mode)
+{
+	mc_xdg_t *const x = wl_resource_get_user_data(resource);
+	(void)client;
+	(void)mode;
+	// We always decorate
+	if (x != NULL && x->configured)
+		xdg_configure_send(x);
+}
+
+static void
+decoration_unset_mode(struct wl_client *client, struct wl_resource *resource)
+{
+	decoration_set_mode(client, resource, ZXDG_TOPLEVEL_DECORATION_V1_MODE_SERVER_SIDE);
+}
+
+static const struct zxdg_toplevel_decoration_v1_interface decoration_impl = {
+	.destroy = destroy_resource,
+	.set_mode = decoration_set_mode,
+	.unset_mode = decoration_unset_mode,
+};
+
+static void
+decoration_destroyed(struct wl_resource *resource)
+{
+	mc_xdg_t *const x = wl_resource_get_user_data(resource);
+	if (x != NULL)
+		x->decoration = NULL;
+}
+
+static void
+decoration_manager_get(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+		       struct wl_resource *toplevel)
+{
+	mc_xdg_t *const x = wl_resource_get_user_data(toplevel);
+	struct wl_resource *r = wl_resource_create(client, &zxdg_toplevel_decoration_v1_interface,
+						   wl_resource_get_version(resource), id);
+
+	if (r == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(r, &decoration_impl, x, decoration_destroyed);
+	if (x != NULL)
+		x->decoration = r;
+}
+
+static const struct zxdg_decoration_manager_v1_interface decoration_manager_impl = {
+	.destroy = destroy_resource,
+	.get_toplevel_decoration = decoration_manager_get,
+};
+
+static void
+toplevel_noop_str(struct wl_client *client, struct wl_resource *resource, const char *str)
+{
+	(void)client;
+	(void)resource;
+	(void)str;
+}
+
+static void
+toplevel_noop(struct wl_client *client, struct wl_resource *resource)
+{
+	(void)client;
+	(void)resource;
+}
+
+static void
+toplevel_noop_res(struct wl_client *client, struct wl_resource *resource, struct wl_resource *r)
+{
+	(void)client;
+	(void)resource;
+	(void)r;
+}
+
+static void
+toplevel_noop_size(struct wl_client *client, struct wl_resource *resource, int32_t w, int32_t h)
+{
+	(void)client;
+	(void)resource;
+	(void)w;
+	(void)h;
+}
+
+static void
+toplevel_move(struct wl_client *client, struct wl_resource *resource, struct wl_resource *seat, uint32_t serial)
+{
+	(void)client;
+	(void)resource;
+	(void)seat;
+	(void)serial;
+}
+
+static void
+toplevel_resize(struct wl_client *client, struct wl_resource *resource, struct wl_resource *seat,
+		uint32_t serial, uint32_t edges)
+{
+	(void)edges;
+	toplevel_move(client, resource, seat, serial);
+}
+
+static void
+toplevel_show_window_menu(struct wl_client *client, struct wl_resource *resource, struct wl_resource *seat,
+			  uint32_t serial, int32_t x, int32_t y)
+{
+	(void)x;
+	(void)y;
+	toplevel_move(client, resource, seat, serial);
+}
+
+static void
+toplevel_fullscreen(mc_xdg_t *const x, const bool fullscreen)
+{
+	if (x == NULL || x->fullscreen == fullscreen)
+		return;
+	x->fullscreen = fullscreen;
+	if (x->configured)
+		xdg_configure_send(x);
+}
+
+static void
+toplevel_set_fullscreen(struct wl_client *client, struct wl_resource *resource, struct wl_resource *output)
+{
+	(void)client;
+	(void)output;
+	toplevel_fullscreen(wl_resource_get_user_data(resource), true);
+}
+
+static void
+toplevel_unset_fullscreen(struct wl_client *client, struct wl_resource *resource)
+{
+	(void)client;
+	toplevel_fullscreen(wl_resource_get_user_data(resource), false);
+}
+
+static const struct xdg_toplevel_interface toplevel_impl = {
+	.destroy = destroy_resource,
+	.set_parent = toplevel_noop_res,
+	.set_title = toplevel_noop_str,
+	.set_app_id = toplevel_noop_str,
+	.show_window_menu = toplevel_show_window_menu,
+	.move = toplevel_move,
+	.resize = toplevel_resize,
+	.set_max_size = toplevel_noop_size,
+	.set_min_size = toplevel_noop_size,
+	.set_maximized = toplevel_noop,
+	.unset_maximized = toplevel_noop,
+	.set_fullscreen = toplevel_set_fullscreen,
+	.unset_fullscreen = toplevel_unset_fullscreen,
+	.set_minimized = toplevel_noop,
+};
+
+static void
+toplevel_destroyed(struct wl_resource *resource)
+{
+	mc_xdg_t *const x = wl_resource_get_user_data(resource);
+
+	if (x == NULL)
+		return;
+	x->toplevel = NULL;
+	x->configured = false;
+	wl_list_remove(&x->link);
+	wl_list_init(&x->link);
+	if (x->decoration != NULL)
+		wl_resource_set_user_data(x->decoration, NULL);
+	x->decoration = NULL;
+}
+
+static void
+xdg_surface_get_toplevel(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	mc_xdg_t *const x = wl_resource_get_user_data(resource);
+	struct wl_resource *r;
+
+	if (x->toplevel != NULL)
+	{
+		wl_resource_post_error(resource, XDG_WM_BASE_ERROR_ROLE, "already a toplevel");
+		return;
+	}
+	if ((r = wl_resource_create(client, &xdg_toplevel_interface, wl_resource_get_version(resource), id)) == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(r, &toplevel_impl, x, toplevel_destroyed);
+	x->toplevel = r;
+	wl_list_insert(x->mc->xdgs.prev, &x->link);
+}
+
+static void
+xdg_surface_get_popup(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+		      struct wl_resource *parent, struct wl_resource *positioner)
+{
+	(void)client;
+	(void)id;
+	(void)parent;
+	(void)positioner;
+	wl_resource_post_error(resource, XDG_WM_BASE_ERROR_INVALID_POPUP_PARENT, "popups not supported");
+}
+
+static void
+xdg_surface_set_window_geometry(struct wl_client *client, struct wl_resource *resource,
+				int32_t x, int32_t y, int32_t w, int32_t h)
+{
+	(void)client;
+	(void)resource;
+	(void)x;
+	(void)y;
+	(void)w;
+	(void)h;
+}
+
+static void
+xdg_surface_ack_configure(struct wl_client *client, struct wl_resource *resource, uint32_t serial)
+{
+	mc_xdg_t *const x = wl_resource_get_user_data(resource);
+	(void)client;
+	++x->mc->stats.acks;
+	VLOG("ack %u%s\n", serial, serial == x->serial ? "" : " (stale)");
+}
+
+static const struct xdg_surface_interface xdg_surface_impl = {
+	.destroy = destroy_resource,
+	.get_toplevel = xdg_surface_get_toplevel,
+	.get_popup = xdg_surface_get_popup,
+	.set_window_geometry = xdg_surface_set_window_geometry,
+	.ack_configure = xdg_surface_ack_configure,
+};
+
+static void
+xdg_surface_destroyed(struct wl_resource *resource)
+{
+	mc_xdg_t *const x = wl_resource_get_user_data(resource);
+
+	if (x->toplevel != NULL)
+		wl_resource_set_user_data(x->toplevel, NULL);
+	if (x->decoration != NULL)
+		wl_resource_set_user_data(x->decoration, NULL);
+	if (x->surface != NULL)
+		x->surface->xdg = NULL;
+	wl_list_remove(&x->link);
+	free(x);
+}
+
+static void
+wm_base_create_positioner(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	(void)client;
+	(void)id;
+	wl_resource_post_error(resource, XDG_WM_BASE_ERROR_INVALID_POPUP_PARENT, "positioners not supported");
+}
+
+static void
+wm_base_get_xdg_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+			struct wl_resource *surface)
+{
+	mc_surface_t *const s = wl_resource_get_user_data(surface);
+	mc_xdg_t *x;
+	struct wl_resource *r;
+
+	if (s->xdg != NULL)
+	{
+		wl_resource_post_error(resource, XDG_WM_BASE_ERROR_ROLE, "surface already has a role");
+		return;
+	}
+	if ((x = calloc(1, sizeof(*x))) == NULL ||
+	    (r = wl_resource_create(client, &xdg_surface_interface, wl_resource_get_version(resource), id)) == NULL)
+	{
+		free(x);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	x->mc = s->mc;
+	x->surface = s;
+	x->resource = r;
+	wl_list_init(&x->link);
+	s->xdg = x;
+	wl_resource_set_implementation(r, &xdg_surface_impl, x, xdg_surface_destroyed);
+}
+
+static void
+wm_base_pong(struct wl_client *client, struct wl_resource *resource, uint32_t serial)
+{
+	(void)client;
+	(void)resource;
+	(void)serial;
+}
+
+static const struct xdg_wm_base_interface wm_base_impl = {
+	.destroy = destroy_resource,
+	.create_positioner = wm_base_create_positioner,
+	.get_xdg_surface = wm_base_get_xdg_surface,
+	.pong = wm_base_pong,
+};
+
+// ---------------------------------------------------------------------------
+// wl_surface & friends
+
+static void
+surface_attach(struct wl_client *client, struct wl_resource *resource, struct wl_resource *buffer,
+	       int32_t x, int32_t y)
+{
+	mc_surface_t *const s = wl_resource_get_user_data(resource);
+	(void)client;
+	(void)x;
+	(void)y;
+	s->pending_attach = true;
+	buf_ref_set(&s->pending, buffer);
+}
+
+static void
+surface_damage(struct wl_client *client, struct wl_resource *resource,
+	       int32_t x, int32_t y, int32_t w, int32_t h)
+{
+	(void)client;
+	(void)resource;
+	(void)x;
+	(void)y;
+	(void)w;
+	(void)h;
+}
+
+static void
+surface_frame(struct wl_client *client, struct wl_resource *resource, uint32_t callback)
+{
+	mc_surface_t *const s = wl_resource_get_user_data(resource);
+	struct wl_resource *r = wl_resource_create(client, &wl_callback_interface, 1, callback);
+
+	if (r == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(r, NULL, NULL, unlink_resource);
+	wl_list_insert(s->pending_frames.prev, wl_resource_get_link(r));
+}
+
+static void
+surface_set_region(struct wl_client *client, struct wl_resource *resource, struct wl_resource *region)
+{
+	(void)client;
+	(void)resource;
+	(void)region;
+}
+
+static void
+surface_commit(struct wl_client *client, struct wl_resource *resource)
+{
+	mc_surface_t *const s = wl_resource_get_user_data(resource);
+	mc_t *const mc = s->mc;
+	(void)client;
+
+	++mc->stats.commits;
+
+	// Initial commit of a toplevel gets its first configure
+	if (s->xdg != NULL && s->xdg->toplevel != NULL && !s->xdg->configured)
+		xdg_configure_send(s->xdg);
+
+	// Feedback is for this commit's content; anything older never made it
+	if (s->pending_attach || !wl_list_empty(&s->pending_feedback))
+	{
+		feedback_discard(mc, &s->feedback);
+		wl_list_insert_list(&s->feedback, &s->pending_feedback);
+		wl_list_init(&s->pending_feedback);
+	}
+
+	if (s->pending_attach)
+	{
+		struct wl_resource *const buffer = s->pending.buffer;
+
+		// Replaced before it got to the screen
+		if (s->next_attach && s->next.buffer != NULL && s->next.buffer != buffer &&
+		    s->next.buffer != s->cur.buffer)
+		{
+			release_send(mc, s->next.buffer);
+			++mc->stats.replaced;
+		}
+		if (buffer != NULL)
+			release_cancel(mc, buffer);
+		buf_ref_set(&s->next, buffer);
+		buf_ref_set(&s->pending, NULL);
+		s->next_attach = true;
+		s->pending_attach = false;
+	}
+
+	wl_list_insert_list(s->frames.prev, &s->pending_frames);
+	wl_list_init(&s->pending_frames);
+	s->has_commit = true;
+}
+
+static void
+surface_set_int(struct wl_client *client, struct wl_resource *resource, int32_t v)
+{
+	(void)client;
+	(void)resource;
+	(void)v;
+}
+
+static void
+surface_offset(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y)
+{
+	(void)client;
+	(void)resource;
+	(void)x;
+	(void)y;
+}
+
+static const struct wl_surface_interface surface_impl = {
+	.destroy = destroy_resource,
+	.attach = surface_attach,
+	.damage = surface_damage,
+	.frame = surface_frame,
+	.set_opaque_region = surface_set_region,
+	.set_input_region = surface_set_region,
+	.commit = surface_commit,
+	.set_buffer_transform = surface_set_int,
+	.set_buffer_scale = surface_set_int,
+	.damage_buffer = surface_damage,
+	.offset = surface_offset,
+};
+
+static void
+surface_destroyed(struct wl_resource *resource)
+{
+	mc_surface_t *const s = wl_resource_get_user_data(resource);
+	struct wl_resource *r, *tmp;
+
+	feedback_discard(s->mc, &s->pending_feedback);
+	feedback_discard(s->mc, &s->feedback);
+	wl_resource_for_each_safe(r, tmp, &s->pending_frames)
+		wl_resource_destroy(r);
+	wl_resource_for_each_safe(r, tmp, &s->frames)
+		wl_resource_destroy(r);
+
+	// Let the client reuse whatever we held
+	if (s->next.buffer != NULL && s->next.buffer != s->cur.buffer)
+		release_send(s->mc, s->next.buffer);
+	if (s->cur.buffer != NULL)
+		release_send(s->mc, s->cur.buffer);
+	buf_ref_set(&s->pending, NULL);
+	buf_ref_set(&s->next, NULL);
+	buf_ref_set(&s->cur, NULL);
+
+	if (s->xdg != NULL)
+		s->xdg->surface = NULL;
+	wl_list_remove(&s->link);
+	free(s);
+}
+
+static void
+region_rect(struct wl_client *client, struct wl_resource *resource,
+	    int32_t x, int32_t y, int32_t w, int32_t h)
+{
+	surface_damage(client, resource, x, y, w, h);
+}
+
+static const struct wl_region_interface region_impl = {
+	.destroy = destroy_resource,
+	.add = region_rect,
+	.subtract = region_rect,
+};
+
+static void
+compositor_create_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	mc_t *const mc = wl_resource_get_user_data(resource);
+	mc_surface_t *s;
+	struct wl_resource *r;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL ||
+	    (r = wl_resource_create(client, &wl_surface_interface, wl_resource_get_version(resource), id)) == NULL)
+	{
+		free(s);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	s->mc = mc;
+	s->resource = r;
+	buf_ref_init(&s->pending);
+	buf_ref_init(&s->next);
+	buf_ref_init(&s->cur);
+	wl_list_init(&s->pending_frames);
+	wl_list_init(&s->pending_feedback);
+	wl_list_init(&s->frames);
+	wl_list_init(&s->feedback);
+	wl_list_insert(mc->surfaces.prev, &s->link);
+	wl_resource_set_implementation(r, &surface_impl, s, surface_destroyed);
+}
+
+static void
+compositor_create_region(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	struct wl_resource *r = wl_resource_create(client, &wl_region_interface, 1, id);
+	(void)resource;
+
+	if (r == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(r, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+	.create_surface = compositor_create_surface,
+	.create_region = compositor_create_region,
+};
+
+static void
+subsurface_set_position(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y)
+{
+	surface_offset(client, resource, x, y);
+}
+
+static void
+subsurface_place(struct wl_client *client, struct wl_resource *resource, struct wl_resource *sibling)
+{
+	surface_set_region(client, resource, sibling);
+}
+
+static const struct wl_subsurface_interface subsurface_impl = {
+	.destroy = destroy_resource,
+	.set_position = subsurface_set_position,
+	.place_above = subsurface_place,
+	.place_below = subsurface_place,
+	.set_sync = toplevel_noop,
+	.set_desync = toplevel_noop,
+};
+
+static void
+subcompositor_get_subsurface(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+			     struct wl_resource *surface, struct wl_resource *parent)
+{
+	struct wl_resource *r = wl_resource_create(client, &wl_subsurface_interface, 1, id);
+	(void)resource;
+	(void)surface;
+	(void)parent;
+
+	if (r == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(r, &subsurface_impl, NULL, NULL);
+}
+
+static const struct wl_subcompositor_interface subcompositor_impl = {
+	.destroy = destroy_resource,
+	.get_subsurface = subcompositor_get_subsurface,
+};
+
+// ---------------------------------------------------------------------------
+// Viewporter
+
+static void
+viewport_set_source(struct wl_client *client, struct wl_resource *resource,
+		    wl_fixed_t x, wl_fixed_t y, wl_fixed_t w, wl_fixed_t h)
+{
+	surface_damage(client, resource, x, y, w, h);
+}
+
+static void
+viewport_set_destination(struct wl_client *client, struct wl_resource *resource, int32_t w, int32_t h)
+{
+	surface_offset(client, resource, w, h);
+}
+
+static const struct wp_viewport_interface viewport_impl = {
+	.destroy = destroy_resource,
+	.set_source = viewport_set_source,
+	.set_destination = viewport_set_destination,
+};
+
+static void
+viewporter_get_viewport(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+			struct wl_resource *surface)
+{
+	struct wl_resource *r = wl_resource_create(client, &wp_viewport_interface, 1, id);
+	(void)resource;
+	(void)surface;
+
+	if (r == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(r, &viewport_impl, NULL, NULL);
+}
+
+static const struct wp_viewporter_interface viewporter_impl = {
+	.destroy = destroy_resource,
+	.get_viewport = viewporter_get_viewport,
+};
+
+// ---------------------------------------------------------------------------
+// Presentation
+
+static void
+presentation_feedback(struct wl_client *client, struct wl_resource *resource,
+		      struct wl_resource *surface, uint32_t callback)
+{
+	mc_surface_t *const s = wl_resource_get_user_data(surface);
+	struct wl_resource *r = wl_resource_create(client, &wp_presentation_feedback_interface, 1, callback);
+	(void)resource;
+
+	if (r == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(r, NULL, NULL, unlink_resource);
+	wl_list_insert(s->pending_feedback.prev, wl_resource_get_link(r));
+}
+
+static const struct wp_presentation_interface presentation_impl = {
+	.destroy = destroy_resource,
+	.feedback = presentation_feedback,
+};
+
+// ---------------------------------------------------------------------------
+// linux-dmabuf
+
+static const struct wl_buffer_interface buffer_impl = {
+	.destroy = destroy_resource,
+};
+
+static void
+params_close(mc_params_t *const p)
+{
+	unsigned int i;
+
+	for (i = 0; i != 4; ++i)
+	{
+		if (p->fds[i] != -1)
+			close(p->fds[i]);
+		p->fds[i] = -1;
+	}
+}
+
+// A dmabuf wl_buffer keeps its fds open, as a real one would
+static void
+dmabuf_buffer_destroyed(struct wl_resource *resource)
+{
+	mc_params_t *const p = wl_resource_get_user_data(resource);
+	params_close(p);
+	free(p);
+}
+
+static void
+params_add(struct wl_client *client, struct wl_resource *resource, int32_t fd, uint32_t plane_idx,
+	   uint32_t offset, uint32_t stride, uint32_t modifier_hi, uint32_t modifier_lo)
+{
+	mc_params_t *const p = wl_resource_get_user_data(resource);
+	(void)client;
+	(void)offset;
+	(void)stride;
+	(void)modifier_hi;
+	(void)modifier_lo;
+
+	if (plane_idx >= 4)
+	{
+		wl_resource_post_error(resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_IDX, "plane %u", plane_idx);
+		close(fd);
+		return;
+	}
+	if (p->fds[plane_idx] != -1)
+	{
+		wl_resource_post_error(resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_SET, "plane %u set", plane_idx);
+		close(fd);
+		return;
+	}
+	p->fds[plane_idx] = fd;
+}
+
+static bool
+dmabuf_fmt_known(const uint32_t format)
+{
+	unsigned int i;
+
+	for (i = 0; i != MC_DMABUF_FMTS; ++i)
+	{
+		if (mc_dmabuf_fmts[i].fourcc == format)
+			return true;
+	}
+	return false;
+}
+
+// Returns the new buffer, NULL (error posted) if the params were bad
+static struct wl_resource *
+params_buffer_new(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+		  int32_t width, int32_t height, uint32_t format)
+{
+	mc_params_t *const p = wl_resource_get_user_data(resource);
+	mc_params_t *bp;
+	struct wl_resource *r;
+
+	if (p->used)
+	{
+		wl_resource_post_error(resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED, "params already used");
+		return NULL;
+	}
+	p->used = true;
+	if (p->fds[0] == -1)
+	{
+		wl_resource_post_error(resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE, "no plane 0");
+		return NULL;
+	}
+	if (width <= 0 || height <= 0)
+	{
+		wl_resource_post_error(resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_DIMENSIONS,
+				       "%dx%d", width, height);
+		return NULL;
+	}
+	if (!dmabuf_fmt_known(format))
+	{
+		wl_resource_post_error(resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_FORMAT,
+				       "format %#x", format);
+		return NULL;
+	}
+
+	if ((bp = malloc(sizeof(*bp))) == NULL ||
+	    (r = wl_resource_create(client, &wl_buffer_interface, 1, id)) == NULL)
+	{
+		free(bp);
+		wl_client_post_no_memory(client);
+		return NULL;
+	}
+	*bp = *p;
+	memset(p->fds, 0xff, sizeof(p->fds));
+	++p->mc->stats.dmabuf_buffers;
+	wl_resource_set_implementation(r, &buffer_impl, bp, dmabuf_buffer_destroyed);
+	return r;
+}
+
+static void
+params_create(struct wl_client *client, struct wl_resource *resource,
+	      int32_t width, int32_t height, uint32_t format, uint32_t flags)
+{
+	struct wl_resource *r;
+	(void)flags;
+
+	if ((r = params_buffer_new(client, resource, 0, width, height, format)) != NULL)
+		zwp_linux_buffer_params_v1_send_created(resource, r);
+}
+
+static void
+params_create_immed(struct wl_client *client, struct wl_resource *resource, uint32_t buffer_id,
+		    int32_t width, int32_t height, uint32_t format, uint32_t flags)
+{
+	(void)flags;
+	params_buffer_new(client, resource, buffer_id, width, height, format);
+}
+
+static const struct zwp_linux_buffer_params_v1_interface params_impl = {
+	.destroy = destroy_resource,
+	.add = params_add,
+	.create = params_create,
+	.create_immed = params_create_immed,
+};
+
+static void
+params_destroyed(struct wl_resource *resource)
+{
+	mc_params_t *const p = wl_resource_get_user_data(resource);
+	params_close(p);
+	free(p);
+}
+
+static void
+dmabuf_create_params(struct wl_client *client, struct wl_resource *resource, uint32_t params_id)
+{
+	mc_params_t *p;
+	struct wl_resource *r;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL ||
+	    (r = wl_resource_create(client, &zwp_linux_buffer_params_v1_interface,
+				    wl_resource_get_version(resource), params_id)) == NULL)
+	{
+		free(p);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	p->mc = wl_resource_get_user_data(resource);
+	memset(p->fds, 0xff, sizeof(p->fds));
+	wl_resource_set_implementation(r, &params_impl, p, params_destroyed);
+}
+
+static const struct zwp_linux_dmabuf_feedback_v1_interface feedback_impl = {
+	.destroy = destroy_resource,
+};
+
+static void
+feedback_tranche_send(struct wl_resource *const r, struct wl_array *const dev,
+		      const unsigned int start, const unsigned int end, const uint32_t flags)
+{
+	struct wl_array idx;
+	unsigned int i;
+	uint16_t *p;
+
+	wl_array_init(&idx);
+	for (i = start; i != end; ++i)
+	{
+		if ((p = wl_array_add(&idx, sizeof(*p))) != NULL)
+			*p = i;
+	}
+	zwp_linux_dmabuf_feedback_v1_send_tranche_target_device(r, dev);
+	zwp_linux_dmabuf_feedback_v1_send_tranche_flags(r, flags);
+	zwp_linux_dmabuf_feedback_v1_send_tranche_formats(r, &idx);
+	zwp_linux_dmabuf_feedback_v1_send_tranche_done(r);
+	wl_array_release(&idx);
+}
+
+static void
+dmabuf_get_feedback(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	mc_t *const mc = wl_resource_get_user_data(resource);
+	struct wl_resource *r = wl_resource_create(client, &zwp_linux_dmabuf_feedback_v1_interface,
+						   wl_resource_get_version(resource), id);
+	struct wl_array dev;
+	dev_t *p;
+
+	if (r == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(r, &feedback_impl, NULL, NULL);
+
+	wl_array_init(&dev);
+	if ((p = wl_array_add(&dev, sizeof(*p))) != NULL)
+		*p = mc->main_dev;
+	zwp_linux_dmabuf_feedback_v1_send_format_table(r, mc->fmt_table_fd, mc->fmt_table_size);
+	zwp_linux_dmabuf_feedback_v1_send_main_device(r, &dev);
+	feedback_tranche_send(r, &dev, 0, MC_SCANOUT_FMTS, ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT);
+	feedback_tranche_send(r, &dev, 0, MC_DMABUF_FMTS, 0);
+	zwp_linux_dmabuf_feedback_v1_send_done(r);
+	wl_array_release(&dev);
+}
+
+static void
+dmabuf_get_surface_feedback(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+			    struct wl_resource *surface)
+{
+	(void)surface;
+	dmabuf_get_feedback(client, resource, id);
+}
+
+static const struct zwp_linux_dmabuf_v1_interface dmabuf_impl = {
+	.destroy = destroy_resource,
+	.create_params = dmabuf_create_params,
+	.get_default_feedback = dmabuf_get_feedback,
+	.get_surface_feedback = dmabuf_get_surface_feedback,
+};
+
+// v4 table entry
+typedef struct mc_fmt_table_ent_s {
+	uint32_t format;
+	uint32_t pad;
+	uint64_t modifier;
+} mc_fmt_table_ent_t;
+
+static int
+fmt_table_new(mc_t *const mc)
+{
+	mc_fmt_table_ent_t *ents;
+	unsigned int i;
+
+	mc->fmt_table_size = sizeof(*ents) * MC_DMABUF_FMTS;
+	if ((mc->fmt_table_fd = memfd_create("mc_fmt_table", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1)
+		return -errno;
+	if (ftruncate(mc->fmt_table_fd, mc->fmt_table_size) != 0 ||
+	    (ents = mmap(NULL, mc->fmt_table_size, PROT_READ | PROT_WRITE, MAP_SHARED, mc->fmt_table_fd, 0)) == MAP_FAILED)
+		return -errno;
+	for (i = 0; i != MC_DMABUF_FMTS; ++i)
+		ents[i] = (mc_fmt_table_ent_t){.format = mc_dmabuf_fmts[i].fourcc, .modifier = mc_dmabuf_fmts[i].modifier};
+	munmap(ents, mc->fmt_table_size);
+	// Clients map it read only & shared - stop it changing under them
+	fcntl(mc->fmt_table_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+	return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Globals
+
+static void
+bind_compositor(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *r = wl_resource_create(client, &wl_compositor_interface, version, id);
+	if (r == NULL)
+		wl_client_post_no_memory(client);
+	else
+		wl_resource_set_implementation(r, &compositor_impl, data, NULL);
+}
+
+static void
+bind_subcompositor(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *r = wl_resource_create(client, &wl_subcompositor_interface, version, id);
+	if (r == NULL)
+		wl_client_post_no_memory(client);
+	else
+		wl_resource_set_implementation(r, &subcompositor_impl, data, NULL);
+}
+
+static void
+bind_wm_base(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *r = wl_resource_create(client, &xdg_wm_base_interface, version, id);
+	if (r == NULL)
+		wl_client_post_no_memory(client);
+	else
+		wl_resource_set_implementation(r, &wm_base_impl, data, NULL);
+}
+
+static void
+bind_decoration_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *r = wl_resource_create(client, &zxdg_decoration_manager_v1_interface, version, id);
+	if (r == NULL)
+		wl_client_post_no_memory(client);
+	else
+		wl_resource_set_implementation(r, &decoration_manager_impl, data, NULL);
+}
+
+static void
+bind_viewporter(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *r = wl_resource_create(client, &wp_viewporter_interface, version, id);
+	if (r == NULL)
+		wl_client_post_no_memory(client);
+	else
+		wl_resource_set_implementation(r, &viewporter_impl, data, NULL);
+}
+
+static void
+bind_presentation(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *r = wl_resource_create(client, &wp_presentation_interface, version, id);
+	if (r == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(r, &presentation_impl, data, NULL);
+	wp_presentation_send_clock_id(r, CLOCK_MONOTONIC);
+}
+
+static void
+bind_dmabuf(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *r = wl_resource_create(client, &zwp_linux_dmabuf_v1_interface, version, id);
+	unsigned int i;
+
+	if (r == NULL)
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(r, &dmabuf_impl, data, NULL);
+
+	// Pre-feedback clients get the list as events
+	if (version >= 4)
+		return;
+	for (i = 0; i != MC_DMABUF_FMTS; ++i)
+	{
+		const struct mc_dmabuf_fmt_s *const f = mc_dmabuf_fmts + i;
+		if (version >= 3)
+			zwp_linux_dmabuf_v1_send_modifier(r, f->fourcc, (uint32_t)(f->modifier >> 32), (uint32_t)f->modifier);
+		else if (f->modifier == DRM_MOD_INVALID)
+			zwp_linux_dmabuf_v1_send_format(r, f->fourcc);
+	}
+}
+
+static int
+globals_create(mc_t *const mc)
+{
+	static const uint32_t shm_fmts[] = {WL_SHM_FORMAT_NV12, WL_SHM_FORMAT_YUV420, WL_SHM_FORMAT_P010};
+	unsigned int i;
+
+	if (wl_display_init_shm(mc->display) != 0)
+		return -1;
+	for (i = 0; i != sizeof(shm_fmts) / sizeof(shm_fmts[0]); ++i)
+		wl_display_add_shm_format(mc->display, shm_fmts[i]);
+
+	if (wl_global_create(mc->display, &wl_compositor_interface, 4, mc, bind_compositor) == NULL ||
+	    wl_global_create(mc->display, &wl_subcompositor_interface, 1, mc, bind_subcompositor) == NULL ||
+	    wl_global_create(mc->display, &xdg_wm_base_interface, 1, mc, bind_wm_base) == NULL ||
+	    wl_global_create(mc->display, &zxdg_decoration_manager_v1_interface, 1, mc, bind_decoration_manager) == NULL ||
+	    wl_global_create(mc->display, &wp_viewporter_interface, 1, mc, bind_viewporter) == NULL ||
+	    wl_global_create(mc->display, &wp_presentation_interface, 1, mc, bind_presentation) == NULL ||
+	    wl_global_create(mc->display, &zwp_linux_dmabuf_v1_interface, 4, mc, bind_dmabuf) == NULL)
+		return -1;
+	return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Script
+
+static int
+event_cmp(const void *a, const void *b)
+{
+	const mc_event_t *const x = a, *const y = b;
+	if (x->t_ns != y->t_ns)
+		return x->t_ns < y->t_ns ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static mc_event_t *
+event_add(mc_t *const mc, const uint64_t t_ns, const enum mc_op op)
+{
+	mc_event_t *ev;
+
+	if ((mc->n_events & 63) == 0)
+	{
+		mc_event_t *const events = realloc(mc->events, sizeof(*events) * (mc->n_events + 64));
+		if (events == NULL)
+			return NULL;
+		mc->events = events;
+	}
+	ev = mc->events + mc->n_events;
+	*ev = (mc_event_t){.t_ns = t_ns, .seq = mc->n_events, .op = op};
+	++mc->n_events;
+	return ev;
+}
+
+static int
+script_load(mc_t *const mc, const char *const fname)
+{
+	FILE *const f = fopen(fname, "r");
+	char line[256];
+	unsigned int lineno = 0;
+	uint64_t t = 0;
+
+	if (f == NULL)
+	{
+		fprintf(stderr, "Can't open script %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		char cmd[32];
+		char *const hash = strchr(line, '#');
+		double v;
+		unsigned int n, ms;
+		int w0, h0, w1, h1;
+		mc_event_t *ev = NULL;
+		bool ok = true;
+
+		++lineno;
+		if (hash != NULL)
+			*hash = 0;
+		if (sscanf(line, "%31s", cmd) != 1)
+			continue;
+
+		if (strcmp(cmd, "at") == 0)
+		{
+			if ((ok = sscanf(line, "%*s %lf", &v) == 1 && v >= 0))
+				t = (uint64_t)(v * 1e6);
+		}
+		else if (strcmp(cmd, "refresh") == 0)
+		{
+			if ((ok = sscanf(line, "%*s %lf", &v) == 1 && v >= 1 && v <= 1000) &&
+			    (ev = event_add(mc, t, MC_OP_REFRESH)) != NULL)
+				ev->val = v;
+		}
+		else if (strcmp(cmd, "release-delay") == 0)
+		{
+			if ((ok = sscanf(line, "%*s %lf", &v) == 1 && v >= 0) &&
+			    (ev = event_add(mc, t, MC_OP_RELEASE_DELAY)) != NULL)
+				ev->val = v;
+		}
+		else if (strcmp(cmd, "configure") == 0)
+		{
+			if ((ok = sscanf(line, "%*s %d %d", &w0, &h0) == 2 && w0 >= 0 && h0 >= 0) &&
+			    (ev = event_add(mc, t, MC_OP_CONFIGURE)) != NULL)
+			{
+				ev->w = w0;
+				ev->h = h0;
+			}
+		}
+		else if (strcmp(cmd, "resize-storm") == 0)
+		{
+			unsigned int i;
+			if ((ok = sscanf(line, "%*s %u %u %d %d %d %d", &n, &ms, &w0, &h0, &w1, &h1) == 6 &&
+			     w0 >= 0 && h0 >= 0 && w1 >= 0 && h1 >= 0))
+			{
+				for (i = 0; i != n; ++i)
+				{
+					if ((ev = event_add(mc, t + (uint64_t)i * ms * 1000000, MC_OP_CONFIGURE)) == NULL)
+						break;
+					ev->w = (i & 1) ? w1 : w0;
+					ev->h = (i & 1) ? h1 : h0;
+				}
+			}
+		}
+		else if (strcmp(cmd, "close") == 0)
+			ev = event_add(mc, t, MC_OP_CLOSE);
+		else if (strcmp(cmd, "quit") == 0)
+			ev = event_add(mc, t, MC_OP_QUIT);
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			fprintf(stderr, "%s:%u: bad command: %s", fname, lineno, line);
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+
+	qsort(mc->events, mc->n_events, sizeof(*mc->events), event_cmp);
+	return 0;
+}
+
+static void
+script_run(mc_t *const mc, const mc_event_t *const ev)
+{
+	mc_xdg_t *x;
+
+	VLOG("%.3f: script op %d\n", (ns_now() - mc->t0) / 1e9, ev->op);
+	switch (ev->op)
+	{
+		case MC_OP_REFRESH:
+			refresh_set(mc, ev->val);
+			break;
+		case MC_OP_RELEASE_DELAY:
+			mc->release_delay_ns = (uint64_t)(ev->val * 1000);
+			break;
+		case MC_OP_CONFIGURE:
+			mc->cfg_w = ev->w;
+			mc->cfg_h = ev->h;
+			wl_list_for_each(x, &mc->xdgs, link)
+			{
+				if (x->configured)
+					xdg_configure_send(x);
+			}
+			break;
+		case MC_OP_CLOSE:
+			wl_list_for_each(x, &mc->xdgs, link)
+				xdg_toplevel_send_close(x->toplevel);
+			break;
+		case MC_OP_QUIT:
+			wl_display_terminate(mc->display);
+			break;
+	}
+}
+
+static int
+script_timer_cb(int fd, uint32_t mask, void *data)
+{
+	mc_t *const mc = data;
+	const uint64_t now = ns_now();
+
+	(void)mask;
+	timer_read(fd);
+	while (mc->next_event != mc->n_events && mc->t0 + mc->events[mc->next_event].t_ns <= now)
+		script_run(mc, mc->events + mc->next_event++);
+	if (mc->next_event != mc->n_events)
+		timer_set(mc->script_fd, mc->t0 + mc->events[mc->next_event].t_ns);
+	return 0;
+}
+
+// ---------------------------------------------------------------------------
+
+static int
+signal_cb(int signal_number, void *data)
+{
+	mc_t *const mc = data;
+	int status;
+
+	if (signal_number == SIGCHLD)
+	{
+		if (mc->child <= 0 || waitpid(mc->child, &status, WNOHANG) != mc->child)
+			return 0;
+		mc->child = 0;
+		mc->child_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	}
+	wl_display_terminate(mc->display);
+	return 0;
+}
+
+static pid_t
+client_spawn(const char *const socket, char *const argv[])
+{
+	const pid_t pid = fork();
+	sigset_t mask;
+
+	if (pid != 0)
+		return pid;
+
+	// wl_event_loop_add_signal blocked these in us
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+	setenv("WAYLAND_DISPLAY", socket, 1);
+	execvp(argv[0], argv);
+	fprintf(stderr, "Failed to run %s: %s\n", argv[0], strerror(errno));
+	_exit(127);
+}
+
+static void
+stats_print(const mc_t *const mc)
+{
+	const mc_stats_t *const s = &mc->stats;
+	const double secs = (ns_now() - mc->t0) / 1e9;
+
+	fprintf(stderr,
+		"mock_compositor: %.3f s, %u vblanks (%u missed), %u commits\n"
+		"  buffers: latched=%u replaced unshown=%u released=%u dmabuf created=%u\n"
+		"  frame callbacks=%u, feedback presented=%u discarded=%u\n"
+		"  configures=%u acked=%u\n",
+		secs, s->vblanks, s->vblanks_missed, s->commits,
+		s->latched, s->replaced, s->released, s->dmabuf_buffers,
+		s->frame_done, s->fb_presented, s->fb_discarded,
+		s->configures, s->acks);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: mock_compositor [-r <hz>] [-d <us>] [-o <w>x<h>] [-s <script>]\n"
+		"                       [-S <socket>] [-v] [--] [<client> [<args>...]]\n"
+		" -r  Vblank rate (default 60)\n"
+		" -d  Release delay for replaced buffers (default 0)\n"
+		" -o  Output size used for fullscreen (default 1920x1080)\n"
+		" -s  Script of timed changes\n"
+		" -S  Socket name (default picks a free one)\n"
+		" -v  Log configures & script steps\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static mc_t mc0;
+	mc_t *const mc = &mc0;
+	const char *script = NULL;
+	const char *socket = NULL;
+	double refresh = 60.0;
+	struct stat st;
+	int n;
+
+	mc->release_delay_ns = 0;
+	mc->out_w = 1920;
+	mc->out_h = 1080;
+	mc->child_status = 0;
+
+	for (n = 1; n < argc; ++n)
+	{
+		const char *const arg = argv[n];
+		const char *const val = n + 1 < argc ? argv[n + 1] : NULL;
+
+		if (strcmp(arg, "--") == 0)
+		{
+			++n;
+			break;
+		}
+		if (arg[0] != '-')
+			break;
+		if (strcmp(arg, "-v") == 0)
+		{
+			verbose = true;
+			continue;
+		}
+		if (val == NULL)
+			usage();
+		if (strcmp(arg, "-r") == 0)
+		{
+			if ((refresh = atof(val)) < 1 || refresh > 1000)
+				usage();
+		}
+		else if (strcmp(arg, "-d") == 0)
+			mc->release_delay_ns = (uint64_t)(atof(val) * 1000);
+		else if (strcmp(arg, "-o") == 0)
+		{
+			if (sscanf(val, "%dx%d", &mc->out_w, &mc->out_h) != 2 || mc->out_w <= 0 || mc->out_h <= 0)
+				usage();
+		}
+		else if (strcmp(arg, "-s") == 0)
+			script = val;
+		else if (strcmp(arg, "-S") == 0)
+			socket = val;
+		else
+			usage();
+		++n;
+	}
+
+	wl_list_init(&mc->releases);
+	wl_list_init(&mc->surfaces);
+	wl_list_init(&mc->xdgs);
+	if (stat("/dev/dri/renderD128", &st) == 0)
+		mc->main_dev = st.st_rdev;
+
+	if (script != NULL && script_load(mc, script) != 0)
+		return 1;
+
+	if ((mc->display = wl_display_create()) == NULL)
+	{
+		fprintf(stderr, "Failed to create display\n");
+		return 1;
+	}
+	mc->loop = wl_display_get_event_loop(mc->display);
+
+	if (fmt_table_new(mc) != 0 || globals_create(mc) != 0)
+	{
+		fprintf(stderr, "Failed to create globals\n");
+		return 1;
+	}
+	if (socket != NULL ? wl_display_add_socket(mc->display, socket) != 0 :
+	    (socket = wl_display_add_socket_auto(mc->display)) == NULL)
+	{
+		fprintf(stderr, "Failed to add socket\n");
+		return 1;
+	}
+
+	mc->vbl_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	mc->rel_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	mc->script_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (mc->vbl_fd == -1 || mc->rel_fd == -1 || mc->script_fd == -1 ||
+	    wl_event_loop_add_fd(mc->loop, mc->vbl_fd, WL_EVENT_READABLE, vblank_timer_cb, mc) == NULL ||
+	    wl_event_loop_add_fd(mc->loop, mc->rel_fd, WL_EVENT_READABLE, release_timer_cb, mc) == NULL ||
+	    wl_event_loop_add_fd(mc->loop, mc->script_fd, WL_EVENT_READABLE, script_timer_cb, mc) == NULL ||
+	    wl_event_loop_add_signal(mc->loop, SIGCHLD, signal_cb, mc) == NULL ||
+	    wl_event_loop_add_signal(mc->loop, SIGINT, signal_cb, mc) == NULL ||
+	    wl_event_loop_add_signal(mc->loop, SIGTERM, signal_cb, mc) == NULL)
+	{
+		fprintf(stderr, "Failed to set up event loop\n");
+		return 1;
+	}
+
+	mc->t0 = ns_now();
+	mc->period_ns = (uint64_t)(1e9 / refresh + 0.5);
+	mc->vbl_next = mc->t0 + mc->period_ns;
+	timer_set(mc->vbl_fd, mc->vbl_next);
+	// Anything at time 0 happens before the client connects
+	script_timer_cb(mc->script_fd, 0, mc);
+
+	fprintf(stderr, "mock_compositor: listening on %s\n", socket);
+	if (n < argc && (mc->child = client_spawn(socket, argv + n)) < 0)
+	{
+		fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+		return 1;
+	}
+
+	wl_display_run(mc->display);
+
+	if (mc->child > 0)
+	{
+		kill(mc->child, SIGTERM);
+		waitpid(mc->child, NULL, 0);
+		mc->child_status = 1;
+	}
+	stats_print(mc);
+
+	wl_display_destroy_clients(mc->display);
+	wl_display_destroy(mc->display);
+	close(mc->vbl_fd);
+	close(mc->rel_fd);
+	close(mc->script_fd);
+	close(mc->fmt_table_fd);
+	free(mc->events);
+	return mc->child_status;
+}
@@ -0,0 +1,584 @@
+// Display path benchmark with synthetic DRM_PRIME frames
+//
+// Builds a pool of AVDRMFrameDescriptor frames on memfd buffers (made into
+// real dmabufs with udmabuf where the kernel has it) and pushes them
+// through the output API as fast as it will take them, so display path
+// regressions show up without a hardware decoder. Reports frames/s, CPU
+// time per frame and latency percentiles for each stage:
+//   wait     for a pool buffer to come back from the output
+//   display  inside egl_wayland_out_display
+//   hold     from egl_wayland_out_display until the output lets go
+// and the heap allocations per frame made by every thread while timing.
+// Each synthetic frame costs 2 of those itself (its av_buffer_create).
+
+#define _GNU_SOURCE
+#include "init_window.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/udmabuf.h>
+
+#include "libavutil/buffer.h"
+#include "libavutil/frame.h"
+#include "libavutil/hwcontext_drm.h"
+#include "libavutil/pixfmt.h"
+
+#define DRM_FOURCC(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+#define R8   DRM_FOURCC('R', '8', ' ', ' ')
+
+#define POOL_MAX 64
+
+static const struct bench_fmt_s {
+	const char *name;
+	uint32_t fourcc;            // Whole frame
+	unsigned int n_planes;
+	uint32_t plane_fourcc[3];   // For the layer per plane layout
+	unsigned int cpp[3];        // Bytes per (subsampled) pixel
+	unsigned int bpc;           // Bytes per component
+} bench_fmts[] = {
+	{"nv12", DRM_FOURCC('N', 'V', '1', '2'), 2,
+	 {R8, DRM_FOURCC('G', 'R', '8', '8')}, {1, 2}, 1},
+	{"yuv420", DRM_FOURCC('Y', 'U', '1', '2'), 3,
+	 {R8, R8, R8}, {1, 1, 1}, 1},
+	{"p010", DRM_FOURCC('P', '0', '1', '0'), 2,
+	 {DRM_FOURCC('R', '1', '6', ' '), DRM_FOURCC('G', 'R', '3', '2')}, {2, 4}, 2},
+	{"xrgb", DRM_FOURCC('X', 'R', '2', '4'), 1,
+	 {DRM_FOURCC('X', 'R', '2', '4')}, {4}, 1},
+};
+#define BENCH_FMTS (sizeof(bench_fmts) / sizeof(bench_fmts[0]))
+
+enum bench_layout {
+	LAYOUT_FRAME,    // One object, one layer with a plane each
+	LAYOUT_OBJECTS,  // An object per plane, one layer
+	LAYOUT_LAYERS,   // One object, a single plane layer per plane
+};
+static const char *const layout_names[] = {"frame", "objects", "layers"};
+
+struct bench_s;
+
+typedef struct bench_buf_s {
+	struct bench_s *b;
+	AVDRMFrameDescriptor desc;
+	uint8_t *map[AV_DRM_MAX_PLANES];
+	size_t size[AV_DRM_MAX_PLANES];
+	uint64_t t_display;
+	struct bench_buf_s *next;
+} bench_buf_t;
+
+typedef struct bench_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bench_buf_t *free;          // Buffers the output has let go of
+	bool timing;                // Record hold times
+	unsigned int n_hold;
+	unsigned int n_hold_max;
+	uint64_t *hold_ns;
+	unsigned int udmabuf;       // Buffers that are real dmabufs
+} bench_t;
+
+// Every malloc family call in the process, libav's included, goes through
+// these ahead of glibc's own
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static _Atomic uint64_t n_allocs;
+
+static inline void
+alloc_count(void)
+{
+	atomic_fetch_add_explicit(&n_allocs, 1, memory_order_relaxed);
+}
+
+void *
+malloc(size_t size)
+{
+	alloc_count();
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	alloc_count();
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	alloc_count();
+	return __libc_realloc(ptr, size);
+}
+
+void *
+memalign(size_t align, size_t size)
+{
+	alloc_count();
+	return __libc_memalign(align, size);
+}
+
+void *
+aligned_alloc(size_t align, size_t size)
+{
+	alloc_count();
+	return __libc_memalign(align, size);
+}
+
+int
+posix_memalign(void **pptr, size_t align, size_t size)
+{
+	void *ptr;
+
+	alloc_count();
+	if ((ptr = __libc_memalign(align, size)) == NULL)
+		return ENOMEM;
+	*pptr = ptr;
+	return 0;
+}
+
+static uint64_t
+ns_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+cpu_ns_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Called from whichever thread drops the last ref - usually the display thread
+static void
+buf_free_cb(void *opaque, uint8_t *data)
+{
+	bench_buf_t *const buf = opaque;
+	bench_t *const b = buf->b;
+	const uint64_t now = ns_now();
+
+	(void)data;
+	pthread_mutex_lock(&b->lock);
+	if (b->timing && b->n_hold != b->n_hold_max)
+		b->hold_ns[b->n_hold++] = now - buf->t_display;
+	buf->next = b->free;
+	b->free = buf;
+	pthread_cond_signal(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+}
+
+// Returns a dmabuf fd if udmabuf will give us one, else the memfd
+static int
+buf_obj_alloc(bench_t *const b, const int udmabuf_fd, const size_t size, uint8_t **const pmap)
+{
+	int fd = memfd_create("out_bench", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	struct udmabuf_create create = {.flags = UDMABUF_FLAGS_CLOEXEC, .size = size};
+	int dfd;
+
+	if (fd == -1)
+		return -1;
+	if (ftruncate(fd, size) != 0 ||
+	    (*pmap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+
+	create.memfd = fd;
+	if (udmabuf_fd == -1 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0 ||
+	    (dfd = ioctl(udmabuf_fd, UDMABUF_CREATE, &create)) < 0)
+		return fd;
+
+	// The dmabuf holds the pages; our mapping stays valid
+	close(fd);
+	++b->udmabuf;
+	return dfd;
+}
+
+// Luma ramp down the frame, offset per buffer so each one looks different
+static void
+buf_fill(const bench_buf_t *const buf, const struct bench_fmt_s *const bf,
+	 const unsigned int idx, const unsigned int w, const unsigned int h)
+{
+	unsigned int i, x, y;
+
+	for (i = 0; i != bf->n_planes; ++i)
+	{
+		const AVDRMLayerDescriptor *const layer = buf->desc.layers + (buf->desc.nb_layers == 1 ? 0 : i);
+		const AVDRMPlaneDescriptor *const plane = layer->planes + (buf->desc.nb_layers == 1 ? i : 0);
+		const unsigned int rows = i == 0 ? h : (h + 1) / 2;
+		const unsigned int cols = (i == 0 ? w : (w + 1) / 2) * bf->cpp[i] / bf->bpc;
+		uint8_t *const p = buf->map[plane->object_index] + plane->offset;
+
+		for (y = 0; y != rows; ++y)
+		{
+			uint8_t *const row = p + plane->pitch * y;
+			const unsigned int v = i != 0 ? 128 : 16 + (y * 219 / rows + idx * 37) % 220;
+
+			if (bf->bpc == 1)
+				memset(row, v, cols);
+			else
+				for (x = 0; x != cols; ++x)
+					((uint16_t *)row)[x] = v << 8;
+		}
+	}
+}
+
+static int
+buf_init(bench_t *const b, bench_buf_t *const buf, const int udmabuf_fd,
+	 const struct bench_fmt_s *const bf, const enum bench_layout layout,
+	 const unsigned int align, const unsigned int idx, const unsigned int w, const unsigned int h)
+{
+	AVDRMFrameDescriptor *const desc = &buf->desc;
+	const long page = sysconf(_SC_PAGESIZE);
+	size_t offset[3];
+	size_t pitch[3];
+	size_t total = 0;
+	unsigned int i;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->b = b;
+
+	for (i = 0; i != bf->n_planes; ++i)
+	{
+		const size_t rows = i == 0 ? h : (h + 1) / 2;
+		pitch[i] = ((size_t)(i == 0 ? w : (w + 1) / 2) * bf->cpp[i] + align - 1) / align * align;
+		offset[i] = layout == LAYOUT_OBJECTS ? 0 : total;
+		total = (layout == LAYOUT_OBJECTS ? 0 : total) + pitch[i] * rows;
+
+		if (layout == LAYOUT_OBJECTS || i == bf->n_planes - 1)
+		{
+			const unsigned int n = desc->nb_objects++;
+			buf->size[n] = (total + page - 1) / page * page;
+			if ((desc->objects[n].fd = buf_obj_alloc(b, udmabuf_fd, buf->size[n], buf->map + n)) == -1)
+				return -errno;
+			desc->objects[n].size = buf->size[n];
+			desc->objects[n].format_modifier = 0;  // Linear
+		}
+	}
+
+	if (layout == LAYOUT_LAYERS)
+	{
+		desc->nb_layers = bf->n_planes;
+		for (i = 0; i != bf->n_planes; ++i)
+		{
+			desc->layers[i].format = bf->plane_fourcc[i];
+			desc->layers[i].nb_planes = 1;
+			desc->layers[i].planes[0].offset = offset[i];
+			desc->layers[i].planes[0].pitch = pitch[i];
+		}
+	}
+	else
+	{
+		desc->nb_layers = 1;
+		desc->layers[0].format = bf->fourcc;
+		desc->layers[0].nb_planes = bf->n_planes;
+		for (i = 0; i != bf->n_planes; ++i)
+		{
+			desc->layers[0].planes[i].object_index = layout == LAYOUT_OBJECTS ? i : 0;
+			desc->layers[0].planes[i].offset = offset[i];
+			desc->layers[0].planes[i].pitch = pitch[i];
+		}
+	}
+
+	buf_fill(buf, bf, idx, w, h);
+	return 0;
+}
+
+static void
+buf_uninit(bench_buf_t *const buf)
+{
+	int i;
+
+	for (i = 0; i != buf->desc.nb_objects; ++i)
+	{
+		munmap(buf->map[i], buf->size[i]);
+		close(buf->desc.objects[i].fd);
+	}
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+print_stage(const char *const name, uint64_t *const ns, const unsigned int n)
+{
+	static const unsigned int pm[] = {500, 900, 990, 999};
+	unsigned int i;
+
+	printf("%-8s %8u", name, n);
+	if (n == 0)
+	{
+		printf("\n");
+		return;
+	}
+	qsort(ns, n, sizeof(*ns), cmp_u64);
+	for (i = 0; i != sizeof(pm) / sizeof(pm[0]); ++i)
+		printf(" %9.1f", ns[(uint64_t)(n - 1) * pm[i] / 1000] / 1000.0);
+	printf(" %9.1f\n", ns[n - 1] / 1000.0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: out_bench [-d|-H <w>x<h>|-m <tiles>] [-F] [-f <format>] [-l <layout>]\n"
+		"                 [-w <width>] [-h <height>] [-a <align>] [-p <pool>]\n"
+		"                 [-n <frames>] [-W <warmup>] [-q <depth>] [-D]\n"
+		"                 [-P fifo|mailbox|immediate] [-T <json>]\n"
+		" -d   dmabuf output (default EGL)\n"
+		" -H   Headless EGL output drawing at w x h\n"
+		" -m   EGL mosaic output, frames go to each tile in turn\n"
+		" -F   Fullscreen\n"
+		" -f   nv12 (default), yuv420, p010 or xrgb\n"
+		" -l   frame (one object, default), objects (one per plane) or\n"
+		"      layers (one object, a layer per plane)\n"
+		" -a   Pitch alignment in bytes (default 256)\n"
+		" -p   Buffers in the pool (default 8)\n"
+		" -n   Frames timed (default 1000) after -W warmup frames (default 2 * pool)\n"
+		" -q   Display queue depth (default 2), blocking unless -D (drop oldest)\n"
+		" -P   Present mode (default immediate)\n"
+		" -T   Trace each frame's stages too, writing a Chrome trace at exit\n"
+		"Defaults are 1920x1080\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static bench_buf_t bufs[POOL_MAX];
+	const struct bench_fmt_s *bf = bench_fmts;
+	enum bench_layout layout = LAYOUT_FRAME;
+	enum egl_wayland_out_present_mode present_mode = EGL_WAYLAND_OUT_PRESENT_IMMEDIATE;
+	bool use_dmabuf = false, fullscreen = false, drop = false;
+	unsigned int w = 1920, h = 1080, align = 256, pool = 8, frames = 1000, warm = ~0U;
+	unsigned int depth = 2, mosaic = 0, hl_w = 0, hl_h = 0;
+	struct egl_wayland_out_env *dpo;
+	bench_t bench = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+	uint64_t *wait_ns, *disp_ns;
+	uint64_t t_start = 0, t_end, cpu_start = 0, cpu_end;
+	uint64_t allocs_start = 0, allocs_end;
+	AVFrame *frame;
+	unsigned int i;
+	int udmabuf_fd;
+	int n;
+
+	for (n = 1; n < argc; ++n)
+	{
+		const char *const arg = argv[n];
+		const char *const val = n + 1 < argc ? argv[n + 1] : NULL;
+
+		if (strcmp(arg, "-d") == 0)
+			use_dmabuf = true;
+		else if (strcmp(arg, "-F") == 0)
+			fullscreen = true;
+		else if (strcmp(arg, "-D") == 0)
+			drop = true;
+		else if (val == NULL)
+			usage();
+		else if (strcmp(arg, "-H") == 0)
+		{
+			if (sscanf(val, "%ux%u", &hl_w, &hl_h) != 2 || hl_w == 0 || hl_h == 0)
+				usage();
+		}
+		else if (strcmp(arg, "-f") == 0)
+		{
+			for (bf = bench_fmts; bf != bench_fmts + BENCH_FMTS && strcmp(bf->name, val) != 0; ++bf)
+				;
+			if (bf == bench_fmts + BENCH_FMTS)
+				usage();
+		}
+		else if (strcmp(arg, "-l") == 0)
+		{
+			for (layout = 0; layout != 3 && strcmp(layout_names[layout], val) != 0; ++layout)
+				;
+			if (layout == 3)
+				usage();
+		}
+		else if (strcmp(arg, "-P") == 0)
+		{
+			if (strcmp(val, "fifo") == 0)
+				present_mode = EGL_WAYLAND_OUT_PRESENT_FIFO;
+			else if (strcmp(val, "mailbox") == 0)
+				present_mode = EGL_WAYLAND_OUT_PRESENT_MAILBOX;
+			else if (strcmp(val, "immediate") == 0)
+				present_mode = EGL_WAYLAND_OUT_PRESENT_IMMEDIATE;
+			else
+				usage();
+		}
+		else if (strcmp(arg, "-m") == 0)
+			mosaic = atoi(val);
+		else if (strcmp(arg, "-w") == 0)
+			w = atoi(val);
+		else if (strcmp(arg, "-h") == 0)
+			h = atoi(val);
+		else if (strcmp(arg, "-a") == 0)
+			align = atoi(val);
+		else if (strcmp(arg, "-p") == 0)
+			pool = atoi(val);
+		else if (strcmp(arg, "-n") == 0)
+			frames = atoi(val);
+		else if (strcmp(arg, "-W") == 0)
+			warm = atoi(val);
+		else if (strcmp(arg, "-q") == 0)
+			depth = atoi(val);
+		else if (strcmp(arg, "-T") == 0)
+		{
+			if (trace_init(val) != 0)
+				usage();
+		}
+		else
+			usage();
+		++n;
+	}
+	if (w == 0 || h == 0 || align == 0 || pool == 0 || pool > POOL_MAX || frames == 0 ||
+	    depth == 0 || depth > 16 || mosaic > 64 ||
+	    (bf->n_planes == 1 && layout != LAYOUT_FRAME) ||
+	    (use_dmabuf && mosaic != 0) || (hl_w != 0 && (use_dmabuf || mosaic != 0)))
+		usage();
+	if (warm == ~0U)
+		warm = pool * 2;
+
+	wait_ns = malloc(sizeof(*wait_ns) * frames);
+	disp_ns = malloc(sizeof(*disp_ns) * frames);
+	// Warmup frames may be let go once timing has started
+	bench.n_hold_max = frames + pool;
+	bench.hold_ns = malloc(sizeof(*bench.hold_ns) * bench.n_hold_max);
+	frame = av_frame_alloc();
+	if (wait_ns == NULL || disp_ns == NULL || bench.hold_ns == NULL || frame == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	for (i = 0; i != pool; ++i)
+	{
+		int rv = buf_init(&bench, bufs + i, udmabuf_fd, bf, layout, align, i, w, h);
+		if (rv != 0)
+		{
+			fprintf(stderr, "Failed to allocate buffer %u: %s\n", i, strerror(-rv));
+			return 1;
+		}
+		bufs[i].next = bench.free;
+		bench.free = bufs + i;
+	}
+	if (udmabuf_fd != -1)
+		close(udmabuf_fd);
+
+	dpo = hl_w != 0 ? egl_headless_out_new(hl_w, hl_h) :
+		use_dmabuf ? dmabuf_wayland_out_new(fullscreen) :
+		mosaic != 0 ? egl_wayland_out_mosaic_new(fullscreen, mosaic) : egl_wayland_out_new(fullscreen);
+	if (dpo == NULL)
+	{
+		fprintf(stderr, "Failed to open output\n");
+		return 1;
+	}
+	egl_wayland_out_set_queue(dpo, depth, drop ? EGL_WAYLAND_OUT_Q_DROP_OLDEST : EGL_WAYLAND_OUT_Q_BLOCK);
+	egl_wayland_out_present_mode(dpo, present_mode);
+	egl_wayland_out_modeset(dpo, w, h, (AVRational){0, 1}, (AVRational){0, 1});
+
+	for (i = 0; i != warm + frames; ++i)
+	{
+		const unsigned int j = i - warm;
+		bench_buf_t *buf;
+		uint64_t t0, t1, t2;
+		int rv;
+
+		if (i == warm)
+		{
+			pthread_mutex_lock(&bench.lock);
+			bench.timing = true;
+			pthread_mutex_unlock(&bench.lock);
+			t_start = ns_now();
+			cpu_start = cpu_ns_now();
+			allocs_start = atomic_load(&n_allocs);
+		}
+
+		t0 = ns_now();
+		pthread_mutex_lock(&bench.lock);
+		while ((buf = bench.free) == NULL)
+			pthread_cond_wait(&bench.cond, &bench.lock);
+		bench.free = buf->next;
+		pthread_mutex_unlock(&bench.lock);
+		t1 = ns_now();
+
+		buf->t_display = t1;
+		frame->format = AV_PIX_FMT_DRM_PRIME;
+		frame->width = w;
+		frame->height = h;
+		frame->pts = i;
+		frame->data[0] = (uint8_t *)&buf->desc;
+		if ((frame->buf[0] = av_buffer_create(frame->data[0], sizeof(buf->desc), buf_free_cb, buf, 0)) == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+
+		rv = mosaic != 0 ? egl_wayland_out_mosaic_display(dpo, i % mosaic, frame) :
+			egl_wayland_out_display(dpo, frame);
+		t2 = ns_now();
+		av_frame_unref(frame);
+		if (rv != 0)
+		{
+			fprintf(stderr, "Display failed: %d\n", rv);
+			return 1;
+		}
+
+		if (i >= warm)
+		{
+			wait_ns[j] = t1 - t0;
+			disp_ns[j] = t2 - t1;
+		}
+	}
+	t_end = ns_now();
+	cpu_end = cpu_ns_now();
+	allocs_end = atomic_load(&n_allocs);
+
+	// Frames still held are let go on delete - don't count teardown
+	pthread_mutex_lock(&bench.lock);
+	bench.timing = false;
+	pthread_mutex_unlock(&bench.lock);
+
+	printf("%s %s %ux%u, pool %u (%u udmabuf objects), queue %u %s\n",
+	       bf->name, layout_names[layout], w, h, pool, bench.udmabuf,
+	       depth, drop ? "drop-oldest" : "block");
+	printf("%u frames in %.3f s: %.1f fps, CPU %.1f us/frame\n",
+	       frames, (t_end - t_start) / 1e9, frames * 1e9 / (t_end - t_start),
+	       (cpu_end - cpu_start) / 1e3 / frames);
+	printf("%"PRIu64" heap allocations: %.2f/frame (2 are the bench's own)\n",
+	       allocs_end - allocs_start, (double)(allocs_end - allocs_start) / frames);
+	printf("%-8s %8s %9s %9s %9s %9s %9s (us)\n", "stage", "n", "p50", "p90", "p99", "p99.9", "max");
+	print_stage("wait", wait_ns, frames);
+	print_stage("display", disp_ns, frames);
+	print_stage("hold", bench.hold_ns, bench.n_hold);
+
+	egl_wayland_out_delete(dpo);
+	av_frame_free(&frame);
+	for (i = 0; i != pool; ++i)
+		buf_uninit(bufs + i);
+	free(wait_ns);
+	free(disp_ns);
+	free(bench.hold_ns);
+	return 0;
+}
@@ -0,0 +1,187 @@
+#include "pace.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libavcodec/packet.h"
+#include "libavutil/avutil.h"
+#include "libavutil/mathematics.h"
+
+// Grace for the first packet so we aren't behind at startup
+#define PACE_START_NS    3000000
+#define PACE_BACK_NS     1000000000
+#define PACE_FORWARD_NS  10000000000
+
+struct pace_s {
+	AVRational period;        // Seconds per packet, 0 if following timestamps
+	AVRational time_base;
+	enum pace_late late_policy;
+	int64_t late_ns;
+
+	bool started;
+	bool ts_seen;             // Stream has its own pts - don't stamp
+	bool skipping;
+	int64_t t0_ns;            // Deadline of packet 0 / ts0
+	int64_t n;                // Packets since t0
+	int64_t ts0;
+	int64_t last_d_ns;        // Last deadline, from t0
+
+	pace_stats_t stats;
+};
+
+static const AVRational ns_q = {1, 1000000000};
+
+static int64_t
+ns_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until(const int64_t ns)
+{
+	const struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+// Deadline from t0
+static int64_t
+rate_deadline(pace_t *const p, AVPacket *const pkt)
+{
+	if (pkt->pts != AV_NOPTS_VALUE)
+		p->ts_seen = true;
+	else if (!p->ts_seen)
+		pkt->pts = pkt->dts = av_rescale_q(p->n, p->period, p->time_base);
+
+	return av_rescale(p->n++, (int64_t)p->period.num * 1000000000, p->period.den);
+}
+
+static int64_t
+ts_deadline(pace_t *const p, const AVPacket *const pkt, const int64_t now)
+{
+	const int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+	int64_t d;
+
+	// Untimed packets go with the one before
+	if (ts == AV_NOPTS_VALUE)
+		return p->last_d_ns;
+
+	if (!p->ts_seen)
+	{
+		p->ts_seen = true;
+		p->ts0 = ts;
+		p->t0_ns = now + PACE_START_NS;
+		return 0;
+	}
+
+	d = av_rescale_q(ts - p->ts0, p->time_base, ns_q);
+	if (d < p->last_d_ns - PACE_BACK_NS || d > p->last_d_ns + PACE_FORWARD_NS)
+	{
+		++p->stats.disconts;
+		p->ts0 = ts;
+		p->t0_ns += p->last_d_ns;
+		d = 0;
+	}
+	return d;
+}
+
+static void
+resync(pace_t *const p, const int64_t late)
+{
+	p->t0_ns += late;
+	++p->stats.resyncs;
+}
+
+bool
+pace_packet(pace_t *const p, AVPacket *const pkt)
+{
+	const int64_t now = ns_now();
+	const bool key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+	int64_t d, late;
+
+	if (!p->started)
+	{
+		p->started = true;
+		p->t0_ns = now + PACE_START_NS;
+	}
+	++p->stats.packets;
+
+	d = p->period.num != 0 ? rate_deadline(p, pkt) : ts_deadline(p, pkt, now);
+	p->last_d_ns = d;
+
+	// Decoding is broken until the next keyframe anyway
+	if (p->skipping && !key)
+	{
+		++p->stats.skipped;
+		return false;
+	}
+	p->skipping = false;
+
+	late = now - (p->t0_ns + d);
+	if (late <= 0)
+	{
+		sleep_until(p->t0_ns + d);
+		return true;
+	}
+
+	++p->stats.late;
+	p->stats.late_total_ns += late;
+	if (late > p->stats.late_max_ns)
+		p->stats.late_max_ns = late;
+	if (late <= p->late_ns)
+		return true;
+
+	switch (p->late_policy)
+	{
+		case PACE_LATE_CATCHUP:
+			break;
+		case PACE_LATE_SKIP:
+			if (!key)
+			{
+				p->skipping = true;
+				++p->stats.skipped;
+				return false;
+			}
+			/* fallthrough */
+		case PACE_LATE_RESYNC:
+			resync(p, late);
+			break;
+	}
+	return true;
+}
+
+void
+pace_stats(const pace_t *const p, pace_stats_t *const stats)
+{
+	*stats = p->stats;
+}
+
+void
+pace_delete(pace_t **const pp)
+{
+	free(*pp);
+	*pp = NULL;
+}
+
+pace_t *
+pace_new(const AVRational rate, const AVRational time_base, const enum pace_late late, const int64_t late_ns)
+{
+	pace_t *const p = calloc(1, sizeof(*p));
+
+	if (p == NULL)
+		return NULL;
+	if (rate.num != 0)
+		p->period = (AVRational){rate.den, rate.num};
+	p->time_base = time_base;
+	p->late_policy = late;
+	p->late_ns = late_ns;
+	return p;
+}
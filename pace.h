@@ -0,0 +1,51 @@
+#ifndef PACE_H
+#define PACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libavutil/rational.h"
+
+struct AVPacket;
+
+// Input pacing, to make a file look like a live feed
+//
+// Each packet gets an absolute CLOCK_MONOTONIC deadline and the caller
+// sleeps until it with clock_nanosleep(TIMER_ABSTIME), so there is no drift
+// however long it runs. Deadlines are either n exact rational periods after
+// the first packet (so 60000/1001 stays 59.94Hz) or the packet's dts (pts
+// if none) after the first's - following the stream's own timing, gaps
+// and all. A jump in the timestamps of over a second back or 10s forward
+// restarts the timeline from the last deadline.
+
+enum pace_late {
+	PACE_LATE_CATCHUP,  // Send late packets at once until back on time
+	PACE_LATE_RESYNC,   // Move the timeline so the late packet is on time
+	PACE_LATE_SKIP,     // Drop packets until the next keyframe, then resync
+};
+
+typedef struct pace_stats_s {
+	unsigned int packets;     // Passed to pace_packet
+	unsigned int late;        // Past their deadline when they arrived
+	unsigned int resyncs;     // Timeline moved by the late policy
+	unsigned int skipped;     // Dropped by PACE_LATE_SKIP
+	unsigned int disconts;    // Timestamp jumps
+	int64_t late_max_ns;
+	int64_t late_total_ns;
+} pace_stats_t;
+
+struct pace_s;
+typedef struct pace_s pace_t;
+
+// rate in packets/s, or 0/x to follow timestamps in time_base
+// The late policy only applies to packets over late_ns late
+pace_t *pace_new(AVRational rate, AVRational time_base, enum pace_late late, int64_t late_ns);
+void pace_delete(pace_t **const pp);
+
+// Sleeps until pkt is due. Returns false if the packet should be dropped.
+// At a fixed rate an untimed stream (e.g. raw ES) has pts & dts filled in
+bool pace_packet(pace_t *const p, struct AVPacket *const pkt);
+
+void pace_stats(const pace_t *const p, pace_stats_t *const stats);
+
+#endif
@@ -0,0 +1,212 @@
+#include "pkt_queue.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "libavcodec/packet.h"
+#include "libavutil/avutil.h"
+#include "libavutil/error.h"
+#include "libavutil/mathematics.h"
+
+// Packets, whatever the watermarks - a power of 2
+#define PKT_QUEUE_SLOTS 1024
+
+struct pkt_queue_s {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+
+	size_t max_bytes;
+	int64_t max_dur_us;
+	AVRational time_base;
+
+	unsigned int head;         // Next get
+	unsigned int n;
+	size_t bytes;
+	int64_t dur_us;
+	int64_t last_dts;          // Of the last put, for packets with no duration
+	bool full;                 // Putter waits for the low watermark
+	bool aborted;
+	int end_err;               // Non-zero once finished
+
+	pkt_queue_stats_t stats;
+
+	AVPacket *pkts[PKT_QUEUE_SLOTS];
+	int64_t durs[PKT_QUEUE_SLOTS];
+};
+
+static bool
+over_high(const pkt_queue_t *const q)
+{
+	return q->n >= PKT_QUEUE_SLOTS || q->bytes >= q->max_bytes || q->dur_us >= q->max_dur_us;
+}
+
+static bool
+under_low(const pkt_queue_t *const q)
+{
+	return q->n <= PKT_QUEUE_SLOTS / 2 && q->bytes <= q->max_bytes / 2 && q->dur_us <= q->max_dur_us / 2;
+}
+
+static int64_t
+pkt_dur_us(pkt_queue_t *const q, const AVPacket *const pkt)
+{
+	int64_t dur = pkt->duration;
+
+	if (dur <= 0 && pkt->dts != AV_NOPTS_VALUE && q->last_dts != AV_NOPTS_VALUE && pkt->dts > q->last_dts)
+		dur = pkt->dts - q->last_dts;
+	if (pkt->dts != AV_NOPTS_VALUE)
+		q->last_dts = pkt->dts;
+	return dur <= 0 ? 0 : av_rescale_q(dur, q->time_base, AV_TIME_BASE_Q);
+}
+
+int
+pkt_queue_put(pkt_queue_t *const q, AVPacket *const pkt)
+{
+	const int64_t dur = pkt_dur_us(q, pkt);
+	unsigned int slot;
+
+	pthread_mutex_lock(&q->lock);
+	if (over_high(q))
+	{
+		q->full = true;
+		++q->stats.put_waits;
+	}
+	while (q->full && !q->aborted)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	if (q->aborted)
+	{
+		pthread_mutex_unlock(&q->lock);
+		av_packet_unref(pkt);
+		return AVERROR_EXIT;
+	}
+
+	slot = (q->head + q->n) & (PKT_QUEUE_SLOTS - 1);
+	av_packet_move_ref(q->pkts[slot], pkt);
+	q->durs[slot] = dur;
+	++q->n;
+	q->bytes += q->pkts[slot]->size;
+	q->dur_us += dur;
+
+	++q->stats.packets;
+	if (q->n > q->stats.max_packets)
+		q->stats.max_packets = q->n;
+	if (q->bytes > q->stats.max_bytes)
+		q->stats.max_bytes = q->bytes;
+	if (q->dur_us > q->stats.max_dur_us)
+		q->stats.max_dur_us = q->dur_us;
+
+	if (q->n == 1)
+		pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+void
+pkt_queue_finish(pkt_queue_t *const q, const int err)
+{
+	pthread_mutex_lock(&q->lock);
+	q->end_err = err != 0 ? err : AVERROR_EOF;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+int
+pkt_queue_get(pkt_queue_t *const q, AVPacket *const pkt)
+{
+	int rv = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->n == 0 && q->end_err == 0)
+		++q->stats.get_waits;
+	while (q->n == 0 && q->end_err == 0 && !q->aborted)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+
+	if (q->aborted)
+		rv = AVERROR_EXIT;
+	else if (q->n == 0)
+		rv = q->end_err;
+	else
+	{
+		const unsigned int slot = q->head;
+
+		av_packet_move_ref(pkt, q->pkts[slot]);
+		q->head = (slot + 1) & (PKT_QUEUE_SLOTS - 1);
+		--q->n;
+		q->bytes -= pkt->size;
+		q->dur_us -= q->durs[slot];
+
+		if (q->full && under_low(q))
+		{
+			q->full = false;
+			pthread_cond_signal(&q->not_full);
+		}
+	}
+	pthread_mutex_unlock(&q->lock);
+	return rv;
+}
+
+void
+pkt_queue_abort(pkt_queue_t *const q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->aborted = true;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void
+pkt_queue_stats(pkt_queue_t *const q, pkt_queue_stats_t *const stats)
+{
+	pthread_mutex_lock(&q->lock);
+	*stats = q->stats;
+	pthread_mutex_unlock(&q->lock);
+}
+
+void
+pkt_queue_delete(pkt_queue_t **const pq)
+{
+	pkt_queue_t *const q = *pq;
+	unsigned int i;
+
+	if (q == NULL)
+		return;
+	*pq = NULL;
+
+	for (i = 0; i != PKT_QUEUE_SLOTS; ++i)
+		av_packet_free(q->pkts + i);
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+pkt_queue_t *
+pkt_queue_new(const size_t max_bytes, const int64_t max_dur_us, const AVRational time_base)
+{
+	pkt_queue_t *q = calloc(1, sizeof(*q));
+	unsigned int i;
+
+	if (q == NULL)
+		return NULL;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	q->max_bytes = max_bytes;
+	q->max_dur_us = max_dur_us;
+	q->time_base = time_base;
+	q->last_dts = AV_NOPTS_VALUE;
+
+	for (i = 0; i != PKT_QUEUE_SLOTS; ++i)
+	{
+		if ((q->pkts[i] = av_packet_alloc()) == NULL)
+		{
+			pkt_queue_delete(&q);
+			return NULL;
+		}
+	}
+	return q;
+}
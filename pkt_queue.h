@@ -0,0 +1,48 @@
+#ifndef PKT_QUEUE_H
+#define PKT_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libavutil/rational.h"
+
+struct AVPacket;
+
+// Bounded packet queue between a demux thread and a decode thread
+//
+// The demuxer blocks once the queue holds max_bytes or max_dur_us of
+// packets (or its fixed packet limit) and resumes when it has drained to
+// half of both, so neither side wakes the other per packet. Packet shells
+// are allocated up front - put and get only move refs.
+// One putter, one getter.
+
+typedef struct pkt_queue_stats_s {
+	unsigned int packets;      // Total put
+	unsigned int max_packets;  // High water marks
+	size_t max_bytes;
+	int64_t max_dur_us;
+	unsigned int put_waits;    // Demuxer blocked on a full queue
+	unsigned int get_waits;    // Decoder found it empty
+} pkt_queue_stats_t;
+
+struct pkt_queue_s;
+typedef struct pkt_queue_s pkt_queue_t;
+
+// time_base is that of the packets' dts & duration
+pkt_queue_t *pkt_queue_new(size_t max_bytes, int64_t max_dur_us, AVRational time_base);
+void pkt_queue_delete(pkt_queue_t **const pq);
+
+// Takes pkt's ref, blocking while the queue is full
+// Returns 0 or AVERROR_EXIT if aborted (pkt is then unrefed)
+int pkt_queue_put(pkt_queue_t *const q, struct AVPacket *const pkt);
+// No more puts. err (AVERROR_EOF or a demux error) is returned by get once
+// the queue is empty
+void pkt_queue_finish(pkt_queue_t *const q, const int err);
+// Blocks for the next packet. Returns 0, the finish err or AVERROR_EXIT
+int pkt_queue_get(pkt_queue_t *const q, struct AVPacket *const pkt);
+// Fail any current & future put or get, e.g. decode has stopped early
+void pkt_queue_abort(pkt_queue_t *const q);
+
+void pkt_queue_stats(pkt_queue_t *const q, pkt_queue_stats_t *const stats);
+
+#endif
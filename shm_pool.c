@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include "shm_pool.h"
+
+#include <wayland-client.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "log.h"
+
+// One layout's worth of buffers - a single shm file cut into equal slots
+typedef struct shm_set_s {
+	struct shm_pool_s *pool;
+	struct shm_set_s *next;     // pool->sets
+	unsigned int ref_count;     // Live buffers + 1 if current
+	shm_layout_t layout;
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	size_t buf_size;            // layout.size rounded up to a page
+	struct wl_shm_pool *w_pool;
+	unsigned int n;
+	struct shm_buf_s *bufs;
+} shm_set_t;
+
+struct shm_buf_s {
+	shm_set_t *set;
+	struct shm_buf_s *next;     // Free list
+	unsigned int ref_count;
+	bool attached;              // Compositor holds a ref
+	struct wl_buffer *wbuf;
+	size_t offset;
+};
+
+struct shm_pool_s {
+	pthread_mutex_t lock;
+	struct wl_shm *w_shm;
+	unsigned int n_bufs;
+	unsigned int ref_count;     // Owner + live sets
+	shm_set_t *cur;
+	shm_set_t *sets;            // All live sets, cur first
+	shm_buf_t *free_bufs;       // Of cur
+};
+
+/* Shared memory support code */
+static void
+randname(char *buf)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	long r = ts.tv_nsec;
+	for (int i = 0; i < 6; ++i) {
+		buf[i] = 'A'+(r&15)+(r&16)*2;
+		r >>= 5;
+	}
+}
+
+static int
+create_shm_file(void)
+{
+	int retries = 100;
+	int fd;
+
+	// Anonymous, so there is no name to clean up, and sealable
+	if ((fd = memfd_create("wl_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)) >= 0)
+		return fd;
+	// Kernels before 3.17
+	do {
+		char name[] = "/wl_shm-XXXXXX";
+		randname(name + sizeof(name) - 7);
+		--retries;
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd >= 0) {
+			shm_unlink(name);
+			return fd;
+		}
+	} while (retries > 0 && errno == EEXIST);
+	return -1;
+}
+
+static int
+allocate_shm_file(size_t size)
+{
+	int fd = create_shm_file();
+	if (fd < 0)
+		return -1;
+	int ret;
+	do {
+		ret = ftruncate(fd, size);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		close(fd);
+		return -1;
+	}
+	// The compositor maps all of it, so it must not shrink under it
+	// Fails harmlessly on the shm_open fallback
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+	return fd;
+}
+
+static void
+pool_free(shm_pool_t *const pool)
+{
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static void
+set_free(shm_set_t *const set)
+{
+	unsigned int i;
+
+	for (i = 0; i != set->n; ++i)
+	{
+		if (set->bufs[i].wbuf != NULL)
+			wl_buffer_destroy(set->bufs[i].wbuf);
+	}
+	if (set->w_pool != NULL)
+		wl_shm_pool_destroy(set->w_pool);
+	if (set->map != NULL)
+		munmap(set->map, set->map_size);
+	if (set->fd != -1)
+		close(set->fd);
+	free(set->bufs);
+	free(set);
+}
+
+// Called with the pool locked. Returns true if the set is dead and must be
+// freed (unlocked) by the caller; *ppool_dead is set if the pool went too
+static bool
+set_unref_locked(shm_set_t *const set, bool *const ppool_dead)
+{
+	shm_pool_t *const pool = set->pool;
+	shm_set_t **pp = &pool->sets;
+
+	if (--set->ref_count != 0)
+		return false;
+
+	while (*pp != set)
+		pp = &(*pp)->next;
+	*pp = set->next;
+	*ppool_dead = --pool->ref_count == 0;
+	return true;
+}
+
+static void
+set_unref_done(shm_set_t *const set, const bool set_dead, const bool pool_dead)
+{
+	shm_pool_t *const pool = set->pool;
+
+	if (set_dead)
+		set_free(set);
+	if (pool_dead)
+		pool_free(pool);
+}
+
+static void
+w_buf_release(void *data, struct wl_buffer *wl_buffer)
+{
+	shm_buf_t *buf = data;
+	(void)wl_buffer;
+
+	/* Sent by the compositor when it's no longer using this buffer */
+	pthread_mutex_lock(&buf->set->pool->lock);
+	buf->attached = false;
+	pthread_mutex_unlock(&buf->set->pool->lock);
+	shm_buf_unref(&buf);
+}
+
+static const struct wl_buffer_listener w_buf_listener = {
+	.release = w_buf_release,
+};
+
+static bool
+layout_eq(const shm_layout_t *const a, const shm_layout_t *const b)
+{
+	return a->format == b->format && a->width == b->width && a->height == b->height &&
+		a->stride == b->stride && a->size == b->size;
+}
+
+static shm_set_t *
+set_new(shm_pool_t *const pool, const shm_layout_t *const layout)
+{
+	shm_set_t *const set = calloc(1, sizeof(*set));
+	unsigned int i;
+
+	if (set == NULL)
+		return NULL;
+	set->pool = pool;
+	set->fd = -1;
+	set->layout = *layout;
+	set->n = pool->n_bufs;
+	set->buf_size = (layout->size + 4095) & ~(size_t)4095;
+	set->map_size = set->buf_size * set->n;
+
+	if ((set->bufs = calloc(set->n, sizeof(*set->bufs))) == NULL)
+		goto fail;
+	if ((set->fd = allocate_shm_file(set->map_size)) == -1)
+		goto fail;
+	// Fault it all in now rather than on first touch of each frame
+	set->map = mmap(NULL, set->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, set->fd, 0);
+	if (set->map == MAP_FAILED)
+	{
+		set->map = NULL;
+		goto fail;
+	}
+
+	set->w_pool = wl_shm_create_pool(pool->w_shm, set->fd, set->map_size);
+	for (i = 0; i != set->n; ++i)
+	{
+		shm_buf_t *const buf = set->bufs + i;
+
+		buf->set = set;
+		buf->offset = set->buf_size * i;
+		buf->wbuf = wl_shm_pool_create_buffer(set->w_pool, buf->offset, layout->width, layout->height,
+						      layout->stride, layout->format);
+		wl_buffer_add_listener(buf->wbuf, &w_buf_listener, buf);
+	}
+
+	LOG_I(LOG_CAT_SHM, "%s: %dx%d fmt %#x, %u x %zu bytes\n", __func__, layout->width, layout->height,
+	    layout->format, set->n, set->buf_size);
+	return set;
+
+fail:
+	LOG_E(LOG_CAT_SHM, "%s: Failed to make %dx%d fmt %#x buffers\n", __func__,
+	    layout->width, layout->height, layout->format);
+	set_free(set);
+	return NULL;
+}
+
+int
+shm_pool_set_layout(shm_pool_t *const pool, const shm_layout_t *const layout)
+{
+	shm_set_t *old = NULL;
+	shm_set_t *set;
+	bool old_dead = false;
+	bool pool_dead = false;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->cur != NULL && layout_eq(&pool->cur->layout, layout))
+	{
+		pthread_mutex_unlock(&pool->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	// Build outside the lock - it is slow
+	if ((set = set_new(pool, layout)) == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&pool->lock);
+	old = pool->cur;
+	if (old != NULL)
+		old_dead = set_unref_locked(old, &pool_dead);
+
+	set->ref_count = 1;
+	set->next = pool->sets;
+	pool->sets = set;
+	pool->cur = set;
+	++pool->ref_count;
+	pool->free_bufs = NULL;
+	for (i = set->n; i-- != 0;)
+	{
+		set->bufs[i].next = pool->free_bufs;
+		pool->free_bufs = set->bufs + i;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (old != NULL)
+		set_unref_done(old, old_dead, pool_dead);
+	return 0;
+}
+
+const shm_layout_t *
+shm_pool_layout(const shm_pool_t *const pool)
+{
+	// Caller must serialise this with set_layout
+	return pool->cur == NULL ? NULL : &pool->cur->layout;
+}
+
+shm_buf_t *
+shm_pool_acquire(shm_pool_t *const pool)
+{
+	shm_buf_t *buf;
+
+	pthread_mutex_lock(&pool->lock);
+	if ((buf = pool->free_bufs) != NULL)
+	{
+		pool->free_bufs = buf->next;
+		buf->next = NULL;
+		buf->ref_count = 1;
+		++buf->set->ref_count;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return buf;
+}
+
+shm_buf_t *
+shm_pool_find(shm_pool_t *const pool, const void *const data)
+{
+	const uint8_t *const p = data;
+	shm_buf_t *buf = NULL;
+	shm_set_t *set;
+
+	if (p == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	for (set = pool->sets; set != NULL; set = set->next)
+	{
+		if (p >= set->map && p < set->map + set->map_size)
+		{
+			buf = set->bufs + (p - set->map) / set->buf_size;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return buf;
+}
+
+shm_buf_t *
+shm_buf_ref(shm_buf_t *const buf)
+{
+	pthread_mutex_lock(&buf->set->pool->lock);
+	++buf->ref_count;
+	pthread_mutex_unlock(&buf->set->pool->lock);
+	return buf;
+}
+
+void
+shm_buf_unref(shm_buf_t **const pbuf)
+{
+	shm_buf_t *const buf = *pbuf;
+	shm_set_t *set;
+	shm_pool_t *pool;
+	bool set_dead = false;
+	bool pool_dead = false;
+
+	if (buf == NULL)
+		return;
+	*pbuf = NULL;
+	set = buf->set;
+	pool = set->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	if (--buf->ref_count == 0)
+	{
+		// Only bufs of the current set go back on the free list
+		if (set == pool->cur)
+		{
+			buf->next = pool->free_bufs;
+			pool->free_bufs = buf;
+		}
+		set_dead = set_unref_locked(set, &pool_dead);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	set_unref_done(set, set_dead, pool_dead);
+}
+
+void
+shm_buf_commit(shm_buf_t *const buf, struct wl_surface *const surface)
+{
+	shm_pool_t *const pool = buf->set->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!buf->attached)
+	{
+		// The compositor's ref
+		buf->attached = true;
+		++buf->ref_count;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	wl_surface_attach(surface, buf->wbuf, 0, 0);
+	wl_surface_damage(surface, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_commit(surface);
+}
+
+uint8_t *
+shm_buf_data(const shm_buf_t *const buf)
+{
+	return buf->set->map + buf->offset;
+}
+
+const shm_layout_t *
+shm_buf_layout(const shm_buf_t *const buf)
+{
+	return &buf->set->layout;
+}
+
+struct wl_buffer *
+shm_buf_wl_buffer(const shm_buf_t *const buf)
+{
+	return buf->wbuf;
+}
+
+void
+shm_pool_delete(shm_pool_t **const ppool)
+{
+	shm_pool_t *const pool = *ppool;
+	shm_set_t *set;
+	bool pool_dead = false;
+	bool set_dead = false;
+
+	if (pool == NULL)
+		return;
+	*ppool = NULL;
+
+	// No release events will come now so drop the compositor's refs.
+	// Unrefs may free sets so restart the scan after each.
+	for (;;)
+	{
+		shm_buf_t *buf = NULL;
+		unsigned int i;
+
+		pthread_mutex_lock(&pool->lock);
+		for (set = pool->sets; set != NULL && buf == NULL; set = set->next)
+		{
+			for (i = 0; i != set->n; ++i)
+			{
+				if (set->bufs[i].attached)
+				{
+					buf = set->bufs + i;
+					buf->attached = false;
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (buf == NULL)
+			break;
+		shm_buf_unref(&buf);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if ((set = pool->cur) != NULL)
+	{
+		pool->cur = NULL;
+		pool->free_bufs = NULL;
+		set_dead = set_unref_locked(set, &pool_dead);
+	}
+	if (pool->sets != NULL)
+		LOG_W(LOG_CAT_SHM, "%s: Buffers still in use\n", __func__);
+	// Our set unref can't have been the pool's last - the owner ref is
+	pool_dead = --pool->ref_count == 0;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (set != NULL && set_dead)
+		set_free(set);
+	if (pool_dead)
+		pool_free(pool);
+}
+
+shm_pool_t *
+shm_pool_new(struct wl_shm *const w_shm, const unsigned int n_bufs)
+{
+	shm_pool_t *const pool = calloc(1, sizeof(*pool));
+
+	if (pool == NULL)
+		return NULL;
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->w_shm = w_shm;
+	pool->n_bufs = n_bufs;
+	pool->ref_count = 1;
+	return pool;
+}
@@ -0,0 +1,60 @@
+#ifndef SHM_POOL_H
+#define SHM_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct wl_shm;
+struct wl_surface;
+struct wl_buffer;
+
+// Long lived set of pre-faulted wl_shm buffers, all of one layout
+//
+// Buffers are refcounted. Acquire gives the caller a ref, commit gives the
+// compositor one until it sends release; a buffer goes back on the free
+// list when both have gone. Changing the layout makes a new set of buffers
+// - the old set is freed as its last buffer comes back. Nothing is
+// allocated per frame otherwise.
+// All calls are thread safe.
+
+typedef struct shm_layout_s {
+	uint32_t format;        // WL_SHM_FORMAT_xxx
+	int width;
+	int height;
+	int stride;             // Of the 1st plane - wl_shm implies the rest
+	size_t size;            // Bytes per buffer
+} shm_layout_t;
+
+struct shm_pool_s;
+typedef struct shm_pool_s shm_pool_t;
+struct shm_buf_s;
+typedef struct shm_buf_s shm_buf_t;
+
+shm_pool_t *shm_pool_new(struct wl_shm *const w_shm, const unsigned int n_bufs);
+// Only call once no more wl events will be dispatched; any buffers still
+// held by the compositor are taken back. Buffers the caller still holds
+// stay valid until unrefed.
+void shm_pool_delete(shm_pool_t **const ppool);
+
+// No-op if unchanged. Returns 0 or -ENOMEM
+int shm_pool_set_layout(shm_pool_t *const pool, const shm_layout_t *const layout);
+// Returns NULL if there is no layout yet
+const shm_layout_t *shm_pool_layout(const shm_pool_t *const pool);
+
+// Returns a ref to a free buffer of the current layout, NULL if all busy
+shm_buf_t *shm_pool_acquire(shm_pool_t *const pool);
+// The buffer (of any layout) that data points into, NULL if none
+// No ref is taken - caller must already hold something that keeps it alive
+shm_buf_t *shm_pool_find(shm_pool_t *const pool, const void *const data);
+
+shm_buf_t *shm_buf_ref(shm_buf_t *const buf);
+void shm_buf_unref(shm_buf_t **const pbuf);
+// Attach to surface, damage all and commit. The buffer is busy until the
+// compositor releases it.
+void shm_buf_commit(shm_buf_t *const buf, struct wl_surface *const surface);
+
+uint8_t *shm_buf_data(const shm_buf_t *const buf);
+const shm_layout_t *shm_buf_layout(const shm_buf_t *const buf);
+struct wl_buffer *shm_buf_wl_buffer(const shm_buf_t *const buf);
+
+#endif
@@ -0,0 +1,347 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libavutil/buffer.h"
+#include "libavutil/frame.h"
+
+// In flight frames - a frame still held after this many newer ones loses
+// its slot and its later stamps are ignored
+#define TRACE_RING     4096
+// Finished frames kept for the JSON
+#define TRACE_KEEP     65536
+// 16 linear steps per power of 2 above 16ns
+#define HIST_SUB_BITS  4
+#define HIST_SUB       (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS   ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// Histogram per stage for the gap from the previous stage seen, plus one
+// for decode (or queue) to present
+#define HIST_TOTAL     TRACE_STAGES
+
+typedef struct trace_rec_s {
+	_Atomic uint32_t id;
+	_Atomic uint64_t t[TRACE_STAGES];
+} trace_rec_t;
+
+typedef struct trace_done_s {
+	uint32_t id;
+	uint64_t t[TRACE_STAGES];
+} trace_done_t;
+
+typedef struct trace_hist_s {
+	_Atomic uint32_t n[HIST_BUCKETS];
+	_Atomic uint64_t count;
+	_Atomic uint64_t max;
+} trace_hist_t;
+
+typedef struct trace_env_s {
+	uint64_t t0;
+	char *json_fname;
+	_Atomic uint32_t next_id;
+	_Atomic uint64_t n_done;
+	_Atomic uint64_t n_dropped;   // Released without being presented
+	_Atomic uint64_t n_lost;      // Slot reused before release
+	trace_rec_t ring[TRACE_RING];
+	trace_hist_t hist[TRACE_STAGES + 1];
+	trace_done_t *keep;
+} trace_env_t;
+
+static const char *const stage_names[TRACE_STAGES + 1] = {
+	"decoded", "queued", "dequeued", "imported", "presented", "released", "total"
+};
+
+bool trace_on = false;
+static trace_env_t *trace_env = NULL;
+
+// Something in every frame's opaque_ref to point at
+static uint8_t trace_dummy;
+
+static uint64_t
+ns_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int
+hist_bucket(const uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < HIST_SUB)
+		return (unsigned int)ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB + (unsigned int)((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Largest value that lands in bucket b
+static uint64_t
+hist_bucket_max(const unsigned int b)
+{
+	unsigned int shift;
+
+	if (b < HIST_SUB)
+		return b;
+	shift = b / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+}
+
+static void
+hist_add(trace_hist_t *const h, const uint64_t ns)
+{
+	uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+	atomic_fetch_add_explicit(h->n + hist_bucket(ns), 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+	while (ns > max &&
+	       !atomic_compare_exchange_weak_explicit(&h->max, &max, ns, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+static uint64_t
+hist_pc(const trace_hist_t *const h, const uint64_t count, const unsigned int per_mille)
+{
+	const uint64_t want = (count * per_mille + 999) / 1000;
+	uint64_t n = 0;
+	unsigned int b;
+
+	for (b = 0; b != HIST_BUCKETS; ++b)
+	{
+		n += atomic_load_explicit(h->n + b, memory_order_relaxed);
+		if (n >= want)
+			return hist_bucket_max(b);
+	}
+	return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+static uint32_t
+frame_id(const AVFrame *const frame)
+{
+	return (uint32_t)(uintptr_t)frame->opaque;
+}
+
+static trace_rec_t *
+rec_get(const uint32_t id)
+{
+	trace_rec_t *const rec = trace_env->ring + (id & (TRACE_RING - 1));
+	return id != 0 && atomic_load_explicit(&rec->id, memory_order_acquire) == id ? rec : NULL;
+}
+
+static void
+rec_stamp(trace_rec_t *const rec, const enum trace_stage stage)
+{
+	atomic_store_explicit(rec->t + stage, ns_now(), memory_order_relaxed);
+}
+
+void
+trace_frame_new_(AVFrame *const frame, const enum trace_stage stage)
+{
+	uint32_t id;
+	trace_rec_t *rec;
+	unsigned int i;
+
+	// 0 is no id
+	while ((id = atomic_fetch_add_explicit(&trace_env->next_id, 1, memory_order_relaxed)) == 0)
+		;
+	rec = trace_env->ring + (id & (TRACE_RING - 1));
+	if (atomic_load_explicit(&rec->id, memory_order_relaxed) != 0)
+		atomic_fetch_add_explicit(&trace_env->n_lost, 1, memory_order_relaxed);
+	for (i = 0; i != TRACE_STAGES; ++i)
+		atomic_store_explicit(rec->t + i, 0, memory_order_relaxed);
+	atomic_store_explicit(&rec->id, id, memory_order_release);
+
+	frame->opaque = (void *)(uintptr_t)id;
+	rec_stamp(rec, stage);
+}
+
+// Last ref to the output's copy gone - the frame is done
+static void
+trace_release(void *opaque, uint8_t *data)
+{
+	trace_env_t *const te = trace_env;
+	const uint32_t id = (uint32_t)(uintptr_t)opaque;
+	trace_rec_t *const rec = rec_get(id);
+	uint64_t t[TRACE_STAGES];
+	uint64_t first = 0;
+	uint64_t prev = 0;
+	unsigned int i;
+
+	(void)data;
+	if (rec == NULL)
+		return;
+	rec_stamp(rec, TRACE_RELEASED);
+	for (i = 0; i != TRACE_STAGES; ++i)
+		t[i] = atomic_load_explicit(rec->t + i, memory_order_relaxed);
+	// Free the slot
+	atomic_store_explicit(&rec->id, 0, memory_order_relaxed);
+
+	if (t[TRACE_PRESENTED] == 0)
+	{
+		atomic_fetch_add_explicit(&te->n_dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	for (i = 0; i != TRACE_STAGES; ++i)
+	{
+		if (t[i] == 0)
+			continue;
+		if (prev != 0)
+			hist_add(te->hist + i, t[i] > prev ? t[i] - prev : 0);
+		else
+			first = t[i];
+		prev = t[i];
+	}
+	hist_add(te->hist + HIST_TOTAL, t[TRACE_PRESENTED] - first);
+
+	if (te->keep != NULL)
+	{
+		trace_done_t *const d = te->keep + atomic_fetch_add_explicit(&te->n_done, 1, memory_order_relaxed) % TRACE_KEEP;
+		d->id = id;
+		memcpy(d->t, t, sizeof(t));
+	}
+	else
+		atomic_fetch_add_explicit(&te->n_done, 1, memory_order_relaxed);
+}
+
+void
+trace_frame_queued_(AVFrame *const frame)
+{
+	trace_rec_t *rec;
+
+	if (frame_id(frame) == 0)
+		trace_frame_new_(frame, TRACE_QUEUED);
+	else if ((rec = rec_get(frame_id(frame))) != NULL)
+		rec_stamp(rec, TRACE_QUEUED);
+
+	// Someone else's - we can't watch it
+	if (frame->opaque_ref != NULL)
+		return;
+	frame->opaque_ref = av_buffer_create(&trace_dummy, 1, trace_release, frame->opaque, AV_BUFFER_FLAG_READONLY);
+}
+
+void
+trace_stamp_(const AVFrame *const frame, const enum trace_stage stage)
+{
+	trace_rec_t *const rec = rec_get(frame_id(frame));
+	if (rec != NULL)
+		rec_stamp(rec, stage);
+}
+
+AVBufferRef *
+trace_ref_(const AVFrame *const frame)
+{
+	return frame->opaque_ref == NULL ? NULL : av_buffer_ref(frame->opaque_ref);
+}
+
+static void
+json_write(const trace_env_t *const te, FILE *const f)
+{
+	const uint64_t n_done = atomic_load_explicit(&te->n_done, memory_order_relaxed);
+	const uint64_t n = n_done < TRACE_KEEP ? n_done : TRACE_KEEP;
+	uint64_t i;
+	unsigned int s;
+	const char *sep = "";
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	// A lane per stage, named for the stage that ends each slice
+	for (s = 1; s != TRACE_STAGES; ++s)
+	{
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			sep, s, stage_names[s]);
+		sep = ",\n";
+	}
+	for (i = n_done - n; i != n_done; ++i)
+	{
+		const trace_done_t *const d = te->keep + i % TRACE_KEEP;
+		uint64_t prev = 0;
+
+		for (s = 0; s != TRACE_STAGES; ++s)
+		{
+			if (d->t[s] == 0)
+				continue;
+			if (prev != 0 && d->t[s] >= prev)
+				fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+					"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+					stage_names[s], s, (prev - te->t0) / 1e3, (d->t[s] - prev) / 1e3, d->id);
+			prev = d->t[s];
+		}
+	}
+	fprintf(f, "\n]}\n");
+}
+
+static void
+trace_finish(void)
+{
+	static const unsigned int pm[] = {500, 900, 990, 999};
+	trace_env_t *const te = trace_env;
+	unsigned int s, i;
+
+	trace_on = false;
+	if (te == NULL)
+		return;
+
+	fprintf(stderr, "Trace: %"PRIu64" frames presented, %"PRIu64" dropped, %"PRIu64" lost\n",
+		atomic_load(&te->n_done), atomic_load(&te->n_dropped), atomic_load(&te->n_lost));
+	fprintf(stderr, "%-10s %10s %9s %9s %9s %9s %9s (us, to stage from the one before)\n",
+		"stage", "n", "p50", "p90", "p99", "p99.9", "max");
+	for (s = 1; s != TRACE_STAGES + 1; ++s)
+	{
+		const trace_hist_t *const h = te->hist + s;
+		const uint64_t count = atomic_load(&h->count);
+
+		if (count == 0)
+			continue;
+		fprintf(stderr, "%-10s %10"PRIu64, stage_names[s], count);
+		for (i = 0; i != sizeof(pm) / sizeof(pm[0]); ++i)
+			fprintf(stderr, " %9.1f", hist_pc(h, count, pm[i]) / 1e3);
+		fprintf(stderr, " %9.1f\n", atomic_load(&h->max) / 1e3);
+	}
+
+	if (te->json_fname != NULL)
+	{
+		FILE *const f = fopen(te->json_fname, "w");
+		if (f == NULL)
+			fprintf(stderr, "Trace: can't write %s: %s\n", te->json_fname, strerror(errno));
+		else
+		{
+			json_write(te, f);
+			fclose(f);
+		}
+	}
+
+	// Frames still held may yet be released - leave the env for them
+}
+
+int
+trace_init(const char *const json_fname)
+{
+	trace_env_t *te;
+
+	if (trace_env != NULL)
+		return -EBUSY;
+	if ((te = calloc(1, sizeof(*te))) == NULL)
+		return -ENOMEM;
+	if (json_fname != NULL &&
+	    ((te->json_fname = strdup(json_fname)) == NULL ||
+	     (te->keep = calloc(TRACE_KEEP, sizeof(*te->keep))) == NULL))
+	{
+		free(te->json_fname);
+		free(te);
+		return -ENOMEM;
+	}
+	te->t0 = ns_now();
+	atomic_init(&te->next_id, 1);
+
+	trace_env = te;
+	trace_on = true;
+	atexit(trace_finish);
+	return 0;
+}
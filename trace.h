@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Per-frame pipeline timestamps
+//
+// A frame gets an id (kept in AVFrame.opaque) and a time at each stage it
+// passes. When the output drops its last ref the gaps between stages go
+// into log-linear histograms (16 steps per power of 2, so within ~6%) and,
+// if a file was given, the frame is kept for a Chrome trace-event JSON
+// (chrome://tracing, Perfetto) written at exit along with a summary.
+// Off unless trace_init is called - each stamp is then one branch.
+
+enum trace_stage {
+	TRACE_DECODED,    // Out of the decoder
+	TRACE_QUEUED,     // Into egl_wayland_out_display
+	TRACE_DEQUEUED,   // Taken by the display thread
+	TRACE_IMPORTED,   // EGLImage / wl_buffer ready, or copied for shm
+	TRACE_PRESENTED,  // Swap or commit returned
+	TRACE_RELEASED,   // Output (and compositor) let go of it
+	TRACE_STAGES
+};
+
+struct AVFrame;
+struct AVBufferRef;
+
+extern bool trace_on;
+
+// json_fname may be NULL for just the summary. Must be called before any
+// frames are traced. Returns 0 or -errno
+int trace_init(const char *json_fname);
+
+void trace_frame_new_(struct AVFrame *frame, enum trace_stage stage);
+void trace_frame_queued_(struct AVFrame *frame);
+void trace_stamp_(const struct AVFrame *frame, enum trace_stage stage);
+struct AVBufferRef *trace_ref_(const struct AVFrame *frame);
+
+// Give frame a new id and stamp stage
+static inline void trace_frame_new(struct AVFrame *frame, enum trace_stage stage)
+{
+	if (__builtin_expect(trace_on, 0))
+		trace_frame_new_(frame, stage);
+}
+
+// Output's own copy of a frame: stamp TRACE_QUEUED (giving it an id if it
+// has none) and TRACE_RELEASED when the last ref to the copy goes
+static inline void trace_frame_queued(struct AVFrame *frame)
+{
+	if (__builtin_expect(trace_on, 0))
+		trace_frame_queued_(frame);
+}
+
+static inline void trace_stamp(const struct AVFrame *frame, enum trace_stage stage)
+{
+	if (__builtin_expect(trace_on, 0))
+		trace_stamp_(frame, stage);
+}
+
+// A ref that holds off TRACE_RELEASED, for holders of a frame's buffer
+// that outlive the frame. NULL if not tracing
+static inline struct AVBufferRef *trace_ref(const struct AVFrame *frame)
+{
+	return __builtin_expect(trace_on, 0) ? trace_ref_(frame) : (struct AVBufferRef *)0;
+}
+
+#endif
@@ -0,0 +1,169 @@
+// Benchmark for the yuv_convert kernels
+//
+// For every format, kernel & thread count reports time per frame, output
+// GB/s and how much of a frame period at the given rate that is. Each
+// kernel's output is also checked against the C version.
+
+#include "yuv_convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t
+ns_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+fill_rand(uint8_t *p, size_t n, uint32_t seed)
+{
+	while (n--)
+	{
+		seed = seed * 1664525 + 1013904223;
+		*p++ = seed >> 24;
+	}
+}
+
+static const char *const fmt_names[] = {"nv12", "yuv420p", "p010"};
+
+static void
+src_init(yuv_cvt_src_t *const src, uint8_t *const buf, const enum yuv_cvt_fmt fmt,
+	 const unsigned int w, const unsigned int h)
+{
+	const unsigned int bpc = fmt == YUV_CVT_P010 ? 2 : 1;
+	const size_t ls = ((size_t)w * bpc + 63) & ~(size_t)63;
+
+	memset(src, 0, sizeof(*src));
+	src->fmt = fmt;
+	src->matrix = h > 576 ? YUV_CVT_BT709 : YUV_CVT_BT601;
+	src->width = w;
+	src->height = h;
+	src->data[0] = buf;
+	src->linesize[0] = ls;
+	if (fmt == YUV_CVT_YUV420P)
+	{
+		src->linesize[1] = src->linesize[2] = ((w + 1) / 2 + 63) & ~63U;
+		src->data[1] = buf + ls * h;
+		src->data[2] = src->data[1] + src->linesize[1] * ((h + 1) / 2);
+	}
+	else
+	{
+		src->linesize[1] = ls;
+		src->data[1] = buf + ls * h;
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: yuv_bench [-w <width>] [-h <height>] [-r <fps>] [-n <frames>] [-t <threads>]\n"
+		"Defaults are 1920x1080 at 60fps, 200 frames, 1 thread and\n"
+		"one per CPU (up to 4)\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const enum yuv_cvt_isa isas[] = {
+		YUV_CVT_ISA_C, YUV_CVT_ISA_SSE4, YUV_CVT_ISA_AVX2, YUV_CVT_ISA_NEON
+	};
+	unsigned int w = 1920, h = 1080, fps = 60, frames = 200, threads = 0;
+	size_t stride, src_size;
+	uint8_t *src_buf, *dst, *ref;
+	unsigned int f, i, t;
+	int n;
+
+	for (n = 1; n < argc; ++n)
+	{
+		const char *const arg = argv[n];
+		if (n + 1 >= argc)
+			usage();
+		if (strcmp(arg, "-w") == 0)
+			w = atoi(argv[++n]);
+		else if (strcmp(arg, "-h") == 0)
+			h = atoi(argv[++n]);
+		else if (strcmp(arg, "-r") == 0)
+			fps = atoi(argv[++n]);
+		else if (strcmp(arg, "-n") == 0)
+			frames = atoi(argv[++n]);
+		else if (strcmp(arg, "-t") == 0)
+			threads = atoi(argv[++n]);
+		else
+			usage();
+	}
+	if (w == 0 || h == 0 || fps == 0 || frames == 0)
+		usage();
+
+	stride = (size_t)w * 4;
+	src_size = (((size_t)w * 2 + 63) & ~(size_t)63) * (h + 1) * 2;
+	src_buf = malloc(src_size);
+	dst = malloc(stride * h);
+	ref = malloc(stride * h);
+	if (src_buf == NULL || dst == NULL || ref == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	fill_rand(src_buf, src_size, 1);
+
+	printf("%ux%u, budget %.2f ms/frame at %u fps\n", w, h, 1000.0 / fps, fps);
+	printf("%-8s %-5s %3s %10s %8s %7s %s\n", "format", "isa", "thr", "ms/frame", "GB/s", "budget", "check");
+
+	for (f = 0; f != 3; ++f)
+	{
+		yuv_cvt_src_t src;
+		yuv_cvt_t *cvt = yuv_cvt_new(1);
+
+		src_init(&src, src_buf, f, w, h);
+		yuv_cvt_set_isa(cvt, YUV_CVT_ISA_C);
+		yuv_cvt_frame(cvt, &src, ref, stride);
+		yuv_cvt_delete(&cvt);
+
+		for (i = 0; i != sizeof(isas) / sizeof(isas[0]); ++i)
+		{
+			for (t = 0; t != 2; ++t)
+			{
+				uint64_t t0, t1;
+				unsigned int j;
+				double ms;
+				bool ok;
+
+				if ((cvt = yuv_cvt_new(t == 0 ? 1 : threads)) == NULL)
+					return 1;
+				if (yuv_cvt_set_isa(cvt, isas[i]) != 0)
+				{
+					yuv_cvt_delete(&cvt);
+					break;
+				}
+
+				memset(dst, 0, stride * h);
+				yuv_cvt_frame(cvt, &src, dst, stride);
+				ok = memcmp(dst, ref, stride * h) == 0;
+
+				t0 = ns_now();
+				for (j = 0; j != frames; ++j)
+					yuv_cvt_frame(cvt, &src, dst, stride);
+				t1 = ns_now();
+
+				ms = (double)(t1 - t0) / 1e6 / frames;
+				printf("%-8s %-5s %3u %10.3f %8.2f %6.1f%% %s\n",
+				       fmt_names[f], yuv_cvt_isa_name(isas[i]), yuv_cvt_threads(cvt),
+				       ms, (double)stride * h / ms / 1e6, ms * fps / 10.0,
+				       ok ? "ok" : "MISMATCH");
+				yuv_cvt_delete(&cvt);
+			}
+		}
+	}
+
+	free(src_buf);
+	free(dst);
+	free(ref);
+	return 0;
+}
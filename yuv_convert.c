@@ -0,0 +1,765 @@
+#include "yuv_convert.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#else
+#define HAVE_X86 0
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#else
+#define HAVE_NEON 0
+#endif
+
+#define YUV_CVT_MAX_THREADS 8
+
+// The maths, in int16 lanes throughout so every ISA gets the same answer:
+//   y'  = mulhrs((Y << 7) - (yoff << 7), ky) + 32   ky Q14, y' Q6 (+ rounding)
+//   c   = (C - 128) << 8
+//   R   = (y' + mulhrs(v, rv)) >> 6                  chroma coeffs Q13
+//   G   = (y' + (mulhrs(u, gu) + mulhrs(v, gv))) >> 6
+//   B   = (y' + mulhrs(u, bu)) >> 6
+// mulhrs(a, b) = (a * b + 0x4000) >> 15, all adds saturate, results clamp
+// to 0..255. 8 bit input; P010 uses the top 8 bits.
+typedef struct yuv_k_s {
+	int16_t ky;
+	int16_t yoff7;
+	int16_t rv;
+	int16_t gu;
+	int16_t gv;
+	int16_t bu;
+} yuv_k_t;
+
+typedef void yuv_row_fn(uint32_t *d, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+			unsigned int w, const yuv_k_t *k);
+
+static int16_t
+q_fix(const double x, const unsigned int bits)
+{
+	const double t = x * (double)(1 << bits);
+	return (int16_t)(t < 0 ? t - 0.5 : t + 0.5);
+}
+
+static void
+k_init(yuv_k_t *const k, const enum yuv_cvt_matrix matrix, const bool full_range)
+{
+	const double kr = matrix == YUV_CVT_BT709 ? 0.2126 : 0.299;
+	const double kb = matrix == YUV_CVT_BT709 ? 0.0722 : 0.114;
+	const double kg = 1.0 - kr - kb;
+	const double ys = full_range ? 1.0 : 255.0 / 219.0;
+	const double cs = full_range ? 1.0 : 255.0 / 224.0;
+
+	k->ky = q_fix(ys, 14);
+	k->yoff7 = full_range ? 0 : 16 << 7;
+	k->rv = q_fix(2.0 * (1.0 - kr) * cs, 13);
+	k->gu = q_fix(-2.0 * (1.0 - kb) * kb / kg * cs, 13);
+	k->gv = q_fix(-2.0 * (1.0 - kr) * kr / kg * cs, 13);
+	k->bu = q_fix(2.0 * (1.0 - kb) * cs, 13);
+}
+
+//----------------------------------------------------------------------------
+// C
+
+static inline int
+sat16(const int x)
+{
+	return x < -32768 ? -32768 : x > 32767 ? 32767 : x;
+}
+
+static inline int
+mulhrs(const int a, const int b)
+{
+	return (a * b + 0x4000) >> 15;
+}
+
+static inline uint32_t
+clamp8(const int x)
+{
+	return x < 0 ? 0 : x > 255 ? 255 : (uint32_t)x;
+}
+
+static inline uint32_t
+px_c(const int y, const int u, const int v, const yuv_k_t *const k)
+{
+	const int yy = sat16(mulhrs((y << 7) - k->yoff7, k->ky) + 32);
+	const int cu = (u - 128) * 256;
+	const int cv = (v - 128) * 256;
+	const int r = sat16(yy + mulhrs(cv, k->rv));
+	const int g = sat16(yy + sat16(mulhrs(cu, k->gu) + mulhrs(cv, k->gv)));
+	const int b = sat16(yy + mulhrs(cu, k->bu));
+
+	return 0xff000000U | clamp8(r >> 6) << 16 | clamp8(g >> 6) << 8 | clamp8(b >> 6);
+}
+
+static void
+row_c_nv12(uint32_t *d, const uint8_t *y, const uint8_t *uv, const uint8_t *v,
+	   unsigned int w, const yuv_k_t *k)
+{
+	unsigned int i;
+	(void)v;
+
+	for (i = 0; i != w; ++i)
+		d[i] = px_c(y[i], uv[i & ~1U], uv[i | 1], k);
+}
+
+static void
+row_c_yuv420p(uint32_t *d, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	      unsigned int w, const yuv_k_t *k)
+{
+	unsigned int i;
+
+	for (i = 0; i != w; ++i)
+		d[i] = px_c(y[i], u[i >> 1], v[i >> 1], k);
+}
+
+static void
+row_c_p010(uint32_t *d, const uint8_t *y, const uint8_t *uv, const uint8_t *v,
+	   unsigned int w, const yuv_k_t *k)
+{
+	const uint16_t *const y16 = (const uint16_t *)y;
+	const uint16_t *const uv16 = (const uint16_t *)uv;
+	unsigned int i;
+	(void)v;
+
+	for (i = 0; i != w; ++i)
+		d[i] = px_c(y16[i] >> 8, uv16[i & ~1U] >> 8, uv16[i | 1] >> 8, k);
+}
+
+static yuv_row_fn *const rows_c[] = {
+	[YUV_CVT_NV12] = row_c_nv12,
+	[YUV_CVT_YUV420P] = row_c_yuv420p,
+	[YUV_CVT_P010] = row_c_p010,
+};
+
+#if HAVE_X86
+//----------------------------------------------------------------------------
+// SSE4.1 - 8 pixels per step
+
+#define SSE4 __attribute__((target("sse4.1")))
+
+typedef struct sse_k_s {
+	__m128i ky, yoff7, rv, gu, gv, bu;
+} sse_k_t;
+
+static inline SSE4 void
+sse_k_init(sse_k_t *const K, const yuv_k_t *const k)
+{
+	K->ky = _mm_set1_epi16(k->ky);
+	K->yoff7 = _mm_set1_epi16(k->yoff7);
+	K->rv = _mm_set1_epi16(k->rv);
+	K->gu = _mm_set1_epi16(k->gu);
+	K->gv = _mm_set1_epi16(k->gv);
+	K->bu = _mm_set1_epi16(k->bu);
+}
+
+// y: Y in 16 bit lanes, cu/cv: (C - 128) << 8 one per pixel
+static inline SSE4 void
+sse_px8(uint32_t *const d, __m128i y, const __m128i cu, const __m128i cv, const sse_k_t *const K)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c255 = _mm_set1_epi16(255);
+	__m128i r, g, b, bg, ra;
+
+	y = _mm_sub_epi16(_mm_slli_epi16(y, 7), K->yoff7);
+	y = _mm_adds_epi16(_mm_mulhrs_epi16(y, K->ky), _mm_set1_epi16(32));
+	r = _mm_adds_epi16(y, _mm_mulhrs_epi16(cv, K->rv));
+	g = _mm_adds_epi16(y, _mm_adds_epi16(_mm_mulhrs_epi16(cu, K->gu), _mm_mulhrs_epi16(cv, K->gv)));
+	b = _mm_adds_epi16(y, _mm_mulhrs_epi16(cu, K->bu));
+	r = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(r, 6), zero), c255);
+	g = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(g, 6), zero), c255);
+	b = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(b, 6), zero), c255);
+
+	bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+	ra = _mm_or_si128(r, _mm_set1_epi16((short)0xff00));
+	_mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *)(d + 4), _mm_unpackhi_epi16(bg, ra));
+}
+
+// 8 bit chroma in the low 16 of each 32 bit lane -> signed, one per pixel
+static inline SSE4 __m128i
+sse_chroma(const __m128i c)
+{
+	return _mm_xor_si128(_mm_slli_epi16(_mm_or_si128(c, _mm_slli_epi32(c, 16)), 8),
+			     _mm_set1_epi16((short)0x8000));
+}
+
+// uv: interleaved 8 bit U, V in 16 bit lanes
+static inline SSE4 void
+sse_uv(const __m128i uv, __m128i *const cu, __m128i *const cv)
+{
+	*cu = sse_chroma(_mm_and_si128(uv, _mm_set1_epi32(0xffff)));
+	*cv = sse_chroma(_mm_srli_epi32(uv, 16));
+}
+
+static SSE4 void
+row_sse4_nv12(uint32_t *d, const uint8_t *y, const uint8_t *uv, const uint8_t *v,
+	      unsigned int w, const yuv_k_t *k)
+{
+	sse_k_t K;
+	unsigned int i;
+
+	sse_k_init(&K, k);
+	for (i = 0; i + 8 <= w; i += 8)
+	{
+		__m128i cu, cv;
+		sse_uv(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(uv + i))), &cu, &cv);
+		sse_px8(d + i, _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(y + i))), cu, cv, &K);
+	}
+	if (i != w)
+		row_c_nv12(d + i, y + i, uv + i, v, w - i, k);
+}
+
+static SSE4 void
+row_sse4_yuv420p(uint32_t *d, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		 unsigned int w, const yuv_k_t *k)
+{
+	sse_k_t K;
+	unsigned int i;
+
+	sse_k_init(&K, k);
+	for (i = 0; i + 8 <= w; i += 8)
+	{
+		uint32_t u4, v4;
+		memcpy(&u4, u + i / 2, 4);
+		memcpy(&v4, v + i / 2, 4);
+		sse_px8(d + i, _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(y + i))),
+			sse_chroma(_mm_cvtepu8_epi32(_mm_cvtsi32_si128((int)u4))),
+			sse_chroma(_mm_cvtepu8_epi32(_mm_cvtsi32_si128((int)v4))), &K);
+	}
+	if (i != w)
+		row_c_yuv420p(d + i, y + i, u + i / 2, v + i / 2, w - i, k);
+}
+
+static SSE4 void
+row_sse4_p010(uint32_t *d, const uint8_t *y, const uint8_t *uv, const uint8_t *v,
+	      unsigned int w, const yuv_k_t *k)
+{
+	sse_k_t K;
+	unsigned int i;
+
+	sse_k_init(&K, k);
+	for (i = 0; i + 8 <= w; i += 8)
+	{
+		__m128i cu, cv;
+		sse_uv(_mm_srli_epi16(_mm_loadu_si128((const __m128i *)(uv + i * 2)), 8), &cu, &cv);
+		sse_px8(d + i, _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(y + i * 2)), 8), cu, cv, &K);
+	}
+	if (i != w)
+		row_c_p010(d + i, y + i * 2, uv + i * 2, v, w - i, k);
+}
+
+static yuv_row_fn *const rows_sse4[] = {
+	[YUV_CVT_NV12] = row_sse4_nv12,
+	[YUV_CVT_YUV420P] = row_sse4_yuv420p,
+	[YUV_CVT_P010] = row_sse4_p010,
+};
+
+//----------------------------------------------------------------------------
+// AVX2 - 16 pixels per step
+// Widening loads (vpmovzx) keep pixels in order across the two lanes so
+// only the final store needs a lane fixup.
+
+#define AVX2 __attribute__((target("avx2")))
+
+typedef struct avx_k_s {
+	__m256i ky, yoff7, rv, gu, gv, bu;
+} avx_k_t;
+
+static inline AVX2 void
+avx_k_init(avx_k_t *const K, const yuv_k_t *const k)
+{
+	K->ky = _mm256_set1_epi16(k->ky);
+	K->yoff7 = _mm256_set1_epi16(k->yoff7);
+	K->rv = _mm256_set1_epi16(k->rv);
+	K->gu = _mm256_set1_epi16(k->gu);
+	K->gv = _mm256_set1_epi16(k->gv);
+	K->bu = _mm256_set1_epi16(k->bu);
+}
+
+static inline AVX2 void
+avx_px16(uint32_t *const d, __m256i y, const __m256i cu, const __m256i cv, const avx_k_t *const K)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i c255 = _mm256_set1_epi16(255);
+	__m256i r, g, b, bg, ra, lo, hi;
+
+	y = _mm256_sub_epi16(_mm256_slli_epi16(y, 7), K->yoff7);
+	y = _mm256_adds_epi16(_mm256_mulhrs_epi16(y, K->ky), _mm256_set1_epi16(32));
+	r = _mm256_adds_epi16(y, _mm256_mulhrs_epi16(cv, K->rv));
+	g = _mm256_adds_epi16(y, _mm256_adds_epi16(_mm256_mulhrs_epi16(cu, K->gu), _mm256_mulhrs_epi16(cv, K->gv)));
+	b = _mm256_adds_epi16(y, _mm256_mulhrs_epi16(cu, K->bu));
+	r = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(r, 6), zero), c255);
+	g = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(g, 6), zero), c255);
+	b = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(b, 6), zero), c255);
+
+	bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+	ra = _mm256_or_si256(r, _mm256_set1_epi16((short)0xff00));
+	lo = _mm256_unpacklo_epi16(bg, ra);  // 0-3, 8-11
+	hi = _mm256_unpackhi_epi16(bg, ra);  // 4-7, 12-15
+	_mm256_storeu_si256((__m256i *)d, _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i *)(d + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+static inline AVX2 __m256i
+avx_chroma(const __m256i c)
+{
+	return _mm256_xor_si256(_mm256_slli_epi16(_mm256_or_si256(c, _mm256_slli_epi32(c, 16)), 8),
+				_mm256_set1_epi16((short)0x8000));
+}
+
+static inline AVX2 void
+avx_uv(const __m256i uv, __m256i *const cu, __m256i *const cv)
+{
+	*cu = avx_chroma(_mm256_and_si256(uv, _mm256_set1_epi32(0xffff)));
+	*cv = avx_chroma(_mm256_srli_epi32(uv, 16));
+}
+
+static AVX2 void
+row_avx2_nv12(uint32_t *d, const uint8_t *y, const uint8_t *uv, const uint8_t *v,
+	      unsigned int w, const yuv_k_t *k)
+{
+	avx_k_t K;
+	unsigned int i;
+
+	avx_k_init(&K, k);
+	for (i = 0; i + 16 <= w; i += 16)
+	{
+		__m256i cu, cv;
+		avx_uv(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(uv + i))), &cu, &cv);
+		avx_px16(d + i, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + i))), cu, cv, &K);
+	}
+	if (i != w)
+		row_c_nv12(d + i, y + i, uv + i, v, w - i, k);
+}
+
+static AVX2 void
+row_avx2_yuv420p(uint32_t *d, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		 unsigned int w, const yuv_k_t *k)
+{
+	avx_k_t K;
+	unsigned int i;
+
+	avx_k_init(&K, k);
+	for (i = 0; i + 16 <= w; i += 16)
+	{
+		avx_px16(d + i, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + i))),
+			 avx_chroma(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(u + i / 2)))),
+			 avx_chroma(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(v + i / 2)))), &K);
+	}
+	if (i != w)
+		row_c_yuv420p(d + i, y + i, u + i / 2, v + i / 2, w - i, k);
+}
+
+static AVX2 void
+row_avx2_p010(uint32_t *d, const uint8_t *y, const uint8_t *uv, const uint8_t *v,
+	      unsigned int w, const yuv_k_t *k)
+{
+	avx_k_t K;
+	unsigned int i;
+
+	avx_k_init(&K, k);
+	for (i = 0; i + 16 <= w; i += 16)
+	{
+		__m256i cu, cv;
+		avx_uv(_mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(uv + i * 2)), 8), &cu, &cv);
+		avx_px16(d + i, _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(y + i * 2)), 8), cu, cv, &K);
+	}
+	if (i != w)
+		row_c_p010(d + i, y + i * 2, uv + i * 2, v, w - i, k);
+}
+
+static yuv_row_fn *const rows_avx2[] = {
+	[YUV_CVT_NV12] = row_avx2_nv12,
+	[YUV_CVT_YUV420P] = row_avx2_yuv420p,
+	[YUV_CVT_P010] = row_avx2_p010,
+};
+#endif
+
+#if HAVE_NEON
+//----------------------------------------------------------------------------
+// NEON - 16 pixels per step
+// vqrdmulh rounds exactly as mulhrs does and vqmovun is the clamp, vst4
+// does the interleave
+
+static inline void
+neon_px8(uint32_t *const d, int16x8_t y, const int16x8_t cu, const int16x8_t cv, const yuv_k_t *const k)
+{
+	const int16x8_t c32 = vdupq_n_s16(32);
+	int16x8_t r, g, b;
+	uint8x8x4_t px;
+
+	y = vsubq_s16(vshlq_n_s16(y, 7), vdupq_n_s16(k->yoff7));
+	y = vqaddq_s16(vqrdmulhq_n_s16(y, k->ky), c32);
+	r = vqaddq_s16(y, vqrdmulhq_n_s16(cv, k->rv));
+	g = vqaddq_s16(y, vqaddq_s16(vqrdmulhq_n_s16(cu, k->gu), vqrdmulhq_n_s16(cv, k->gv)));
+	b = vqaddq_s16(y, vqrdmulhq_n_s16(cu, k->bu));
+
+	px.val[0] = vqmovun_s16(vshrq_n_s16(b, 6));
+	px.val[1] = vqmovun_s16(vshrq_n_s16(g, 6));
+	px.val[2] = vqmovun_s16(vshrq_n_s16(r, 6));
+	px.val[3] = vdup_n_u8(0xff);
+	vst4_u8((uint8_t *)d, px);
+}
+
+static inline int16x8_t
+neon_chroma(const uint8x8_t c)
+{
+	return vreinterpretq_s16_u16(veorq_u16(vshll_n_u8(c, 8), vdupq_n_u16(0x8000)));
+}
+
+// 8 chroma samples for 16 pixels
+static inline void
+neon_px16(uint32_t *const d, const int16x8_t y0, const int16x8_t y1,
+	  const uint8x8_t u, const uint8x8_t v, const yuv_k_t *const k)
+{
+	const uint8x8x2_t uu = vzip_u8(u, u);
+	const uint8x8x2_t vv = vzip_u8(v, v);
+
+	neon_px8(d, y0, neon_chroma(uu.val[0]), neon_chroma(vv.val[0]), k);
+	neon_px8(d + 8, y1, neon_chroma(uu.val[1]), neon_chroma(vv.val[1]), k);
+}
+
+static void
+row_neon_nv12(uint32_t *d, const uint8_t *y, const uint8_t *uv, const uint8_t *v,
+	      unsigned int w, const yuv_k_t *k)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= w; i += 16)
+	{
+		const uint8x16_t yy = vld1q_u8(y + i);
+		const uint8x8x2_t c = vld2_u8(uv + i);
+		neon_px16(d + i,
+			  vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(yy))),
+			  vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(yy))),
+			  c.val[0], c.val[1], k);
+	}
+	if (i != w)
+		row_c_nv12(d + i, y + i, uv + i, v, w - i, k);
+}
+
+static void
+row_neon_yuv420p(uint32_t *d, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		 unsigned int w, const yuv_k_t *k)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= w; i += 16)
+	{
+		const uint8x16_t yy = vld1q_u8(y + i);
+		neon_px16(d + i,
+			  vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(yy))),
+			  vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(yy))),
+			  vld1_u8(u + i / 2), vld1_u8(v + i / 2), k);
+	}
+	if (i != w)
+		row_c_yuv420p(d + i, y + i, u + i / 2, v + i / 2, w - i, k);
+}
+
+static void
+row_neon_p010(uint32_t *d, const uint8_t *y, const uint8_t *uv, const uint8_t *v,
+	      unsigned int w, const yuv_k_t *k)
+{
+	const uint16_t *const y16 = (const uint16_t *)y;
+	const uint16_t *const uv16 = (const uint16_t *)uv;
+	unsigned int i;
+
+	for (i = 0; i + 16 <= w; i += 16)
+	{
+		const uint16x8x2_t c = vld2q_u16(uv16 + i);
+		neon_px16(d + i,
+			  vreinterpretq_s16_u16(vshrq_n_u16(vld1q_u16(y16 + i), 8)),
+			  vreinterpretq_s16_u16(vshrq_n_u16(vld1q_u16(y16 + i + 8), 8)),
+			  vshrn_n_u16(c.val[0], 8), vshrn_n_u16(c.val[1], 8), k);
+	}
+	if (i != w)
+		row_c_p010(d + i, y + i * 2, uv + i * 2, v, w - i, k);
+}
+
+static yuv_row_fn *const rows_neon[] = {
+	[YUV_CVT_NV12] = row_neon_nv12,
+	[YUV_CVT_YUV420P] = row_neon_yuv420p,
+	[YUV_CVT_P010] = row_neon_p010,
+};
+#endif
+
+//----------------------------------------------------------------------------
+
+static yuv_row_fn *const *
+isa_rows(const enum yuv_cvt_isa isa)
+{
+	switch (isa)
+	{
+	case YUV_CVT_ISA_C:
+		return rows_c;
+#if HAVE_X86
+	case YUV_CVT_ISA_SSE4:
+		return __builtin_cpu_supports("sse4.1") ? rows_sse4 : NULL;
+	case YUV_CVT_ISA_AVX2:
+		return __builtin_cpu_supports("avx2") ? rows_avx2 : NULL;
+#endif
+#if HAVE_NEON
+	case YUV_CVT_ISA_NEON:
+		return rows_neon;
+#endif
+	default:
+		break;
+	}
+	return NULL;
+}
+
+static enum yuv_cvt_isa
+isa_best(void)
+{
+	static const enum yuv_cvt_isa order[] = {
+		YUV_CVT_ISA_AVX2, YUV_CVT_ISA_NEON, YUV_CVT_ISA_SSE4
+	};
+	unsigned int i;
+
+	for (i = 0; i != sizeof(order) / sizeof(order[0]); ++i)
+	{
+		if (isa_rows(order[i]) != NULL)
+			return order[i];
+	}
+	return YUV_CVT_ISA_C;
+}
+
+const char *
+yuv_cvt_isa_name(const enum yuv_cvt_isa isa)
+{
+	switch (isa)
+	{
+	case YUV_CVT_ISA_AUTO:
+		return "auto";
+	case YUV_CVT_ISA_C:
+		return "c";
+	case YUV_CVT_ISA_SSE4:
+		return "sse4";
+	case YUV_CVT_ISA_AVX2:
+		return "avx2";
+	case YUV_CVT_ISA_NEON:
+		return "neon";
+	}
+	return "?";
+}
+
+typedef struct cvt_job_s {
+	yuv_row_fn *row;
+	yuv_k_t k;
+	const yuv_cvt_src_t *src;
+	uint8_t *dst;
+	ptrdiff_t dst_stride;
+	unsigned int band;     // Rows per thread (even)
+} cvt_job_t;
+
+struct yuv_cvt_s {
+	enum yuv_cvt_isa isa;
+	yuv_row_fn *const *rows;
+
+	unsigned int n_threads;
+	pthread_t threads[YUV_CVT_MAX_THREADS];
+	unsigned int n_started;
+
+	pthread_mutex_t lock;
+	pthread_cond_t go_cond;
+	pthread_cond_t done_cond;
+	unsigned int gen;
+	unsigned int pending;
+	bool terminate;
+	cvt_job_t job;
+};
+
+typedef struct cvt_worker_s {
+	yuv_cvt_t *cvt;
+	unsigned int n;
+} cvt_worker_t;
+
+static void
+job_band(const cvt_job_t *const job, const unsigned int n)
+{
+	const yuv_cvt_src_t *const src = job->src;
+	const unsigned int y0 = n * job->band;
+	const unsigned int y1 = y0 + job->band > src->height ? src->height : y0 + job->band;
+	unsigned int y;
+
+	for (y = y0; y < y1; ++y)
+	{
+		const unsigned int cy = y >> 1;
+		job->row((uint32_t *)(job->dst + y * job->dst_stride),
+			 src->data[0] + y * src->linesize[0],
+			 src->data[1] + cy * src->linesize[1],
+			 src->data[2] == NULL ? NULL : src->data[2] + cy * src->linesize[2],
+			 src->width, &job->k);
+	}
+}
+
+static void *
+cvt_worker(void *v)
+{
+	yuv_cvt_t *const cvt = ((cvt_worker_t *)v)->cvt;
+	const unsigned int n = ((cvt_worker_t *)v)->n;
+	unsigned int gen = 0;
+
+	free(v);
+	pthread_mutex_lock(&cvt->lock);
+	for (;;)
+	{
+		while (cvt->gen == gen && !cvt->terminate)
+			pthread_cond_wait(&cvt->go_cond, &cvt->lock);
+		if (cvt->terminate)
+			break;
+		gen = cvt->gen;
+		pthread_mutex_unlock(&cvt->lock);
+
+		job_band(&cvt->job, n);
+
+		pthread_mutex_lock(&cvt->lock);
+		if (--cvt->pending == 0)
+			pthread_cond_signal(&cvt->done_cond);
+	}
+	pthread_mutex_unlock(&cvt->lock);
+	return NULL;
+}
+
+int
+yuv_cvt_frame(yuv_cvt_t *const cvt, const yuv_cvt_src_t *const src,
+	      uint8_t *const dst, const ptrdiff_t dst_stride)
+{
+	cvt_job_t *const job = &cvt->job;
+	unsigned int n = cvt->n_threads;
+
+	if ((unsigned int)src->fmt > YUV_CVT_P010 || src->width == 0 || src->height == 0 ||
+	    src->data[0] == NULL || src->data[1] == NULL ||
+	    (src->fmt == YUV_CVT_YUV420P && src->data[2] == NULL))
+		return -EINVAL;
+
+	job->row = cvt->rows[src->fmt];
+	k_init(&job->k, src->matrix, src->full_range);
+	job->src = src;
+	job->dst = dst;
+	job->dst_stride = dst_stride;
+
+	// Not worth waking anyone for a handful of rows
+	if (src->height < n * 16)
+		n = 1;
+	job->band = ((src->height + n - 1) / n + 1) & ~1U;
+
+	if (n > 1)
+	{
+		pthread_mutex_lock(&cvt->lock);
+		cvt->pending = n - 1;
+		++cvt->gen;
+		pthread_cond_broadcast(&cvt->go_cond);
+		pthread_mutex_unlock(&cvt->lock);
+	}
+
+	job_band(job, 0);
+
+	if (n > 1)
+	{
+		pthread_mutex_lock(&cvt->lock);
+		while (cvt->pending != 0)
+			pthread_cond_wait(&cvt->done_cond, &cvt->lock);
+		pthread_mutex_unlock(&cvt->lock);
+	}
+	return 0;
+}
+
+int
+yuv_cvt_set_isa(yuv_cvt_t *const cvt, const enum yuv_cvt_isa isa)
+{
+	const enum yuv_cvt_isa t = isa == YUV_CVT_ISA_AUTO ? isa_best() : isa;
+	yuv_row_fn *const *const rows = isa_rows(t);
+
+	if (rows == NULL)
+		return -EINVAL;
+	cvt->isa = t;
+	cvt->rows = rows;
+	return 0;
+}
+
+enum yuv_cvt_isa
+yuv_cvt_isa(const yuv_cvt_t *const cvt)
+{
+	return cvt->isa;
+}
+
+unsigned int
+yuv_cvt_threads(const yuv_cvt_t *const cvt)
+{
+	return cvt->n_threads;
+}
+
+void
+yuv_cvt_delete(yuv_cvt_t **const pcvt)
+{
+	yuv_cvt_t *const cvt = *pcvt;
+	unsigned int i;
+
+	if (cvt == NULL)
+		return;
+	*pcvt = NULL;
+
+	pthread_mutex_lock(&cvt->lock);
+	cvt->terminate = true;
+	pthread_cond_broadcast(&cvt->go_cond);
+	pthread_mutex_unlock(&cvt->lock);
+	for (i = 0; i != cvt->n_started; ++i)
+		pthread_join(cvt->threads[i], NULL);
+
+	pthread_cond_destroy(&cvt->done_cond);
+	pthread_cond_destroy(&cvt->go_cond);
+	pthread_mutex_destroy(&cvt->lock);
+	free(cvt);
+}
+
+yuv_cvt_t *
+yuv_cvt_new(unsigned int n_threads)
+{
+	yuv_cvt_t *const cvt = calloc(1, sizeof(*cvt));
+
+	if (cvt == NULL)
+		return NULL;
+
+	if (n_threads == 0)
+	{
+		const long n = sysconf(_SC_NPROCESSORS_ONLN);
+		n_threads = n < 1 ? 1 : n > 4 ? 4 : (unsigned int)n;
+	}
+	if (n_threads > YUV_CVT_MAX_THREADS)
+		n_threads = YUV_CVT_MAX_THREADS;
+
+	pthread_mutex_init(&cvt->lock, NULL);
+	pthread_cond_init(&cvt->go_cond, NULL);
+	pthread_cond_init(&cvt->done_cond, NULL);
+	yuv_cvt_set_isa(cvt, YUV_CVT_ISA_AUTO);
+
+	// Thread 0 is the caller
+	cvt->n_threads = 1;
+	while (cvt->n_threads < n_threads)
+	{
+		cvt_worker_t *const w = malloc(sizeof(*w));
+
+		if (w == NULL)
+			break;
+		w->cvt = cvt;
+		w->n = cvt->n_threads;
+		if (pthread_create(cvt->threads + cvt->n_started, NULL, cvt_worker, w) != 0)
+		{
+			free(w);
+			break;
+		}
+		++cvt->n_started;
+		++cvt->n_threads;
+	}
+	return cvt;
+}
@@ -0,0 +1,62 @@
+#ifndef YUV_CONVERT_H
+#define YUV_CONVERT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// 4:2:0 YUV -> XRGB8888 (B, G, R, 0xff in memory) colour conversion
+//
+// Chroma is replicated, not interpolated. All kernels use the same 16 bit
+// fixed point arithmetic so SIMD output is bit exact with the C version.
+// A converter owns a few worker threads and splits a frame into bands of
+// rows across them; conversions on one converter must not overlap.
+
+enum yuv_cvt_fmt {
+	YUV_CVT_NV12,
+	YUV_CVT_YUV420P,
+	YUV_CVT_P010,
+};
+
+enum yuv_cvt_matrix {
+	YUV_CVT_BT601,
+	YUV_CVT_BT709,
+};
+
+enum yuv_cvt_isa {
+	YUV_CVT_ISA_AUTO,  // Best the CPU has
+	YUV_CVT_ISA_C,
+	YUV_CVT_ISA_SSE4,
+	YUV_CVT_ISA_AVX2,
+	YUV_CVT_ISA_NEON,
+};
+
+typedef struct yuv_cvt_src_s {
+	enum yuv_cvt_fmt fmt;
+	enum yuv_cvt_matrix matrix;
+	bool full_range;
+	unsigned int width;
+	unsigned int height;
+	const uint8_t *data[3];     // NV12 & P010 use 2 planes
+	ptrdiff_t linesize[3];      // Bytes
+} yuv_cvt_src_t;
+
+struct yuv_cvt_s;
+typedef struct yuv_cvt_s yuv_cvt_t;
+
+// n_threads is the total including the caller; 0 picks one per CPU (max 4)
+yuv_cvt_t *yuv_cvt_new(unsigned int n_threads);
+void yuv_cvt_delete(yuv_cvt_t **const pcvt);
+unsigned int yuv_cvt_threads(const yuv_cvt_t *const cvt);
+
+// Returns 0 or -EINVAL if the isa isn't available on this CPU
+int yuv_cvt_set_isa(yuv_cvt_t *const cvt, const enum yuv_cvt_isa isa);
+const char *yuv_cvt_isa_name(const enum yuv_cvt_isa isa);
+enum yuv_cvt_isa yuv_cvt_isa(const yuv_cvt_t *const cvt);
+
+// dst must hold src->height rows of src->width pixels
+// Returns 0 or -EINVAL for a bad source
+int yuv_cvt_frame(yuv_cvt_t *const cvt, const yuv_cvt_src_t *const src,
+		  uint8_t *const dst, const ptrdiff_t dst_stride);
+
+#endif